@@ -20,6 +20,7 @@
 
 #include <bow/libbow.h>
 #include <values.h>
+#include <pthread.h>
 
 static int _bow_barrel_version = -1;
 #define BOW_DEFAULT_BARREL_VERSION 3
@@ -42,6 +43,8 @@ bow_barrel_new (int word_capacity,
   ret->classnames = NULL;
   /* return a document barrel by default */
   ret->is_vpc = 0;
+  ret->postings = NULL;
+  ret->data = NULL;
   return ret;
 }
 
@@ -73,65 +76,357 @@ bow_barrel_add_document (bow_barrel *barrel,
   return di;
 }
 
-/* Add statistics to the barrel BARREL by indexing all the documents
-   found when recursively decending directory DIRNAME.  Return the number
-   of additional documents indexed. */
-int
-bow_barrel_add_from_text_dir (bow_barrel *barrel, 
-			      const char *dirname, 
-			      const char *except_name,
-			      const char *classname)
+/* Parallel indexing for bow_barrel_add_from_text_dir().  Thread 0
+   walks the directory and queues the filenames, numbering them in the
+   order bow_map_filenames_from_dir() finds them; the other
+   BOW_NUM_THREADS threads lex the files into their own vocabularies
+   and WI2DVF's, with the file numbers as document indices.  The
+   calling thread then merges these in file number order, so that the
+   word indices, document indices, counts and word occurrence counts
+   come out exactly as they would from indexing on one thread. */
+
+#define BOW_INDEX_QUEUE_SIZE 1024
+
+/* What a worker remembers about one of the files it lexed. */
+typedef struct _bow_index_doc {
+  int seq;			/* the file's number in the walk */
+  char *filename;
+  int is_text;			/* -1 if the file couldn't be opened */
+  int num_lwis;
+  int *lwis;			/* local WI's in order of first occurrence */
+  int *num_tokens;		/* number of tokens of each of LWIS */
+} bow_index_doc;
+
+/* The partial index built by one worker. */
+typedef struct _bow_index_worker {
+  bow_int4str *vocab;		/* local word <-> local WI */
+  bow_postings *postings;	/* local WI -> entries, while lexing */
+  bow_wi2dvf *wi2dvf;		/* local WI -> DV, with DI's being SEQ's */
+  bow_array *docs;		/* bow_index_doc's, in increasing SEQ */
+  int *cursors;			/* next DV entry to merge, per local WI */
+  /* Scratch space for the file being lexed. */
+  int *lwis;			/* local WI's in order of first occurrence */
+  int *num_tokens;		/* number of tokens of each of LWIS */
+  int lwis_size;
+  int *lwi2slot;		/* index into LWIS, per local WI */
+  int lwi2slot_size;
+} bow_index_worker;
+
+typedef struct _bow_index_context {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  char *queue[BOW_INDEX_QUEUE_SIZE];
+  int queue_head;
+  int queue_length;
+  int next_seq;			/* the number of the file at QUEUE_HEAD */
+  int walk_done;
+  const char *dirname;
+  const char *except_name;
+  bow_index_worker *workers;
+} bow_index_context;
+
+static int
+_bow_index_queue_filename (const char *filename, void *context)
 {
-  int text_file_count, binary_file_count;
-  int class;
+  bow_index_context *ic = context;
 
-#ifdef VPC_ONLY
-  /* Used when we are building a class barrel */
-  bow_cdoc cdoc;
-  bow_cdoc *cdocp;
-  int word_count = 0;
-  int di;
+  if (ic->except_name && !strcmp (filename, ic->except_name))
+    return 0;
+  pthread_mutex_lock (&ic->lock);
+  while (ic->queue_length == BOW_INDEX_QUEUE_SIZE)
+    pthread_cond_wait (&ic->not_full, &ic->lock);
+  ic->queue[(ic->queue_head + ic->queue_length) % BOW_INDEX_QUEUE_SIZE]
+    = strdup (filename);
+  assert (ic->queue[(ic->queue_head + ic->queue_length)
+		    % BOW_INDEX_QUEUE_SIZE]);
+  ic->queue_length++;
+  pthread_cond_signal (&ic->not_empty);
+  pthread_mutex_unlock (&ic->lock);
+  return 1;
+}
 
-  /* Function used to build a multinomial vpc barrel without building a
-   * document barrel */
-  int class_barrel_index_file (const char *filename, void *context)
+/* Lex the file FILENAME, whose number in the walk is SEQ, into the
+   partial index of worker W. */
+static void
+_bow_index_worker_lex_file (bow_index_worker *w, int seq, char *filename)
+{
+  char word[BOW_MAX_WORD_LENGTH];
+  bow_index_doc doc;
+  bow_lex *lex;
+  FILE *fp;
+  int lwi;
+
+  doc.seq = seq;
+  doc.filename = filename;
+  doc.num_lwis = 0;
+  doc.lwis = doc.num_tokens = NULL;
+  if (!(fp = fopen (filename, "r")))
+    doc.is_text = -1;
+  else if (!(doc.is_text = bow_fp_is_text (fp)))
+    fclose (fp);
+  else
     {
-      FILE *fp;
-      int num_words;
+      /* Loop once for each document in this file. */
+      while ((lex = bow_default_lexer->open_text_fp (bow_default_lexer, fp,
+						     filename)))
+	{
+	  while (bow_default_lexer->get_word (bow_default_lexer,
+					      lex, word, BOW_MAX_WORD_LENGTH))
+	    {
+	      lwi = bow_str2int (w->vocab, word);
+	      if (bow_postings_last_di (w->postings, lwi) != seq)
+		{
+		  /* First occurrence of this word in this file. */
+		  if (doc.num_lwis == w->lwis_size)
+		    {
+		      w->lwis_size *= 2;
+		      w->lwis = bow_realloc (w->lwis,
+					     w->lwis_size * sizeof (int));
+		      w->num_tokens = bow_realloc (w->num_tokens,
+						   w->lwis_size * sizeof (int));
+		    }
+		  if (lwi >= w->lwi2slot_size)
+		    {
+		      w->lwi2slot_size = MAX (lwi + 1, w->lwi2slot_size * 2);
+		      w->lwi2slot = bow_realloc (w->lwi2slot, (w->lwi2slot_size
+							       * sizeof (int)));
+		    }
+		  w->lwi2slot[lwi] = doc.num_lwis;
+		  w->lwis[doc.num_lwis] = lwi;
+		  w->num_tokens[doc.num_lwis] = 0;
+		  doc.num_lwis++;
+		}
+	      w->num_tokens[w->lwi2slot[lwi]]++;
+	      bow_postings_add_wi_di_count_weight (w->postings, lwi, seq, 1, 1);
+	    }
+	  bow_default_lexer->close (bow_default_lexer, lex);
+	}
+      fclose (fp);
+      if (doc.num_lwis)
+	{
+	  doc.lwis = bow_malloc (doc.num_lwis * sizeof (int));
+	  memcpy (doc.lwis, w->lwis, doc.num_lwis * sizeof (int));
+	  doc.num_tokens = bow_malloc (doc.num_lwis * sizeof (int));
+	  memcpy (doc.num_tokens, w->num_tokens, doc.num_lwis * sizeof (int));
+	}
+    }
+  bow_array_append (w->docs, &doc);
+}
 
-      /* If the filename matches the exception name, return immediately. */
-      if (except_name && !strcmp (filename, except_name))
-	return 0;
+static void
+_bow_index_thread (int thread_index, void *context)
+{
+  bow_index_context *ic = context;
+  bow_index_worker *w;
+  char *filename;
+  int seq;
 
-      if (!(fp = fopen (filename, "r")))
+  if (thread_index == 0)
+    {
+      /* This thread walks the directory. */
+      bow_map_filenames_from_dir (_bow_index_queue_filename, ic,
+				  ic->dirname, "");
+      pthread_mutex_lock (&ic->lock);
+      ic->walk_done = 1;
+      pthread_cond_broadcast (&ic->not_empty);
+      pthread_mutex_unlock (&ic->lock);
+      return;
+    }
+
+  w = &(ic->workers[thread_index - 1]);
+  w->vocab = bow_int4str_new (0);
+  w->postings = bow_postings_new (0);
+  w->wi2dvf = bow_wi2dvf_new (0);
+  w->docs = bow_array_new (0, sizeof (bow_index_doc), 0);
+  w->lwis_size = w->lwi2slot_size = 1024;
+  w->lwis = bow_malloc (w->lwis_size * sizeof (int));
+  w->num_tokens = bow_malloc (w->lwis_size * sizeof (int));
+  w->lwi2slot = bow_malloc (w->lwi2slot_size * sizeof (int));
+  for (;;)
+    {
+      pthread_mutex_lock (&ic->lock);
+      while (ic->queue_length == 0 && !ic->walk_done)
+	pthread_cond_wait (&ic->not_empty, &ic->lock);
+      if (ic->queue_length == 0)
+	{
+	  pthread_mutex_unlock (&ic->lock);
+	  break;
+	}
+      filename = ic->queue[ic->queue_head];
+      ic->queue_head = (ic->queue_head + 1) % BOW_INDEX_QUEUE_SIZE;
+      ic->queue_length--;
+      seq = ic->next_seq++;
+      pthread_cond_signal (&ic->not_full);
+      pthread_mutex_unlock (&ic->lock);
+      _bow_index_worker_lex_file (w, seq, filename);
+    }
+  /* Turn the entries into DV's, for merging. */
+  bow_postings_freeze (w->postings, &w->wi2dvf);
+  bow_postings_free (w->postings);
+  bow_free (w->lwis);
+  bow_free (w->num_tokens);
+  bow_free (w->lwi2slot);
+}
+
+/* Index the files under DIRNAME into BARREL as documents of class
+   CLASS, using BOW_NUM_THREADS threads.  Add to the counts of text
+   and binary files at TEXT_FILE_COUNT and BINARY_FILE_COUNT. */
+static void
+_bow_barrel_add_from_text_dir_parallel (bow_barrel *barrel,
+					const char *dirname,
+					const char *except_name,
+					int class,
+					int *text_file_count,
+					int *binary_file_count)
+{
+  bow_index_context ic;
+  bow_index_worker *w;
+  bow_postings *postings;
+  bow_index_doc *doc;
+  bow_cdoc cdoc;
+  bow_cdoc *cdocp;
+  bow_dv *dv;
+  bow_de *de;
+  int *seq2worker, *seq2doc;
+  int num_workers = bow_num_threads;
+  int seq, i, lwi, wi, di, word_count;
+
+  pthread_mutex_init (&ic.lock, NULL);
+  pthread_cond_init (&ic.not_empty, NULL);
+  pthread_cond_init (&ic.not_full, NULL);
+  ic.queue_head = ic.queue_length = ic.next_seq = ic.walk_done = 0;
+  ic.dirname = dirname;
+  ic.except_name = except_name;
+  ic.workers = bow_malloc (num_workers * sizeof (bow_index_worker));
+  bow_threads_run (num_workers + 1, _bow_index_thread, &ic);
+  pthread_mutex_destroy (&ic.lock);
+  pthread_cond_destroy (&ic.not_empty);
+  pthread_cond_destroy (&ic.not_full);
+
+  /* Find each file's worker and its place in that worker's DOCS. */
+  seq2worker = bow_malloc ((ic.next_seq + 1) * sizeof (int));
+  seq2doc = bow_malloc ((ic.next_seq + 1) * sizeof (int));
+  for (i = 0; i < num_workers; i++)
+    {
+      w = &(ic.workers[i]);
+      w->cursors = bow_malloc ((w->vocab->str_array_length + 1)
+			       * sizeof (int));
+      for (lwi = 0; lwi < w->vocab->str_array_length; lwi++)
+	w->cursors[lwi] = 0;
+      for (di = 0; di < w->docs->length; di++)
+	{
+	  doc = bow_array_entry_at_index (w->docs, di);
+	  seq2worker[doc->seq] = i;
+	  seq2doc[doc->seq] = di;
+	}
+    }
+
+  if (barrel->postings)
+    postings = barrel->postings;
+  else
+    postings = bow_postings_new (bow_num_words ());
+  for (seq = 0; seq < ic.next_seq; seq++)
+    {
+      w = &(ic.workers[seq2worker[seq]]);
+      doc = bow_array_entry_at_index (w->docs, seq2doc[seq]);
+      if (doc->is_text < 0)
 	{
 	  bow_verbosify (bow_progress,
-			 "Couldn't open file `%s' for reading.", filename);
-	  return 0;
+			 "Couldn't open file `%s' for reading.",
+			 doc->filename);
+	  free (doc->filename);
+	  continue;
 	}
-      if (bow_fp_is_text (fp))
+      if (doc->is_text)
 	{
-	  /* Add all the words in this document. */
-	  num_words = bow_wi2dvf_add_di_text_fp (&(barrel->wi2dvf), di, fp,
-						 filename);
-	  word_count += num_words;
-	  text_file_count++;
+	  cdoc.type = bow_doc_train;
+	  cdoc.class = class;
+	  /* Set to one so bow_infogain_per_wi_new() works correctly
+	     by default. */
+	  cdoc.prior = 1.0f;
+	  assert (cdoc.class >= 0);
+	  cdoc.filename = doc->filename;
+	  cdoc.class_probs = NULL;
+	  di = bow_array_append (barrel->cdocs, &cdoc);
+	  /* Add the words in the order they first appeared in the
+	     file, so that new words get the same WI's they would have
+	     gotten from bow_wi2dvf_add_di_text_fp(). */
+	  word_count = 0;
+	  for (i = 0; i < doc->num_lwis; i++)
+	    {
+	      lwi = doc->lwis[i];
+	      dv = w->wi2dvf->entry[lwi].dv;
+	      de = &(dv->entry[w->cursors[lwi]++]);
+	      assert (de->di == seq);
+	      wi = bow_word2int_add_occurrences (bow_int2str (w->vocab, lwi),
+						 doc->num_tokens[i]);
+	      if (wi >= 0)
+		{
+		  bow_postings_add_wi_di_count_weight (postings, wi, di,
+						       de->count, de->weight);
+		  word_count += doc->num_tokens[i];
+		}
+	      if (w->cursors[lwi] == dv->length)
+		{
+		  /* Nothing left in this DV; free it early. */
+		  bow_dv_free (dv);
+		  w->wi2dvf->entry[lwi].dv = NULL;
+		}
+	    }
+	  cdocp = bow_array_entry_at_index (barrel->cdocs, di);
+	  cdocp->word_count = word_count;
+	  (*text_file_count)++;
 	}
       else
 	{
 	  bow_verbosify (bow_progress,
 			 "\nFile `%s' skipped because not text\n",
-			 filename);
-	  binary_file_count++;
+			 doc->filename);
+	  free (doc->filename);
+	  (*binary_file_count)++;
+	}
+      if (doc->lwis)
+	{
+	  bow_free (doc->lwis);
+	  bow_free (doc->num_tokens);
 	}
-      fclose (fp);
       bow_verbosify (bow_progress,
 		     "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b"
 		     "%6d : %8d", 
-		     text_file_count, bow_num_words ());
-      return 1;
+		     *text_file_count, bow_num_words ());
     }
-#endif
+  if (postings != barrel->postings)
+    {
+      bow_postings_freeze (postings, &(barrel->wi2dvf));
+      bow_postings_free (postings);
+    }
+
+  for (i = 0; i < num_workers; i++)
+    {
+      w = &(ic.workers[i]);
+      bow_int4str_free (w->vocab);
+      bow_wi2dvf_free (w->wi2dvf);
+      bow_array_free (w->docs);
+      bow_free (w->cursors);
+    }
+  bow_free (seq2worker);
+  bow_free (seq2doc);
+  bow_free (ic.workers);
+}
+
+/* Add statistics to the barrel BARREL by indexing all the documents
+   found when recursively decending directory DIRNAME.  Return the number
+   of additional documents indexed. */
+int
+bow_barrel_add_from_text_dir (bow_barrel *barrel, 
+			      const char *dirname, 
+			      const char *except_name,
+			      const char *classname)
+{
+  int text_file_count, binary_file_count;
+  int class;
+  bow_postings *postings;	/* where barrel_index_file() puts entries */
 
   int barrel_index_file (const char *filename, void *context)
     {
@@ -168,8 +463,8 @@ bow_barrel_add_from_text_dir (bow_barrel *barrel,
              document. */
 	  di = bow_array_append (barrel->cdocs, &cdoc);
 	  /* Add all the words in this document. */
-	  num_words = bow_wi2dvf_add_di_text_fp (&(barrel->wi2dvf), di, fp,
-						 filename);
+	  num_words = bow_postings_add_di_text_fp (postings, di, fp,
+						   filename);
 	  /* Fill in the new CDOC's idea of WORD_COUNT */
 	  cdocp = bow_array_entry_at_index (barrel->cdocs, di);
 	  cdocp->word_count = num_words;
@@ -194,41 +489,31 @@ bow_barrel_add_from_text_dir (bow_barrel *barrel,
     barrel->classnames = bow_int4str_new (0);
   class = bow_str2int (barrel->classnames, classname);
 
-#ifdef VPC_ONLY
-  /* If we are building a class barrel, make one cdoc per class */
-  if (barrel->is_vpc)
-    {
-      cdoc.type = bow_doc_train;
-      cdoc.class = class;
-      cdoc.filename = strdup (classname);
-      cdoc.word_count = 0; /* Number of documents in this class */
-      cdoc.normalizer = -1.0f;
-      cdoc.prior = 1.0f; /* Need to set this later... */
-      cdoc.class_probs = NULL;
-
-      /* Add the CDOC to CDOCS, and determine the "index" of this
-	 "document." */
-      di = bow_array_append (barrel->cdocs, &cdoc);
-    }
-#endif
-	 
   bow_verbosify (bow_progress,
 		 "Gathering stats... files : unique-words :: "
 		 "                 ");
   text_file_count = binary_file_count = 0;
-#ifdef VPC_ONLY
-  /* Call our special function for building a class barrel rather than
-   * a document barrel.  When finished, set the priors and word counts */
-  if (barrel->is_vpc)
+  if (bow_num_threads > 1 && !bow_index_memory_budget)
+    _bow_barrel_add_from_text_dir_parallel (barrel, dirname, except_name,
+					    class, &text_file_count,
+					    &binary_file_count);
+  else
     {
-      bow_map_filenames_from_dir (class_barrel_index_file, 0, dirname, "");
-      cdocp = bow_array_entry_at_index (barrel->cdocs, di);
-      cdocp->prior = (float) text_file_count;
-      cdocp->word_count = word_count;
+      /* Gather the entries in a bow_postings, and only make DV's of
+	 them once all the files are read, or, between
+	 bow_barrel_start_indexing() and bow_barrel_finish_indexing(),
+	 once all the directories are read. */
+      if (barrel->postings)
+	postings = barrel->postings;
+      else
+	postings = bow_postings_new (bow_num_words ());
+      bow_map_filenames_from_dir (barrel_index_file, 0, dirname, "");
+      if (postings != barrel->postings)
+	{
+	  bow_postings_freeze (postings, &(barrel->wi2dvf));
+	  bow_postings_free (postings);
+	}
     }
-  else    
-#endif
-  bow_map_filenames_from_dir (barrel_index_file, 0, dirname, "");
   bow_verbosify (bow_progress, "\n");
   if (binary_file_count > text_file_count)
     bow_verbosify (bow_quiet,
@@ -236,6 +521,28 @@ bow_barrel_add_from_text_dir (bow_barrel *barrel,
   return text_file_count;
 }
 
+/* Make the following calls to bow_barrel_add_from_text_dir() on
+   BARREL gather their entries in one bow_postings, so that, when a
+   memory budget has made it write runs to disk, they are merged only
+   once, by bow_barrel_finish_indexing(). */
+void
+bow_barrel_start_indexing (bow_barrel *barrel)
+{
+  assert (!barrel->postings);
+  barrel->postings = bow_postings_new (bow_num_words ());
+}
+
+/* Put the entries gathered since bow_barrel_start_indexing() into
+   the DV's of BARREL. */
+void
+bow_barrel_finish_indexing (bow_barrel *barrel)
+{
+  assert (barrel->postings);
+  bow_postings_freeze (barrel->postings, &(barrel->wi2dvf));
+  bow_postings_free (barrel->postings);
+  barrel->postings = NULL;
+}
+
 /* Call this on a vector-per-document barrel to set the CDOC->PRIOR's
    so that the CDOC->PRIOR's for all documents of the same class sum
    to 1. */
@@ -562,6 +869,8 @@ bow_barrel_new_from_data_fp (FILE *fp)
     ret->classnames = NULL;  
   ret->wi2dvf = bow_wi2dvf_new_from_data_fp (fp);
   assert (ret->wi2dvf->num_words);
+  ret->postings = NULL;
+  ret->data = NULL;
   return ret;
 }
 
@@ -581,10 +890,11 @@ bow_barrel_new_from_data_file (const char *filename)
 
   if (ret_barrel)
     {
-      /* Read in all the dvf's so that we can close the FP. */
+      /* Read in all the dvf's, including hidden ones, so that we can
+	 close the FP. */
       for (wi = 0; wi < ret_barrel->wi2dvf->size; wi++)
 	{
-	  dv = bow_wi2dvf_dv (ret_barrel->wi2dvf, wi);
+	  dv = bow_wi2dvf_dv_hidden (ret_barrel->wi2dvf, wi, 1);
 	  if (dv)
 	    dv_count++;
 	}
@@ -763,6 +1073,144 @@ bow_barrel_write (bow_barrel *barrel, FILE *fp)
   bow_wi2dvf_write (barrel->wi2dvf, fp);
 }
 
+/* Mark as deleted the documents of BARREL with document index less
+   than MAX_DI whose filenames are in FILENAMES.  Return the number of
+   documents deleted. */
+int
+bow_barrel_delete_filenames (bow_barrel *barrel, bow_int4str *filenames,
+			     int max_di)
+{
+  bow_cdoc *cdoc;
+  int di, num_deleted = 0;
+
+  for (di = 0; di < MIN (max_di, barrel->cdocs->length); di++)
+    {
+      cdoc = bow_array_entry_at_index (barrel->cdocs, di);
+      if (cdoc->type != bow_doc_deleted
+	  && bow_str2int_no_add (filenames, cdoc->filename) != -1)
+	{
+	  cdoc->type = bow_doc_deleted;
+	  num_deleted++;
+	}
+    }
+  return num_deleted;
+}
+
+/* Write to FP the changes to BARREL since it held FIRST_DI documents. */
+void
+bow_barrel_write_delta (bow_barrel *barrel, int first_di, FILE *fp)
+{
+  bow_array *cdocs;
+  bow_cdoc *cdoc;
+  bow_wi2dvf *tail;
+  int di, num_deleted;
+
+  bow_fwrite_int (first_di, fp);
+  for (di = 0, num_deleted = 0; di < first_di; di++)
+    {
+      cdoc = bow_array_entry_at_index (barrel->cdocs, di);
+      if (cdoc->type == bow_doc_deleted)
+	num_deleted++;
+    }
+  bow_fwrite_int (num_deleted, fp);
+  for (di = 0; di < first_di; di++)
+    {
+      cdoc = bow_array_entry_at_index (barrel->cdocs, di);
+      if (cdoc->type == bow_doc_deleted)
+	bow_fwrite_int (di, fp);
+    }
+
+  /* Write the new documents as an array of their own.  It doesn't own
+     their filenames, so it doesn't free them. */
+  cdocs = bow_array_new (barrel->cdocs->length - first_di + 1,
+			 barrel->cdocs->entry_size, NULL);
+  for (di = first_di; di < barrel->cdocs->length; di++)
+    bow_array_append (cdocs, bow_array_entry_at_index (barrel->cdocs, di));
+  bow_array_write (cdocs, (int(*)(void*,FILE*))_bow_barrel_cdoc_write, fp);
+  bow_array_free (cdocs);
+  bow_int4str_write (barrel->classnames, fp);
+
+  /* As in bow_barrel_write(), the entries go last. */
+  tail = bow_wi2dvf_new_tail (barrel->wi2dvf, first_di);
+  bow_wi2dvf_write (tail, fp);
+  bow_wi2dvf_free (tail);
+}
+
+/* Apply to BARREL the changes written by bow_barrel_write_delta()
+   that are read from FP. */
+void
+bow_barrel_read_delta (bow_barrel *barrel, FILE *fp)
+{
+  bow_array *cdocs;
+  bow_cdoc *cdoc;
+  int first_di, num_deleted, di, i;
+
+  bow_fread_int (&first_di, fp);
+  if (first_di != barrel->cdocs->length)
+    bow_error ("The delta follows %d documents, but the barrel has %d",
+	       first_di, barrel->cdocs->length);
+  bow_fread_int (&num_deleted, fp);
+  for (i = 0; i < num_deleted; i++)
+    {
+      bow_fread_int (&di, fp);
+      assert (di < first_di);
+      cdoc = bow_array_entry_at_index (barrel->cdocs, di);
+      cdoc->type = bow_doc_deleted;
+    }
+
+  /* BARREL->CDOCS takes over the filenames of the new documents. */
+  cdocs = bow_array_new_with_entry_size_from_data_fp
+    (barrel->cdocs->entry_size,
+     (int(*)(void*,FILE*))_bow_barrel_cdoc_read, NULL, fp);
+  for (di = 0; di < cdocs->length; di++)
+    bow_array_append (barrel->cdocs, bow_array_entry_at_index (cdocs, di));
+  bow_array_free (cdocs);
+
+  if (barrel->classnames)
+    bow_int4str_free (barrel->classnames);
+  barrel->classnames = bow_int4str_new_from_fp (fp);
+  /* Merge the entries now, so that reading the DV's later, from
+     several threads at once for example, doesn't change them. */
+  bow_wi2dvf_merge_delta (&(barrel->wi2dvf),
+			  bow_wi2dvf_new_from_data_fp (fp));
+}
+
+/* Remove the deleted documents from BARREL, renumbering the rest. */
+void
+bow_barrel_compact (bow_barrel *barrel)
+{
+  bow_wi2dvf *old = barrel->wi2dvf;
+  bow_wi2dvf *new;
+  bow_cdoc *cdoc;
+  int *new_di;
+  int di, num_docs;
+
+  /* Squeeze the deleted documents out of the CDOCS, noting where each
+     of the others goes. */
+  new_di = bow_malloc (barrel->cdocs->length * sizeof (int));
+  for (di = 0, num_docs = 0; di < barrel->cdocs->length; di++)
+    {
+      cdoc = bow_array_entry_at_index (barrel->cdocs, di);
+      if (cdoc->type == bow_doc_deleted)
+	{
+	  if (barrel->cdocs->free_func)
+	    (*barrel->cdocs->free_func) (cdoc);
+	  new_di[di] = -1;
+	  continue;
+	}
+      if (num_docs != di)
+	memcpy (bow_array_entry_at_index (barrel->cdocs, num_docs), cdoc,
+		barrel->cdocs->entry_size);
+      new_di[di] = num_docs++;
+    }
+  barrel->cdocs->length = num_docs;
+
+  new = bow_wi2dvf_new_renumbered (old, new_di);
+  bow_wi2dvf_free (old);
+  barrel->wi2dvf = new;
+  bow_free (new_di);
+}
+
 /* Print barrel to FP in human-readable and awk-accessible format. */
 void
 bow_barrel_printf_old1 (bow_barrel *barrel, FILE *fp, const char *format)
@@ -1016,10 +1464,17 @@ bow_barrel_printf_selected (bow_barrel *barrel, FILE *fp,
     }
 }
 
+/* Documents deleted by bow_barrel_delete_filenames() aren't printed. */
+static int
+_bow_cdoc_is_not_deleted (bow_cdoc *cdoc)
+{
+  return (cdoc->type != bow_doc_deleted);
+}
+
 void
 bow_barrel_printf (bow_barrel *barrel, FILE *fp, const char *format)
 {
-  bow_barrel_printf_selected (barrel, fp, format, bow_cdoc_yes);
+  bow_barrel_printf_selected (barrel, fp, format, _bow_cdoc_is_not_deleted);
 }
 
 /* Print on stdout the number of times WORD occurs in the various
@@ -1217,5 +1672,60 @@ bow_barrel_free (bow_barrel *barrel)
     bow_array_free (barrel->cdocs);
   if (barrel->classnames)
     bow_int4str_free (barrel->classnames);
+  if (barrel->postings)
+    bow_postings_free (barrel->postings);
+  while (barrel->data)
+    {
+      bow_barrel_data *d = barrel->data;
+      barrel->data = d->next;
+      if (d->data)
+	(*d->free_data) (d->data);
+      bow_free (d);
+    }
   bow_free (barrel);
 }
+
+/* Serializes changes to the DATA lists of barrels.  Entries are never
+   unlinked until their barrel is freed, so bow_barrel_get_data() can
+   search a list without it. */
+static pthread_mutex_t bow_barrel_data_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+bow_barrel_set_data (bow_barrel *barrel, const void *key, void *data,
+		     void (*free_data) (void *data))
+{
+  bow_barrel_data *d;
+
+  pthread_mutex_lock (&bow_barrel_data_lock);
+  for (d = barrel->data; d; d = d->next)
+    if (d->key == key)
+      break;
+  if (d)
+    {
+      if (d->data)
+	(*d->free_data) (d->data);
+      d->free_data = free_data;
+      __atomic_store_n (&d->data, data, __ATOMIC_RELEASE);
+    }
+  else
+    {
+      d = bow_malloc (sizeof (bow_barrel_data));
+      d->key = key;
+      d->data = data;
+      d->free_data = free_data;
+      d->next = barrel->data;
+      __atomic_store_n (&barrel->data, d, __ATOMIC_RELEASE);
+    }
+  pthread_mutex_unlock (&bow_barrel_data_lock);
+}
+
+void *
+bow_barrel_get_data (bow_barrel *barrel, const void *key)
+{
+  bow_barrel_data *d;
+
+  for (d = __atomic_load_n (&barrel->data, __ATOMIC_ACQUIRE); d; d = d->next)
+    if (d->key == key)
+      return __atomic_load_n (&d->data, __ATOMIC_ACQUIRE);
+  return NULL;
+}
@@ -43,6 +43,7 @@
 #include <limits.h>		/* for PATH_MAX and SHRT_MAX and friends */
 #include <float.h>		/* for FLT_MAX and friends */
 #include <unistd.h>		/* for SEEK_SET and friends on SunOS */
+#include <pthread.h>		/* for pthread_mutex_t */
 #if BOW_MCHECK
 #include <mcheck.h>
 #endif /* BOW_MCHECK */
@@ -131,6 +132,10 @@ typedef struct _bow_lex {
   char *document;
   int document_length;
   int document_position;
+  /* How the simple lexers find words; set to
+     BOW_DEFAULT_LEXER_PARAMETERS when the lex is opened. */
+  struct _bow_lexer_parameters *parameters;
+  int num_words;		/* the number of words returned so far */
 } bow_lex;
 
 /* A lexer is represented by a pointer to a structure of this type. */
@@ -441,12 +446,17 @@ typedef struct _bow_sparray {
 
 /* Managing int->string and string->int mappings. */
 
+/* Several threads may add to and look up in the same mapping at once;
+   the lookups take no lock.  See int4str.c */
 typedef struct _bow_int4str {
   const char **str_array;
   int str_array_length;
   int str_array_size;
-  int *str_hash;
-  int str_hash_size;
+  struct _bow_int4str_hash *str_hash;
+  void **retired;		/* old tables to free with the mapping */
+  int retired_length;
+  int retired_size;
+  pthread_mutex_t lock;		/* held while adding */
 } bow_int4str;
 
 /* Allocate, initialize and return a new int/string mapping structure.
@@ -468,7 +478,7 @@ int bow_str2int (bow_int4str *map, const char *string);
 int _bow_str2int (bow_int4str *map, const char *string, unsigned id);
 
 /* Given the char-pointer STRING, return its integer index.  If STRING
-   is not yet in the mapping, return -1. */
+   is not yet in the mapping, return -1.  Takes no locks. */
 int bow_str2int_no_add (bow_int4str *map, const char *string);
 
 /* Create a new int-str mapping by lexing words from FILE. */
@@ -642,6 +652,10 @@ int bow_word2int_no_add (const char *word);
    associated with WORD. */
 int bow_word2int_add_occurrence (const char *word);
 
+/* Like bow_word2int_add_occurrence(), except it increments the
+   occurrence count by COUNT. */
+int bow_word2int_add_occurrences (const char *word, int count);
+
 /* The int/string mapping for bow's vocabulary words. */
 extern bow_int4str *word_map;
 
@@ -801,6 +815,17 @@ bow_wv *bow_wv_new_from_text_string (char *the_string);
 /* Create and return a new "word vector" from a document buffer LEX. */
 bow_wv *bow_wv_new_from_lex (bow_lex *lex);
 
+/* Reentrant versions of the above, which lex with CTX's lexer and
+   parameters, and look up words as CTX says.  See ctx.c */
+struct _bow_ctx;
+bow_wv *bow_wv_new_from_text_fp_r (struct _bow_ctx *ctx, FILE *fp,
+				   const char *filename);
+bow_wv *bow_wv_new_from_lex_r (struct _bow_ctx *ctx, bow_lex *lex);
+
+/* Create and return a new "word vector" from the string STR, opened
+   with the open_str() of CTX's lexer, or NULL if it has no words. */
+bow_wv *bow_wv_new_from_str_r (struct _bow_ctx *ctx, char *str);
+
 /* Create and return a new "word vector" that is the sum of all the
    "word vectors" in WV_ARRAY.  The second parameter, WV_ARRAY_LENGTH,
    is the number of "word vectors" in WV_ARRAY. */
@@ -857,13 +882,35 @@ void bow_wv_free (bow_wv *wv);
 
 /* Collections of "word vectors. */
 
-/* An array that maps "document indices" to "word vectors" */
+/* A "forward index", which maps "document indices" to the words in
+   each document.  It doesn't hold the counts and weights themselves,
+   but where to find them: for each word, the position of the
+   document's entry in that word's "document vector".  See di2wv.c */
+typedef struct _bow_di2wv_entry {
+  int wi;			/* a "word index" */
+  int dvi;			/* index of the DI in the WI'th DV */
+} bow_di2wv_entry;
+
 typedef struct _bow_di2wv {
-  int length;
-  int size;
-  bow_wv *entry[0];
+  int length;			/* the number of "document indices" */
+  /* The words of document DI are ENTRY[START[DI]] up to, but not
+     including, ENTRY[START[DI+1]], in increasing order of WI. */
+  size_t *start;
+  bow_di2wv_entry *entry;
+  char *mmap_base;		/* if non-NULL, the file mapped in core */
+  size_t mmap_length;		/* the number of bytes mapped at MMAP_BASE */
 } bow_di2wv;
 
+/* What a file that goes with a barrel, such as a forward index of
+   it, records about the barrel, so that a reader can tell when the
+   file no longer matches it. */
+typedef struct _bow_barrel_stamp {
+  int num_docs;			/* the length of the barrel's CDOCS */
+  int num_words;		/* the NUM_WORDS of the barrel's WI2DVF */
+  off_t data_size;		/* the size of the barrel's data file */
+  time_t data_mtime;		/* when the data file was last modified */
+} bow_barrel_stamp;
+
 
 
 /* Documents */  
@@ -878,7 +925,8 @@ typedef enum {
   bow_doc_validation,   /* docs used for a validation set */
   bow_doc_ignore,	/* docs left unused */
   bow_doc_pool,         /* the cotraining candidate pool */
-  bow_doc_waiting       /* the "unlabeled" docs not used by cotraining yet */
+  bow_doc_waiting,      /* the "unlabeled" docs not used by cotraining yet */
+  bow_doc_deleted	/* removed from the index; splits leave these be */
 } bow_doc_type;
 
 #define bow_str2type(STR) \
@@ -896,7 +944,9 @@ typedef enum {
 		? bow_doc_pool \
 		: ((strcmp (STR, "waiting") == 0) \
 		   ? bow_doc_waiting \
-		   : -1)))))))
+		   : ((strcmp (STR, "deleted") == 0) \
+		      ? bow_doc_deleted \
+		      : -1))))))))
      
 #define bow_type2str(T) \
 ((T == bow_doc_train)                                \
@@ -915,7 +965,9 @@ typedef enum {
 		   ? "pool"                         \
 		   : ((T == bow_doc_waiting)        \
 		      ? "waiting"                  \
-		      : "UNKNOWN DOC TYPE"))))))))
+		      : ((T == bow_doc_deleted)     \
+			 ? "deleted"               \
+			 : "UNKNOWN DOC TYPE")))))))))
 
 
 /* A generic "document" entry, useful for setting document types.  
@@ -1101,22 +1153,72 @@ int bow_dv_write_size (bow_dv *dv);
 /* Return a new "document vector" read from a pointer into a data file, FP. */
 bow_dv *bow_dv_new_from_data_fp (FILE *fp);
 
+/* Write "document vector" DV to the stream FP as an image of the
+   in-core `bow_dv' structure, in host byte order, so that it can be
+   used in place when the file is memory-mapped. */
+void bow_dv_write_native (bow_dv *dv, FILE *fp);
+
+/* Return the number of bytes required for writing the "document
+   vector" DV with bow_dv_write_native(). */
+int bow_dv_write_native_size (bow_dv *dv);
+
+/* Return a new "document vector" read from a pointer into a data
+   file, FP, that was written with bow_dv_write_native(). */
+bow_dv *bow_dv_new_from_native_data_fp (FILE *fp);
+
+/* Write "document vector" DV to the stream FP in a compact form, with
+   gap-encoded DI's, varint COUNT's, and WEIGHT's omitted when they are
+   equal to the COUNT's. */
+void bow_dv_write_compressed (bow_dv *dv, FILE *fp);
+
+/* Return the number of bytes required for writing the "document
+   vector" DV with bow_dv_write_compressed(). */
+int bow_dv_write_compressed_size (bow_dv *dv);
+
+/* Return a new "document vector" read from a pointer into a data
+   file, FP, that was written with bow_dv_write_compressed(). */
+bow_dv *bow_dv_new_from_compressed_data_fp (FILE *fp);
+
+/* Return a new "document vector" decoded from DATA, which points at
+   the bytes written by bow_dv_write_compressed(). */
+bow_dv *bow_dv_new_from_compressed_data (const unsigned char *data);
+
+/* If non-zero, bow_dv_write_compressed() stores weights that aren't
+   equal to their counts as 16-bit truncated floats. */
+extern int bow_dv_quantize_weights;
+
 /* Free the memory held by the "document vector" DV. */
 void bow_dv_free (bow_dv *dv);
 
 /* A "document vector with file info (file storage information)" */
 typedef struct _bow_dvf {
-  int seek_start;
+  off_t seek_start;		/* -1 if there is no DV, 2 if only in core */
   bow_dv *dv;
+  int hidden;			/* non-zero if hidden by bow_wi2dvf_hide_wi() */
+  float max_weight;		/* bounds the DV's weights, or -1; see topk.c */
 } bow_dvf;
 
 
+/* The ways in which the "document vectors" of a `wi2dvf' can be laid
+   out in its data file. */
+typedef enum {
+  bow_dv_encoding_stream = 0,	/* bow_dv_write(), network byte order */
+  bow_dv_encoding_native,	/* bow_dv_write_native(), mmap'able */
+  bow_dv_encoding_compressed,	/* bow_dv_write_compressed() */
+  bow_dv_encoding_limit
+} bow_dv_encoding;
+
 /* xxx Perhaps these should be generalized and renamed to `bow_i2v'? */
 /* An array that maps "word indices" to "document vectors with file info" */
 typedef struct _bow_wi2dvf {
   int size;			/* the number of ENTRY's allocated */
   int num_words;		/* number of non-NULL dv's in this wi2dvf */
   FILE *fp;			/* where to get DVF's that aren't cached yet */
+  bow_dv_encoding encoding;	/* the layout of the DV's in FP */
+  char *mmap_base;		/* if non-NULL, FP's contents mapped in core */
+  size_t mmap_length;		/* the number of bytes mapped at MMAP_BASE */
+  bow_di2wv *di2wv;		/* if non-NULL, a forward index of the DV's */
+  int has_max_weights;		/* non-zero if any ENTRY's MAX_WEIGHT is set */
   bow_dvf entry[0];		/* array of info about each word */
 } bow_wi2dvf;
 
@@ -1126,6 +1228,14 @@ bow_wi2dvf *bow_wi2dvf_new (int capacity);
 /* The default capacity used when 0 is passed for CAPACITY above. */
 extern unsigned int bow_wi2dvf_default_capacity;
 
+/* The layout used by bow_wi2dvf_write() for the "document vectors".
+   When a `wi2dvf' written with bow_dv_encoding_native is read back in,
+   its data file is memory-mapped, and bow_wi2dvf_dv() returns views
+   directly into the mapped pages instead of reading and malloc'ing.
+   The data file of a bow_dv_encoding_compressed `wi2dvf' is mapped
+   too, and its DV's are decoded from the mapped pages. */
+extern bow_dv_encoding bow_wi2dvf_write_encoding;
+
 /* Create a `wi2dvf' by reading data from file-pointer FP.  This
    doesn't actually read in all the "document vectors"; it only reads
    in the DVF information, and lazily loads the actual "document
@@ -1178,6 +1288,42 @@ void bow_wi2dvf_add_wi_di_count_weight (bow_wi2dvf **wi2dvf, int wi,
 void bow_wi2dvf_set_wi_di_count_weight (bow_wi2dvf **wi2dvf, int wi,
 					int di, int count, float weight);
 
+/* Add the entries of the "document vector" DV to the WI'th "document
+   vector" of WI2DVF.  If there is no WI'th DV yet, DV becomes it;
+   otherwise DV is freed.  Either way, the caller must not use DV
+   afterwards.  If the WI'th DV is in the data file of WI2DVF and
+   hasn't been read yet, it is read first. */
+void bow_wi2dvf_add_wi_dv (bow_wi2dvf **wi2dvf, int wi, bow_dv *dv);
+
+/* Append the entries of each DV of DELTA, which must all come after
+   those of WI2DVF's, to the DV's of WI2DVF, reading those that are
+   only in its data file, and free DELTA.  Do it before the DV's are
+   read by anyone else, since it changes them. */
+void bow_wi2dvf_merge_delta (bow_wi2dvf **wi2dvf, bow_wi2dvf *delta);
+
+/* Return a new `wi2dvf' holding copies of the entries of WI2DVF with
+   document indices FIRST_DI or more.  This doesn't read DV's that are
+   only in the data file, so those must hold no such entries. */
+bow_wi2dvf *bow_wi2dvf_new_tail (bow_wi2dvf *wi2dvf, int first_di);
+
+/* Return a new `wi2dvf' with the entries of WI2DVF, but with each
+   document index DI changed to NEW_DI[DI], leaving out those for
+   which that is -1.  The DV's of WI2DVF are freed as they are copied,
+   so WI2DVF can only be freed afterwards. */
+bow_wi2dvf *bow_wi2dvf_new_renumbered (bow_wi2dvf *wi2dvf,
+				       const int *new_di);
+
+/* Write to FP, which must be at the start of the file, the part of a
+   wi2dvf data file that comes before the "document vectors", for SIZE
+   words and the native DV encoding.  SEEK_START gives the file offset
+   of each word's DV, or -1; if it is NULL, all are written as -1, to
+   be filled in later.  If HIDDEN is non-NULL, word WI is hidden if
+   HIDDEN[WI] is non-zero.  Return the offset at which the first DV
+   must be written.  This lets a wi2dvf be written one DV at a time,
+   without having them all in core. */
+off_t bow_wi2dvf_write_native_header (int size, const off_t *seek_start,
+				      const char *hidden, FILE *fp);
+
 /* Remove the word with index WI from the vocabulary of the map WI2DVF */
 void bow_wi2dvf_remove_wi (bow_wi2dvf *wi2dvf, int wi);
 
@@ -1233,9 +1379,121 @@ void bow_wi2dvf_print_stats (bow_wi2dvf *map);
 /* Free the memory held by the map WI2DVF. */
 void bow_wi2dvf_free (bow_wi2dvf *wi2dvf);
 
+/* The DV's of a WI2DVF whose data file is memory-mapped are read-only
+   views of it.  Copy those into malloc'ed memory, and read the rest
+   with stdio, so that the weights of all of them can be changed in
+   place.  Does nothing for a WI2DVF that isn't mapped. */
+void bow_wi2dvf_unmap (bow_wi2dvf *wi2dvf);
+
 /* Remove words that don't occur in WI2DVF */
 void bow_wv_prune_words_not_in_wi2dvf (bow_wv *wv, bow_wi2dvf *wi2dvf);
 
+/* Create a forward index for WI2DVF.  To have bow_heap_next_wv() use
+   it, set WI2DVF->DI2WV to it.  Adding entries to WI2DVF afterwards
+   frees it and sets WI2DVF->DI2WV back to NULL. */
+bow_di2wv *bow_di2wv_new_from_wi2dvf (bow_wi2dvf *wi2dvf);
+
+/* Write DI2WV to the file-pointer FP, in the host's layout, along
+   with STAMP, which describes the barrel it was made from. */
+void bow_di2wv_write (bow_di2wv *di2wv, const bow_barrel_stamp *stamp,
+		      FILE *fp);
+
+/* Create a forward index by reading from the file-pointer FP, which
+   must be at the start of a file written by bow_di2wv_write().  The
+   file is memory-mapped if it can be.  Return NULL if FP doesn't hold
+   a forward index that this host can use, or if the stamp written
+   with it differs from STAMP. */
+bow_di2wv *bow_di2wv_new_from_data_fp (FILE *fp,
+				       const bow_barrel_stamp *stamp);
+
+/* Free the memory held by DI2WV. */
+void bow_di2wv_free (bow_di2wv *di2wv);
+
+
+/* Building the "document vectors" of a wi2dvf while indexing.  See
+   postings.c.  Rather than growing each DV with bow_realloc() as the
+   documents come in, the entries of each word are appended to a chain
+   of blocks carved out of large slabs, and only turned into DV's, of
+   exactly the right size, when indexing is done. */
+
+/* A block of entries for one word. */
+typedef struct _bow_postings_block {
+  struct _bow_postings_block *next; /* the word's next block */
+  int wi;			/* the word whose entries these are */
+  int size;			/* the number of entries it can hold */
+  bow_de entry[0];
+} bow_postings_block;
+
+/* The blocks of one word. */
+typedef struct _bow_postings_list {
+  bow_postings_block *head;	/* the first block */
+  bow_postings_block *tail;	/* the block now being filled */
+  bow_dv *dv;			/* the DV being filled when freezing */
+  int length;			/* the number of entries in all the blocks */
+  int tail_length;		/* the number of them in TAIL */
+} bow_postings_list;
+
+typedef struct _bow_postings {
+  int size;			/* the number of entries in LIST */
+  bow_postings_list *list;	/* indexed by "word index" */
+  char *slab;			/* the slab blocks are now carved from */
+  int slab_used;		/* the number of bytes of SLAB used */
+  /* Statistics about the memory used, since the last freeze. */
+  int num_slabs;
+  int num_blocks;
+  size_t num_entries;
+  /* When the slabs take more than MEMORY_BUDGET bytes, the entries
+     are written to a "run" file, sorted by word index, and the slabs
+     are freed.  Zero means never. */
+  size_t memory_budget;
+  int last_di;			/* the largest document index added */
+  FILE **runs;			/* the run files, oldest first */
+  int num_runs;
+  int runs_size;
+} bow_postings;
+
+/* The default MEMORY_BUDGET of new bow_postings, in bytes.  Zero, the
+   default, means keep all the entries in core. */
+extern size_t bow_index_memory_budget;
+
+/* The directory in which to put run files.  If NULL, use $TMPDIR, or
+   /tmp if that isn't set. */
+extern const char *bow_index_tmpdir;
+
+/* The number of bytes in each slab. */
+#define BOW_POSTINGS_SLAB_SIZE (1 << 20)
+
+/* Create a new, empty builder, with room for CAPACITY words. */
+bow_postings *bow_postings_new (int capacity);
+
+/* Increase by COUNT and WEIGHT the entry for word index WI and
+   document index DI.  The document indices added for each word must
+   not decrease. */
+void bow_postings_add_wi_di_count_weight (bow_postings *postings, int wi,
+					  int di, int count, float weight);
+
+/* Read all the words from file pointer FP, and add them to POSTINGS,
+   associated with document index DI.  Return the number of words.
+   Like bow_wi2dvf_add_di_text_fp(). */
+int bow_postings_add_di_text_fp (bow_postings *postings, int di, FILE *fp,
+				 const char *filename);
+
+/* Return the largest document index added for word index WI, or -1 if
+   there are none. */
+int bow_postings_last_di (bow_postings *postings, int wi);
+
+/* Add all the entries in POSTINGS to WI2DVF, and empty POSTINGS.  If
+   POSTINGS has written any run files, merge them, the rest of its
+   entries, and the DV's of WI2DVF into a new data file, and replace
+   WI2DVF with one that reads its DV's from that file. */
+void bow_postings_freeze (bow_postings *postings, bow_wi2dvf **wi2dvf);
+
+/* Print statistics about the memory used by POSTINGS to FP. */
+void bow_postings_print_stats (bow_postings *postings, FILE *fp);
+
+/* Free the memory held by POSTINGS. */
+void bow_postings_free (bow_postings *postings);
+
 /* xxx Move these to prind.c */
 
 /* If this is non-zero, use uniform class priors. */
@@ -1256,12 +1514,23 @@ typedef enum {
 } bow_smoothing;
 
 /* A wrapper around a wi2dvf/cdocs combination. */
+/* Tables a method computes from a barrel and keeps with it; see
+   bow_barrel_set_data(). */
+typedef struct _bow_barrel_data {
+  const void *key;		/* whose tables these are */
+  void *data;
+  void (*free_data) (void *data);
+  struct _bow_barrel_data *next;
+} bow_barrel_data;
+
 typedef struct _bow_barrel {
   struct _rainbow_method *method; /* TFIDF, NaiveBayes, PrInd, others. */
   bow_array *cdocs;		/* The documents (or classes, for VPC) */
   bow_wi2dvf *wi2dvf;		/* The matrix of words vs documents */
   bow_int4str *classnames;	/* A map between classnames and indices */
   int is_vpc;			/* non-zero if each `document' is a `class' */
+  bow_postings *postings;	/* if non-NULL, where indexing puts entries */
+  bow_barrel_data *data;	/* tables methods keep with it, or NULL */
 } bow_barrel;
 
 /* An array of these is filled in by the method's scoring function. */
@@ -1293,24 +1562,44 @@ typedef struct _rainbow_method {
   void (*free_barrel)(bow_barrel *barrel);
   /* Parameters of the method. */
   void *params;
+  /* Non-zero if SCORE, WV_SET_WEIGHTS and WV_NORMALIZE_WEIGHTS only
+     read the barrel, so that several threads may call them at once. */
+  int score_is_thread_safe;
+  /* Bound what each word can add to a score, as NORMALIZE_WEIGHTS
+     does, for a barrel whose final weights were read from disk.  NULL
+     if SCORE doesn't prune. */
+  void (*set_score_bounds)(bow_barrel *barrel);
 } rainbow_method;
 
 /* Macros that make it easier to call the RAINBOW_METHOD functions */
 
+/* These change the weights of BARREL's DV's in place, so they first
+   make sure none of them is a read-only view of a mapped file.  So
+   does making a vector-per-class barrel, which may weight the DV's of
+   the document barrel. */
+
 #define bow_barrel_set_weights(BARREL)		\
 if ((*(BARREL)->method->set_weights))           \
-  ((*(BARREL)->method->set_weights)(BARREL))
+  (bow_wi2dvf_unmap ((BARREL)->wi2dvf),		\
+   (*(BARREL)->method->set_weights)(BARREL))
 
 #define bow_barrel_scale_weights(BARREL, DOC_BARREL)		\
 if ((*(BARREL)->method->scale_weights))				\
-  ((*(BARREL)->method->scale_weights)(BARREL, DOC_BARREL))
+  (bow_wi2dvf_unmap ((BARREL)->wi2dvf),				\
+   (*(BARREL)->method->scale_weights)(BARREL, DOC_BARREL))
 
 #define bow_barrel_normalize_weights(BARREL)		\
 if ((*(BARREL)->method->normalize_weights))		\
-  ((*(BARREL)->method->normalize_weights)(BARREL))
+  (bow_wi2dvf_unmap ((BARREL)->wi2dvf),		\
+   (*(BARREL)->method->normalize_weights)(BARREL))
+
+#define bow_barrel_set_score_bounds(BARREL)		\
+if ((*(BARREL)->method->set_score_bounds))		\
+  ((*(BARREL)->method->set_score_bounds)(BARREL))
 
 #define bow_barrel_new_vpc_with_weights(BARREL) \
-((*(BARREL)->method->vpc_with_weights)(BARREL))
+(bow_wi2dvf_unmap ((BARREL)->wi2dvf),		\
+ (*(BARREL)->method->vpc_with_weights)(BARREL))
 
 #define bow_barrel_score(BARREL, QUERY_WV, SCORES, NUM_SCORES, LOO_CLASS) \
 ((*(BARREL)->method->score)(BARREL, QUERY_WV, SCORES, NUM_SCORES, LOO_CLASS))
@@ -1337,6 +1626,53 @@ if (((*(BARREL)->method->wv_normalize_weights)))	\
 #define bow_barrel_add_classname(BARREL, NAME) \
 (bow_str2int ((BARREL)->classnames, NAME))
 
+
+/* Finding the best few documents for a query without scoring every
+   document that shares a word with it.  See topk.c */
+
+/* If zero, bow_wi2dvf_top_k() ignores the bounds of
+   bow_wi2dvf_set_max_weights() and scores every candidate, and TFIDF
+   doesn't use it at all, so that its hit counts are exact.  The
+   default is 1. */
+extern int bow_score_pruning;
+
+/* Set the MAX_WEIGHT of each word of WI2DVF to the largest magnitude
+   of the WEIGHT of its DV's entries for model documents in CDOCS,
+   times the document's NORMALIZER if USE_NORMALIZER is non-zero.
+   Call this once the weights are set, or read from disk, before
+   scoring; adding entries to WI2DVF forgets them.  bow_wi2dvf_top_k() doesn't prune with the
+   words whose bounds aren't set. */
+void bow_wi2dvf_set_max_weights (bow_wi2dvf *wi2dvf, bow_array *cdocs,
+				 int use_normalizer);
+
+/* Set the MAX_WEIGHT of each word of WI2DVF back to unknown. */
+void bow_wi2dvf_forget_max_weights (bow_wi2dvf *wi2dvf);
+
+/* Return 1 and put the exact score of document DI in *SCORE, or
+   return 0 if DI isn't to be ranked at all.  DI has NUM_PRESENT of the
+   query's words; WVI[i], in increasing order, is the index in the
+   query of the i'th of them, and DW[i] its WEIGHT in DI. */
+typedef int (*bow_top_k_score_fn) (void *context, int di, int num_present,
+				   const int *wvi, const float *dw,
+				   double *score);
+
+/* Put into SCORES, best first, the K model documents of CDOCS with
+   the highest SCORE_FN among those that have some word of QUERY_WV,
+   and return how many were put there.  Ties go to the lower DI.  The
+   score of a document is taken to be at most the sum over its words
+   of |QUERY_WV weight * QUERY_SCALE * DV weight|, times the magnitude
+   of its NORMALIZER if USE_NORMALIZER is non-zero, as it is for
+   bow_wi2dvf_set_max_weights(); documents which that shows can't make
+   the top K are never given to SCORE_FN.  The weights of WI2DVF must
+   be final, and bounded by bow_wi2dvf_set_max_weights() for any
+   pruning to be done.  This doesn't change WI2DVF, so several
+   threads may call it at once.  The NAME's of SCORES are set to
+   NULL. */
+int bow_wi2dvf_top_k (bow_wi2dvf *wi2dvf, bow_array *cdocs,
+		      int use_normalizer, bow_wv *query_wv,
+		      double query_scale, bow_top_k_score_fn score_fn,
+		      void *context, bow_score *scores, int k);
+
 #include <bow/tfidf.h>
 #include <bow/naivebayes.h>
 #include <bow/prind.h>
@@ -1383,6 +1719,45 @@ int bow_barrel_add_from_text_dir (bow_barrel *barrel,
 				  const char *except_name, 
 				  const char *classnames);
 
+/* Have the calls to bow_barrel_add_from_text_dir() on BARREL that
+   follow, up to bow_barrel_finish_indexing(), gather their entries in
+   a single bow_postings, rather than each adding them to BARREL's
+   wi2dvf as it finishes.  With bow_index_memory_budget set, this way
+   all the run files get merged just once. */
+void bow_barrel_start_indexing (bow_barrel *barrel);
+
+/* Add the entries gathered since bow_barrel_start_indexing() to
+   BARREL's wi2dvf. */
+void bow_barrel_finish_indexing (bow_barrel *barrel);
+
+/* Incremental updates of a document barrel that was read from a file.
+   Documents added to it, with bow_barrel_add_from_text_dir() for
+   example, get the next document indices, and their entries are
+   appended to its DV's.  Deleted documents get type bow_doc_deleted,
+   but keep their entries, until the barrel is compacted. */
+
+/* Mark as deleted the documents of BARREL with document index less
+   than MAX_DI whose filenames are in FILENAMES.  Return the number of
+   documents deleted. */
+int bow_barrel_delete_filenames (bow_barrel *barrel, bow_int4str *filenames,
+				 int max_di);
+
+/* Write to FP the changes to BARREL since it held FIRST_DI documents:
+   the documents added since then, with their entries, and which of
+   the first FIRST_DI documents have been deleted. */
+void bow_barrel_write_delta (bow_barrel *barrel, int first_di, FILE *fp);
+
+/* Apply to BARREL the changes written by bow_barrel_write_delta()
+   that are read from FP.  BARREL must be as it was when FIRST_DI was
+   passed to that function.  The entries are merged into its DV's
+   right away, so that reading them later changes nothing, and FP is
+   closed. */
+void bow_barrel_read_delta (bow_barrel *barrel, FILE *fp);
+
+/* Remove the deleted documents from BARREL, renumbering the rest.
+   Its DV's all end up in core. */
+void bow_barrel_compact (bow_barrel *barrel);
+
 /* Add statistics to the barrel BARREL by indexing all the documents
    in HDB database DIRNAME.  Return the number of additional
    documents indexed. */
@@ -1424,6 +1799,36 @@ bow_barrel_new_vpc_weight_then_merge (bow_barrel *doc_barrel);
 void bow_barrel_set_vpc_priors_by_counting (bow_barrel *vpc_barrel,
 					    bow_barrel *doc_barrel);
 
+/* Return a new, empty `vector-per-class' barrel, to which documents
+   are added straight into the class statistics, without a barrel of
+   the documents, so that its memory doesn't grow with their number.
+   The method must be one, like naivebayes, whose class barrel is made
+   by bow_barrel_new_vpc_merge_then_weight(). */
+bow_barrel *bow_barrel_new_vpc_streaming ();
+
+/* Add the documents under directory DIRNAME, of class CLASSNAME, to
+   VPC_BARREL, skipping as many of them as are already counted in its
+   class.  Every CHECKPOINT_INTERVAL documents, write a checkpoint to
+   CHECKPOINT_FILENAME if it is non-NULL.  Return the number of
+   documents added. */
+int bow_barrel_add_vpc_from_text_dir (bow_barrel *vpc_barrel,
+				      const char *dirname,
+				      const char *except_name,
+				      const char *classname,
+				      const char *checkpoint_filename,
+				      int checkpoint_interval);
+
+/* Set the priors and weights of VPC_BARREL once all the documents
+   are in, making it the same as the class barrel
+   bow_barrel_new_vpc_with_weights() would make from them. */
+void bow_barrel_finish_vpc_streaming (bow_barrel *vpc_barrel);
+
+/* Write the vocabulary and the unfinished VPC_BARREL to FILENAME, or
+   read them back in, to resume training from there. */
+void bow_barrel_write_vpc_checkpoint (bow_barrel *vpc_barrel,
+				      const char *filename);
+bow_barrel *bow_barrel_new_vpc_from_checkpoint (const char *filename);
+
 /* Like bow_barrel_new_vpc, but uses both labeled and unlabeled data.
    It uses the class_probs of each doc to determine its class
    membership. The counts in the wi2dvf are set to bogus numbers.  The
@@ -1506,6 +1911,19 @@ bow_iterator_double *bow_barrel_iterator_for_ci_new(bow_barrel *barrel,int ci);
 /* Free the memory held by BARREL. */
 void bow_barrel_free (bow_barrel *barrel);
 
+/* Keep DATA with BARREL under KEY, which is usually the address of
+   something static in the method that made it, freeing any DATA that
+   was there before with the FREE_DATA it was given.  Don't do this
+   while BARREL is being scored.  The DATA is freed, with FREE_DATA,
+   when BARREL is. */
+void bow_barrel_set_data (bow_barrel *barrel, const void *key, void *data,
+			  void (*free_data) (void *data));
+
+/* Return the DATA kept with BARREL under KEY, or NULL.  This takes no
+   lock, and may be called while other threads are scoring with
+   BARREL, or setting the data of another key. */
+void *bow_barrel_get_data (bow_barrel *barrel, const void *key);
+
 /* Assign the values of the "word vector entry's" WEIGHT field
    equal to the COUNT. */
 void bow_wv_set_weights_to_count (bow_wv *wv, bow_barrel *barrel);
@@ -1631,6 +2049,102 @@ int bow_verbosify (int verbosity_level, const char *format, ...);
 volatile void _bow_error (const char *format, ...);
 
 
+
+/* Running work on several threads.  See threads.c */
+
+/* The number of threads used by the parallel parts of the library,
+   such as bow_barrel_add_from_text_dir().  Default is 1, which keeps
+   all the work on the calling thread. */
+extern int bow_num_threads;
+
+/* Return the number of processors currently online, or 1 if that
+   can't be determined. */
+int bow_threads_num_processors ();
+
+/* Call FUNC(I, CONTEXT) for each I from 0 to NUM_THREADS-1, each on
+   its own thread, and return once they have all returned.  Thread 0
+   is the calling thread itself. */
+void bow_threads_run (int num_threads,
+		      void (*func)(int thread_index, void *context),
+		      void *context);
+
+
+
+/* Using the library from several threads at once.  See ctx.c */
+
+/* What the reentrant `_r' functions use in place of the global
+   variables that their plain versions read or write.  A context may
+   be used by only one thread at a time; give each thread its own. */
+typedef struct _bow_ctx {
+  bow_lexer *lexer;		/* the lexer to read words with */
+  bow_lexer_parameters lexer_parameters; /* how its simple lexers do it */
+  /* If non-zero, add words not in the vocabulary and count the
+     occurrences of those in it, as bow_word2int_add_occurrence()
+     does; otherwise only look words up, leaving the vocabulary
+     alone. */
+  int add_words;
+  bow_wv *query_wv;		/* where bow_barrel_score_r() works */
+  int query_wv_size;		/* the capacity of QUERY_WV */
+} bow_ctx;
+
+/* Return a new context, with the lexer, lexer parameters and
+   vocabulary behavior currently set by the global variables. */
+bow_ctx *bow_ctx_new ();
+
+void bow_ctx_free (bow_ctx *ctx);
+
+/* Set the weights of a copy of QUERY_WV for BARREL, score it against
+   BARREL as bow_barrel_score() does, and return the number of scores
+   placed in SCORES.  QUERY_WV and BARREL are only read, so several
+   threads may call this at once with the same barrel, each with its
+   own CTX.  Methods whose scoring isn't thread-safe score one query
+   at a time. */
+int bow_barrel_score_r (bow_ctx *ctx, bow_barrel *barrel, bow_wv *query_wv,
+			bow_score *scores, int num_scores, int loo_class);
+
+
+
+/* The inner loops of scoring.  See kernels.c */
+
+/* Each of these points at the fastest version the processor can run,
+   AVX-512, AVX2 or plain C, chosen when the program starts.  All
+   versions of a kernel return bit-identical results. */
+
+/* For each of the LENGTH entries E of a document vector, add
+   W * (E.weight * SCALE[E.di]) to SCORES[E.di].  The E.di's must all
+   be different, as they are in any bow_dv. */
+extern void (*bow_kernel_scatter_add) (float *scores, const float *scale,
+				       const bow_de *entry, int length,
+				       float w);
+
+/* Like bow_kernel_scatter_add(), but add the single-precision product
+   ((E.weight * SCALE[E.di]) * FACTOR[E.di]) * W to double SCORES. */
+extern void (*bow_kernel_scatter_add_d) (double *scores, const float *scale,
+					 const float *factor,
+					 const bow_de *entry, int length,
+					 float w);
+
+/* Return the sum over the LENGTH entries E of a word vector of
+   E.weight * W[E.wi]. */
+extern double (*bow_kernel_dot_sd) (const bow_we *entry, int length,
+				    const double *w);
+
+/* Put the best K of the LENGTH SCORES into BSCORES, best first, with
+   their indices as DI, and return how many were put there.  Ties go
+   to the lower index.  The NAME's of BSCORES are left alone. */
+extern int (*bow_kernel_top_k) (const double *scores, int length,
+				bow_score *bscores, int k);
+extern int (*bow_kernel_top_k_f) (const float *scores, int length,
+				  bow_score *bscores, int k);
+
+/* The version of the kernels in use: "avx512", "avx2" or "scalar". */
+extern const char *bow_kernels_name;
+
+/* Use the version of the kernels called NAME.  Return 0, or -1 if
+   there is no such version or the processor can't run it. */
+int bow_kernels_select (const char *name);
+
+
 
 /* Memory allocation with error checking. */
 
@@ -1699,7 +2213,7 @@ extern int bow_file_format_version;
 /* The default, initial value of above variable.  The above variable will
    take on a different value when reading from binary data archived with 
    a different format version. */
-#define BOW_DEFAULT_FILE_FORMAT_VERSION 7
+#define BOW_DEFAULT_FILE_FORMAT_VERSION 9
 
 /* Functions for conveniently recording and finding out the format
    version used to write binary data to disk. */
@@ -1901,6 +2415,14 @@ typedef struct _bow_dv_heap {
   bow_wv *heap_wv;
   int heap_wv_di;
   int last_di;
+  /* If DI2WV is non-NULL, bow_heap_next_wv() reads each document's
+     words from this forward index of WI2DVF instead of merging the
+     DV's in the heap. */
+  bow_di2wv *di2wv;
+  bow_wi2dvf *wi2dvf;
+  int even_if_hidden;
+  int max_wi;
+  int heap_wv_size;		/* the capacity of HEAP_WV */
   bow_dv_heap_element entry[0];	/* The heap */
 } bow_dv_heap;
 
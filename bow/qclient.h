@@ -0,0 +1,202 @@
+/* The binary query protocol of rainbow's event-driven query server,
+   and a client library for it.
+   Copyright (C) 2026 agent
+
+   Written by:  agent <agent@local>
+
+   This file is part of the Bag-Of-Words Library, `libbow'.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License
+   as published by the Free Software Foundation, version 2.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA */
+
+#ifndef __BOW_QCLIENT_H
+#define __BOW_QCLIENT_H
+
+#include <bow/libbow.h>
+
+/* A connection to `rainbow --event-query-server' may mix text
+   requests (a line holding a byte count, then the query text) with
+   binary requests, which start with BOW_QPROTO_REQUEST_MAGIC.  Every
+   integer is an unsigned 32- or 16-bit number in network byte order;
+   every score is an IEEE single-precision float, sent as the 32-bit
+   integer with the same bits.
+
+   A binary request is:
+     u32 BOW_QPROTO_REQUEST_MAGIC
+     u32 the number of bytes in the rest of the request
+     u32 an id, returned in the reply
+     u16 the operation, one of BOW_QPROTO_OP_*
+     u16 K, the number of best classes to return for each document,
+         or 0 for all of them
+     u32 the number of documents
+   and then for each document:
+     u32 BOW_QPROTO_DOC_TEXT or BOW_QPROTO_DOC_WV
+     u32 N
+     N bytes of text, or N pairs of u32 word index and u32 count.
+   A count must be from 1 to 2^31 - 1; a request with any other gets
+   BOW_QPROTO_STATUS_MALFORMED.
+
+   Word indices are those of the server's vocabulary, which a client
+   can read from the model directory with bow_words_read_from_file().
+   Documents sent as word vectors skip the server's lexer entirely.
+
+   A reply is:
+     u32 BOW_QPROTO_REPLY_MAGIC
+     u32 the number of bytes in the rest of the reply
+     u32 the id of the request
+     u16 one of BOW_QPROTO_STATUS_*
+     u16 zero
+   For BOW_QPROTO_OP_CLASSIFY this is followed by the u32 number of
+   documents, and for each document, the u32 number of scores and
+   then that many pairs of u32 class index and float score, best
+   first.  For BOW_QPROTO_OP_CLASSNAMES it is followed by the u32
+   number of classes, and for each class the u32 length of its name
+   and then the name itself.  A request whose reply could be longer
+   than BOW_QPROTO_MAX_LENGTH gets BOW_QPROTO_STATUS_TOO_LARGE; send
+   fewer documents, or ask for fewer scores.
+
+   Replies on a connection come back in the order of the requests. */
+
+#define BOW_QPROTO_REQUEST_MAGIC 0xb0b0a001
+#define BOW_QPROTO_REPLY_MAGIC 0xb0b0a002
+
+/* The byte counts of the fixed headers of requests and replies. */
+#define BOW_QPROTO_REQUEST_HEADER_SIZE 20
+#define BOW_QPROTO_REPLY_HEADER_SIZE 16
+
+/* The largest request or reply, not counting its first eight bytes. */
+#define BOW_QPROTO_MAX_LENGTH (64 * 1024 * 1024)
+
+enum {
+  BOW_QPROTO_OP_CLASSIFY = 0,
+  BOW_QPROTO_OP_CLASSNAMES = 1
+};
+
+enum {
+  BOW_QPROTO_DOC_TEXT = 0,
+  BOW_QPROTO_DOC_WV = 1
+};
+
+enum {
+  BOW_QPROTO_STATUS_OK = 0,
+  BOW_QPROTO_STATUS_MALFORMED = 1,
+  BOW_QPROTO_STATUS_UNKNOWN_OP = 2,
+  BOW_QPROTO_STATUS_TOO_LARGE = 3	/* the reply would be too long */
+};
+
+/* Reading and writing the protocol's numbers at any alignment. */
+static inline void
+bow_qproto_put32 (unsigned char *p, unsigned int n)
+{
+  p[0] = n >> 24; p[1] = n >> 16; p[2] = n >> 8; p[3] = n;
+}
+static inline void
+bow_qproto_put16 (unsigned char *p, unsigned int n)
+{
+  p[0] = n >> 8; p[1] = n;
+}
+static inline unsigned int
+bow_qproto_get32 (const unsigned char *p)
+{
+  return (((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16)
+	  | ((unsigned int)p[2] << 8) | p[3]);
+}
+static inline unsigned int
+bow_qproto_get16 (const unsigned char *p)
+{
+  return (p[0] << 8) | p[1];
+}
+static inline void
+bow_qproto_put_float (unsigned char *p, float f)
+{
+  unsigned int n;
+  memcpy (&n, &f, sizeof (n));
+  bow_qproto_put32 (p, n);
+}
+static inline float
+bow_qproto_get_float (const unsigned char *p)
+{
+  unsigned int n = bow_qproto_get32 (p);
+  float f;
+  memcpy (&f, &n, sizeof (f));
+  return f;
+}
+
+
+/* The client library.  See qclient.c */
+
+typedef struct _bow_qclient {
+  int fd;
+  unsigned int next_id;		/* the id of the next request sent */
+  /* The request being built by bow_qclient_begin() and friends. */
+  unsigned char *req;
+  int req_length;
+  int req_size;
+  int req_num_docs;
+  /* Bytes read from the server that haven't been returned yet. */
+  unsigned char *in;
+  int in_length;
+  int in_size;
+} bow_qclient;
+
+/* The decoded reply to a BOW_QPROTO_OP_CLASSIFY request.  The SCORES
+   of document D are HITS[D][0] to HITS[D][NUM_HITS[D]-1]; the DI of
+   each is a class index. */
+typedef struct _bow_qclient_reply {
+  unsigned int id;
+  int status;
+  int num_docs;
+  int *num_hits;
+  bow_score **hits;
+  /* Where NUM_HITS and HITS live; reused by the next reply. */
+  bow_score *hits_storage;
+  int hits_storage_size;
+  int docs_size;
+} bow_qclient_reply;
+
+/* Connect to the query server on port PORT of HOST.  Return NULL,
+   with ERRNO set, if that fails. */
+bow_qclient *bow_qclient_open (const char *host, int port);
+
+/* Close the connection CLIENT and free it. */
+void bow_qclient_close (bow_qclient *client);
+
+/* Start building a BOW_QPROTO_OP_CLASSIFY request that asks for the
+   best K classes of each document, or all of them if K is 0. */
+void bow_qclient_begin (bow_qclient *client, int k);
+
+/* Add LENGTH bytes of TEXT to the request as a document. */
+void bow_qclient_add_text (bow_qclient *client, const char *text, int length);
+
+/* Add the word vector WV to the request as a document. */
+void bow_qclient_add_wv (bow_qclient *client, bow_wv *wv);
+
+/* Send the request built since bow_qclient_begin().  Return its id,
+   or -1 on error.  Several requests may be sent before their replies
+   are received. */
+int bow_qclient_send (bow_qclient *client);
+
+/* Wait for the next reply from the server and decode it into REPLY,
+   which must have been zeroed before its first use.  Return 0, or -1
+   if the connection failed or the reply was malformed. */
+int bow_qclient_receive (bow_qclient *client, bow_qclient_reply *reply);
+
+/* Free the memory held by REPLY, but not REPLY itself. */
+void bow_qclient_reply_free_contents (bow_qclient_reply *reply);
+
+/* Ask the server for its class names.  Return their number and set
+   *NAMES to a malloc()'ed array of malloc()'ed strings, or return -1
+   on error.  There must be no requests awaiting replies. */
+int bow_qclient_classnames (bow_qclient *client, char ***names);
+
+#endif /* __BOW_QCLIENT_H */
@@ -77,6 +77,12 @@
 #define INIT_KKT      0.001 /* initial val for epsilon_crit */
 #define EPSILON_CSTAR 1E-2
 
+/* whether solve_svm uses dcd - with any kernel but the linear one,
+ * --svm-use-smo=2 falls back to smo.  dcd keeps no error cache: it
+ * ignores the tvals it's passed & computes them all at the end, so
+ * the callers needn't keep them up to date between solves. */
+#define SVM_USING_DCD (svm_use_smo == 2 && svm_kernel_type == 0)
+
 struct di {
   double d;
   int i;
@@ -107,8 +113,12 @@ struct set {
 
 struct svm_smo_model {
   bow_wv    **docs;
+  int        *ord;     /* the kernel cache ordinal of each doc */
   /* see the tech rept. for the meaning of these poorly named variables */
   struct set  I0, I1, I2, I3, I4;
+  struct set  active;  /* the examples not shrunk away */
+  int        *cols;    /* scratch for the ordinals of the active ones */
+  double     *diag;    /* the kernel of each doc with itself */
   double     *weights;
   double     *W;
   double     *error;
@@ -118,7 +128,7 @@ struct svm_smo_model {
   int         iup,ilow;
   int         ndocs;
   int         nsv;
-  int         n_pair_suc, n_pair_tot, n_single_suc, n_single_tot, n_outer;
+  int         n_pair_suc, n_pair_tot, n_outer;
 };
 
 extern double svm_epsilon_a;    /* for alpha's & there bounds */
@@ -129,14 +139,16 @@ extern int svm_bsize;
 extern int svm_kernel_type;
 extern int svm_remove_misclassified;
 extern int svm_weight_style;
-/* this is included here so that the kcache call count can be reset  */
-extern int svm_nkc_calls;
+/* this is included here so that the kcache call count can be reset 
+ * (each thread counts its own) */
+extern __thread int svm_nkc_calls;
 
 extern int svm_init_al_tset;
 extern int svm_al_qsize;
 extern int svm_al_do_trans;
 
 extern int svm_use_smo;
+extern int svm_smo_shrinking;
 extern int svm_verbosity;
 extern int svm_random_seed;
 
@@ -161,10 +173,14 @@ bow_wv *svm_darray_to_wv(double *W);
 /* util fn when qsort is not necessary */
 void get_top_n(struct di *arr, int len, int n);
 
-/* increment the kernel cache's lru counter */
-void kcache_init(int nwide);
+/* the kernel cache - rows of the kernel matrix of the documents 
+ * registered with kcache_init, by their ordinal in DOCS */
+void kcache_init(bow_wv **docs, int ndocs);
 void kcache_clear();
-void kcache_age();
+int kcache_ordinal(bow_wv *wv);
+double *svm_kernel_row(int o);
+void kcache_restrict(int *ords, int n);
+void kcache_unrestrict();
 double svm_kernel_cache(bow_wv *wv1, bow_wv *wv2);
 double svm_kernel_cache_lookup(bow_wv *wv1, bow_wv *wv2);
 
@@ -172,6 +188,9 @@ int build_svm_guts(bow_wv **docs, int *yvect, double *weights, double *b,
 		   double **W, int ndocs, double *s, float *cvect, int *nsv);
 int smo(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W, 
 	int ndocs, double *error, float *cvect, int *nsv);
+/* dual coordinate descent, for the linear kernel only */
+int dcd(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W, 
+	int ndocs, double *error, float *cvect, int *nsv);
 
 
 inline int solve_svm(bow_wv **docs, int *yvect, double *weights, double *tb,
@@ -38,7 +38,8 @@ typedef struct _bow_tfidf_params {
 } bow_params_tfidf;
 
 /* The number of documents with non-zero dot-product with the query. 
-   Set in bow_tfidf_score(). */
-extern int bow_tfidf_num_hit_documents;
+   Set in bow_tfidf_score(), separately for each thread.  When it
+   prunes, only the documents it scored are counted. */
+extern __thread int bow_tfidf_num_hit_documents;
 
 #endif /* __BOW_TFIDF_H */
@@ -140,6 +140,12 @@ void bow_treenode_add_new_loo_for_di_wvi (treenode *tn,
 				      double weight, int di, int wvi,
 				      int di_wv_num_entries, int di_count);
 
+/* Make sure that treenode TN has the arrays, indexed by DI, in which
+   the above function records NEW LOO info for DI_COUNT documents.
+   Once they exist, several threads may add LOO info for different
+   documents at the same time. */
+void bow_treenode_alloc_new_loo (treenode *tn, int di_count);
+
 /* Clear all LOO info for treenode TN */
 void bow_treenode_free_loo (treenode *tn, int di_count);
 
@@ -264,6 +270,59 @@ double bow_treenode_log_local_prob_of_wv_loo (treenode *tn,
 double bow_treenode_complete_log_prob_of_wv (treenode *tn, bow_wv *wv);
 
 
+/* Compiled trees */
+
+/* A snapshot of the WORDS, NEW_WORDS and LAMBDAS of a whole tree,
+   laid out in flat arrays so that many documents can be scored
+   against all leaves, and their counts added to all ancestors,
+   without chasing PARENT pointers or recomputing log(). */
+typedef struct _bow_treenode_compiled {
+  int shrinkage;		/* LEAF_LOG_PROBS use the vertical mixture */
+  int words_capacity;		/* number of rows in WORDS, LEAF_LOG_PROBS */
+  int nodes_count;
+  int leaves_count;
+  int path_capacity;		/* longest leaf-to-root path, plus uniform */
+  treenode **nodes;		/* in bow_treenode_iterate_all() order */
+  treenode **leaves;		/* in bow_treenode_iterate_leaves() order */
+  int *leaf_ancestors;		/* [li*PATH_CAPACITY+ai] index into NODES,
+				   -1 for the uniform distribution */
+  double *leaf_lambdas;		/* [li*PATH_CAPACITY+ai] copy of LAMBDAS */
+  double *words;		/* [wi*NODES_COUNT+ni] copy of WORDS */
+  double *new_words;		/* [wi*NODES_COUNT+ni] working NEW_WORDS */
+  double *leaf_log_probs;	/* [wi*LEAVES_COUNT+li] log Pr(wi|leaf),
+				   or NULL until they are set */
+} bow_treenode_compiled;
+
+/* Return a compiled snapshot of the WORDS, NEW_WORDS and LAMBDAS of
+   the tree under ROOT. */
+bow_treenode_compiled *bow_treenode_compiled_new (treenode *root);
+
+/* Fill in the LEAF_LOG_PROBS of TC.  They use the vertical mixture
+   over ancestors if SHRINKAGE is non-zero, and the leaf's own WORDS
+   otherwise. */
+void bow_treenode_compiled_set_leaf_log_probs (bow_treenode_compiled *tc,
+					       int shrinkage);
+
+/* Return the index of node TN in the NODES array of TC. */
+int bow_treenode_compiled_node_index (bow_treenode_compiled *tc, 
+				      treenode *tn);
+
+/* Copy the NEW_WORDS accumulated in TC back into the nodes of the
+   tree it was compiled from. */
+void bow_treenode_compiled_store_new_words (bow_treenode_compiled *tc);
+
+/* Free the memory allocated by bow_treenode_compiled_new(). */
+void bow_treenode_compiled_free (bow_treenode_compiled *tc);
+
+/* Fill LOG_PROBS with the log-probability of each leaf of TC having
+   produced each of the WVS_COUNT word vectors in WVS; the entry for
+   the WVI'th word vector and the LI'th leaf is
+   LOG_PROBS[WVI*TC->LEAVES_COUNT+LI]. */
+void bow_treenode_compiled_log_prob_of_wvs (bow_treenode_compiled *tc,
+					    bow_wv **wvs, int wvs_count,
+					    double *log_probs);
+
+
 /* Tree statistics and diagnostics. */
 
 /* Return the number of leaves under (and including) TN */
@@ -0,0 +1,91 @@
+/* Contexts for using the library from several threads at once.
+   Copyright (C) 2026 agent
+
+   Written by:  agent <agent@local>
+
+   This file is part of the Bag-Of-Words Library, `libbow'.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License
+   as published by the Free Software Foundation, version 2.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA */
+
+#include <bow/libbow.h>
+#include <pthread.h>
+
+/* Held while scoring with a method whose scoring isn't thread-safe. */
+static pthread_mutex_t bow_ctx_score_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return a new context, with the lexer, lexer parameters and
+   vocabulary behavior currently set by the global variables. */
+bow_ctx *
+bow_ctx_new ()
+{
+  bow_ctx *ctx = bow_malloc (sizeof (bow_ctx));
+
+  ctx->lexer = bow_default_lexer;
+  ctx->lexer_parameters = *bow_default_lexer_parameters;
+  ctx->add_words = !bow_word2int_do_not_add;
+  ctx->query_wv_size = 64;
+  ctx->query_wv = bow_wv_new (ctx->query_wv_size);
+  return ctx;
+}
+
+void
+bow_ctx_free (bow_ctx *ctx)
+{
+  bow_wv_free (ctx->query_wv);
+  bow_free (ctx);
+}
+
+/* Copy QUERY_WV into CTX->QUERY_WV, growing it if necessary. */
+static bow_wv *
+bow_ctx_copy_query_wv (bow_ctx *ctx, bow_wv *query_wv)
+{
+  int wvi;
+
+  if (query_wv->num_entries > ctx->query_wv_size)
+    {
+      while (query_wv->num_entries > ctx->query_wv_size)
+	ctx->query_wv_size *= 2;
+      bow_wv_free (ctx->query_wv);
+      ctx->query_wv = bow_wv_new (ctx->query_wv_size);
+    }
+  for (wvi = 0; wvi < query_wv->num_entries; wvi++)
+    ctx->query_wv->entry[wvi] = query_wv->entry[wvi];
+  ctx->query_wv->num_entries = query_wv->num_entries;
+  ctx->query_wv->normalizer = query_wv->normalizer;
+  return ctx->query_wv;
+}
+
+/* Set the weights of a copy of QUERY_WV for BARREL, score it against
+   BARREL as bow_barrel_score() does, and return the number of scores
+   placed in SCORES.  The scoring functions set the weights of the
+   word vector they are given, and some, like naivebayes, set them
+   again while scoring, so working on a copy is what leaves QUERY_WV
+   alone. */
+int
+bow_barrel_score_r (bow_ctx *ctx, bow_barrel *barrel, bow_wv *query_wv,
+		    bow_score *scores, int num_scores, int loo_class)
+{
+  bow_wv *wv = bow_ctx_copy_query_wv (ctx, query_wv);
+  int safe = barrel->method->score_is_thread_safe;
+  int num_hits;
+
+  if (!safe)
+    pthread_mutex_lock (&bow_ctx_score_lock);
+  bow_wv_set_weights (wv, barrel);
+  bow_wv_normalize_weights (wv, barrel);
+  num_hits = bow_barrel_score (barrel, wv, scores, num_scores, loo_class);
+  if (!safe)
+    pthread_mutex_unlock (&bow_ctx_score_lock);
+  return num_hits;
+}
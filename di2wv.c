@@ -0,0 +1,206 @@
+/* A forward index from documents to the words they contain.
+   Copyright (C) 2026 agent
+
+   Written by:  agent <agent@local>
+
+   This file is part of the Bag-Of-Words Library, `libbow'.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License
+   as published by the Free Software Foundation, version 2.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA */
+
+#include <bow/libbow.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* The file starts with these four ints and a bow_barrel_stamp, then
+   come the LENGTH+1 START offsets, then the entries, all in host
+   layout so that the file can be used in place when it is
+   memory-mapped. */
+#define BOW_DI2WV_MAGIC 0x62647733	/* "bdw3" */
+#define BOW_DI2WV_HEADER_SIZE (4 * sizeof (int) + sizeof (bow_barrel_stamp))
+
+/* Create a forward index for WI2DVF.  The DV's of hidden words are
+   included, so that unhiding them later doesn't invalidate it. */
+bow_di2wv *
+bow_di2wv_new_from_wi2dvf (bow_wi2dvf *wi2dvf)
+{
+  bow_di2wv *ret;
+  bow_dv *dv;
+  size_t *next;			/* where the next entry of each DI goes */
+  int wi, dvi, di;
+
+  ret = bow_malloc (sizeof (bow_di2wv));
+  ret->mmap_base = NULL;
+  ret->mmap_length = 0;
+
+  /* Find the number of documents. */
+  ret->length = 0;
+  for (wi = 0; wi < wi2dvf->size; wi++)
+    {
+      dv = bow_wi2dvf_dv_hidden (wi2dvf, wi, 1);
+      if (dv && dv->length > 0)
+	ret->length = MAX (ret->length, dv->entry[dv->length-1].di + 1);
+    }
+
+  /* Count the words of each document, and from those counts figure
+     out where each document's entries start. */
+  ret->start = bow_malloc ((ret->length + 1) * sizeof (size_t));
+  for (di = 0; di <= ret->length; di++)
+    ret->start[di] = 0;
+  for (wi = 0; wi < wi2dvf->size; wi++)
+    {
+      dv = bow_wi2dvf_dv_hidden (wi2dvf, wi, 1);
+      for (dvi = 0; dv && dvi < dv->length; dvi++)
+	ret->start[dv->entry[dvi].di + 1]++;
+    }
+  for (di = 0; di < ret->length; di++)
+    ret->start[di + 1] += ret->start[di];
+
+  /* Fill in the entries.  Going through the words in order leaves
+     each document's entries sorted by word index. */
+  ret->entry = bow_malloc (ret->start[ret->length]
+			   * sizeof (bow_di2wv_entry));
+  next = bow_malloc (ret->length * sizeof (size_t));
+  memcpy (next, ret->start, ret->length * sizeof (size_t));
+  for (wi = 0; wi < wi2dvf->size; wi++)
+    {
+      dv = bow_wi2dvf_dv_hidden (wi2dvf, wi, 1);
+      for (dvi = 0; dv && dvi < dv->length; dvi++)
+	{
+	  di = dv->entry[dvi].di;
+	  ret->entry[next[di]].wi = wi;
+	  ret->entry[next[di]].dvi = dvi;
+	  next[di]++;
+	}
+    }
+  bow_free (next);
+  return ret;
+}
+
+/* Write DI2WV to the file-pointer FP, along with STAMP.  The layout
+   is that of the host, as for bow_dv_encoding_native. */
+void
+bow_di2wv_write (bow_di2wv *di2wv, const bow_barrel_stamp *stamp, FILE *fp)
+{
+  int header[4];
+  bow_barrel_stamp st;
+
+  header[0] = BOW_DI2WV_MAGIC;
+  header[1] = sizeof (size_t);
+  header[2] = di2wv->length;
+  header[3] = 0;
+  /* Copy it field by field, so that any padding is written as zeros. */
+  memset (&st, 0, sizeof (st));
+  st.num_docs = stamp->num_docs;
+  st.num_words = stamp->num_words;
+  st.data_size = stamp->data_size;
+  st.data_mtime = stamp->data_mtime;
+  if (fwrite (header, sizeof (int), 4, fp) != 4
+      || fwrite (&st, sizeof (st), 1, fp) != 1
+      || (fwrite (di2wv->start, sizeof (size_t), di2wv->length + 1, fp)
+	  != di2wv->length + 1)
+      || (fwrite (di2wv->entry, sizeof (bow_di2wv_entry),
+		  di2wv->start[di2wv->length], fp)
+	  != di2wv->start[di2wv->length]))
+    bow_error ("Couldn't write forward index");
+}
+
+/* Create a forward index by reading from the file-pointer FP, which
+   must be at the start of a file written by bow_di2wv_write().  The
+   file is memory-mapped if it can be.  Return NULL if FP doesn't hold
+   a forward index that this host can use, or if it was made from a
+   barrel other than the one STAMP describes. */
+bow_di2wv *
+bow_di2wv_new_from_data_fp (FILE *fp, const bow_barrel_stamp *stamp)
+{
+  bow_di2wv *ret;
+  struct stat st;
+  char *base;
+  int header[4];
+  bow_barrel_stamp file_stamp;
+  off_t entries_offset;
+  size_t num_entries;
+
+  if (fstat (fileno (fp), &st) != 0 || !S_ISREG (st.st_mode)
+      || fread (header, sizeof (int), 4, fp) != 4
+      || header[0] != BOW_DI2WV_MAGIC || header[1] != sizeof (size_t)
+      || header[2] < 0
+      || fread (&file_stamp, sizeof (file_stamp), 1, fp) != 1
+      || file_stamp.num_docs != stamp->num_docs
+      || file_stamp.num_words != stamp->num_words
+      || file_stamp.data_size != stamp->data_size
+      || file_stamp.data_mtime != stamp->data_mtime
+      || header[2] > stamp->num_docs)
+    return NULL;
+
+  ret = bow_malloc (sizeof (bow_di2wv));
+  ret->length = header[2];
+  entries_offset = (BOW_DI2WV_HEADER_SIZE
+		    + (off_t) (ret->length + 1) * sizeof (size_t));
+  if (st.st_size < entries_offset)
+    {
+      bow_free (ret);
+      return NULL;
+    }
+  base = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno (fp), 0);
+  if (base != MAP_FAILED)
+    {
+      ret->mmap_base = base;
+      ret->mmap_length = st.st_size;
+      ret->start = (size_t*) (base + BOW_DI2WV_HEADER_SIZE);
+      ret->entry = (bow_di2wv_entry*) (base + entries_offset);
+    }
+  else
+    {
+      /* Read it in the old-fashioned way. */
+      ret->mmap_base = NULL;
+      ret->mmap_length = 0;
+      ret->start = bow_malloc ((ret->length + 1) * sizeof (size_t));
+      ret->entry = NULL;
+      if (fread (ret->start, sizeof (size_t), ret->length + 1, fp)
+	  != ret->length + 1)
+	goto bad;
+    }
+  num_entries = ret->start[ret->length];
+  if (entries_offset + (off_t) num_entries * sizeof (bow_di2wv_entry)
+      != st.st_size)
+    goto bad;
+  if (!ret->mmap_base)
+    {
+      ret->entry = bow_malloc (num_entries * sizeof (bow_di2wv_entry));
+      if (fread (ret->entry, sizeof (bow_di2wv_entry), num_entries, fp)
+	  != num_entries)
+	goto bad;
+    }
+  return ret;
+
+ bad:
+  bow_di2wv_free (ret);
+  return NULL;
+}
+
+/* Free the memory held by DI2WV. */
+void
+bow_di2wv_free (bow_di2wv *di2wv)
+{
+  if (di2wv->mmap_base)
+    munmap (di2wv->mmap_base, di2wv->mmap_length);
+  else
+    {
+      bow_free (di2wv->start);
+      if (di2wv->entry)
+	bow_free (di2wv->entry);
+    }
+  bow_free (di2wv);
+}
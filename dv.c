@@ -21,10 +21,12 @@
 
 #include <bow/libbow.h>
 #include <assert.h>
+#include <string.h>
 
 unsigned int bow_dv_default_capacity = 2;
 
-/* The number of "document vectors" current in existance. */
+/* The number of "document vectors" current in existance.  Updated
+   atomically, since DV's may be made on several threads at once. */
 unsigned int bow_dv_count = 0;
 
 /* Create a new, empty "document vector". */
@@ -39,7 +41,7 @@ bow_dv_new (int capacity)
   ret->length = 0;
   ret->idf = 0.0f;
   ret->size = capacity;
-  bow_dv_count++;
+  __sync_fetch_and_add (&bow_dv_count, 1);
   return ret;
 }
 
@@ -193,13 +195,21 @@ bow_dv_set_di_count_weight (bow_dv **dv, int di, int count, float weight)
 bow_de *
 bow_dv_entry_at_di (bow_dv *dv, int di)
 {
-  int dvi;
+  int lo, hi, mid;
 
-  for (dvi = 0; dvi < dv->length && dv->entry[dvi].di <= di; dvi++)
+  /* The entries are sorted by DI; do a binary search. */
+  lo = 0;
+  hi = dv->length;
+  while (lo < hi)
     {
-      if (dv->entry[dvi].di == di)
-	return &(dv->entry[dvi]);
+      mid = (lo + hi) / 2;
+      if (dv->entry[mid].di < di)
+	lo = mid + 1;
+      else
+	hi = mid;
     }
+  if (lo < dv->length && dv->entry[lo].di == di)
+    return &(dv->entry[lo]);
   return NULL;
 }
 
@@ -300,9 +310,341 @@ bow_dv_new_from_data_fp (FILE *fp)
   return ret;
 }
 
+/* Return the number of bytes required for writing the "document
+   vector" DV with bow_dv_write_native(). */
+int
+bow_dv_write_native_size (bow_dv *dv)
+{
+  assert (dv);
+  return sizeof (bow_dv) + sizeof (bow_de) * dv->length;
+}
+
+/* Write "document vector" DV to the stream FP as an image of the
+   in-core `bow_dv' structure, in host byte order, so that it can be
+   used in place when the file is memory-mapped.  The unused entries
+   are not written, and SIZE is written equal to LENGTH.  Note that,
+   unlike bow_dv_write(), this format is not machine-independent. */
+void
+bow_dv_write_native (bow_dv *dv, FILE *fp)
+{
+  bow_dv header;
+  int num_written;
+
+  assert (dv);
+  assert (dv->idf == dv->idf);	/* testing for NaN */
+  header.length = dv->length;
+  header.size = dv->length;
+  header.idf = dv->idf;
+  num_written = fwrite (&header, sizeof (bow_dv), 1, fp);
+  assert (num_written == 1);
+  num_written = fwrite (dv->entry, sizeof (bow_de), dv->length, fp);
+  assert (num_written == dv->length);
+}
+
+/* Return a new "document vector" read from a pointer into a data
+   file, FP, that was written with bow_dv_write_native(). */
+bow_dv *
+bow_dv_new_from_native_data_fp (FILE *fp)
+{
+  bow_dv header;
+  bow_dv *ret;
+  int num_read;
+
+  assert (feof (fp) == 0);	/* Help make sure FP hasn't been closed. */
+  num_read = fread (&header, sizeof (bow_dv), 1, fp);
+  assert (num_read == 1);
+  assert (header.length > 0 && header.size == header.length);
+  ret = bow_dv_new (header.length);
+  ret->idf = header.idf;
+  ret->length = header.length;
+  num_read = fread (ret->entry, sizeof (bow_de), header.length, fp);
+  assert (num_read == header.length);
+  return ret;
+}
+
+/* If non-zero, bow_dv_write_compressed() stores weights as 16-bit
+   truncated floats, unless they can be recovered exactly from the
+   counts. */
+int bow_dv_quantize_weights = 0;
+
+/* Flags in the header of a compressed "document vector". */
+#define BOW_DV_COMPRESSED_WEIGHTS_ARE_COUNTS 1	/* no weights stored */
+#define BOW_DV_COMPRESSED_WEIGHTS_16BIT 2	/* weights are bfloat16 */
+
+/* Append the unsigned varint N to *BUF and advance it; if *BUF is
+   NULL, only count the bytes.  Return the number of bytes. */
+static inline int
+_bow_dv_put_varint (unsigned char **buf, unsigned int n)
+{
+  int len = 0;
+  do
+    {
+      unsigned char byte = n & 0x7f;
+      n >>= 7;
+      if (n)
+	byte |= 0x80;
+      if (*buf)
+	*(*buf)++ = byte;
+      len++;
+    }
+  while (n);
+  return len;
+}
+
+/* Return the unsigned varint at *P, and advance *P past it. */
+static inline unsigned int
+_bow_dv_get_varint (const unsigned char **p)
+{
+  unsigned int n = 0;
+  int shift = 0;
+  unsigned char byte;
+  do
+    {
+      byte = *(*p)++;
+      n |= (unsigned int)(byte & 0x7f) << shift;
+      shift += 7;
+    }
+  while (byte & 0x80);
+  return n;
+}
+
+/* Map signed counts to unsigned ones so that small magnitudes get
+   short varints.  Counts are almost never negative, but class barrels
+   built by some methods store bogus counts. */
+#define ZIGZAG_ENCODE(N) ((((unsigned int)(N)) << 1) ^ (unsigned int)((N) >> 31))
+#define ZIGZAG_DECODE(N) ((int)((N) >> 1) ^ -(int)((N) & 1))
+
+/* Return the 16 high bits of the float F, rounded to nearest even. */
+static inline unsigned short
+_bow_dv_float_to_bfloat16 (float f)
+{
+  unsigned int bits;
+  memcpy (&bits, &f, sizeof (float));
+  if ((bits & 0x7f800000) == 0x7f800000)
+    return bits >> 16;		/* Inf or NaN; don't round into them */
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return bits >> 16;
+}
+
+static inline float
+_bow_dv_bfloat16_to_float (unsigned short h)
+{
+  unsigned int bits = ((unsigned int) h) << 16;
+  float f;
+  memcpy (&f, &bits, sizeof (float));
+  return f;
+}
+
+/* Store the float F at P as 4 bytes, most significant first, the way
+   bow_fwrite_int() stores an int, so that the data file can be read
+   on a machine of either byte order. */
+static inline void
+_bow_dv_put_float (unsigned char *p, float f)
+{
+  unsigned int bits;
+  memcpy (&bits, &f, sizeof (float));
+  p[0] = bits >> 24;
+  p[1] = (bits >> 16) & 0xff;
+  p[2] = (bits >> 8) & 0xff;
+  p[3] = bits & 0xff;
+}
+
+static inline float
+_bow_dv_get_float (const unsigned char *p)
+{
+  unsigned int bits = (((unsigned int) p[0] << 24) | (p[1] << 16)
+		       | (p[2] << 8) | p[3]);
+  float f;
+  memcpy (&f, &bits, sizeof (float));
+  return f;
+}
+
+/* Return the flags to use when compressing the "document vector" DV. */
+static int
+_bow_dv_compressed_flags (bow_dv *dv)
+{
+  int dvi;
+
+  for (dvi = 0; dvi < dv->length; dvi++)
+    if (dv->entry[dvi].weight != (float) dv->entry[dvi].count)
+      break;
+  if (dvi == dv->length)
+    return BOW_DV_COMPRESSED_WEIGHTS_ARE_COUNTS;
+  if (bow_dv_quantize_weights)
+    return BOW_DV_COMPRESSED_WEIGHTS_16BIT;
+  return 0;
+}
+
+/* Encode the body of the "document vector" DV (everything after the
+   leading byte count) into BUF, or just count the bytes if BUF is
+   NULL.  Return the number of bytes. */
+static int
+_bow_dv_encode_compressed (bow_dv *dv, unsigned char *buf)
+{
+  int len = 0;
+  int flags = _bow_dv_compressed_flags (dv);
+  int dvi;
+  int last_di = 0;
+
+  len += _bow_dv_put_varint (&buf, dv->length);
+  if (buf)
+    {
+      _bow_dv_put_float (buf, dv->idf);
+      buf += sizeof (float);
+      *buf++ = flags;
+    }
+  len += sizeof (float) + 1;
+  for (dvi = 0; dvi < dv->length; dvi++)
+    {
+      /* DI's are sorted, so store the gap from the previous one. */
+      assert (dv->entry[dvi].di >= last_di);
+      len += _bow_dv_put_varint (&buf, dv->entry[dvi].di - last_di);
+      last_di = dv->entry[dvi].di;
+      len += _bow_dv_put_varint (&buf, ZIGZAG_ENCODE (dv->entry[dvi].count));
+      if (flags & BOW_DV_COMPRESSED_WEIGHTS_ARE_COUNTS)
+	continue;
+      if (flags & BOW_DV_COMPRESSED_WEIGHTS_16BIT)
+	{
+	  if (buf)
+	    {
+	      unsigned short h = 
+		_bow_dv_float_to_bfloat16 (dv->entry[dvi].weight);
+	      *buf++ = h >> 8;
+	      *buf++ = h & 0xff;
+	    }
+	  len += 2;
+	}
+      else
+	{
+	  if (buf)
+	    {
+	      _bow_dv_put_float (buf, dv->entry[dvi].weight);
+	      buf += sizeof (float);
+	    }
+	  len += sizeof (float);
+	}
+    }
+  return len;
+}
+
+/* Return a new "document vector" decoded from the body at P, written
+   by _bow_dv_encode_compressed(). */
+static bow_dv *
+_bow_dv_decode_compressed (const unsigned char *p)
+{
+  bow_dv *ret;
+  int len, flags, dvi;
+  int di = 0;
+
+  len = _bow_dv_get_varint (&p);
+  if (len == 0)
+    return NULL;
+  ret = bow_dv_new (len);
+  ret->length = len;
+  ret->idf = _bow_dv_get_float (p);
+  p += sizeof (float);
+  assert (ret->idf == ret->idf);	/* testing for NaN */
+  flags = *p++;
+  for (dvi = 0; dvi < len; dvi++)
+    {
+      bow_de *de = &(ret->entry[dvi]);
+      unsigned int count;
+      di += _bow_dv_get_varint (&p);
+      de->di = di;
+      count = _bow_dv_get_varint (&p);
+      de->count = ZIGZAG_DECODE (count);
+      if (flags & BOW_DV_COMPRESSED_WEIGHTS_ARE_COUNTS)
+	de->weight = de->count;
+      else if (flags & BOW_DV_COMPRESSED_WEIGHTS_16BIT)
+	{
+	  de->weight = _bow_dv_bfloat16_to_float ((p[0] << 8) | p[1]);
+	  p += 2;
+	}
+      else
+	{
+	  de->weight = _bow_dv_get_float (p);
+	  p += sizeof (float);
+	}
+    }
+  return ret;
+}
+
+/* Return the number of bytes required for writing the "document
+   vector" DV with bow_dv_write_compressed(). */
+int
+bow_dv_write_compressed_size (bow_dv *dv)
+{
+  unsigned char *none = NULL;
+  int len;
+
+  assert (dv);
+  len = _bow_dv_encode_compressed (dv, NULL);
+  return len + _bow_dv_put_varint (&none, len);
+}
+
+/* Write "document vector" DV to the stream FP in a compact form: the
+   byte count of the rest, LENGTH, IDF, a flags byte, and then for
+   each entry the gap from the previous DI and the COUNT as varints,
+   followed by the WEIGHT, unless it is equal to the COUNT.  If
+   BOW_DV_QUANTIZE_WEIGHTS is non-zero, weights are rounded to 16
+   bits. */
+void
+bow_dv_write_compressed (bow_dv *dv, FILE *fp)
+{
+  int len = _bow_dv_encode_compressed (dv, NULL);
+  unsigned char *buf = bow_malloc (len + 5);
+  unsigned char *p = buf;
+  int num_written;
+
+  _bow_dv_put_varint (&p, len);
+  _bow_dv_encode_compressed (dv, p);
+  num_written = fwrite (buf, 1, (p - buf) + len, fp);
+  assert (num_written == (p - buf) + len);
+  bow_free (buf);
+}
+
+/* Return a new "document vector" read from a pointer into a data
+   file, FP, that was written with bow_dv_write_compressed(). */
+bow_dv *
+bow_dv_new_from_compressed_data_fp (FILE *fp)
+{
+  unsigned int len = 0;
+  int shift = 0;
+  int byte;
+  unsigned char *buf;
+  int num_read;
+  bow_dv *ret;
+
+  assert (feof (fp) == 0);	/* Help make sure FP hasn't been closed. */
+  do
+    {
+      byte = getc (fp);
+      assert (byte != EOF);
+      len |= (unsigned int)(byte & 0x7f) << shift;
+      shift += 7;
+    }
+  while (byte & 0x80);
+  buf = bow_malloc (len);
+  num_read = fread (buf, 1, len, fp);
+  assert (num_read == len);
+  ret = _bow_dv_decode_compressed (buf);
+  bow_free (buf);
+  return ret;
+}
+
+/* Return a new "document vector" decoded from DATA, which points at
+   the bytes written by bow_dv_write_compressed(), for example in a
+   memory-mapped data file. */
+bow_dv *
+bow_dv_new_from_compressed_data (const unsigned char *data)
+{
+  _bow_dv_get_varint (&data);
+  return _bow_dv_decode_compressed (data);
+}
+
 void
 bow_dv_free (bow_dv *dv)
 {
-  bow_dv_count--;
+  __sync_fetch_and_sub (&bow_dv_count, 1);
   bow_free (dv);
 }
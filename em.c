@@ -576,6 +576,282 @@ bow_em_perturb_weights (bow_barrel *doc_barrel, bow_barrel *vpc_barrel)
   
 
 
+/* The number of words a thread of em_count_words() takes at a time. */
+#define EM_CHUNK 64
+
+/* The word vectors of the documents each E-step classifies, read in
+   once so that the E-steps needn't walk a heap every round. */
+typedef struct _em_doc_set {
+  int num_docs;
+  bow_cdoc **cdocs;
+  bow_wv **wvs;
+} em_doc_set;
+
+/* What the threads of an E-step or an M-step share. */
+typedef struct _em_step_context {
+  bow_barrel *doc_barrel;
+  bow_barrel *vpc_barrel;
+  int num_classes;
+  int max_wi;
+  em_doc_set *docs;		/* the documents an E-step classifies */
+  int next;			/* the next document or chunk of words */
+  int *num_words;		/* per thread, the class DV's made */
+} em_step_context;
+
+/* Return the word vectors of the documents of DOC_BARREL for which
+   USE_IF_TRUE returns non-zero, in order of document index. */
+static em_doc_set *
+em_doc_set_new (bow_barrel *doc_barrel, int (*use_if_true)(bow_cdoc*))
+{
+  em_doc_set *ds = bow_malloc (sizeof (em_doc_set));
+  bow_dv_heap *heap;
+  bow_wv *query_wv = NULL;
+  int di, size = 0;
+
+  for (di = 0; di < doc_barrel->cdocs->length; di++)
+    if ((*use_if_true) (bow_array_entry_at_index (doc_barrel->cdocs, di)))
+      size++;
+  ds->num_docs = 0;
+  ds->cdocs = bow_malloc ((size + 1) * sizeof (bow_cdoc*));
+  ds->wvs = bow_malloc ((size + 1) * sizeof (bow_wv*));
+  heap = bow_test_new_heap (doc_barrel);
+  while ((di = bow_heap_next_wv (heap, doc_barrel, &query_wv, use_if_true))
+	 != -1)
+    {
+      assert (ds->num_docs < size);
+      ds->cdocs[ds->num_docs] = 
+	bow_array_entry_at_index (doc_barrel->cdocs, di);
+      /* The heap owns QUERY_WV, so keep a copy of our own. */
+      ds->wvs[ds->num_docs] = bow_wv_copy (query_wv);
+      ds->wvs[ds->num_docs]->normalizer = query_wv->normalizer;
+      ds->num_docs++;
+    }
+  return ds;
+}
+
+static void
+em_doc_set_free (em_doc_set *ds)
+{
+  int i;
+
+  for (i = 0; i < ds->num_docs; i++)
+    bow_wv_free (ds->wvs[i]);
+  bow_free (ds->cdocs);
+  bow_free (ds->wvs);
+  bow_free (ds);
+}
+
+/* Set the CLASS_PROBS of DOC_CDOC from the NUM_HITS scores in HITS
+   that bow_em_score() gave it over NUM_CLASSES classes. */
+static void
+em_set_class_probs (bow_cdoc *doc_cdoc, bow_score *hits, int num_hits,
+		    int num_classes)
+{
+  int ci, hi;
+
+  if (em_stat_method == simple)
+    {
+      /* set the class probs to 1 for the maximally likely class */
+      for (ci = 0; ci < num_classes; ci++)
+	doc_cdoc->class_probs[ci] = 0.0;
+
+      doc_cdoc->class_probs[hits[0].di] = unlabeled_normalizer;
+    }
+  else if (em_stat_method == nb_score)
+    {
+      /* set the class probs to the naive bayes score */
+      for (hi = 0; hi < num_hits; hi++)
+	doc_cdoc->class_probs[hits[hi].di] = unlabeled_normalizer *
+	  hits[hi].weight;
+
+      /* this is a neg training doc.  Zero out the pos
+	 component. */
+      if (bow_em_multi_hump_neg > 1 &&
+	  doc_cdoc->type == bow_doc_train)
+	{
+	  double new_total = 0;
+
+	  doc_cdoc->class_probs[binary_pos_ci] = 0;
+	  for (ci = 0; ci < num_classes; ci++)
+	    new_total += doc_cdoc->class_probs[ci];
+
+	  if (new_total != 0)
+	    {
+	      for (ci = 0; ci < num_classes; ci++)
+		doc_cdoc->class_probs[ci] = unlabeled_normalizer *
+		  doc_cdoc->class_probs[ci] / new_total;
+	    }
+	  else
+	    {
+	      /* blech.  we got hosed on roundoff. */
+	      for (ci = 0; ci < num_classes; ci++)
+		doc_cdoc->class_probs[ci] = 
+		  (float) unlabeled_normalizer /
+		  ((float) num_classes - 1.0);
+	      doc_cdoc->class_probs[binary_pos_ci] = 0;
+	    }
+	}
+    }
+  else
+    bow_error ("No method for this type.");
+}
+
+/* The work of one thread of em_classify_docs(): take documents until
+   there are none left, and set the CLASS_PROBS of each from its
+   scores under SC->VPC_BARREL.  Each document is taken by one thread
+   only, and depends on no other, so the order doesn't matter. */
+static void
+em_classify_docs_thread (int thread_index, void *context)
+{
+  em_step_context *sc = context;
+  bow_score *hits = alloca (sizeof (bow_score) * sc->num_classes);
+  bow_wv *query_wv;
+  int i, num_hits;
+
+  while ((i = __sync_fetch_and_add (&sc->next, 1)) < sc->docs->num_docs)
+    {
+      query_wv = sc->docs->wvs[i];
+      bow_wv_set_weights (query_wv, sc->vpc_barrel);
+      bow_wv_normalize_weights (query_wv, sc->vpc_barrel);
+      num_hits = bow_barrel_score (sc->vpc_barrel, query_wv, hits,
+				   sc->num_classes, (int) NULL);
+      assert (num_hits == sc->num_classes);
+      em_set_class_probs (sc->docs->cdocs[i], hits, num_hits,
+			  sc->num_classes);
+    }
+}
+
+/* The E-step: set the CLASS_PROBS of each document in DOCS from its
+   NUM_CLASSES scores under VPC_BARREL, on BOW_NUM_THREADS threads. */
+static void
+em_classify_docs (bow_barrel *vpc_barrel, em_doc_set *docs, int num_classes)
+{
+  em_step_context sc;
+
+  sc.vpc_barrel = vpc_barrel;
+  sc.num_classes = num_classes;
+  sc.docs = docs;
+  sc.next = 0;
+  /* Printed word scores would be interleaved. */
+  bow_threads_run (bow_print_word_scores ? 1 : bow_num_threads,
+		   em_classify_docs_thread, &sc);
+}
+
+/* The work of one thread of em_count_words(): take chunks of words
+   until there are none left, and for each, make its class DV from
+   the CLASS_PROBS of the training and unlabeled documents containing
+   it.  Each word is taken by one thread only, so each class DV is
+   too, and its weights are summed in the same order as by
+   bow_wi2dvf_add_wi_di_count_weight() one document at a time. */
+static void
+em_count_words_thread (int thread_index, void *context)
+{
+  em_step_context *sc = context;
+  bow_wi2dvf *wi2dvf = sc->doc_barrel->wi2dvf;
+  bow_dv *dv, *vpc_dv;
+  bow_cdoc *cdoc;
+  float addition;
+  int wi, end, dvi, ci;
+
+  while ((wi = __sync_fetch_and_add (&sc->next, EM_CHUNK)) < sc->max_wi)
+    {
+      for (end = MIN (wi + EM_CHUNK, sc->max_wi); wi < end; wi++)
+	{
+	  dv = bow_wi2dvf_dv (wi2dvf, wi);
+	  if (!dv)
+	    continue;
+	  vpc_dv = NULL;
+	  for (dvi = 0; dvi < dv->length; dvi++)
+	    {
+	      cdoc = bow_array_entry_at_index (sc->doc_barrel->cdocs,
+					       dv->entry[dvi].di);
+	      if (cdoc->type != bow_doc_train
+		  && cdoc->type != bow_doc_unlabeled)
+		continue;
+	      assert (cdoc->word_count > 0);
+
+	      /* Every class gets an entry, in order of class index. */
+	      if (!vpc_dv)
+		{
+		  vpc_dv = bow_dv_new (sc->num_classes);
+		  for (ci = 0; ci < sc->num_classes; ci++)
+		    {
+		      vpc_dv->entry[ci].di = ci;
+		      vpc_dv->entry[ci].count = 0;
+		      vpc_dv->entry[ci].weight = 0.0f;
+		    }
+		  vpc_dv->length = sc->num_classes;
+		}
+
+	      for (ci = 0; ci < sc->num_classes; ci++)
+		{
+		  /* it's important to do this even when class_prob is 0 to 
+		     ensure that perplexity calculations happen ok. */
+		  if (bow_event_model == bow_event_document_then_word)
+		    addition = (cdoc->class_probs[ci] *
+				(float) dv->entry[dvi].count * 
+				(float) bow_event_document_then_word_document_length / 
+				(float) cdoc->word_count);
+		  else
+		    addition = cdoc->class_probs[ci] *
+		      (float) dv->entry[dvi].count;
+		  /* The count is a hopelessly dummy value. */
+		  if (!bow_binary_word_counts || !vpc_dv->entry[ci].count)
+		    vpc_dv->entry[ci].count++;
+		  vpc_dv->entry[ci].weight += addition;
+		}
+	    }
+	  if (vpc_dv)
+	    {
+	      sc->vpc_barrel->wi2dvf->entry[wi].dv = vpc_dv;
+	      sc->vpc_barrel->wi2dvf->entry[wi].seek_start = 2;
+	      sc->num_words[thread_index]++;
+	    }
+	}
+    }
+}
+
+/* The counting part of the M-step: give VPC_BARREL a new WI2DVF
+   holding, for each word below MAX_WI, the NUM_CLASSES sums of its
+   counts in the training and unlabeled documents of DOC_BARREL
+   weighted by their CLASS_PROBS.  The words are split among
+   BOW_NUM_THREADS threads. */
+static void
+em_count_words (bow_barrel *doc_barrel, bow_barrel *vpc_barrel,
+		int num_classes, int max_wi)
+{
+  em_step_context sc;
+  int num_threads = bow_num_threads;
+  int wi, t;
+
+  if (bow_event_model != bow_event_document_then_word
+      && bow_event_model != bow_event_word)
+    bow_error("No implementation of this event model.");
+
+  /* Read in the DV's first, since the threads can't share the data
+     file. */
+  if (num_threads > 1)
+    for (wi = 0; wi < max_wi; wi++)
+      bow_wi2dvf_dv (doc_barrel->wi2dvf, wi);
+
+  if (vpc_barrel->wi2dvf != NULL)
+    bow_wi2dvf_free (vpc_barrel->wi2dvf);
+  vpc_barrel->wi2dvf = bow_wi2dvf_new (doc_barrel->wi2dvf->size);
+
+  sc.doc_barrel = doc_barrel;
+  sc.vpc_barrel = vpc_barrel;
+  sc.num_classes = num_classes;
+  sc.max_wi = max_wi;
+  sc.next = 0;
+  sc.num_words = bow_malloc (num_threads * sizeof (int));
+  for (t = 0; t < num_threads; t++)
+    sc.num_words[t] = 0;
+  bow_threads_run (num_threads, em_count_words_thread, &sc);
+  for (t = 0; t < num_threads; t++)
+    vpc_barrel->wi2dvf->num_words += sc.num_words[t];
+  bow_free (sc.num_words);
+}
+
 /* Create a class barrel with EM-style clustering on unlabeled
    docs */
 bow_barrel *
@@ -586,16 +862,12 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
   int max_wi;               /* max word index */
   int dvi;                  /* document vector index */
   int ci;                   /* class index */
-  bow_dv *dv;               /* document vector */
   int di;                   /* document index */
   int binary_neg_ci = -1;
   bow_dv_heap *test_heap=NULL;	/* we'll extract test WV's from here */
   bow_wv *query_wv;
-  bow_score *hits;
-  int actual_num_hits;
-  int hi;		     /* hit index */
   bow_cdoc *doc_cdoc;
-  int num_tested;
+  em_doc_set *em_docs = NULL;	/* the documents the E-steps classify */
   int em_runs = 0;
   int num_train_docs = 0;
   int num_unlabeled_docs = 0;
@@ -607,9 +879,9 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
   double old_accuracy = -2;
   double new_accuracy = -1;
   /*bow_wi2dvf *prev_wi2dvf = NULL;*/
-  /*float prev_priors[200];*/
-  /*int prev_word_counts[200];*/
-  /*float prev_normalizers[200];*/
+  /*float *prev_priors;*/
+  /*int *prev_word_counts;*/
+  /*float *prev_normalizers;*/
   float total_weight;
   float labeled_weight_fraction;
   float new_labeled_fraction;
@@ -617,8 +889,6 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
 
 
   /* some sanity checks first */
-  assert(200 > bow_barrel_num_classes(doc_barrel));
-  assert(200 > bow_em_multi_hump_neg + 1);
   assert (!bow_em_multi_hump_neg || 
 	  (bow_em_binary_case && em_stat_method == nb_score));	  
   assert (!strcmp(doc_barrel->method->name, "em") ||
@@ -846,12 +1116,10 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
       {
 	if (em_multi_hump_init == bow_em_init_spiked)
 	  {
-	    int counts[500];
+	    int *counts = bow_malloc (bow_em_multi_hump_neg * sizeof (int));
 	    int n;
 	    int yet_to_find = 0; 
 
-	    assert (bow_em_multi_hump_neg < 500);
-
 	    /* Count the number of negative documents */
 	    for (di=0; di < doc_barrel->cdocs->length; di++)
 	      {
@@ -896,6 +1164,7 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
 		  }
 	      }
 	    assert(yet_to_find == 0);
+	    bow_free (counts);
 	  }
 	else if (em_multi_hump_init == bow_em_init_spread)
 	  {
@@ -1030,9 +1299,6 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
 		     "Making class barrel by counting words:       ");
 
 
-      if (vpc_barrel->wi2dvf != NULL)
-	bow_wi2dvf_free(vpc_barrel->wi2dvf);
-
 #if 0      
       /* save the previous wi2dvf */
       if (prev_wi2dvf != NULL)
@@ -1048,78 +1314,10 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
 	}
 #endif
 
-
-
-      /* get a new wi2dvf structure for our class barrel */
-      vpc_barrel->wi2dvf = bow_wi2dvf_new (doc_barrel->wi2dvf->size);
-      
       /* Initialize the WI2DVF part of the VPC_BARREL.  Sum together the
 	 counts and weights for individual documents, grabbing only the
 	 training and unlabeled documents. */
-      for (wi = 0; wi < max_wi; wi++)
-	{
-	  dv = bow_wi2dvf_dv (doc_barrel->wi2dvf, wi);
-	  if (!dv)
-	    continue;
-
-#if 0
-	  /* create the dv in the class barrel if there's an
-	     entry in the doc barrel.  This ensures that
-	     perplexity calculations happen correctly. */
-	  vpc_barrel->wi2dvf->entry[wi].dv = bow_dv_new (0);
-	  vpc_barrel->wi2dvf->entry[wi].seek_start = 2;
-	  (vpc_barrel->wi2dvf->num_words)++;
-#endif
-
-	  for (dvi = 0; dvi < dv->length; dvi++)
-	    {
-	      bow_cdoc *cdoc; 
-	      
-	      di = dv->entry[dvi].di;
-	      cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
-
-	      if (cdoc->type == bow_doc_train ||
-		  cdoc->type == bow_doc_unlabeled)
-		{
-		  assert(cdoc->word_count > 0);
-		  for (ci=0; ci < max_new_ci; ci++)
-		    {
-		      /* it's important to do this even when class_prob is 0 to 
-			 ensure that perplexity calculations happen ok. */
-
-#if 0
-		      if (cdoc->class_probs[ci] > 0)
-#endif
-			{
-			  if (bow_event_model == bow_event_document_then_word)
-			    bow_wi2dvf_add_wi_di_count_weight 
-			      (&(vpc_barrel->wi2dvf), 
-			       wi, ci, 
-			       1,  /* hopelessly dummy value */
-			       (cdoc->class_probs[ci] *
-				(float) dv->entry[dvi].count * 
-				(float) bow_event_document_then_word_document_length / 
-				(float) cdoc->word_count));
-			  else if (bow_event_model == bow_event_word)
-			    {
-			      float addition = cdoc->class_probs[ci] *
-				(float) dv->entry[dvi].count;
-			      bow_wi2dvf_add_wi_di_count_weight 
-				(&(vpc_barrel->wi2dvf), 
-				 wi, ci, 
-				 1,  /* hopelessly dummy value */
-				 addition);
-			    }
-			  else
-			    bow_error("No implementation of this event model.");
-			}
-		    }
-		}
-	    }
-
-	  if (wi % 100 == 0)
-	    bow_verbosify (bow_progress, "\b\b\b\b\b\b%6d", max_wi - wi);
-	}
+      em_count_words (doc_barrel, vpc_barrel, max_new_ci, max_wi);
 
       bow_verbosify (bow_progress, "\n");
       
@@ -1237,82 +1435,12 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
 	  /* now classify the unknown documents */
 	  bow_verbosify(bow_progress, "\nClassifying unlabeled documents:       ");
 	  
-	  /* Initialize QUERY_WV so BOW_TEST_NEXT_WV() knows not to
-             try to free.  Create the heap from which we'll get
-             WV's. */
-	  query_wv = NULL;
-	  hits = alloca (sizeof (bow_score) * max_new_ci);
-	  num_tested = 0;
-	  test_heap = bow_test_new_heap (doc_barrel);
-	  
-	  /* Loop once for each unlabeled document. */
-	  while ((di = bow_heap_next_wv (test_heap, doc_barrel, &query_wv, 
-					 bow_cdoc_next_em_doc))
-		 != -1)
-	    {
-	      doc_cdoc = bow_array_entry_at_index (doc_barrel->cdocs, 
-						   di);
-	      bow_wv_set_weights (query_wv, vpc_barrel);
-	      bow_wv_normalize_weights (query_wv, vpc_barrel);
-	      actual_num_hits = 
-		bow_barrel_score (vpc_barrel, 
-				  query_wv, hits,
-				  max_new_ci, (int) NULL);
-	      assert (actual_num_hits == max_new_ci);
-
-	      if (em_stat_method == simple)
-		{
-		  /* set the class probs to 1 for the maximally likely class */
-		  for (ci = 0; ci < max_new_ci; ci++)
-		    doc_cdoc->class_probs[ci] = 0.0;
-		  
-		  doc_cdoc->class_probs[hits[0].di] = unlabeled_normalizer;
-		}
-	      else if (em_stat_method == nb_score)
-		{
-		  /* set the class probs to the naive bayes score */
-		  for (hi = 0; hi < actual_num_hits; hi++)
-		    doc_cdoc->class_probs[hits[hi].di] = unlabeled_normalizer *
-		      hits[hi].weight;
-		  
-		  /* this is a neg training doc.  Zero out the pos
-		     component. */		      
-		  if (bow_em_multi_hump_neg > 1 &&
-		      doc_cdoc->type == bow_doc_train)
-		    {
-		      double new_total = 0;
-
-		      doc_cdoc->class_probs[binary_pos_ci] = 0;
-		      for (ci = 0; ci < max_new_ci; ci++)
-			new_total += doc_cdoc->class_probs[ci];
-
-		      if (new_total != 0)
-			{
-			  for (ci = 0; ci < max_new_ci; ci++)
-			    doc_cdoc->class_probs[ci] = unlabeled_normalizer *
-			      doc_cdoc->class_probs[ci] / new_total;
-			}
-		      else
-			{
-			  /* blech.  we got hosed on roundoff. */
-			  for (ci = 0; ci < max_new_ci; ci++)
-			    doc_cdoc->class_probs[ci] = 
-			      (float) unlabeled_normalizer /
-			      ((float) max_new_ci - 1.0);
-			  doc_cdoc->class_probs[binary_pos_ci] = 0;
-			}
-		    }
-		}
-	      else
-		bow_error ("No method for this type.");
-	      
-	      if (num_tested % 100 == 0)
-		bow_verbosify (bow_progress, "\b\b\b\b\b\b%6d", num_tested);
-	      
-	      num_tested++;	  
-	    }
-	  
-	  bow_verbosify(bow_progress, "\b\b\b\b\b\b%6d\n", num_tested);
+	  /* Read in the documents to classify the first time through;
+	     which ones they are doesn't change from round to round. */
+	  if (!em_docs)
+	    em_docs = em_doc_set_new (doc_barrel, bow_cdoc_next_em_doc);
+	  em_classify_docs (vpc_barrel, em_docs, max_new_ci);
+	  bow_verbosify(bow_progress, "\b\b\b\b\b\b%6d\n", em_docs->num_docs);
 	}
 
       /* Lower the temperature if doing DA */
@@ -1363,6 +1491,9 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
     }
 #endif
 
+  if (em_docs)
+    em_doc_set_free (em_docs);
+
   bow_em_making_barrel = 0;  
   return vpc_barrel;
 }
@@ -2074,10 +2205,9 @@ bow_em_set_weights (bow_barrel *barrel)
   /* Gather the word count here instead of directly of in CDOC->WORD_COUNT
      so we avoid round-off error with each increment.  Remember,
      CDOC->WORD_COUNT is a int! */
-  float num_words_per_ci[200];
+  float *num_words_per_ci = alloca (barrel->cdocs->length * sizeof (float));
   int barrel_is_empty = 0;
 
-  assert (bow_barrel_num_classes (barrel) < 200);
   /* We assume that we have already called BOW_BARREL_NEW_VPC() on
      BARREL, so BARREL already has one-document-per-class. */
 
@@ -2184,10 +2314,11 @@ bow_em_set_weights (bow_barrel *barrel)
 	  /* If the model doesn't know about this word, skip it. */
 	  if (dv == NULL)
 	    continue;
-	  for (ci = 0; ci < barrel->cdocs->length; ci++)
+	  /* Let bow_em_pr_wi_ci() pick up in DV where it left off. */
+	  for (ci = 0, dvi = 0; ci < barrel->cdocs->length; ci++)
 	    {
 	      pr_w_c = bow_em_pr_wi_ci (barrel, wi, ci, NULL, 0, 0,
-						NULL, NULL);
+					&dv, &dvi);
 	      cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
 	      assert (pr_w_c <= 1);
 	      pr_all_w_c[ci] += pr_w_c;
@@ -2521,7 +2652,8 @@ rainbow_method bow_method_em =
   bow_wv_set_weights_to_count,
   NULL,				/* no need for extra weight normalization */
   bow_barrel_free,
-  NULL  /* is this right?  should we have em parameters? */
+  NULL,  /* is this right?  should we have em parameters? */
+  1				/* scoring is thread-safe */
 };
 
 void _register_method_em () __attribute__ ((constructor));
@@ -115,6 +115,9 @@ bow_make_dv_heap_from_wv (bow_wi2dvf *wi2dvf, bow_wv *wv)
   for (i = (heap->length)/2; i > 0; i--) 
     bow_heapify (heap, i);
 
+  /* A heap of only some of the words can't use the forward index. */
+  heap->di2wv = NULL;
+
   return heap;
 }
 
@@ -193,6 +196,12 @@ bow_make_dv_heap_from_wi2dvf_hidden (bow_wi2dvf *wi2dvf, int even_if_hidden)
   heap->heap_wv_di = -2;
   heap->last_di = -2;
 
+  heap->di2wv = wi2dvf->di2wv;
+  heap->wi2dvf = wi2dvf;
+  heap->even_if_hidden = even_if_hidden;
+  heap->max_wi = max_wi;
+  heap->heap_wv_size = 0;
+
   return heap;
 }
 
@@ -29,6 +29,9 @@ extern void crossbow_classify_tagged_docs (int tag, int verbose,
 #define SHRINK_WITH_UNIFORM_ONLY 0
 #define PRINT_WORD_DISTS 0
 
+/* Number of documents the E-step scores against all leaves at once. */
+#define CROSSBOW_HEM_BATCH_SIZE 64
+
 #define MN 0
 #if MN
 extern double crossbow_hem_em_one_mn_iteration ();
@@ -578,97 +581,150 @@ crossbow_hem_label_most_confident ()
 #include "mn.c"
 #endif
 
-/* Return the perplexity */
-double
-crossbow_hem_em_one_iteration ()
+/* Return non-zero if EM should estimate parameters from DOC. */
+static int
+crossbow_hem_em_uses_doc (crossbow_doc *doc)
 {
-  int di;
+  if (crossbow_hem_incremental_labeling)
+    {
+      if (crossbow_hem_lambdas_from_validation)
+	{
+	  if (doc->tag != bow_doc_train
+	      && doc->tag != bow_doc_validation)
+	    return 0;
+	}
+      else
+	{
+	  if (doc->tag != bow_doc_train)
+	    return 0;
+	}
+    }
+  else if (crossbow_hem_lambdas_from_validation)
+    {
+      if (doc->tag != bow_doc_train
+	  && doc->tag != bow_doc_unlabeled
+	  && doc->tag != bow_doc_validation)
+	return 0;
+    }
+  else
+    {
+      if (doc->tag != bow_doc_train && doc->tag != bow_doc_unlabeled)
+	return 0;
+    }
+  /* Temporary fix */
+  if (strstr (doc->filename, ".include")
+      || strstr (doc->filename, ".exclude"))
+    return 0;
+  return 1;
+}
+
+/* What one thread of crossbow_hem_em_one_iteration() accumulates from
+   its share of the documents.  The NEW_ arrays are laid out like
+   those of the compiled tree. */
+typedef struct _crossbow_hem_em_acc {
+  double *new_words;		/* [wi*NODES_COUNT+ni] */
+  double *new_lambdas;		/* [li*PATH_CAPACITY+ai] */
+  double *new_prior;		/* [li] */
+  double log_prob_of_data;
+  int num_data_words;		/* the number of word occurrences */
+  int docs_added_count;
+} crossbow_hem_em_acc;
+
+/* What crossbow_hem_em_one_iteration() shares with its threads. */
+typedef struct _crossbow_hem_em_context {
+  bow_treenode_compiled *compiled;
+  int num_threads;
+  crossbow_hem_em_acc *accs;	/* one for each thread */
+} crossbow_hem_em_context;
+
+/* Run the E-step, and gather the M-step counts, for one thread's
+   range of documents. */
+static void
+crossbow_hem_em_thread (int thread_index, void *context)
+{
+  crossbow_hem_em_context *ec = context;
+  bow_treenode_compiled *compiled = ec->compiled;
+  crossbow_hem_em_acc *acc = &(ec->accs[thread_index]);
+  int num_leaves = compiled->leaves_count;
+  int path_capacity = compiled->path_capacity;
+  int di, di_end, bdi;
   crossbow_doc *doc;
   bow_wv *wv;
-  treenode *iterator, *leaf, *ancestor;
+  treenode *leaf;
   int li;			/* a leaf index */
-  int wvi;
-  int num_leaves;
+  int wvi, ai;
   double *leaf_membership;
   double *leaf_data_prob;
-  double pp, log_prob_of_data = 0;
-  int num_data_words = 0;	/* the number of word occurrences */
   double *ancestor_membership;
   double ancestor_membership_total;
-  double total_deposit_prob;
+  double word_deposit, lambda_deposit;
   int found_deterministic_leaf;
-  int docs_added_count = 0;
+  bow_wv **batch_wvs = NULL;
+  double *batch_log_probs = NULL;
+  int batch_count = 0, batch_index = 0;
+  const int *leaf_ancestors;
+  const double *leaf_lambdas;
+  double *leaf_new_lambdas;
+  double *new_words, *leaf_new_word;
 
-#if MN
-  return crossbow_hem_em_one_mn_iteration ();
-#endif
-
-  num_leaves = bow_treenode_leaf_count (crossbow_root);
   leaf_membership = alloca (num_leaves * sizeof (double));
   leaf_data_prob = alloca (num_leaves * sizeof (double));
-  /* xxx Here NUM_LEAVES+10 should be MAX_DEPTH */
-  ancestor_membership = alloca ((num_leaves + 10) * sizeof (double));
-  for (di = 0; di < crossbow_docs->length; di++)
+  ancestor_membership = alloca (path_capacity * sizeof (double));
+  if (compiled->leaf_log_probs)
     {
-      total_deposit_prob = 0;
+      batch_wvs = bow_malloc (CROSSBOW_HEM_BATCH_SIZE * sizeof (bow_wv*));
+      batch_log_probs = bow_malloc (CROSSBOW_HEM_BATCH_SIZE * num_leaves
+				    * sizeof (double));
+    }
 
+  /* Each thread always gets the same range of documents, so that
+     the sums come out the same from run to run. */
+  di = (long) crossbow_docs->length * thread_index / ec->num_threads;
+  di_end = (long) crossbow_docs->length * (thread_index+1) / ec->num_threads;
+  for (; di < di_end; di++)
+    {
       doc = bow_array_entry_at_index (crossbow_docs, di);
-      if (crossbow_hem_incremental_labeling)
-	{
-	  if (crossbow_hem_lambdas_from_validation)
-	    {
-	      if (doc->tag != bow_doc_train
-		  && doc->tag != bow_doc_validation)
-		continue;
-	    }
-	  else
-	    {
-	      if (doc->tag != bow_doc_train)
-		continue;
-	    }
-	}
-      else if (crossbow_hem_lambdas_from_validation)
-	{
-	  if (doc->tag != bow_doc_train
-	      && doc->tag != bow_doc_unlabeled
-	      && doc->tag != bow_doc_validation)
-	    continue;
-	}
-      else
-	{
-	  if (doc->tag != bow_doc_train && doc->tag != bow_doc_unlabeled)
-	    continue;
-	}
-      /* Temporary fix */
-      if (strstr (doc->filename, ".include")
-	  || strstr (doc->filename, ".exclude"))
+      if (!crossbow_hem_em_uses_doc (doc))
 	continue;
 
       /* E-step estimating leaf membership probability for one
          document, with annealing temperature. */
       wv = crossbow_wv_at_di (di);
-      found_deterministic_leaf = 0;
-      for (iterator = crossbow_root, li = 0;
-	   (leaf = bow_treenode_iterate_leaves (&iterator)); 
-	   li++)
+      if (compiled->leaf_log_probs)
 	{
-	  if (crossbow_hem_shrinkage)
+	  /* Score this document, and the next few that EM will use,
+	     against all the leaves at once. */
+	  if (batch_index == batch_count)
 	    {
-	      if (crossbow_hem_loo)
-		leaf_data_prob[li] = 
-		  bow_treenode_log_prob_of_wv_loo (leaf, wv, di);
-	      else
-		leaf_data_prob[li] = bow_treenode_log_prob_of_wv (leaf, wv);
+	      for (bdi = di, batch_count = 0;
+		   bdi < di_end && batch_count < CROSSBOW_HEM_BATCH_SIZE;
+		   bdi++)
+		{
+		  if (crossbow_hem_em_uses_doc
+		      (bow_array_entry_at_index (crossbow_docs, bdi)))
+		    batch_wvs[batch_count++] = crossbow_wv_at_di (bdi);
+		}
+	      bow_treenode_compiled_log_prob_of_wvs (compiled, batch_wvs,
+						     batch_count,
+						     batch_log_probs);
+	      batch_index = 0;
 	    }
+	  assert (batch_wvs[batch_index] == wv);
+	  leaf_data_prob = batch_log_probs + batch_index * num_leaves;
+	  batch_index++;
+	}
+      found_deterministic_leaf = 0;
+      for (li = 0; li < num_leaves; li++)
+	{
+	  leaf = compiled->leaves[li];
+	  if (compiled->leaf_log_probs)
+	    ;
+	  else if (crossbow_hem_shrinkage)
+	    leaf_data_prob[li] = 
+	      bow_treenode_log_prob_of_wv_loo (leaf, wv, di);
 	  else
-	    {
-	      if (crossbow_hem_loo)
-		leaf_data_prob[li] = 
-		  bow_treenode_log_local_prob_of_wv_loo (leaf, wv, di);
-	      else
-		leaf_data_prob[li] = 
-		  bow_treenode_log_local_prob_of_wv (leaf, wv);
-	    }
+	    leaf_data_prob[li] = 
+	      bow_treenode_log_local_prob_of_wv_loo (leaf, wv, di);
 	  assert (leaf_data_prob[li] > -HUGE_VAL);
 
 	  if (crossbow_hem_deterministic_horizontal
@@ -723,55 +779,57 @@ crossbow_hem_em_one_iteration ()
 
 
       /* For perplexity calculation */
-      for (iterator = crossbow_root, li = 0;
-	   (leaf = bow_treenode_iterate_leaves (&iterator)); 
-	   li++)
+      for (li = 0; li < num_leaves; li++)
 	{
 	  /* xxx Should this be with bow_treenode_complete_log_prob_of_wv()? */
 	  if (leaf_membership[li])
-	    log_prob_of_data += (leaf_membership[li] * leaf_data_prob[li]);
-	  assert (log_prob_of_data == log_prob_of_data);
+	    acc->log_prob_of_data += (leaf_membership[li] * leaf_data_prob[li]);
+	  assert (acc->log_prob_of_data == acc->log_prob_of_data);
 	}
-      num_data_words += bow_wv_word_count (wv);
+      acc->num_data_words += bow_wv_word_count (wv);
 
-      docs_added_count++;
+      acc->docs_added_count++;
 
       /* E-step estimating ancestor membership probability for words
          in one document, and M-step for one document */
-      for (iterator = crossbow_root, li = 0;
-	   (leaf = bow_treenode_iterate_leaves (&iterator)); 
-	   li++)
+      for (li = 0; li < num_leaves; li++)
 	{
+	  leaf = compiled->leaves[li];
 	  if (leaf_membership[li] == 0)
 	    continue;
 	  if (strstr (leaf->name, "/Misc/"))
 	    continue;
+	  leaf_ancestors = compiled->leaf_ancestors + li * path_capacity;
+	  leaf_lambdas = compiled->leaf_lambdas + li * path_capacity;
+	  leaf_new_lambdas = acc->new_lambdas + li * path_capacity;
 	  for (wvi = 0; wvi < wv->num_entries; wvi++)
 	    {
+	      /* This word's NEW_WORDS entries, one for each node */
+	      new_words = (acc->new_words
+			   + wv->entry[wvi].wi * compiled->nodes_count);
+	      leaf_new_word = new_words + leaf_ancestors[0];
 	      if (crossbow_hem_shrinkage)
 		{
-		  int ai;
-		  double word_deposit, lambda_deposit;
-
 		  /* Calculate normalized ancestor membership probs */
 		  ancestor_membership_total = 0;
-		  for (ancestor = leaf, ai = 0; ancestor; 
-		       ancestor = ancestor->parent, ai++)
+		  for (ai = 0; leaf_ancestors[ai] >= 0; ai++)
 		    {
 		      if (crossbow_hem_loo)
 			ancestor_membership[ai] =
-			  leaf->lambdas[ai]
-			  * bow_treenode_pr_wi_loo_local (ancestor, 
-							  wv->entry[wvi].wi,
-							  di, wvi);
+			  leaf_lambdas[ai]
+			  * bow_treenode_pr_wi_loo_local
+			  (compiled->nodes[leaf_ancestors[ai]], 
+			   wv->entry[wvi].wi, di, wvi);
 		      else
-			ancestor_membership[ai] = leaf->lambdas[ai] * 
-			  ancestor->words[wv->entry[wvi].wi];
+			ancestor_membership[ai] = leaf_lambdas[ai] * 
+			  compiled->words[wv->entry[wvi].wi 
+					  * compiled->nodes_count
+					  + leaf_ancestors[ai]];
 		      assert (ancestor_membership[ai] >= 0);
 		      ancestor_membership_total += ancestor_membership[ai];
 		    }
 		  ancestor_membership[ai] =
-		    leaf->lambdas[ai] * 1.0 / leaf->words_capacity;
+		    leaf_lambdas[ai] * 1.0 / leaf->words_capacity;
 		  ancestor_membership_total += ancestor_membership[ai];
 		  assert (ancestor_membership_total);
 		  for (ai = 0; ai < leaf->depth + 2; ai++)
@@ -782,8 +840,7 @@ crossbow_hem_em_one_iteration ()
 
 
 		  /* The M-step */
-		  for (ancestor = leaf, ai = 0; ancestor; 
-		       ancestor = ancestor->parent, ai++)
+		  for (ai = 0; leaf_ancestors[ai] >= 0; ai++)
 		    {
 		      if (crossbow_hem_vertical_word_movement)
 			word_deposit = wv->entry[wvi].count
@@ -802,10 +859,10 @@ crossbow_hem_em_one_iteration ()
 			{
 			  if (crossbow_hem_loo)
 			    bow_treenode_add_new_loo_for_di_wvi
-			      (ancestor, word_deposit, di, wvi,
+			      (compiled->nodes[leaf_ancestors[ai]], 
+			       word_deposit, di, wvi,
 			       wv->num_entries, crossbow_docs->length);
-			  ancestor->new_words[wv->entry[wvi].wi] += 
-			    word_deposit;
+			  new_words[leaf_ancestors[ai]] += word_deposit;
 			}
 		      if (ancestor_membership[ai] == 0) 
 			continue;
@@ -814,12 +871,12 @@ crossbow_hem_em_one_iteration ()
 		      assert (lambda_deposit >= 0);
 		      if (!crossbow_hem_lambdas_from_validation
 			  || doc->tag == bow_doc_validation)
-			leaf->new_lambdas[ai] += lambda_deposit;
+			leaf_new_lambdas[ai] += lambda_deposit;
 		    }
 		  /* The uniform distribution */
 		  if (!crossbow_hem_lambdas_from_validation
 		      || doc->tag == bow_doc_validation)
-		    leaf->new_lambdas[ai] += 
+		    leaf_new_lambdas[ai] += 
 		      wv->entry[wvi].count
 		      * leaf_membership[li] * ancestor_membership[ai];
 		} /* if crossbow_hem_shrinkage */
@@ -827,18 +884,141 @@ crossbow_hem_em_one_iteration ()
 		{
 		  /* The M-step without shrinkage, without ancestor
 		     membership probabilities. */
-		  leaf->new_words[wv->entry[wvi].wi] += 
-		    wv->entry[wvi].count * leaf_membership[li];
-		  leaf->new_lambdas[0]++;
+		  *leaf_new_word += wv->entry[wvi].count * leaf_membership[li];
+		  leaf_new_lambdas[0]++;
 		}
-	      assert (leaf->new_words[wv->entry[wvi].wi] >= 0);
-	      assert (leaf->new_words[wv->entry[wvi].wi]
-		      == leaf->new_words[wv->entry[wvi].wi]);
+	      assert (*leaf_new_word >= 0);
+	      assert (*leaf_new_word == *leaf_new_word);
+	    }
+	  acc->new_prior[li] += leaf_membership[li];
+	}
+    }
+
+  if (batch_wvs)
+    {
+      bow_free (batch_wvs);
+      bow_free (batch_log_probs);
+    }
+}
+
+/* Return the perplexity */
+double
+crossbow_hem_em_one_iteration ()
+{
+  int di;
+  crossbow_doc *doc;
+  treenode *iterator, *leaf;
+  int li, ai, ni, t;
+  long i, new_words_count;
+  double pp, log_prob_of_data = 0;
+  int num_data_words = 0;	/* the number of word occurrences */
+  int docs_added_count = 0;
+  bow_treenode_compiled *compiled;
+  crossbow_hem_em_context ec;
+  crossbow_hem_em_acc *acc, *acc0;
+  int num_leaves, path_capacity;
+
+#if MN
+  return crossbow_hem_em_one_mn_iteration ();
+#endif
+
+  /* WORDS and LAMBDAS stay fixed until the M-step is finished, so
+     the E-step can use a compiled snapshot of the tree, and the
+     M-step can accumulate into its NEW_WORDS.  Without leave-one-out
+     the leaves' log-probabilities can be computed once up front. */
+  compiled = bow_treenode_compiled_new (crossbow_root);
+  if (!crossbow_hem_loo)
+    bow_treenode_compiled_set_leaf_log_probs (compiled, 
+					      crossbow_hem_shrinkage);
+  num_leaves = compiled->leaves_count;
+  path_capacity = compiled->path_capacity;
+  new_words_count = (long) compiled->words_capacity * compiled->nodes_count;
+
+  /* Read the word vectors, and make room for the LOO info, before
+     the threads need them. */
+  for (di = 0; di < crossbow_docs->length; di++)
+    {
+      doc = bow_array_entry_at_index (crossbow_docs, di);
+      if (crossbow_hem_em_uses_doc (doc))
+	crossbow_wv_at_di (di);
+    }
+  if (crossbow_hem_loo)
+    for (ni = 0; ni < compiled->nodes_count; ni++)
+      bow_treenode_alloc_new_loo (compiled->nodes[ni],
+				  crossbow_docs->length);
+
+  /* Thread 0 starts from the tree's own NEW_ counts, just as the
+     E-step on a single thread would; the others start from zero. */
+  ec.compiled = compiled;
+  ec.num_threads = bow_num_threads;
+  ec.accs = bow_malloc (ec.num_threads * sizeof (crossbow_hem_em_acc));
+  for (t = 0; t < ec.num_threads; t++)
+    {
+      acc = &(ec.accs[t]);
+      acc->new_lambdas = 
+	bow_malloc (num_leaves * path_capacity * sizeof (double));
+      acc->new_prior = bow_malloc (num_leaves * sizeof (double));
+      acc->log_prob_of_data = 0;
+      acc->num_data_words = 0;
+      acc->docs_added_count = 0;
+      if (t == 0)
+	{
+	  acc->new_words = compiled->new_words;
+	  for (li = 0; li < num_leaves; li++)
+	    {
+	      leaf = compiled->leaves[li];
+	      for (ai = 0; ai < leaf->depth + 2; ai++)
+		acc->new_lambdas[li * path_capacity + ai] = 
+		  leaf->new_lambdas[ai];
+	      acc->new_prior[li] = leaf->new_prior;
 	    }
-	  leaf->new_prior += leaf_membership[li];
+	}
+      else
+	{
+	  acc->new_words = bow_malloc (new_words_count * sizeof (double));
+	  for (i = 0; i < new_words_count; i++)
+	    acc->new_words[i] = 0;
+	  for (i = 0; i < num_leaves * path_capacity; i++)
+	    acc->new_lambdas[i] = 0;
+	  for (li = 0; li < num_leaves; li++)
+	    acc->new_prior[li] = 0;
 	}
     }
 
+  bow_threads_run (ec.num_threads, crossbow_hem_em_thread, &ec);
+
+  /* Add up the threads' results, always in the same order. */
+  acc0 = &(ec.accs[0]);
+  for (t = 0; t < ec.num_threads; t++)
+    {
+      acc = &(ec.accs[t]);
+      log_prob_of_data += acc->log_prob_of_data;
+      num_data_words += acc->num_data_words;
+      docs_added_count += acc->docs_added_count;
+      if (t == 0)
+	continue;
+      for (i = 0; i < new_words_count; i++)
+	acc0->new_words[i] += acc->new_words[i];
+      for (i = 0; i < num_leaves * path_capacity; i++)
+	acc0->new_lambdas[i] += acc->new_lambdas[i];
+      for (li = 0; li < num_leaves; li++)
+	acc0->new_prior[li] += acc->new_prior[li];
+      bow_free (acc->new_words);
+      bow_free (acc->new_lambdas);
+      bow_free (acc->new_prior);
+    }
+  for (li = 0; li < num_leaves; li++)
+    {
+      leaf = compiled->leaves[li];
+      for (ai = 0; ai < leaf->depth + 2; ai++)
+	leaf->new_lambdas[ai] = acc0->new_lambdas[li * path_capacity + ai];
+      leaf->new_prior = acc0->new_prior[li];
+    }
+  bow_free (acc0->new_lambdas);
+  bow_free (acc0->new_prior);
+  bow_free (ec.accs);
+  bow_treenode_compiled_store_new_words (compiled);
+  bow_treenode_compiled_free (compiled);
   /* Finish M-step */
   bow_treenode_set_leaf_prior_from_new_prior_all (crossbow_root, 1);
   for (iterator = crossbow_root;
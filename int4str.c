@@ -31,18 +31,71 @@
    by calling bow_int4str_initialize */
 #define DEFAULT_INITIAL_CAPACITY 1024
 
-/* The value of map->STR_HASH entries that are emtpy. */
+/* The value of STR_HASH slot indices that are empty. */
 #define HASH_EMPTY -1
 
-/* Returns an initial index for ID at which to begin searching for an entry. */
-#define HASH(map, id) ((id) % (map)->str_hash_size)
+/* The STR_HASH is an open-addressing table of a power-of-two number of
+   slots, probed linearly.  Each slot holds a STR_ARRAY index and the
+   `id' of its string, so that most probes can be rejected without a
+   strcmp(), and the table can be grown without rehashing the strings.
+
+   Strings are only ever added, never removed, and additions are
+   serialized by MAP->LOCK.  Lookups take no lock at all.  An adder
+   fills in the STR_ARRAY entry and the slot's ID before it stores the
+   slot's INDEX, and the lookups read INDEX before anything else, so a
+   lookup either sees a complete entry or an empty slot.  When the
+   STR_HASH or STR_ARRAY grows, the old one is kept on MAP->RETIRED
+   until the map is freed, because a lookup may still be reading it. */
+typedef struct _bow_int4str_slot {
+  int index;
+  unsigned id;
+} bow_int4str_slot;
+
+struct _bow_int4str_hash {
+  unsigned mask;		/* the number of slots, minus one */
+  bow_int4str_slot slot[0];
+};
+
+#define LOAD_ACQUIRE(P) __atomic_load_n (P, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(P, V) __atomic_store_n (P, V, __ATOMIC_RELEASE)
+
+/* Returns the initial slot at which to look for ID.  Mix the bits,
+   since MASK keeps only the low ones. */
+static inline unsigned
+_bow_str_hash_slot (unsigned id, unsigned mask)
+{
+  id ^= id >> 16;
+  id *= 0x45d9f3b;
+  id ^= id >> 16;
+  return id & mask;
+}
+
+static struct _bow_int4str_hash *
+_bow_str_hash_new (int num_slots)
+{
+  struct _bow_int4str_hash *ret;
+  int i;
 
-/* Returns subsequent indices for ID, given the previous one. */
-/* All elements of the formula must be of type unsigned to get unsigned arithmetic */
-#define REHASH(map, id, h) (((id) + (h)) % (map)->str_hash_size)
+  ret = bow_malloc (sizeof (struct _bow_int4str_hash)
+		    + num_slots * sizeof (bow_int4str_slot));
+  ret->mask = num_slots - 1;
+  for (i = 0; i < num_slots; i++)
+    ret->slot[i].index = HASH_EMPTY;
+  return ret;
+}
 
-/* This function is defined in bow/primelist.c. */
-extern int _bow_primedouble (unsigned n);
+/* Remember PTR, to be freed by bow_int4str_free_contents(). */
+static void
+_bow_int4str_retire (bow_int4str *map, void *ptr)
+{
+  if (map->retired_length == map->retired_size)
+    {
+      map->retired_size = map->retired_size ? map->retired_size * 2 : 8;
+      map->retired = bow_realloc (map->retired,
+				  map->retired_size * sizeof (void*));
+    }
+  map->retired[map->retired_length++] = ptr;
+}
 
 /* Initialize the string->int and int->string map.  The parameter
    CAPACITY is used as a hint about the number of words to expect; if
@@ -51,18 +104,20 @@ extern int _bow_primedouble (unsigned n);
 void
 bow_int4str_init (bow_int4str *map, int capacity)
 {
-  int i;
+  int num_slots;
 
   if (capacity == 0)
     capacity = DEFAULT_INITIAL_CAPACITY;
   map->str_array_size = capacity;
   map->str_array = bow_malloc (map->str_array_size * sizeof (char*));
-  //map->hash_id_array = bow_malloc (map->str_array_size * sizeof (unsigned));
   map->str_array_length = 0;
-  map->str_hash_size = _bow_primedouble (map->str_array_size);
-  map->str_hash = bow_malloc (map->str_hash_size * sizeof (int));
-  for (i = 0; i < map->str_hash_size; i++)
-    map->str_hash[i] = HASH_EMPTY;
+  /* Keep the table at most half full. */
+  for (num_slots = 16; num_slots < 2 * capacity; num_slots *= 2)
+    ;
+  map->str_hash = _bow_str_hash_new (num_slots);
+  map->retired = NULL;
+  map->retired_length = map->retired_size = 0;
+  pthread_mutex_init (&map->lock, NULL);
 }
 
 /* Allocate, initialize and return a new int/string mapping structure.
@@ -82,8 +137,8 @@ bow_int4str_new (int capacity)
 const char *
 bow_int2str (bow_int4str *map, int index)
 {
-  assert (index < map->str_array_length);
-  return map->str_array[index];
+  assert (index < LOAD_ACQUIRE (&map->str_array_length));
+  return LOAD_ACQUIRE (&map->str_array)[index];
 }
 
 
@@ -96,196 +151,101 @@ _str2id (const unsigned char *s)
   for (h = 0; *s; s++)
     h = 131*h + *s;
 
-  /* Never return 0, otherwise _str_hash_add() will infinite-loop */
-  //assert (h != 0);
-  //if (h == 0) h = 1;
-
   return h;
 }
 
-#if 0
-int my_strcmp (const char *s1, const char *s2)
+/* Search the STR_HASH of MAP for STRING, whose `id' is ID.  Return
+   its index, or -1 if it isn't there.  Safe to call while another
+   thread is adding to MAP.  If SLOTP is non-NULL, set it to the slot
+   at which the search stopped, and TABLEP to the table searched. */
+static inline int
+_bow_str_hash_lookup (bow_int4str *map, const char *string, unsigned id,
+		      struct _bow_int4str_hash **tablep, unsigned *slotp)
 {
-  return strcmp (s1, s2);
-}
-#endif
-
-
-int
-_bow_str_hash_lookup (bow_int4str *map, const char *string, unsigned id, 
-		  int *strdiffp)
-{
-  register unsigned h;
-  register const char **str_array = map->str_array;
-  
-  *strdiffp = 1;
-  h = id % map->str_hash_size;
-  if (map->str_hash[h] == HASH_EMPTY
-      || (!(*strdiffp = strcmp (string, str_array[map->str_hash[h]]))))
-    return h;
-
-  {
-    unsigned incr = 1 + (id % (map->str_hash_size - 1));
-    for (;;)
-      {
-	/* Incrementing INCR is not among the recommendation of
-	   Corman, Lieiserson & Rivest, page 236, but without this,
-	   the problem below happens.  I'm mystified. */
-	//h = (h + incr++) % map->str_hash_size;
-	h = (h + incr) % map->str_hash_size;
-	if (map->str_hash[h] == HASH_EMPTY
-	    || (!(*strdiffp =strcmp(string, str_array[map->str_hash[h]]))))
-	  return h;
-      }
-  }
-}
-
+  struct _bow_int4str_hash *table = LOAD_ACQUIRE (&map->str_hash);
+  const char **str_array;
+  unsigned h;
+  int index;
 
-int
-_bow_str_hash_lookup2 (bow_int4str *map, const char *string, unsigned id)
-{
-  register unsigned h;
-  register const char **str_array = map->str_array;
-
-#define HOP_REPORTING 0
-#if HOP_REPORTING
-  static int num_hops = 0;
-  static int num_calls = 0;
-  static int hops_count = 0;
-  static int max_hops_count = 0;
-  static int max2_hops_count = 0;
-  if (num_calls % 100000 == 0)
+  for (h = _bow_str_hash_slot (id, table->mask); ;
+       h = (h + 1) & table->mask)
+    {
+      index = LOAD_ACQUIRE (&table->slot[h].index);
+      if (index == HASH_EMPTY)
+	break;
+      if (table->slot[h].id == id)
+	{
+	  str_array = LOAD_ACQUIRE (&map->str_array);
+	  if (!strcmp (string, str_array[index]))
+	    break;
+	}
+    }
+  if (slotp)
     {
-      fprintf (stderr, "num_hops=%d, num_calls=%d, ratio=%f, max_hops=%d,%d\n",
-	       num_hops, num_calls, ((float)num_hops)/num_calls, 
-	       max_hops_count, max2_hops_count);
-      max_hops_count, hops_count = num_hops = num_calls = 0;
+      *tablep = table;
+      *slotp = h;
     }
-#endif
-
-#if HOP_REPORTING
-  num_calls++;
-  hops_count = 0;
-#endif
-  h = id % map->str_hash_size;
-  if (map->str_hash[h] == HASH_EMPTY
-      || (! strcmp (string, str_array[map->str_hash[h]])))
-    return h;
-
-  {
-    unsigned incr = 1 + (id % (map->str_hash_size - 1));
-    for (;;)
-      {
-#if HOP_REPORTING
-	num_hops++;
-	hops_count++;
-	if (hops_count > max_hops_count)
-	  max_hops_count = hops_count;
-	if (hops_count != max_hops_count && hops_count > max2_hops_count)
-	  max2_hops_count = hops_count;
-#endif
-	h = (h + incr) % map->str_hash_size;
-	if (map->str_hash[h] == HASH_EMPTY
-	    || (! strcmp(string, str_array[map->str_hash[h]])))
-	  return h;
-      }
-  }
+  return index;
 }
 
-
 /* Given the char-pointer STRING, return its integer index.  If STRING
-   is not yet in the mapping, return -1. */
+   is not yet in the mapping, return -1.  This takes no locks, and may
+   be called while other threads are adding to MAP. */
 int
 bow_str2int_no_add (bow_int4str *map, const char *string)
 {
-  int strdiff;
-  int h;
-
-  h = _bow_str_hash_lookup (map, string, _str2id (string), &strdiff);
-  if (strdiff == 0)
-    return map->str_hash[h];
-  return -1;
+  return _bow_str_hash_lookup (map, string, _str2id (string), NULL, NULL);
 }
 
-/* Add the char* STRING to the string hash table MAP->STR_HASH.  The
-   second argument H must be the value returned by
-   _BOW_STR_HASH_LOOKUP(STRING).  Don't call this function with a string
-   that has already been added to the hashtable!  The duplicate index
-   would get added, and cause many bugs. */
+/* Double the size of the STR_HASH of MAP.  The stored `id's make this
+   possible without looking at the strings.  MAP->LOCK must be held. */
 static void
-_str_hash_add (bow_int4str *map, 
-	       const char *string, unsigned id, int h, int str_array_index)
+_bow_str_hash_grow (bow_int4str *map)
 {
-  assert (h >= 0);
-  assert (str_array_index >= 0 && str_array_index < map->str_array_length);
-  /* if (map->str_hash[h] == HASH_EMPTY) */
-  if (map->str_hash_size > map->str_array_length * 2)
-    {
-      /* str_hash doesn't have to grow; just drop it in place.
-	 STR_ARRAY_INDEX is the index at which we can find STRING in
-	 the STR_ARRAY. */
-      map->str_hash[h] = str_array_index;
-    }
-  else
-    {
-      /* str_hash must grow in order to accomodate new entry. */
-      int sd;
-
-      int i;
-      int *old_str_hash, *entry;
-      int old_str_hash_size;
+  struct _bow_int4str_hash *old = map->str_hash;
+  struct _bow_int4str_hash *new = _bow_str_hash_new (2 * (old->mask + 1));
+  unsigned i, h;
 
-      /* Create a new, empty str_hash. */
-      old_str_hash = map->str_hash;
-      old_str_hash_size = map->str_hash_size;
-      map->str_hash_size = _bow_primedouble (old_str_hash_size);
 #if 0
-      bow_verbosify (bow_progress,
-		     "Growing hash table to %d\n", map->str_hash_size);
+  bow_verbosify (bow_progress,
+		 "Growing hash table to %d\n", new->mask + 1);
 #endif
-      map->str_hash = bow_malloc (map->str_hash_size * sizeof(int));
-      for (i = map->str_hash_size, entry = map->str_hash; i > 0; i--, entry++)
-	*entry = HASH_EMPTY;
-
-      /* Fill the new str_hash with the values from the old str_hash. */
+  for (i = 0; i <= old->mask; i++)
+    if (old->slot[i].index != HASH_EMPTY)
       {
-	for (i = 0; i < old_str_hash_size; i++)
-	  if (old_str_hash[i] != HASH_EMPTY)
-	    {
-	      const char *old_string = map->str_array[old_str_hash[i]];
-	      unsigned old_id = _str2id (old_string);
-	      _str_hash_add (map, old_string, old_id,
-			     _bow_str_hash_lookup (map, old_string, old_id, 
-						   &sd),
-			     old_str_hash[i]);
-	      assert (sd);      /* All these strings should be unique! */
-	    }
+	for (h = _bow_str_hash_slot (old->slot[i].id, new->mask);
+	     new->slot[h].index != HASH_EMPTY;
+	     h = (h + 1) & new->mask)
+	  ;
+	new->slot[h] = old->slot[i];
       }
-
-      /* Free the old hash memory */
-      bow_free (old_str_hash);
-
-      /* Finally, add new string. */
-      _str_hash_add (map, string, id,
-		     _bow_str_hash_lookup (map, string, id, &sd),
-		     str_array_index);
-    }
+  STORE_RELEASE (&map->str_hash, new);
+  _bow_int4str_retire (map, old);
 }
 
-
 /* Just like BOW_STR2INT, except assume that the STRING's ID has
    already been calculated. */
 int
 _bow_str2int (bow_int4str *map, const char *string, unsigned id)
 {
-  int h;			/* ID, truncated to fit in STR_HASH */
+  struct _bow_int4str_hash *table;
+  const char **str_array;
+  unsigned h;
+  int index;
 
-  /* Search STR_HASH for the string, or an empty space.  */
-  h = _bow_str_hash_lookup2 (map, string, id);
-  
-  if (map->str_hash[h] != HASH_EMPTY)
-    /* Found the string; return its index. */
-    return map->str_hash[h];
+  /* Most of the time the string is already there; find it without
+     locking. */
+  if ((index = _bow_str_hash_lookup (map, string, id, NULL, NULL)) >= 0)
+    return index;
+
+  pthread_mutex_lock (&map->lock);
+
+  /* Look again, now that no one else can add it. */
+  if ((index = _bow_str_hash_lookup (map, string, id, &table, &h)) >= 0)
+    {
+      pthread_mutex_unlock (&map->lock);
+      return index;
+    }
 
   /* Didn't find the string in our mapping, so add it. */
 
@@ -297,30 +257,44 @@ _bow_str2int (bow_int4str *map, const char *string, unsigned id)
   /* Add it to str_array. */
   if (map->str_array_length > map->str_array_size-2)
     {
-      /* str_array must grow in order to accomodate new entry. */
+      /* str_array must grow in order to accomodate new entry.  Don't
+	 realloc(), since a lookup may be reading the old one. */
       map->str_array_size *= 2;
       assert (map->str_array_size < 1768448882);
-      map->str_array = bow_realloc (map->str_array, 
-				    map->str_array_size * sizeof (char*));
-      //map->hash_id_array = bow_realloc (map->hash_id_array, 
-      //map->str_array_size * sizeof (unsigned));
+      str_array = bow_malloc (map->str_array_size * sizeof (char*));
+      memcpy (str_array, map->str_array,
+	      map->str_array_length * sizeof (char*));
+      _bow_int4str_retire (map, map->str_array);
+      STORE_RELEASE (&map->str_array, str_array);
     }
-  map->str_array[map->str_array_length] = string;
-  //map->hash_id_array[map->str_array_length] = id;
+  index = map->str_array_length;
+  map->str_array[index] = string;
 
-  /* The STR_ARRAY has one more element in it now, so increment its length. */
-  map->str_array_length++;
+  /* Add it to str_hash, growing the table first if it would be more
+     than half full. */
+  if (2 * (unsigned) (index + 1) > table->mask + 1)
+    {
+      _bow_str_hash_grow (map);
+      table = map->str_hash;
+      for (h = _bow_str_hash_slot (id, table->mask);
+	   table->slot[h].index != HASH_EMPTY;
+	   h = (h + 1) & table->mask)
+	;
+    }
+  /* The STR_ARRAY has one more element in it now. */
+  STORE_RELEASE (&map->str_array_length, index + 1);
 
-  /* Add it to str_hash. */
-  _str_hash_add (map, string, id, h, (map->str_array_length)-1);
+  table->slot[h].id = id;
+  STORE_RELEASE (&table->slot[h].index, index);
 
-  /* Return the index at which it was added.  */
-  return (map->str_array_length)-1;
+  pthread_mutex_unlock (&map->lock);
+  return index;
 }
 
 /* Given the char-pointer STRING, return its integer index.  If this is 
    the first time we're seeing STRING, add it to the tables, assign
-   it a new index, and return the new index. */
+   it a new index, and return the new index.  Several threads may call
+   this at once on the same MAP. */
 int
 bow_str2int (bow_int4str *map, const char *string)
 {
@@ -509,8 +483,15 @@ bow_int4str_new_from_file (const char *filename)
 void
 bow_int4str_free_contents (bow_int4str *map)
 {
+  int i;
+
+  for (i = 0; i < map->retired_length; i++)
+    bow_free (map->retired[i]);
+  if (map->retired)
+    bow_free (map->retired);
   bow_free (map->str_array);
   bow_free (map->str_hash);
+  pthread_mutex_destroy (&map->lock);
 }
 
 void
@@ -29,6 +29,7 @@ bow_int4str *word_map = NULL;
 /* An array, holding the occurrence counts of all words in vocabulary. */
 static int *word_map_counts = NULL;
 static int word_map_counts_size = 0;
+static pthread_mutex_t word_map_counts_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* If this is non-zero, then bow_word2int() will return -1 when asked
    for the index of a word that is not already in the mapping. */
@@ -136,11 +137,21 @@ bow_word2int_no_add (const char *word)
    associated with WORD. */
 int
 bow_word2int_add_occurrence (const char *word)
+{
+  return bow_word2int_add_occurrences (word, 1);
+}
+
+/* Like bow_word2int_add_occurrence(), except it increments the
+   occurrence count by COUNT. */
+int
+bow_word2int_add_occurrences (const char *word, int count)
 {
   int ret = bow_word2int (word);
   
   if (ret < 0)
     return ret;
+  /* Several threads may be lexing queries at once. */
+  pthread_mutex_lock (&word_map_counts_lock);
   while (word_map->str_array_length >= word_map_counts_size)
     {
       /* WORD_MAP_COUNTS must grow to accomodate the new entry */
@@ -151,7 +162,8 @@ bow_word2int_add_occurrence (const char *word)
       for (wi = old_size; wi < word_map_counts_size; wi++)
 	word_map_counts[wi] = 0;
     }
-  (word_map_counts[ret])++;
+  word_map_counts[ret] += count;
+  pthread_mutex_unlock (&word_map_counts_lock);
   return ret;
 }
 
@@ -34,6 +34,17 @@ int bow_file_format_version = BOW_DEFAULT_FILE_FORMAT_VERSION;
    Before version 5:
    Changed bow_cdoc.class, bow_de.di, bow_de.count from short to int.
 
+   Before version 8:
+   The wi2dvf seek-table was not preceded by the `bow_dv_encoding' of
+   its document vectors; they were always bow_dv_encoding_stream.
+
+   Before version 9:
+   The wi2dvf seek-table held 32-bit offsets, limiting a barrel to 2GB,
+   and hidden words were not recorded; they were unhidden by
+   bow_wi2dvf_write().  Now each offset is written as two ints, high
+   word first, and the seek-table is followed by a bitmap of the
+   hidden words.
+
    */
 
 void
@@ -0,0 +1,512 @@
+/* The inner loops of scoring, with versions for SIMD instruction sets.
+   Copyright (C) 2026 agent
+
+   Written by:  agent <agent@local>
+
+   This file is part of the Bag-Of-Words Library, `libbow'.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License
+   as published by the Free Software Foundation, version 2.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA */
+
+#include <bow/libbow.h>
+
+/* Every version of a kernel does the same floating point operations
+   in the same order, so that scores don't depend on the processor a
+   model happens to run on.  That rules out fused multiply-adds, which
+   the compiler would otherwise be free to use in the AVX-512 code. */
+#define BOW_KERNEL_EXACT __attribute__ ((optimize ("fp-contract=off")))
+
+#if defined (__GNUC__) && __GNUC__ >= 5 && defined (__x86_64__)
+#define BOW_KERNELS_X86 1
+#include <immintrin.h>
+#define BOW_KERNEL_AVX2 \
+  __attribute__ ((target ("avx2"), optimize ("fp-contract=off")))
+#define BOW_KERNEL_AVX512 \
+  __attribute__ ((target ("avx512f"), optimize ("fp-contract=off")))
+#else
+#define BOW_KERNELS_X86 0
+#endif
+
+
+/* Adding to scores by way of a document vector. */
+
+static void BOW_KERNEL_EXACT
+_bow_kernel_scatter_add_scalar (float *scores, const float *scale,
+				const bow_de *entry, int length, float w)
+{
+  int i;
+
+  for (i = 0; i < length; i++)
+    scores[entry[i].di] += w * (entry[i].weight * scale[entry[i].di]);
+}
+
+static void BOW_KERNEL_EXACT
+_bow_kernel_scatter_add_d_scalar (double *scores, const float *scale,
+				  const float *factor,
+				  const bow_de *entry, int length, float w)
+{
+  int i;
+  float increment;
+
+  for (i = 0; i < length; i++)
+    {
+      increment = (((entry[i].weight * scale[entry[i].di])
+		    * factor[entry[i].di])
+		   * w);
+      scores[entry[i].di] += increment;
+    }
+}
+
+#if BOW_KERNELS_X86
+
+/* Loading the DI's (or WI's) and weights of eight consecutive
+   bow_de's (or bow_we's, which have the same layout) into vectors.
+   The 24 ints are read with three plain loads and picked apart. */
+static inline void BOW_KERNEL_AVX2
+_bow_kernel_load_8 (const void *entries, __m256i *di, __m256 *weight)
+{
+  const __m256i *p = entries;
+  __m256i a = _mm256_loadu_si256 (p);
+  __m256i b = _mm256_loadu_si256 (p + 1);
+  __m256i c = _mm256_loadu_si256 (p + 2);
+  __m256i t;
+
+  /* Ints 0,9,18,3,12,21,6,15, then 8,17,2,11,20,5,14,23. */
+  t = _mm256_blend_epi32 (_mm256_blend_epi32 (a, b, 0x92), c, 0x24);
+  *di = _mm256_permutevar8x32_epi32 (t, _mm256_setr_epi32 (0, 3, 6, 1,
+							   4, 7, 2, 5));
+  t = _mm256_blend_epi32 (_mm256_blend_epi32 (a, b, 0x49), c, 0x92);
+  *weight = _mm256_castsi256_ps
+    (_mm256_permutevar8x32_epi32 (t, _mm256_setr_epi32 (2, 5, 0, 3,
+							6, 1, 4, 7)));
+}
+
+/* The same for sixteen, with AVX-512's two-table permutes. */
+static inline void BOW_KERNEL_AVX512
+_bow_kernel_load_16 (const void *entries, __m512i *di, __m512 *weight)
+{
+  const __m512i *p = entries;
+  __m512i a = _mm512_loadu_si512 (p);
+  __m512i b = _mm512_loadu_si512 (p + 1);
+  __m512i c = _mm512_loadu_si512 (p + 2);
+  __m512i t;
+
+  /* Indices 0-15 pick from A, 16-31 from B; the second permute puts
+     C's ints in with indices 16-31 again. */
+  t = _mm512_permutex2var_epi32
+    (a, _mm512_setr_epi32 (0, 3, 6, 9, 12, 15, 18, 21,
+			   24, 27, 30, 0, 0, 0, 0, 0), b);
+  *di = _mm512_permutex2var_epi32
+    (t, _mm512_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7,
+			   8, 9, 10, 17, 20, 23, 26, 29), c);
+  t = _mm512_permutex2var_epi32
+    (a, _mm512_setr_epi32 (2, 5, 8, 11, 14, 17, 20, 23,
+			   26, 29, 0, 0, 0, 0, 0, 0), b);
+  *weight = _mm512_castsi512_ps
+    (_mm512_permutex2var_epi32
+     (t, _mm512_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7,
+			    8, 9, 16, 19, 22, 25, 28, 31), c));
+}
+
+/* There are no AVX2 versions of the scatters: without a scatter
+   instruction the sums have to be stored one at a time, and the
+   gathers and stores together come out slower than the plain loop. */
+
+static void BOW_KERNEL_AVX512
+_bow_kernel_scatter_add_avx512 (float *scores, const float *scale,
+				const bow_de *entry, int length, float w)
+{
+  __m512 vw = _mm512_set1_ps (w);
+  __m512i di;
+  __m512 s;
+  int i;
+
+  for (i = 0; i + 16 <= length; i += 16)
+    {
+      _bow_kernel_load_16 (entry + i, &di, &s);
+      s = _mm512_mul_ps (s, _mm512_i32gather_ps (di, scale, 4));
+      s = _mm512_add_ps (_mm512_i32gather_ps (di, scores, 4),
+			 _mm512_mul_ps (vw, s));
+      _mm512_i32scatter_ps (scores, di, s, 4);
+    }
+  _bow_kernel_scatter_add_scalar (scores, scale, entry + i, length - i, w);
+}
+
+static void BOW_KERNEL_AVX512
+_bow_kernel_scatter_add_d_avx512 (double *scores, const float *scale,
+				  const float *factor,
+				  const bow_de *entry, int length, float w)
+{
+  __m512 vw = _mm512_set1_ps (w);
+  __m512i di;
+  __m256i di_half;
+  __m512 t;
+  __m512d s;
+  int i;
+
+  for (i = 0; i + 16 <= length; i += 16)
+    {
+      _bow_kernel_load_16 (entry + i, &di, &t);
+      t = _mm512_mul_ps (t, _mm512_i32gather_ps (di, scale, 4));
+      t = _mm512_mul_ps (t, _mm512_i32gather_ps (di, factor, 4));
+      t = _mm512_mul_ps (t, vw);
+      di_half = _mm512_castsi512_si256 (di);
+      s = _mm512_add_pd (_mm512_i32gather_pd (di_half, scores, 8),
+			 _mm512_cvtps_pd (_mm512_castps512_ps256 (t)));
+      _mm512_i32scatter_pd (scores, di_half, s, 8);
+      di_half = _mm512_extracti64x4_epi64 (di, 1);
+      s = _mm512_add_pd (_mm512_i32gather_pd (di_half, scores, 8),
+			 _mm512_cvtps_pd
+			 (_mm256_castpd_ps (_mm512_extractf64x4_pd
+					    (_mm512_castps_pd (t), 1))));
+      _mm512_i32scatter_pd (scores, di_half, s, 8);
+    }
+  _bow_kernel_scatter_add_d_scalar (scores, scale, factor,
+				    entry + i, length - i, w);
+}
+
+#endif /* BOW_KERNELS_X86 */
+
+
+/* Dot products of a sparse and a dense vector.  The products are
+   summed in eight interleaved partial sums: entry I goes into sum
+   I%8, and the sums are then added pairwise, 0+4, 1+5, 2+6 and 3+7,
+   then those 0+2 and 1+3, and finally those two. */
+
+static double
+_bow_kernel_dot_finish (double *s)
+{
+  double t0, t1, t2, t3;
+
+  t0 = s[0] + s[4];
+  t1 = s[1] + s[5];
+  t2 = s[2] + s[6];
+  t3 = s[3] + s[7];
+  t0 = t0 + t2;
+  t1 = t1 + t3;
+  return t0 + t1;
+}
+
+static double BOW_KERNEL_EXACT
+_bow_kernel_dot_sd_scalar (const bow_we *entry, int length, const double *w)
+{
+  double s[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  int i;
+
+  for (i = 0; i < length; i++)
+    s[i % 8] += entry[i].weight * w[entry[i].wi];
+  return _bow_kernel_dot_finish (s);
+}
+
+#if BOW_KERNELS_X86
+
+static double BOW_KERNEL_AVX2
+_bow_kernel_dot_sd_avx2 (const bow_we *entry, int length, const double *w)
+{
+  __m256d lo = _mm256_setzero_pd ();
+  __m256d hi = _mm256_setzero_pd ();
+  __m256i wi;
+  __m256 weight;
+  double s[8];
+  int i;
+
+  for (i = 0; i + 8 <= length; i += 8)
+    {
+      _bow_kernel_load_8 (entry + i, &wi, &weight);
+      lo = _mm256_add_pd (lo, _mm256_mul_pd
+			  (_mm256_cvtps_pd (_mm256_castps256_ps128 (weight)),
+			   _mm256_i32gather_pd (w, _mm256_castsi256_si128 (wi),
+						8)));
+      hi = _mm256_add_pd (hi, _mm256_mul_pd
+			  (_mm256_cvtps_pd (_mm256_extractf128_ps (weight, 1)),
+			   _mm256_i32gather_pd (w, _mm256_extracti128_si256
+						(wi, 1), 8)));
+    }
+  _mm256_storeu_pd (s, lo);
+  _mm256_storeu_pd (s + 4, hi);
+  for (; i < length; i++)
+    s[i % 8] += entry[i].weight * w[entry[i].wi];
+  return _bow_kernel_dot_finish (s);
+}
+
+static double BOW_KERNEL_AVX512
+_bow_kernel_dot_sd_avx512 (const bow_we *entry, int length, const double *w)
+{
+  __m512d sum = _mm512_setzero_pd ();
+  __m256i wi;
+  __m256 weight;
+  double s[8];
+  int i;
+
+  for (i = 0; i + 8 <= length; i += 8)
+    {
+      _bow_kernel_load_8 (entry + i, &wi, &weight);
+      sum = _mm512_add_pd (sum, _mm512_mul_pd (_mm512_cvtps_pd (weight),
+					       _mm512_i32gather_pd (wi, w, 8)));
+    }
+  _mm512_storeu_pd (s, sum);
+  for (; i < length; i++)
+    s[i % 8] += entry[i].weight * w[entry[i].wi];
+  return _bow_kernel_dot_finish (s);
+}
+
+#endif /* BOW_KERNELS_X86 */
+
+
+/* Picking the best scores.  Each version keeps the SCORES that beat
+   the worst one kept so far in a list sorted by insertion, so ties go
+   to the lower index, as they always have in the methods' own loops.
+   The SIMD versions only differ in skipping quickly over runs of
+   scores that can't get into a full list. */
+
+/* Put SCORE with index DI into the sorted BSCORES, which holds
+   NUM_SCORES of at most K entries, if it belongs there, and return the
+   new number of entries. */
+static inline int
+_bow_kernel_top_k_insert (bow_score *bscores, int num_scores, int k,
+			  int di, double score)
+{
+  int dsi;
+
+  if (num_scores < k || bscores[num_scores-1].weight < score)
+    {
+      if (num_scores < k)
+	num_scores++;
+      dsi = num_scores - 1;
+      for (; dsi > 0 && bscores[dsi-1].weight < score; dsi--)
+	bscores[dsi] = bscores[dsi-1];
+      bscores[dsi].weight = score;
+      bscores[dsi].di = di;
+    }
+  return num_scores;
+}
+
+static int
+_bow_kernel_top_k_scalar (const double *scores, int length,
+			  bow_score *bscores, int k)
+{
+  int num_scores = 0;
+  int i;
+
+  if (k <= 0)
+    return 0;
+  for (i = 0; i < length; i++)
+    num_scores = _bow_kernel_top_k_insert (bscores, num_scores, k,
+					   i, scores[i]);
+  return num_scores;
+}
+
+static int
+_bow_kernel_top_k_f_scalar (const float *scores, int length,
+			    bow_score *bscores, int k)
+{
+  int num_scores = 0;
+  int i;
+
+  if (k <= 0)
+    return 0;
+  for (i = 0; i < length; i++)
+    num_scores = _bow_kernel_top_k_insert (bscores, num_scores, k,
+					   i, scores[i]);
+  return num_scores;
+}
+
+#if BOW_KERNELS_X86
+
+static int BOW_KERNEL_AVX2
+_bow_kernel_top_k_avx2 (const double *scores, int length,
+			bow_score *bscores, int k)
+{
+  int num_scores = 0;
+  int i, mask;
+
+  if (k <= 0)
+    return 0;
+  for (i = 0; i < length && num_scores < k; i++)
+    num_scores = _bow_kernel_top_k_insert (bscores, num_scores, k,
+					   i, scores[i]);
+  for (; i + 4 <= length; i += 4)
+    {
+      mask = _mm256_movemask_pd
+	(_mm256_cmp_pd (_mm256_loadu_pd (scores + i),
+			_mm256_set1_pd (bscores[num_scores-1].weight),
+			_CMP_GT_OQ));
+      for (; mask; mask &= mask - 1)
+	num_scores = _bow_kernel_top_k_insert
+	  (bscores, num_scores, k, i + __builtin_ctz (mask),
+	   scores[i + __builtin_ctz (mask)]);
+    }
+  for (; i < length; i++)
+    num_scores = _bow_kernel_top_k_insert (bscores, num_scores, k,
+					   i, scores[i]);
+  return num_scores;
+}
+
+static int BOW_KERNEL_AVX2
+_bow_kernel_top_k_f_avx2 (const float *scores, int length,
+			  bow_score *bscores, int k)
+{
+  int num_scores = 0;
+  int i, mask;
+
+  if (k <= 0)
+    return 0;
+  for (i = 0; i < length && num_scores < k; i++)
+    num_scores = _bow_kernel_top_k_insert (bscores, num_scores, k,
+					   i, scores[i]);
+  for (; i + 4 <= length; i += 4)
+    {
+      mask = _mm256_movemask_pd
+	(_mm256_cmp_pd (_mm256_cvtps_pd (_mm_loadu_ps (scores + i)),
+			_mm256_set1_pd (bscores[num_scores-1].weight),
+			_CMP_GT_OQ));
+      for (; mask; mask &= mask - 1)
+	num_scores = _bow_kernel_top_k_insert
+	  (bscores, num_scores, k, i + __builtin_ctz (mask),
+	   scores[i + __builtin_ctz (mask)]);
+    }
+  for (; i < length; i++)
+    num_scores = _bow_kernel_top_k_insert (bscores, num_scores, k,
+					   i, scores[i]);
+  return num_scores;
+}
+
+static int BOW_KERNEL_AVX512
+_bow_kernel_top_k_avx512 (const double *scores, int length,
+			  bow_score *bscores, int k)
+{
+  int num_scores = 0;
+  int i, mask;
+
+  if (k <= 0)
+    return 0;
+  for (i = 0; i < length && num_scores < k; i++)
+    num_scores = _bow_kernel_top_k_insert (bscores, num_scores, k,
+					   i, scores[i]);
+  for (; i + 8 <= length; i += 8)
+    {
+      mask = _mm512_cmp_pd_mask (_mm512_loadu_pd (scores + i),
+				 _mm512_set1_pd (bscores[num_scores-1].weight),
+				 _CMP_GT_OQ);
+      for (; mask; mask &= mask - 1)
+	num_scores = _bow_kernel_top_k_insert
+	  (bscores, num_scores, k, i + __builtin_ctz (mask),
+	   scores[i + __builtin_ctz (mask)]);
+    }
+  for (; i < length; i++)
+    num_scores = _bow_kernel_top_k_insert (bscores, num_scores, k,
+					   i, scores[i]);
+  return num_scores;
+}
+
+static int BOW_KERNEL_AVX512
+_bow_kernel_top_k_f_avx512 (const float *scores, int length,
+			    bow_score *bscores, int k)
+{
+  int num_scores = 0;
+  int i, mask;
+
+  if (k <= 0)
+    return 0;
+  for (i = 0; i < length && num_scores < k; i++)
+    num_scores = _bow_kernel_top_k_insert (bscores, num_scores, k,
+					   i, scores[i]);
+  for (; i + 8 <= length; i += 8)
+    {
+      mask = _mm512_cmp_pd_mask (_mm512_cvtps_pd (_mm256_loadu_ps
+						   (scores + i)),
+				 _mm512_set1_pd (bscores[num_scores-1].weight),
+				 _CMP_GT_OQ);
+      for (; mask; mask &= mask - 1)
+	num_scores = _bow_kernel_top_k_insert
+	  (bscores, num_scores, k, i + __builtin_ctz (mask),
+	   scores[i + __builtin_ctz (mask)]);
+    }
+  for (; i < length; i++)
+    num_scores = _bow_kernel_top_k_insert (bscores, num_scores, k,
+					   i, scores[i]);
+  return num_scores;
+}
+
+#endif /* BOW_KERNELS_X86 */
+
+
+/* Choosing among the versions. */
+
+void (*bow_kernel_scatter_add) (float *scores, const float *scale,
+				const bow_de *entry, int length, float w)
+     = _bow_kernel_scatter_add_scalar;
+void (*bow_kernel_scatter_add_d) (double *scores, const float *scale,
+				  const float *factor,
+				  const bow_de *entry, int length, float w)
+     = _bow_kernel_scatter_add_d_scalar;
+double (*bow_kernel_dot_sd) (const bow_we *entry, int length,
+			     const double *w)
+     = _bow_kernel_dot_sd_scalar;
+int (*bow_kernel_top_k) (const double *scores, int length,
+			 bow_score *bscores, int k)
+     = _bow_kernel_top_k_scalar;
+int (*bow_kernel_top_k_f) (const float *scores, int length,
+			   bow_score *bscores, int k)
+     = _bow_kernel_top_k_f_scalar;
+
+const char *bow_kernels_name = "scalar";
+
+int
+bow_kernels_select (const char *name)
+{
+  if (!strcmp (name, "scalar"))
+    {
+      bow_kernel_scatter_add = _bow_kernel_scatter_add_scalar;
+      bow_kernel_scatter_add_d = _bow_kernel_scatter_add_d_scalar;
+      bow_kernel_dot_sd = _bow_kernel_dot_sd_scalar;
+      bow_kernel_top_k = _bow_kernel_top_k_scalar;
+      bow_kernel_top_k_f = _bow_kernel_top_k_f_scalar;
+      bow_kernels_name = "scalar";
+      return 0;
+    }
+#if BOW_KERNELS_X86
+  __builtin_cpu_init ();
+  if (!strcmp (name, "avx2") && __builtin_cpu_supports ("avx2"))
+    {
+      bow_kernel_scatter_add = _bow_kernel_scatter_add_scalar;
+      bow_kernel_scatter_add_d = _bow_kernel_scatter_add_d_scalar;
+      bow_kernel_dot_sd = _bow_kernel_dot_sd_avx2;
+      bow_kernel_top_k = _bow_kernel_top_k_avx2;
+      bow_kernel_top_k_f = _bow_kernel_top_k_f_avx2;
+      bow_kernels_name = "avx2";
+      return 0;
+    }
+  if (!strcmp (name, "avx512") && __builtin_cpu_supports ("avx512f"))
+    {
+      bow_kernel_scatter_add = _bow_kernel_scatter_add_avx512;
+      bow_kernel_scatter_add_d = _bow_kernel_scatter_add_d_avx512;
+      bow_kernel_dot_sd = _bow_kernel_dot_sd_avx512;
+      bow_kernel_top_k = _bow_kernel_top_k_avx512;
+      bow_kernel_top_k_f = _bow_kernel_top_k_f_avx512;
+      bow_kernels_name = "avx512";
+      return 0;
+    }
+#endif /* BOW_KERNELS_X86 */
+  return -1;
+}
+
+void _bow_kernels_init () __attribute__ ((constructor));
+
+void
+_bow_kernels_init ()
+{
+  if (bow_kernels_select ("avx512") != 0
+      && bow_kernels_select ("avx2") != 0)
+    bow_kernels_select ("scalar");
+}
@@ -414,30 +414,8 @@ bow_kl_score (bow_barrel *barrel, bow_wv *query_wv,
 
   /* Return the SCORES by putting them (and the `class indices') into
      SCORES in sorted order. */
-  {
-    num_scores = 0;
-    for (ci = 0; ci < barrel->cdocs->length; ci++)
-      {
-	if (num_scores < bscores_len
-	    || bscores[num_scores-1].weight < scores[ci])
-	  {
-	    /* We are going to put this score and CI into SCORES
-	       because either: (1) there is empty space in SCORES, or
-	       (2) SCORES[CI] is larger than the smallest score there
-	       currently. */
-	    int dsi;		/* an index into SCORES */
-	    if (num_scores < bscores_len)
-	      num_scores++;
-	    dsi = num_scores - 1;
-	    /* Shift down all the entries that are smaller than SCORES[CI] */
-	    for (; dsi > 0 && bscores[dsi-1].weight < scores[ci]; dsi--)
-	      bscores[dsi] = bscores[dsi-1];
-	    /* Insert the new score */
-	    bscores[dsi].weight = scores[ci];
-	    bscores[dsi].di = ci;
-	  }
-      }
-  }
+  num_scores = (*bow_kernel_top_k) (scores, barrel->cdocs->length,
+				    bscores, bscores_len);
 
 #if 0
   printf ("kl %8.6f %8.6f %d %d %8.6f %8.6f   ",
@@ -463,7 +441,8 @@ rainbow_method bow_method_kl =
   bow_wv_set_weights_to_count,
   NULL,				/* no need for extra weight normalization */
   bow_barrel_free,
-  0
+  0,
+  1				/* scoring is thread-safe */
 };
 
 void _register_method_kl () __attribute__ ((constructor));
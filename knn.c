@@ -252,6 +252,14 @@ bow_knn_set_weights (bow_barrel *barrel)
      document in our model */
 }
 
+/* Bound what each word of BARREL can add to a score, for the pruning
+   in bow_knn_get_k_best(). */
+void bow_knn_set_score_bounds (bow_barrel *barrel)
+{
+  bow_wi2dvf_set_max_weights (barrel->wi2dvf, barrel->cdocs,
+			      NORM_C(doc_weights));
+}
+
 void bow_knn_normalise_weights (bow_barrel *barrel)
 {
   /* This puts the euclidian doc length in cdoc->normalizer for each
@@ -260,6 +268,10 @@ void bow_knn_normalise_weights (bow_barrel *barrel)
     {
       bow_barrel_normalize_weights_by_vector_length(barrel);
     }
+
+  /* The weights are final now, so bow_knn_get_k_best() can bound
+     what each word adds to a score. */
+  bow_knn_set_score_bounds (barrel);
 }
 
 
@@ -343,140 +355,89 @@ bow_knn_normalise_query_weights (bow_wv *query)
     }
 }
 
-/* Little :) function lifted from tfidf.c and edited to do exactly
-   what we need here. Was originally called bow_tfidf_score */
+/* What bow_knn_score_document() needs to know about the query. */
+struct bow_knn_query {
+  bow_barrel *barrel;
+  bow_wv *query_wv;
+};
+
+/* Score the model document DI against the query CONTEXT, given the
+   weights DW of the NUM_PRESENT query words WVI in it. */
+static int
+bow_knn_score_document (void *context, int di, int num_present,
+			const int *wvi, const float *dw, double *score)
+{
+  struct bow_knn_query *q = context;
+  bow_wv *query_wv = q->query_wv;
+  bow_cdoc *doc;
+  double current_score = 0.0;
+  float tmp;
+  int i;
+
+  /* Get the document structure */
+  doc = bow_cdocs_di2doc (q->barrel->cdocs, di);
+
+  /* Loop over all the words this document has in common with our
+     query document, in index order, summing up the score.
+     Normalisation happens outside this loop, we just need to check
+     for the idf factor stuff. The tf weights are just fine. */
+  for (i = 0; i < num_present; i++)
+    {
+      if (dw[i] == 0)
+	continue;
+
+      /* Multiply the tfidf weights */
+      tmp = query_wv->entry[wvi[i]].weight * (double) dw[i];
+
+      /* Plop this into the current score */
+      current_score += tmp;
+
+      /* A test to make sure we haven't got NaN. */ 
+      assert (current_score == current_score); 
+    }
+
+  /* Now check for normalisation */
+  if(NORM_C(query_weights))
+    {
+      current_score *= query_wv->normalizer;
+    }
+  if(NORM_C(doc_weights))
+    {
+      current_score *= doc->normalizer;
+    }
+
+  assert (current_score == current_score); /* checking for NaN */ 
+
+  *score = current_score;
+  return 1;
+}
+
+/* Fill SCORES with the BEST model documents closest to QUERY_WV, best
+   first, and return how many there are.  Documents that can't be
+   among them aren't scored; see topk.c. */
 int
 bow_knn_get_k_best (bow_barrel *barrel, bow_wv *query_wv,  
 		    bow_score *scores, int best)
 {
-  bow_dv_heap *heap; 
-  bow_cdoc *doc; 
-  int num_scores = 0;           /* How many elements are in this array */ 
-  int current_di, wi, current_index, i; 
-  double current_score = 0.0, doc_tfidf; 
-  float tmp; 
-
-  /* Create the Heap of vectors of documents */ 
-  heap = bow_make_dv_heap_from_wv (barrel->wi2dvf, query_wv); 
- 
-  /* Keep looking at document/word entries until the heap is emptied */ 
-  while (heap->length > 0) 
-    { 
-      /* Get the index of the document we're currently working on */ 
-      current_di = heap->entry[0].current_di; 
- 
-      /* Get the document structure */ 
-      doc = bow_cdocs_di2doc (barrel->cdocs, current_di); 
-
-      /* If it's not a model document, then move on to next one */ 
-      if (doc->type != bow_doc_train) 
-        { 
-          do  
-            { 
-              bow_dv_heap_update (heap); 
-            } 
-          while ((current_di == heap->entry[0].current_di) 
-                 && (heap->length > 0)); 
-         
-          /* Try again */ 
-          continue; 
-        } 
- 
-      /* Reset the index into the query word vector */ 
-      current_index = 0; 
- 
-      /* Reset the score */ 
-      current_score = 0.0; 
- 
-      /* Loop over all the words this document has in common with our
-	 query document, summing up the score. We know the words come
-	 out of the heap in index order and we know the words in the
-	 query word vector are in index order as well. */
-      do 
-        { 
-          wi = heap->entry[0].wi; 
-          doc_tfidf = heap->entry[0].dv->entry[heap->entry[0].index].weight;
-
-	  /* Find the corresponding word in the query word vector */ 
-	  /* Note - we know this word is in the query because we built
-	     the heap using only the query words. */
-          while (wi > (query_wv->entry[current_index].wi)) 
-            current_index++; 
-          assert (wi == query_wv->entry[current_index].wi); 
-
-	  /* Now we can add something to the score. Normalisation
-	     happens outside this loop, we just need to check for the
-	     idf factor stuff. The tf weights are just fine. */
-
-	  /* Multiply the tfidf weights */
-	  /* printf("%f * %f\n", query_wv->entry[current_index].weight,
-		 doc_tfidf); */
-
-	  tmp = query_wv->entry[current_index].weight * doc_tfidf;
-
-	  /* Plop this into the current score */
-	  current_score += tmp;
-
-	  /* A test to make sure we haven't got NaN. */ 
-          assert (current_score == current_score); 
- 
-          /* Now we need to update the heap - moving this element on
-	     to its 
-             new position */ 
-          bow_dv_heap_update (heap); 
-        } 
-      while ((current_di == heap->entry[0].current_di) 
-             && (heap->length > 0)); 
-
-      /* Now check for normalisation */
-      if(NORM_C(query_weights))
-	{
-	  current_score *= query_wv->normalizer;
-	}
-      if(NORM_C(doc_weights))
-	{
-	  current_score *= doc->normalizer;
-	}
+  struct bow_knn_query q;
+  bow_cdoc *doc;
+  int num_scores, i;
+
+  q.barrel = barrel;
+  q.query_wv = query_wv;
+  num_scores = bow_wi2dvf_top_k (barrel->wi2dvf, barrel->cdocs,
+				 NORM_C(doc_weights), query_wv,
+				 (NORM_C(query_weights) 
+				  ? query_wv->normalizer : 1.0),
+				 bow_knn_score_document, &q, scores, best);
+  for (i = 0; i < num_scores; i++)
+    {
+      doc = bow_cdocs_di2doc (barrel->cdocs, scores[i].di);
+      scores[i].name = doc->filename;
+    }
 
-      assert (current_score == current_score); /* checking for NaN */ 
-
-      /* We now hopefully have the correct score for doc */
-
-      /* Store the result in the SCORES array */ 
-      /* If we haven't filled the list, or we beat the last item in
-	 the list */ 
-      if ((num_scores < best) 
-          || (scores[num_scores - 1].weight < current_score)) 
-        { 
-          /* We're going to search up the list comparing element i-1 with 
-             our current score and moving it down the list if it's worse */ 
-          if (num_scores < best) 
-            { 
-              i = num_scores; 
-              num_scores++; 
-            } 
-          else 
-            i = num_scores - 1; 
-
-	  /* Shift down all the bits of the array that need shifting */ 
-          for (; (i > 0) && (scores[i - 1].weight < current_score); i--) 
-	    {
-	      scores[i].di = scores[i-1].di; 
-	      scores[i].weight = scores[i-1].weight; 
-	      scores[i].name = scores[i-1].name; 
-	    }
- 
-          /* Insert our new score */ 
-          scores[i].weight = current_score; 
-          scores[i].di = current_di;
-	  scores[i].name = doc->filename;
-        } 
-    } 
-
-  bow_free (heap); 
- 
-  /* All done - return the number of elements we have */ 
-  return num_scores; 
+  /* All done - return the number of elements we have */
+  return num_scores;
 } 
 
 
@@ -564,7 +525,9 @@ rainbow_method bow_method_knn =
   bow_knn_query_set_weights,
   bow_knn_normalise_query_weights,
   bow_barrel_free,
-  0
+  0,
+  1,				/* scoring is thread-safe */
+  bow_knn_set_score_bounds
 };
 
 void _register_method_knn () __attribute__ ((constructor));
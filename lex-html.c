@@ -122,8 +122,11 @@ int entityMaxLen;
 
 static bow_int4str *entityMap;
 
-#define PARAMS (bow_default_lexer_parameters)
+#define PARAMS (lex->parameters)
 
+/* Build the map at startup rather than on first use, so that
+   documents can be lexed on several threads. */
+static void initEntityMap() __attribute__ ((constructor));
 static void initEntityMap()
 {
     int i;
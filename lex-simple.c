@@ -45,14 +45,12 @@ int bow_lexer_toss_words_shorter_than = 2;
 
 /* Only return the first N words in the document */
 int bow_lexer_max_num_words_per_document = 0;
-/* Yucky, yucky, horible, temporary global variable. */
-int bow_lexer_num_words_in_document = 0;
 
 /* to stem and stopword correctly for words like inlinkxxxhowever */
 char *bow_lexer_infix_separator = NULL;
 int bow_lexer_infix_length = 0;
 
-#define PARAMS (bow_default_lexer_parameters)
+#define PARAMS (lex->parameters)
 
 /* Create and return a BOW_LEX, filling the document buffer from
    characters in FP, starting after the START_PATTERN, and ending with
@@ -69,13 +67,14 @@ bow_lexer_simple_open_text_fp (bow_lexer *self,
   int byte;			/* a character read from FP */
   FILE *pre_pipe_fp = NULL;
 
-  bow_lexer_num_words_in_document = 0;
   if (feof (fp))
     return NULL;
 
   /* Create space for the document buffer. */
   ret = bow_malloc (self->sizeof_lex);
   ret->document = bow_malloc (document_size);
+  ret->parameters = bow_default_lexer_parameters;
+  ret->num_words = 0;
 
   /* Make sure DOCUMENT_START_PATTERN is not NULL; this would cause
      it to scan forward to EOF. */
@@ -243,13 +242,14 @@ bow_lexer_simple_open_str (bow_lexer *self,
   int bufpos = 0;
   int start_pos = 0;
   
-  bow_lexer_num_words_in_document = 0;
   if (!buf)
     return NULL;
   
   /* Create space for the document buffer. */
   ret = bow_malloc (self->sizeof_lex);
   ret->document = bow_malloc (document_size);
+  ret->parameters = bow_default_lexer_parameters;
+  ret->num_words = 0;
   
   /* Make sure DOCUMENT_START_PATTERN is not NULL; this would cause
      it to scan forward to EOF. */
@@ -528,10 +528,9 @@ old_bow_lexer_simple_postprocess_word (bow_lexer *self, bow_lex *lex,
   if (bow_xxx_words_only && strstr (buf, "titlexxx") == NULL)
     return 0;
 
-  bow_lexer_num_words_in_document++;
+  lex->num_words++;
   if (bow_lexer_max_num_words_per_document
-      && (bow_lexer_num_words_in_document
-	  > bow_lexer_max_num_words_per_document))
+      && lex->num_words > bow_lexer_max_num_words_per_document)
     return 0;
   
   /* Return the length of the word we found. */
@@ -8,10 +8,11 @@
 
 #define HEADER_TWICE 1
 
-static int suffixing_doing_headers;
-static int suffixing_appending_headers;
-static char suffixing_suffix[BOW_MAX_WORD_LENGTH];
-static int suffixing_suffix_length;
+/* Per-thread, so that documents can be lexed on several threads. */
+static __thread int suffixing_doing_headers;
+static __thread int suffixing_appending_headers;
+static __thread char suffixing_suffix[BOW_MAX_WORD_LENGTH];
+static __thread int suffixing_suffix_length;
 
 int bow_lexer_html_get_raw_word (bow_lexer *self, bow_lex *lex, 
 				 char *buf, int buflen);
@@ -842,56 +842,77 @@ multiclass_mixture_given_doc_and_partial_cis (crossbow_doc *doc,
 }
 
 
-/* Return the perplexity */
-double
-multiclass_em_one_iteration ()
+/* What one thread of multiclass_em_one_iteration() accumulates from
+   its share of the documents. */
+typedef struct _multiclass_em_acc {
+  double *new_words;		/* [wi*NODES_COUNT+ni] */
+  double *new_prior;		/* [ni] */
+  double *new_m;		/* [cmi*MAX_NUM_MIXTURES+l] */
+  double uniform_new_prior;
+  double log_prob_of_data;
+  double log_prob_of_data2;
+  int num_data_words;		/* the number of word occurrences */
+} multiclass_em_acc;
+
+/* What multiclass_em_one_iteration() shares with its threads. */
+typedef struct _multiclass_em_context {
+  bow_treenode_compiled *compiled;
+  int root_ni;			/* index of CROSSBOW_ROOT in COMPILED */
+  int *child_ni;		/* index of each of its children */
+  int num_threads;
+  multiclass_em_acc *accs;	/* one for each thread */
+} multiclass_em_context;
+
+/* Return non-zero if multiclass EM should estimate parameters from DOC. */
+static int
+multiclass_em_uses_doc (crossbow_doc *doc)
 {
-  int di;
+  if (doc->tag != bow_doc_train && doc->tag != bow_doc_unlabeled)
+    return 0;
+  /* Temporary fix */
+  if (strstr (doc->filename, ".include")
+      || strstr (doc->filename, ".exclude"))
+    return 0;
+  return 1;
+}
+
+/* Run the per-word E-step, and gather the M-step counts, for one
+   thread's range of documents. */
+static void
+multiclass_em_thread (int thread_index, void *context)
+{
+  multiclass_em_context *ec = context;
+  multiclass_em_acc *acc = &(ec->accs[thread_index]);
+  int nodes_count = ec->compiled->nodes_count;
+  int di, di_end;
   crossbow_doc *doc;
   bow_wv *wv;
   treenode *node;
+  int ni;
   int cisi, wvi;
-  int num_nodes;
-  double *node_word_prob, log_prob_of_data2;
-  double node_membership_sum, word_prob, log_prob_of_data, deposit;
-  int num_data_words = 0;	/* the number of word occurrences */
+  double *node_word_prob;
+  double node_membership_sum, word_prob, deposit;
   double *node_membership;
   cmixture *m;
+  double *new_m;
   int cis_size;
-  double *mixture_all;
 
   /* One node for each topic, plus one for all-english, plus one for uniform */
-  num_nodes = crossbow_root->children_count + 1 + 1;
-  node_membership = alloca (num_nodes * sizeof (double));
-  node_word_prob = alloca (num_nodes * sizeof (double));
-  mixture_all = alloca ((crossbow_root->children_count+2) * sizeof(double));
-
-  log_prob_of_data = log_prob_of_data2 = 0;
-  for (di = 0; di < crossbow_docs->length; di++)
+  node_membership = alloca ((crossbow_root->children_count + 1 + 1)
+			    * sizeof (double));
+  node_word_prob = alloca ((crossbow_root->children_count + 1 + 1)
+			   * sizeof (double));
+
+  /* Each thread always gets the same range of documents, so that
+     the sums come out the same from run to run. */
+  di = (long) crossbow_docs->length * thread_index / ec->num_threads;
+  di_end = (long) crossbow_docs->length * (thread_index+1) / ec->num_threads;
+  for (; di < di_end; di++)
     {
       doc = bow_array_entry_at_index (crossbow_docs, di);
-      if (doc->tag != bow_doc_train && doc->tag != bow_doc_unlabeled)
-	continue;
-      /* Temporary fix */
-      if (strstr (doc->filename, ".include")
-	  || strstr (doc->filename, ".exclude"))
+      if (!multiclass_em_uses_doc (doc))
 	continue;
 
-      multiclass_mixture_given_doc (doc, mixture_all);
-      bow_verbosify (bow_verbose, "%s ", doc->filename);
-      for (cisi = 0; cisi < crossbow_root->children_count+2; cisi++)
-	{
-	  bow_verbosify (bow_verbose, "%s=%g,",
-			 (cisi < crossbow_root->children_count
-			  ? bow_int2str (crossbow_classnames, cisi)
-			  : (cisi == crossbow_root->children_count
-			     ? "root"
-			     : "uniform")),
-			 mixture_all[cisi]);
-	}
-      bow_verbosify (bow_verbose, "\n");
-
-
       /* Get the word vector for this document, and for each word,
          estimate its membership probability in each of its classes
          (and the root class), and then gather stats for the M-step */
@@ -899,12 +920,13 @@ multiclass_em_one_iteration ()
       m = cmixture_for_cis (doc->cis, doc->cis_size, 0, &cis_size);
       assert (m);
       assert (m->doc_count > 0);
+      new_m = acc->new_m + (m - cm) * MAX_NUM_MIXTURES;
       /* Zero the document-specific mixture in preparation for incrementing */
       for (cisi = 0; cisi < cis_size + 2; cisi++)
 	doc->cis_mixture[cisi] = 0;
       for (wvi = 0; wvi < wv->num_entries; wvi++)
 	{
-	  num_data_words += wv->entry[wvi].count;
+	  acc->num_data_words += wv->entry[wvi].count;
 
 	  /* Per-word E-step */
 	  node_membership_sum = 0;
@@ -936,39 +958,45 @@ multiclass_em_one_iteration ()
 	      node_membership[cisi] /= node_membership_sum;
 	      word_prob += node_membership[cisi] * node_word_prob[cisi];
 	      if (node_membership[cisi])
-		log_prob_of_data2 += (node_membership[cisi]
-				      * wv->entry[wvi].count
-				      * log (node_word_prob[cisi]));
+		acc->log_prob_of_data2 += (node_membership[cisi]
+					   * wv->entry[wvi].count
+					   * log (node_word_prob[cisi]));
 	    }
-	  log_prob_of_data += wv->entry[wvi].count * log (word_prob);
+	  acc->log_prob_of_data += wv->entry[wvi].count * log (word_prob);
 
 	  /* Per-word M-step */
 	  for (cisi = 0; cisi <= doc->cis_size; cisi++)
 	    {
 	      if (cisi == doc->cis_size)
-		node = crossbow_root;
+		{
+		  node = crossbow_root;
+		  ni = ec->root_ni;
+		}
 	      else
-		node = crossbow_root->children[doc->cis[cisi]];
+		{
+		  node = crossbow_root->children[doc->cis[cisi]];
+		  ni = ec->child_ni[doc->cis[cisi]];
+		}
 	      deposit = wv->entry[wvi].count * node_membership[cisi];
-	      node->new_words[wv->entry[wvi].wi] += deposit;
+	      acc->new_words[wv->entry[wvi].wi * nodes_count + ni] += deposit;
 	      bow_treenode_add_new_loo_for_di_wvi
 		(node, deposit, di, wvi, 
 		 wv->num_entries, crossbow_docs->length);
 
 	      /* For non-combo version */
-	      node->new_prior += deposit;
+	      acc->new_prior[ni] += deposit;
 	      /* For combo version */
-	      m->new_m[cisi] += deposit;
+	      new_m[cisi] += deposit;
 	      doc->cis_mixture[cisi] += deposit;
 	    }
 	  /* For the uniform distribution */
 	  deposit = wv->entry[wvi].count * node_membership[doc->cis_size+1];
-	  multiclass_uniform_new_prior += deposit;
-	  m->new_m[doc->cis_size+1] += deposit;
+	  acc->uniform_new_prior += deposit;
+	  new_m[doc->cis_size+1] += deposit;
 	  doc->cis_mixture[cis_size+1] += deposit;
 	}
 
-      /* Normalize the document-specific CIS_MIXTURE, (and print it out) */
+      /* Normalize the document-specific CIS_MIXTURE */
       {
 	double max = -FLT_MAX;
 	double cis_mixture_sum;
@@ -981,21 +1009,163 @@ multiclass_em_one_iteration ()
 	    //doc->cis_mixture[cisi] = exp (doc->cis_mixture[cisi] - max);
 	    cis_mixture_sum += doc->cis_mixture[cisi];
 	  }
-	bow_verbosify (bow_verbose, "%s ", doc->filename);
 	for (cisi = 0; cisi < cis_size+2; cisi++)
-	  {
-	    doc->cis_mixture[cisi] /= cis_mixture_sum;
-	    bow_verbosify (bow_verbose, "%s=%g,",
-			   (cisi < cis_size
-			    ? bow_int2str (crossbow_classnames, doc->cis[cisi])
-			    : (cisi == cis_size
-			       ? "root"
-			       : "uniform")),
-			   doc->cis_mixture[cisi]);
-	  }
-	bow_verbosify (bow_verbose, "\n");
+	  doc->cis_mixture[cisi] /= cis_mixture_sum;
       }
     }
+}
+
+/* Return the perplexity */
+double
+multiclass_em_one_iteration ()
+{
+  int di;
+  crossbow_doc *doc;
+  int ci, cisi, ni, cmi, l, t;
+  long i, new_words_count;
+  double log_prob_of_data, log_prob_of_data2;
+  int num_data_words = 0;	/* the number of word occurrences */
+  int cis_size;
+  double *mixture_all;
+  multiclass_em_context ec;
+  multiclass_em_acc *acc, *acc0;
+  bow_treenode_compiled *compiled;
+
+  mixture_all = alloca ((crossbow_root->children_count+2) * sizeof(double));
+
+  /* The per-word M-step adds to the NEW_WORDS of a compiled copy of
+     the tree, laid out so that several threads can each have their
+     own. */
+  compiled = bow_treenode_compiled_new (crossbow_root);
+  new_words_count = (long) compiled->words_capacity * compiled->nodes_count;
+  ec.compiled = compiled;
+  ec.root_ni = bow_treenode_compiled_node_index (compiled, crossbow_root);
+  ec.child_ni = alloca (crossbow_root->children_count * sizeof (int));
+  for (ci = 0; ci < crossbow_root->children_count; ci++)
+    ec.child_ni[ci] = 
+      bow_treenode_compiled_node_index (compiled, crossbow_root->children[ci]);
+
+  /* Read the word vectors, and make room for the LOO info, before
+     the threads need them. */
+  for (di = 0; di < crossbow_docs->length; di++)
+    {
+      doc = bow_array_entry_at_index (crossbow_docs, di);
+      if (multiclass_em_uses_doc (doc))
+	crossbow_wv_at_di (di);
+    }
+  for (ni = 0; ni < compiled->nodes_count; ni++)
+    bow_treenode_alloc_new_loo (compiled->nodes[ni], crossbow_docs->length);
+
+  /* Thread 0 starts from the existing NEW_ counts, just as the E-step
+     on a single thread would; the others start from zero. */
+  ec.num_threads = bow_num_threads;
+  ec.accs = bow_malloc (ec.num_threads * sizeof (multiclass_em_acc));
+  for (t = 0; t < ec.num_threads; t++)
+    {
+      acc = &(ec.accs[t]);
+      acc->new_prior = bow_malloc (compiled->nodes_count * sizeof (double));
+      acc->new_m = bow_malloc (cm_length * MAX_NUM_MIXTURES * sizeof (double));
+      acc->log_prob_of_data = 0;
+      acc->log_prob_of_data2 = 0;
+      acc->num_data_words = 0;
+      if (t == 0)
+	{
+	  acc->new_words = compiled->new_words;
+	  for (ni = 0; ni < compiled->nodes_count; ni++)
+	    acc->new_prior[ni] = compiled->nodes[ni]->new_prior;
+	  for (cmi = 0; cmi < cm_length; cmi++)
+	    for (l = 0; l < MAX_NUM_MIXTURES; l++)
+	      acc->new_m[cmi * MAX_NUM_MIXTURES + l] = cm[cmi].new_m[l];
+	  acc->uniform_new_prior = multiclass_uniform_new_prior;
+	}
+      else
+	{
+	  acc->new_words = bow_malloc (new_words_count * sizeof (double));
+	  for (i = 0; i < new_words_count; i++)
+	    acc->new_words[i] = 0;
+	  for (ni = 0; ni < compiled->nodes_count; ni++)
+	    acc->new_prior[ni] = 0;
+	  for (i = 0; i < cm_length * MAX_NUM_MIXTURES; i++)
+	    acc->new_m[i] = 0;
+	  acc->uniform_new_prior = 0;
+	}
+    }
+
+  bow_threads_run (ec.num_threads, multiclass_em_thread, &ec);
+
+  /* Add up the threads' results, always in the same order. */
+  acc0 = &(ec.accs[0]);
+  log_prob_of_data = log_prob_of_data2 = 0;
+  for (t = 0; t < ec.num_threads; t++)
+    {
+      acc = &(ec.accs[t]);
+      log_prob_of_data += acc->log_prob_of_data;
+      log_prob_of_data2 += acc->log_prob_of_data2;
+      num_data_words += acc->num_data_words;
+      if (t == 0)
+	continue;
+      for (i = 0; i < new_words_count; i++)
+	acc0->new_words[i] += acc->new_words[i];
+      for (ni = 0; ni < compiled->nodes_count; ni++)
+	acc0->new_prior[ni] += acc->new_prior[ni];
+      for (i = 0; i < cm_length * MAX_NUM_MIXTURES; i++)
+	acc0->new_m[i] += acc->new_m[i];
+      acc0->uniform_new_prior += acc->uniform_new_prior;
+      bow_free (acc->new_words);
+      bow_free (acc->new_prior);
+      bow_free (acc->new_m);
+    }
+  for (ni = 0; ni < compiled->nodes_count; ni++)
+    compiled->nodes[ni]->new_prior = acc0->new_prior[ni];
+  for (cmi = 0; cmi < cm_length; cmi++)
+    for (l = 0; l < MAX_NUM_MIXTURES; l++)
+      cm[cmi].new_m[l] = acc0->new_m[cmi * MAX_NUM_MIXTURES + l];
+  multiclass_uniform_new_prior = acc0->uniform_new_prior;
+  bow_free (acc0->new_prior);
+  bow_free (acc0->new_m);
+  bow_free (ec.accs);
+  bow_treenode_compiled_store_new_words (compiled);
+  bow_treenode_compiled_free (compiled);
+
+  /* Print the mixtures for each document, in order. */
+  if (bow_verbosity_level >= bow_verbose)
+    {
+      for (di = 0; di < crossbow_docs->length; di++)
+	{
+	  doc = bow_array_entry_at_index (crossbow_docs, di);
+	  if (!multiclass_em_uses_doc (doc))
+	    continue;
+
+	  multiclass_mixture_given_doc (doc, mixture_all);
+	  bow_verbosify (bow_verbose, "%s ", doc->filename);
+	  for (cisi = 0; cisi < crossbow_root->children_count+2; cisi++)
+	    {
+	      bow_verbosify (bow_verbose, "%s=%g,",
+			     (cisi < crossbow_root->children_count
+			      ? bow_int2str (crossbow_classnames, cisi)
+			      : (cisi == crossbow_root->children_count
+				 ? "root"
+				 : "uniform")),
+			     mixture_all[cisi]);
+	    }
+	  bow_verbosify (bow_verbose, "\n");
+
+	  cmixture_for_cis (doc->cis, doc->cis_size, 0, &cis_size);
+	  bow_verbosify (bow_verbose, "%s ", doc->filename);
+	  for (cisi = 0; cisi < cis_size+2; cisi++)
+	    {
+	      bow_verbosify (bow_verbose, "%s=%g,",
+			     (cisi < cis_size
+			      ? bow_int2str (crossbow_classnames, doc->cis[cisi])
+			      : (cisi == cis_size
+				 ? "root"
+				 : "uniform")),
+			     doc->cis_mixture[cisi]);
+	    }
+	  bow_verbosify (bow_verbose, "\n");
+	}
+    }
+
   /* Normalize all per-word M-step results */
   bow_treenode_set_words_from_new_words_all (crossbow_root, 0.0);
   bow_treenode_set_prior_and_extra_from_new_prior_all
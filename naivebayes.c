@@ -36,12 +36,26 @@ static int naivebayes_rescale_scores = 1;
 static int naivebayes_final_rescale_scores = 1;
 static int naivebayes_return_log_pr = 0;
 static int naivebayes_cross_entropy = 0;
+static int naivebayes_compiled = 0;
 
 double bow_naivebayes_anneal_temperature = 1;
 
-/* icky globals for Good-Turing discounting */
-static double **bow_naivebayes_goodturing_discounts = NULL;
-static bow_barrel *bow_naivebayes_goodturing_barrel = NULL;
+/* The Good-Turing discounts of a class barrel, indexed by class, then
+   by the number of times a word occurred in the class. */
+typedef struct _bow_naivebayes_goodturing {
+  int num_classes;
+  double **discounts;
+  /* Discounts this replaced, which a thread scoring with the barrel
+     may still be using, so they are only freed with the barrel. */
+  struct _bow_naivebayes_goodturing *retired;
+} bow_naivebayes_goodturing;
+
+/* A barrel's discounts are kept with it under the address of this;
+   see bow_barrel_set_data().  The lock keeps two threads from setting
+   them at once. */
+static char bow_naivebayes_goodturing_key;
+static pthread_mutex_t bow_naivebayes_goodturing_lock =
+  PTHREAD_MUTEX_INITIALIZER;
 
 /* icky globals for Dirichlet smoothing */
 double *bow_naivebayes_dirichlet_alphas = NULL;
@@ -52,6 +66,7 @@ double bow_naivebayes_dirichlet_total = 0;
 #define NB_M_EST_M_KEY 3001
 #define NB_BINARY_SCORE 3002
 #define NB_NORMALIZE_LOG 3003
+#define NB_COMPILED 3004
 
 static struct argp_option naivebayes_options[] =
 {
@@ -67,6 +82,11 @@ static struct argp_option naivebayes_options[] =
    "When using naivebayes, return -1/log(P(C|d), normalized to sum to one "
    "instead of P(C|d).  This results in values that are not so close to "
    "zero and one."},
+  {"naivebayes-compiled", NB_COMPILED, 0, 0,
+   "When using naivebayes, precompute a table of log P(w|C) when the "
+   "weights are set or the model is first used, and score queries by "
+   "adding up its entries instead of smoothing and taking the log of "
+   "each word's probability in each class again."},
   {0, 0}
 };
 
@@ -86,6 +106,9 @@ naivebayes_parse_opt (int key, char *arg, struct argp_state *state)
       naivebayes_rescale_scores = 1;
       naivebayes_final_rescale_scores = 1;
       break;
+    case NB_COMPILED:
+      naivebayes_compiled = 1;
+      break;
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -111,6 +134,68 @@ static struct argp_child naivebayes_argp_child =
 /* Defined in goodturing.c */
 extern int simple_good_turing (int length, int *freq, double *disc);
 
+static void
+bow_naivebayes_goodturing_free (void *data)
+{
+  bow_naivebayes_goodturing *gt = data, *retired;
+  int k;
+
+  for ( ; gt; gt = retired)
+    {
+      retired = gt->retired;
+      for (k = 0; k < gt->num_classes; k++)
+	bow_free (gt->discounts[k]);
+      bow_free (gt->discounts);
+      bow_free (gt);
+    }
+}
+
+/* Make DISCOUNTS, over NUM_CLASSES classes, the Good-Turing discounts
+   of BARREL.  Any it had are retired, not freed, because a thread
+   scoring with BARREL may still be using them. */
+static void
+bow_naivebayes_goodturing_set (bow_barrel *barrel, double **discounts,
+			       int num_classes)
+{
+  bow_naivebayes_goodturing *gt, *old;
+
+  pthread_mutex_lock (&bow_naivebayes_goodturing_lock);
+  gt = bow_barrel_get_data (barrel, &bow_naivebayes_goodturing_key);
+  if (gt)
+    {
+      old = bow_malloc (sizeof (bow_naivebayes_goodturing));
+      old->num_classes = gt->num_classes;
+      old->discounts = gt->discounts;
+      old->retired = gt->retired;
+      gt->retired = old;
+      gt->num_classes = num_classes;
+      __atomic_store_n (&gt->discounts, discounts, __ATOMIC_RELEASE);
+    }
+  else
+    {
+      gt = bow_malloc (sizeof (bow_naivebayes_goodturing));
+      gt->num_classes = num_classes;
+      gt->discounts = discounts;
+      gt->retired = NULL;
+      bow_barrel_set_data (barrel, &bow_naivebayes_goodturing_key, gt,
+			   bow_naivebayes_goodturing_free);
+    }
+  pthread_mutex_unlock (&bow_naivebayes_goodturing_lock);
+}
+
+/* Return the Good-Turing discounts of BARREL. */
+static double **
+bow_naivebayes_goodturing_discounts (bow_barrel *barrel)
+{
+  bow_naivebayes_goodturing *gt;
+
+  gt = bow_barrel_get_data (barrel, &bow_naivebayes_goodturing_key);
+  if (!gt)
+    bow_error ("No Good-Turing discounts have been calculated "
+	       "for this barrel");
+  return __atomic_load_n (&gt->discounts, __ATOMIC_ACQUIRE);
+}
+
 void
 bow_naivebayes_initialize_goodturing (bow_barrel *barrel)
 {
@@ -125,21 +210,13 @@ bow_naivebayes_initialize_goodturing (bow_barrel *barrel)
   bow_dv *dv;
   int zero_count;
   int total_words = 0;
-  
-  if (NULL != bow_naivebayes_goodturing_discounts)
-    {
-      for (k = 0; k < bow_barrel_num_classes(barrel) ; k++)
-	bow_free (bow_naivebayes_goodturing_discounts[k]);
-      bow_free (bow_naivebayes_goodturing_discounts);
-    }
+  double **discounts;
 
-  bow_naivebayes_goodturing_barrel = barrel;
-  bow_naivebayes_goodturing_discounts = bow_malloc (sizeof (double *) * 
-				     bow_barrel_num_classes(barrel));
+  discounts = bow_malloc (sizeof (double *) * 
+			  bow_barrel_num_classes(barrel));
   for (k = 0; k < bow_barrel_num_classes(barrel) ; k++)
     {
-      bow_naivebayes_goodturing_discounts[k] = 
-	bow_malloc (sizeof (double) * len);
+      discounts[k] = bow_malloc (sizeof (double) * len);
     }
 
   max_wi = MIN (barrel->wi2dvf->size, bow_num_words ());
@@ -152,7 +229,7 @@ bow_naivebayes_initialize_goodturing (bow_barrel *barrel)
 
       for (k = 0; k < len ; k++)
 	{
-	  bow_naivebayes_goodturing_discounts[ci][k] = 0.0;
+	  discounts[ci][k] = 0.0;
 	  counts[k] = 0;
 	}
       
@@ -193,23 +270,27 @@ bow_naivebayes_initialize_goodturing (bow_barrel *barrel)
 
       /* Calculate all the discount factors */
       if (0 != simple_good_turing(len, counts, 
-				  &(bow_naivebayes_goodturing_discounts[ci][0])))
+				  &(discounts[ci][0])))
 	bow_error("Simple Good-Turing calculation error.");
       
       /* Distribute the weight of the zero mass evenly */
-      bow_naivebayes_goodturing_discounts[ci][0] = 
-	bow_naivebayes_goodturing_discounts[ci][0] * total_words / 
+      discounts[ci][0] = 
+	discounts[ci][0] * total_words / 
 	(cdoc->word_count * zero_count);
 
       for (k = 0; k < len; k++)
 	{
 	  bow_verbosify(bow_progress, "(%d %f)", k, 
-			bow_naivebayes_goodturing_discounts[ci][k] );
+			discounts[ci][k] );
 	}
       bow_verbosify(bow_progress, "\n");
 
 
     }
+
+  bow_free (counts);
+  bow_naivebayes_goodturing_set (barrel, discounts,
+				 bow_barrel_num_classes (barrel));
 }
 
 void
@@ -386,16 +467,17 @@ bow_naivebayes_pr_wi_ci (bow_barrel *barrel,
     }
   else if (bow_smoothing_method == bow_smoothing_goodturing)
     {
-      assert(barrel == bow_naivebayes_goodturing_barrel);
+      double **discounts = bow_naivebayes_goodturing_discounts (barrel);
+
       /* don't adjust if above k */
       if (num_wi_ci > bow_smoothing_goodturing_k)
 	pr_w_c = num_wi_ci / num_w_ci;
       /* if zero, just grab the stored weight */
       else if (num_wi_ci == 0)
-	pr_w_c = bow_naivebayes_goodturing_discounts[ci][0];
+	pr_w_c = discounts[ci][0];
       /* else adjust by discount factor */
       else
-	pr_w_c = bow_naivebayes_goodturing_discounts[ci][(int) num_wi_ci] * 
+	pr_w_c = discounts[ci][(int) num_wi_ci] * 
 	  num_wi_ci / num_w_ci;
     }
   else if (bow_smoothing_method == bow_smoothing_dirichlet)
@@ -615,6 +697,252 @@ bow_naivebayes_set_cdoc_word_count_from_wi2dvf_weights (bow_barrel *barrel)
 }
 
 
+/* The compiled model of --naivebayes-compiled.  The log P(w|c) of
+   a word W and class C is WORD_BASE[W] + CLASS_BASE[C] + DELTA, where
+   DELTA is zero for the classes in which W never occurred, as long as
+   the smoothing method gives those all the same probability up to a
+   factor depending only on the class, as all of ours but Dirichlet
+   do.  So each word's row only needs entries for the classes it
+   occurred in.  A row with entries for at least half the classes, or
+   that smoothing doesn't fit this way, is stored densely instead,
+   with an entry for each class in order. */
+typedef struct _bow_naivebayes_compiled {
+  int num_classes;
+  int num_words;
+  float *class_base;		/* indexed by class */
+  float *word_base;		/* indexed by word */
+  int *row_start;		/* word W's entries, or -1 if unknown */
+  int *row_length;		/* NUM_CLASSES for a dense row */
+  int *entry_ci;
+  float *entry_delta;
+} bow_naivebayes_compiled;
+
+/* A barrel's compiled model is kept with it under the address of
+   this; see bow_barrel_set_data().  The lock keeps two threads from
+   compiling the same barrel at once. */
+static char bow_naivebayes_compiled_key;
+static pthread_mutex_t bow_naivebayes_compiled_lock =
+  PTHREAD_MUTEX_INITIALIZER;
+
+static void
+bow_naivebayes_compiled_free (void *data)
+{
+  bow_naivebayes_compiled *nbc = data;
+
+  bow_free (nbc->class_base);
+  bow_free (nbc->word_base);
+  bow_free (nbc->row_start);
+  bow_free (nbc->row_length);
+  bow_free (nbc->entry_ci);
+  bow_free (nbc->entry_delta);
+  bow_free (nbc);
+}
+
+/* Put log P(w|c) of word WI, whose DV is DV, for every class in
+   ROW, and set CLASS_IS_SEEN[CI] if WI occurred in class CI.  Return
+   the number of classes it occurred in. */
+static int
+bow_naivebayes_compiled_get_row (bow_barrel *barrel, int wi, bow_dv *dv,
+				 double *row, char *class_is_seen)
+{
+  int num_classes = bow_barrel_num_classes (barrel);
+  bow_dv *last_dv = NULL;
+  int last_dvi = 0;
+  int ci, dvi, seen = 0;
+
+  for (ci = 0; ci < num_classes; ci++)
+    {
+      row[ci] = log (bow_naivebayes_pr_wi_ci (barrel, wi, ci, -1, 0, 0,
+					      &last_dv, &last_dvi));
+      class_is_seen[ci] = 0;
+    }
+  for (dvi = 0; dvi < dv->length; dvi++)
+    if (dv->entry[dvi].weight > 0)
+      {
+	class_is_seen[dv->entry[dvi].di] = 1;
+	seen++;
+      }
+  return seen;
+}
+
+/* Return the WORD_BASE of the word whose log P(w|c) are in ROW: that
+   which makes its probability in a class it didn't occur in, and
+   whose CLASS_BASE we know, come out right. */
+static double
+bow_naivebayes_compiled_word_base (bow_naivebayes_compiled *nbc,
+				   double *row, char *class_is_seen,
+				   char *class_has_base)
+{
+  int ci;
+
+  for (ci = 0; ci < nbc->num_classes; ci++)
+    if (!class_is_seen[ci] && class_has_base[ci])
+      return row[ci] - nbc->class_base[ci];
+  return 0;
+}
+
+/* Return a new compiled model of the weights of BARREL, which must
+   have been set by bow_naivebayes_set_weights(). */
+static bow_naivebayes_compiled *
+bow_naivebayes_compiled_new (bow_barrel *barrel)
+{
+  bow_naivebayes_compiled *nbc;
+  int num_classes = bow_barrel_num_classes (barrel);
+  double *row = alloca (num_classes * sizeof (double));
+  char *class_is_seen = alloca (num_classes);
+  char *class_has_base = alloca (num_classes);
+  int entries_size, num_entries = 0, num_bases = 0;
+  int wi, ci, seen, dense;
+  double word_base, expected;
+  bow_dv *dv;
+
+  nbc = bow_malloc (sizeof (bow_naivebayes_compiled));
+  nbc->num_classes = num_classes;
+  nbc->num_words = MIN (barrel->wi2dvf->size, bow_num_words ());
+  nbc->class_base = bow_malloc (num_classes * sizeof (float));
+  nbc->word_base = bow_malloc (nbc->num_words * sizeof (float));
+  nbc->row_start = bow_malloc (nbc->num_words * sizeof (int));
+  nbc->row_length = bow_malloc (nbc->num_words * sizeof (int));
+  entries_size = nbc->num_words + num_classes;
+  nbc->entry_ci = bow_malloc (entries_size * sizeof (int));
+  nbc->entry_delta = bow_malloc (entries_size * sizeof (float));
+  for (ci = 0; ci < num_classes; ci++)
+    {
+      nbc->class_base[ci] = 0;
+      class_has_base[ci] = 0;
+    }
+
+  /* Learn the base of each class from the words that never occurred
+     in it, until we know them all. */
+  for (wi = 0; wi < nbc->num_words && num_bases < num_classes; wi++)
+    {
+      if (!(dv = bow_wi2dvf_dv (barrel->wi2dvf, wi)))
+	continue;
+      bow_naivebayes_compiled_get_row (barrel, wi, dv, row, class_is_seen);
+      word_base = bow_naivebayes_compiled_word_base (nbc, row, class_is_seen,
+						     class_has_base);
+      for (ci = 0; ci < num_classes; ci++)
+	if (!class_is_seen[ci] && !class_has_base[ci])
+	  {
+	    nbc->class_base[ci] = row[ci] - word_base;
+	    class_has_base[ci] = 1;
+	    num_bases++;
+	  }
+    }
+
+  for (wi = 0; wi < nbc->num_words; wi++)
+    {
+      nbc->row_start[wi] = -1;
+      nbc->row_length[wi] = 0;
+      nbc->word_base[wi] = 0;
+      if (!(dv = bow_wi2dvf_dv (barrel->wi2dvf, wi)))
+	continue;
+      seen = bow_naivebayes_compiled_get_row (barrel, wi, dv, row,
+					      class_is_seen);
+      word_base = bow_naivebayes_compiled_word_base (nbc, row, class_is_seen,
+						     class_has_base);
+
+      /* Use a dense row if the word occurs in many classes, or if its
+	 probabilities in the others don't fit the bases. */
+      dense = (2 * seen >= num_classes);
+      for (ci = 0; ci < num_classes && !dense; ci++)
+	{
+	  if (class_is_seen[ci])
+	    continue;
+	  expected = word_base + nbc->class_base[ci];
+	  if (fabs (row[ci] - expected) > 1e-6 * fabs (row[ci]) + 1e-9)
+	    dense = 1;
+	}
+
+      /* Store the differences from the bases. */
+      while (num_entries + num_classes > entries_size)
+	{
+	  entries_size *= 2;
+	  nbc->entry_ci = bow_realloc (nbc->entry_ci,
+				       entries_size * sizeof (int));
+	  nbc->entry_delta = bow_realloc (nbc->entry_delta,
+					  entries_size * sizeof (float));
+	}
+      nbc->word_base[wi] = word_base;
+      nbc->row_start[wi] = num_entries;
+      for (ci = 0; ci < num_classes; ci++)
+	{
+	  if (!dense && !class_is_seen[ci])
+	    continue;
+	  nbc->entry_ci[num_entries] = ci;
+	  nbc->entry_delta[num_entries] =
+	    row[ci] - word_base - nbc->class_base[ci];
+	  num_entries++;
+	}
+      nbc->row_length[wi] = num_entries - nbc->row_start[wi];
+    }
+  bow_verbosify (bow_progress,
+		 "Compiled naivebayes model: %d words, %d classes, "
+		 "%d entries\n", nbc->num_words, num_classes, num_entries);
+  return nbc;
+}
+
+/* Return the compiled model of BARREL, compiling it if necessary. */
+static bow_naivebayes_compiled *
+bow_naivebayes_compiled_for_barrel (bow_barrel *barrel)
+{
+  bow_naivebayes_compiled *nbc;
+
+  nbc = bow_barrel_get_data (barrel, &bow_naivebayes_compiled_key);
+  if (nbc)
+    return nbc;
+  pthread_mutex_lock (&bow_naivebayes_compiled_lock);
+  nbc = bow_barrel_get_data (barrel, &bow_naivebayes_compiled_key);
+  if (!nbc)
+    {
+      nbc = bow_naivebayes_compiled_new (barrel);
+      bow_barrel_set_data (barrel, &bow_naivebayes_compiled_key, nbc,
+			   bow_naivebayes_compiled_free);
+    }
+  pthread_mutex_unlock (&bow_naivebayes_compiled_lock);
+  return nbc;
+}
+
+/* Add to SCORES the log-probability of QUERY_WV, whose weights are
+   already set, in each class, using the compiled model NBC. */
+static void
+bow_naivebayes_compiled_add_log_pr (bow_naivebayes_compiled *nbc,
+				    bow_wv *query_wv, double *scores)
+{
+  double total_weight = 0, total_word_base = 0, weight;
+  int wvi, wi, ci, e, start, length;
+  const int *entry_ci;
+  const float *entry_delta;
+
+  for (wvi = 0; wvi < query_wv->num_entries; wvi++)
+    {
+      wi = query_wv->entry[wvi].wi;
+      if (wi >= nbc->num_words || nbc->row_start[wi] < 0)
+	continue;
+      weight = query_wv->entry[wvi].weight;
+      total_weight += weight;
+      total_word_base += weight * nbc->word_base[wi];
+      start = nbc->row_start[wi];
+      length = nbc->row_length[wi];
+      entry_delta = nbc->entry_delta + start;
+      if (length == nbc->num_classes)
+	{
+	  /* A dense row. */
+	  for (ci = 0; ci < length; ci++)
+	    scores[ci] += weight * entry_delta[ci];
+	}
+      else
+	{
+	  entry_ci = nbc->entry_ci + start;
+	  for (e = 0; e < length; e++)
+	    scores[entry_ci[e]] += weight * entry_delta[e];
+	}
+    }
+  for (ci = 0; ci < nbc->num_classes; ci++)
+    scores[ci] += total_weight * nbc->class_base[ci] + total_word_base;
+}
+
+
 /* Function to assign `Naive Bayes'-style weights to each element of
    each document vector. */
 void
@@ -757,6 +1085,16 @@ bow_naivebayes_set_weights (bow_barrel *barrel)
   fprintf (stderr, "wi2dvf num_words %d, weight-setting num_words %d\n",
 	   barrel->wi2dvf->num_words, weight_setting_num_words);
 #endif
+
+  if (naivebayes_compiled && bow_event_model != bow_event_document)
+    {
+      /* The weights have changed; compile them afresh. */
+      pthread_mutex_lock (&bow_naivebayes_compiled_lock);
+      bow_barrel_set_data (barrel, &bow_naivebayes_compiled_key,
+			   bow_naivebayes_compiled_new (barrel),
+			   bow_naivebayes_compiled_free);
+      pthread_mutex_unlock (&bow_naivebayes_compiled_lock);
+    }
 }
 
 #define IMPOSSIBLE_SCORE_FOR_ZERO_CLASS_PRIOR 999.99
@@ -849,114 +1187,130 @@ bow_naivebayes_score (bow_barrel *barrel, bow_wv *query_wv,
      document event model, then loop over all words in the vocabulary,
      otherwise, just loop over all the words in the QUERY_WV
      document. */
-  h_w_d = 0;
-  for (wvi = 0, wi = 0;
-       ((bow_event_model == bow_event_document)
-	? (wi < max_wi)
-	: (wvi < query_wv->num_entries));
-       ((bow_event_model == bow_event_document)
-	? (wi++)
-	: (wvi++)))
+  if (naivebayes_compiled && loo_class < 0
+      && bow_event_model != bow_event_document && !bow_print_word_scores)
     {
-      bow_dv *dv;		/* the "document vector" for the word WI */
-
-      /* Get information about this word. */
-      
-      /* Align WI and WVI in ways that depend on whether we are looping
-	 over all words in the vocabulary or over words in the query. */
-      if (bow_event_model == bow_event_document)
+      /* Add up the entries of the compiled model instead. */
+      bow_naivebayes_compiled_add_log_pr
+	(bow_naivebayes_compiled_for_barrel (barrel), query_wv, scores);
+      for (ci = 0; ci < barrel->cdocs->length; ci++)
 	{
-	  if (query_wv->entry[wvi].wi < wi
-	      && wvi < query_wv->num_entries)
-	    {
-	      assert (query_wv->entry[wvi].wi == wi-1);
-	      wvi++;
-	    }
+	  bow_cdoc *cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
+	  if (cdoc->prior == 0)
+	    scores[ci] = IMPOSSIBLE_SCORE_FOR_ZERO_CLASS_PRIOR;
 	}
-      else
+    }
+  else
+    {
+      h_w_d = 0;
+      for (wvi = 0, wi = 0;
+	   ((bow_event_model == bow_event_document)
+	    ? (wi < max_wi)
+	    : (wvi < query_wv->num_entries));
+	   ((bow_event_model == bow_event_document)
+	    ? (wi++)
+	    : (wvi++)))
 	{
-	  wi = query_wv->entry[wvi].wi;
-	}
-      dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
+	  bow_dv *dv;		/* the "document vector" for the word WI */
 
-      /* If the model doesn't know about this word, skip it. */
-      if (!dv)
-	continue;
+	  /* Get information about this word. */
+      
+	  /* Align WI and WVI in ways that depend on whether we are looping
+	     over all words in the vocabulary or over words in the query. */
+	  if (bow_event_model == bow_event_document)
+	    {
+	      if (query_wv->entry[wvi].wi < wi
+		  && wvi < query_wv->num_entries)
+		{
+		  assert (query_wv->entry[wvi].wi == wi-1);
+		  wvi++;
+		}
+	    }
+	  else
+	    {
+	      wi = query_wv->entry[wvi].wi;
+	    }
+	  dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
 
-      if (wi == query_wv->entry[wvi].wi && query_wv->num_entries)
-	{
-	  pr_w_d = ((double)query_wv->entry[wvi].count) / num_words_in_query;
-	  h_w_d -= pr_w_d * log (pr_w_d);
-	}
+	  /* If the model doesn't know about this word, skip it. */
+	  if (!dv)
+	    continue;
 
-      if (bow_print_word_scores)
-	printf ("%-30s (queryweight=%.8f)\n",
-		bow_int2word (wi), 
-		query_wv->entry[wvi].weight * query_wv->normalizer);
+	  if (wi == query_wv->entry[wvi].wi && query_wv->num_entries)
+	    {
+	      pr_w_d = ((double)query_wv->entry[wvi].count) / num_words_in_query;
+	      h_w_d -= pr_w_d * log (pr_w_d);
+	    }
 
-      rescaler = DBL_MAX;
+	  if (bow_print_word_scores)
+	    printf ("%-30s (queryweight=%.8f)\n",
+		    bow_int2word (wi), 
+		    query_wv->entry[wvi].weight * query_wv->normalizer);
 
-      /* Loop over all classes, putting this word's (WI's)
-	 contribution into SCORES. */
-      for (ci = 0, dvi = 0; ci < barrel->cdocs->length; ci++)
-	{
-	  if (scores[ci] == IMPOSSIBLE_SCORE_FOR_ZERO_CLASS_PRIOR)
-	    continue;
-	  pr_w_c = bow_naivebayes_pr_wi_ci (barrel, wi, ci, 
-					    loo_class, 
-					    query_wv->entry[wvi].weight, 
-					    query_wv_total_weight,
-					    &dv, &dvi);
-	  /* If this is a word that does not occur in the document,
-	     then use the probability it does not occur in the class.
-	     This occurs only if we are using the document event model. */
-	  if (query_wv->num_entries == 0 || wi != query_wv->entry[wvi].wi)
-	    pr_w_c = 1.0 - pr_w_c;
-	  assert (pr_w_c > 0 && pr_w_c <= 1);
-
-	  /* Put the probability in log-space */
-	  log_pr_tf = log (pr_w_c);
-	  assert (log_pr_tf > -FLT_MAX + 1.0e5);
-
-	  /* Take into consideration the number of times it occurs in 
-	     the query document */
-	  if (bow_event_model != bow_event_document)
-	    log_pr_tf *= query_wv->entry[wvi].weight;
-	  assert (log_pr_tf > -FLT_MAX + 1.0e5);
-
-	  scores[ci] += log_pr_tf;
+	  rescaler = DBL_MAX;
 
-	  if (bow_print_word_scores)
+	  /* Loop over all classes, putting this word's (WI's)
+	     contribution into SCORES. */
+	  for (ci = 0, dvi = 0; ci < barrel->cdocs->length; ci++)
 	    {
-	      bow_cdoc *cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
-	      printf (" %8.2e %7.2f %-40s  %10.9f\n", 
-		      pr_w_c,
-		      log_pr_tf, 
-		      (strrchr (cdoc->filename, '/') ? : cdoc->filename),
-		      scores[ci]);
-	    }
+	      if (scores[ci] == IMPOSSIBLE_SCORE_FOR_ZERO_CLASS_PRIOR)
+		continue;
+	      pr_w_c = bow_naivebayes_pr_wi_ci (barrel, wi, ci, 
+						loo_class, 
+						query_wv->entry[wvi].weight, 
+						query_wv_total_weight,
+						&dv, &dvi);
+	      /* If this is a word that does not occur in the document,
+		 then use the probability it does not occur in the class.
+		 This occurs only if we are using the document event model. */
+	      if (query_wv->num_entries == 0 || wi != query_wv->entry[wvi].wi)
+		pr_w_c = 1.0 - pr_w_c;
+	      assert (pr_w_c > 0 && pr_w_c <= 1);
+
+	      /* Put the probability in log-space */
+	      log_pr_tf = log (pr_w_c);
+	      assert (log_pr_tf > -FLT_MAX + 1.0e5);
+
+	      /* Take into consideration the number of times it occurs in 
+		 the query document */
+	      if (bow_event_model != bow_event_document)
+		log_pr_tf *= query_wv->entry[wvi].weight;
+	      assert (log_pr_tf > -FLT_MAX + 1.0e5);
+
+	      scores[ci] += log_pr_tf;
+
+	      if (bow_print_word_scores)
+		{
+		  bow_cdoc *cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
+		  printf (" %8.2e %7.2f %-40s  %10.9f\n", 
+			  pr_w_c,
+			  log_pr_tf, 
+			  (strrchr (cdoc->filename, '/') ? : cdoc->filename),
+			  scores[ci]);
+		}
 
-	  /* Keep track of the minimum score updated for this word. */
-	  if (rescaler > scores[ci])
-	    rescaler = scores[ci];
-	}
+	      /* Keep track of the minimum score updated for this word. */
+	      if (rescaler > scores[ci])
+		rescaler = scores[ci];
+	    }
 
-      /* Loop over all classes, re-scaling SCORES so that they
-	 don't get so small we loose floating point resolution.
-	 This scaling always keeps all SCORES positive. */
-      if (naivebayes_rescale_scores && rescaler < 0 &&
-	  !naivebayes_score_returns_doc_pr)
-	{
-	  for (ci = 0; ci < barrel->cdocs->length; ci++)
+	  /* Loop over all classes, re-scaling SCORES so that they
+	     don't get so small we loose floating point resolution.
+	     This scaling always keeps all SCORES positive. */
+	  if (naivebayes_rescale_scores && rescaler < 0 &&
+	      !naivebayes_score_returns_doc_pr)
 	    {
-	      /* Add to SCORES to bring them close to zero.  RESCALER is
-		 expected to often be less than zero here. */
-	      /* xxx If this doesn't work, we could keep track of the min
-		 and the max, and sum by their average. */
-	      if (scores[ci] != IMPOSSIBLE_SCORE_FOR_ZERO_CLASS_PRIOR)
-		scores[ci] += -rescaler;
-	      assert (scores[ci] > -DBL_MAX + 1.0e5
-		      && scores[ci] < DBL_MAX - 1.0e5);
+	      for (ci = 0; ci < barrel->cdocs->length; ci++)
+		{
+		  /* Add to SCORES to bring them close to zero.  RESCALER is
+		     expected to often be less than zero here. */
+		  /* xxx If this doesn't work, we could keep track of the min
+		     and the max, and sum by their average. */
+		  if (scores[ci] != IMPOSSIBLE_SCORE_FOR_ZERO_CLASS_PRIOR)
+		    scores[ci] += -rescaler;
+		  assert (scores[ci] > -DBL_MAX + 1.0e5
+			  && scores[ci] < DBL_MAX - 1.0e5);
+		}
 	    }
 	}
     }
@@ -1141,7 +1495,8 @@ rainbow_method bow_method_naivebayes =
   bow_wv_set_weights_to_count,
   NULL,				/* no need for extra weight normalization */
   bow_barrel_free,
-  &bow_naivebayes_params
+  &bow_naivebayes_params,
+  1				/* scoring is thread-safe */
 };
 
 void _register_method_naivebayes () __attribute__ ((constructor));
@@ -142,6 +142,82 @@ static bow_wv *empty_wv = NULL;
    provides the next word vector in *WV, returning the `document index' DI of 
    the document contained in *WV.  This function returns -1 when there
    are no more documents left. */
+/* Like bow_heap_next_wv(), but reading the words of the next document
+   straight out of the forward index HEAP->DI2WV, so that the cost is
+   proportional to the length of that document rather than to the log
+   of the number of words in the heap. */
+static int
+_bow_heap_next_wv_forward (bow_dv_heap *heap, bow_barrel *barrel,
+			   bow_wv **wv, int (*use_if_true)(bow_cdoc*))
+{
+  bow_di2wv *di2wv = heap->di2wv;
+  bow_cdoc *doc_cdoc;
+  bow_dv *dv;
+  size_t ei, end;
+  int new_di, wi, dvi, wvi;
+
+  /* This special -2 value set in heap.c */
+  new_di = (heap->last_di == -2) ? -1 : heap->last_di;
+  do 
+    {
+      new_di++;
+      if (new_di >= barrel->cdocs->length)
+	{
+	  /* No more satisfying documents left */
+	  if (heap->heap_wv)
+	    bow_wv_free (heap->heap_wv);
+	  *wv = NULL;
+	  bow_free (heap);
+	  return -1;
+	}
+      doc_cdoc = bow_array_entry_at_index (barrel->cdocs, new_di);
+    }
+  while (!(*use_if_true) (doc_cdoc));
+  heap->last_di = new_di;
+
+  if (new_di >= di2wv->length)
+    {
+      *wv = empty_wv;
+      return new_di;
+    }
+  ei = di2wv->start[new_di];
+  end = di2wv->start[new_di+1];
+  if (heap->heap_wv_size < end - ei)
+    {
+      if (heap->heap_wv)
+	bow_wv_free (heap->heap_wv);
+      heap->heap_wv_size = end - ei;
+      heap->heap_wv = bow_wv_new (heap->heap_wv_size);
+    }
+
+  /* The entries are sorted by word index, as in the heap merge. */
+  wvi = 0;
+  for ( ; ei < end; ei++)
+    {
+      wi = di2wv->entry[ei].wi;
+      if (wi >= heap->max_wi)
+	break;
+      dv = bow_wi2dvf_dv_hidden (heap->wi2dvf, wi, heap->even_if_hidden);
+      if (!dv)
+	continue;
+      dvi = di2wv->entry[ei].dvi;
+      assert (dvi < dv->length && dv->entry[dvi].di == new_di);
+      heap->heap_wv->entry[wvi].wi = wi;
+      heap->heap_wv->entry[wvi].count = dv->entry[dvi].count;
+      heap->heap_wv->entry[wvi].weight = dv->entry[dvi].weight;
+      wvi++;
+    }
+  if (wvi == 0)
+    {
+      *wv = empty_wv;
+      return new_di;
+    }
+  heap->heap_wv->num_entries = wvi;
+  heap->heap_wv->normalizer = 1;
+  *wv = heap->heap_wv;
+  return new_di;
+}
+
 int
 bow_heap_next_wv (bow_dv_heap *heap, bow_barrel *barrel, bow_wv **wv,
 		  int (*use_if_true)(bow_cdoc*))
@@ -156,6 +232,9 @@ bow_heap_next_wv (bow_dv_heap *heap, bow_barrel *barrel, bow_wv **wv,
       empty_wv->num_entries = 0;
     }
 
+  if (heap->di2wv)
+    return _bow_heap_next_wv_forward (heap, barrel, wv, use_if_true);
+
   /* This special -2 value set in heap.c */
   if (heap->last_di == -2)
     {
@@ -128,6 +128,13 @@ enum {
   XXX_WORDS_ONLY_KEY,
   MAX_NUM_WORDS_PER_DOCUMENT_KEY,
   USE_UNKNOWN_WORD_KEY,
+  BARREL_ENCODING_KEY,
+  BARREL_QUANTIZE_WEIGHTS_KEY,
+  THREADS_KEY,
+  SCORING_KERNELS_KEY,
+  INDEX_MEMORY_KEY,
+  INDEX_TMPDIR_KEY,
+  NO_SCORE_PRUNING_KEY,
 };
 
 static struct argp_option bow_options[] =
@@ -148,6 +155,35 @@ static struct argp_option bow_options[] =
    "The non-negative integer to use for seeding the random number generator"},
   {"annotations", ANNOTATION_KEY, "FILE", 0,
    "The sarray file containing annotations for the files in the index"},
+  {"barrel-encoding", BARREL_ENCODING_KEY, "ENC", 0,
+   "How to lay out the document vectors of barrels written to disk.  "
+   "ENC is one of `stream' (the default, machine-independent), `mmap' "
+   "(host byte order; the file is memory-mapped when read back in, "
+   "which makes loading nearly free, e.g. for --query-server), or "
+   "`compressed' (delta-coded document indices and small counts; "
+   "several times smaller)."},
+  {"barrel-quantize-weights", BARREL_QUANTIZE_WEIGHTS_KEY, 0, 0,
+   "With --barrel-encoding=compressed, store document vector weights "
+   "that aren't equal to their counts in 16 bits instead of 32."},
+  {"threads", THREADS_KEY, "N", 0,
+   "Use N threads for the parts of the work that can run in parallel, "
+   "such as indexing.  0 means one per processor.  The default is 1."},
+  {"scoring-kernels", SCORING_KERNELS_KEY, "IMPL", 0,
+   "Use the IMPL version of the inner loops of scoring, one of `avx512', "
+   "`avx2' or `scalar'.  The default is the fastest one this processor "
+   "can run.  All give the same results."},
+  {"no-score-pruning", NO_SCORE_PRUNING_KEY, 0, 0,
+   "When finding the best few of many documents (kNN, or TFIDF with a "
+   "short query, as in arrow), score every document instead of skipping "
+   "those that can't make it.  The results are the same, but slower."},
+  {"index-memory", INDEX_MEMORY_KEY, "MB", 0,
+   "While indexing, keep at most about MB megabytes of document vector "
+   "entries in memory, writing the rest to temporary files and merging "
+   "them at the end.  The vocabulary is still kept in memory, and "
+   "indexing uses only one thread.  The default is no limit."},
+  {"index-tmpdir", INDEX_TMPDIR_KEY, "DIR", 0,
+   "Write the temporary files of --index-memory in DIR.  The default "
+   "is $TMPDIR, or /tmp."},
 
 #if HAVE_HDB
   {"hdb", HDB_KEY, 0, 0,
@@ -302,6 +338,38 @@ parse_bow_opt (int opt, char *arg, struct argp_state *state)
 	  return ARGP_ERR_UNKNOWN;
 	}
       break;
+    case BARREL_ENCODING_KEY:
+      if (!strcmp (arg, "stream"))
+	bow_wi2dvf_write_encoding = bow_dv_encoding_stream;
+      else if (!strcmp (arg, "mmap") || !strcmp (arg, "native"))
+	bow_wi2dvf_write_encoding = bow_dv_encoding_native;
+      else if (!strcmp (arg, "compressed"))
+	bow_wi2dvf_write_encoding = bow_dv_encoding_compressed;
+      else
+	bow_error ("--barrel-encoding: No such encoding `%s'", arg);
+      break;
+    case BARREL_QUANTIZE_WEIGHTS_KEY:
+      bow_dv_quantize_weights = 1;
+      break;
+    case THREADS_KEY:
+      bow_num_threads = atoi (arg);
+      if (bow_num_threads <= 0)
+	bow_num_threads = bow_threads_num_processors ();
+      break;
+    case INDEX_MEMORY_KEY:
+      bow_index_memory_budget = (size_t) (atof (arg) * 1024 * 1024);
+      break;
+    case INDEX_TMPDIR_KEY:
+      bow_index_tmpdir = arg;
+      break;
+    case SCORING_KERNELS_KEY:
+      if (bow_kernels_select (arg) != 0)
+	bow_error ("--scoring-kernels: `%s' is unknown or not supported "
+		   "by this processor", arg);
+      break;
+    case NO_SCORE_PRUNING_KEY:
+      bow_score_pruning = 0;
+      break;
 #if HAVE_HDB
     case HDB_KEY:
       bow_hdb = 1;
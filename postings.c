@@ -0,0 +1,671 @@
+/* Building the "document vectors" of a wi2dvf while indexing.
+   Copyright (C) 2026 agent
+
+   Written by:  agent <agent@local>
+
+   This file is part of the Bag-Of-Words Library, `libbow'.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License
+   as published by the Free Software Foundation, version 2.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA */
+
+/* Most words occur in only a few documents, and a few words occur in
+   nearly all of them.  Growing a DV for each word with bow_realloc()
+   means many small reallocs, and leaves up to a third of each DV
+   unused.  Here the first block of a word holds only a few entries,
+   each later block twice as many as the one before, up to a limit,
+   and all the blocks come out of slabs of BOW_POSTINGS_SLAB_SIZE
+   bytes allocated with bow_malloc(), so the bow_malloc hooks see each
+   slab.  bow_postings_freeze() goes through the slabs in the order
+   they were allocated, copying each block onto the end of its word's
+   DV, and frees each slab as soon as it is done with it; so the DV's
+   and the slabs don't both have to be in memory in full.
+
+   For corpora whose DV's don't fit in core, give the builder a memory
+   budget.  Whenever the slabs grow past it, between two documents,
+   each word's entries are written, in word index order, to a "run"
+   file, and the slabs are freed.  bow_postings_freeze() then merges
+   the runs (in groups of at most BOW_POSTINGS_MAX_MERGE, if there are
+   many) into a wi2dvf data file in the native DV encoding, which is
+   memory-mapped back in.  A run is a sequence of records, each the
+   word index, the number of entries and the entries, in host layout,
+   ended by a word index of -1. */
+
+#include <bow/libbow.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>		/* for mkstemp() */
+#include <unistd.h>		/* for unlink() */
+
+/* The default memory budget of new builders; zero means none. */
+size_t bow_index_memory_budget = 0;
+
+/* Where to put run files, or NULL for $TMPDIR or /tmp. */
+const char *bow_index_tmpdir = NULL;
+
+/* The number of entries in the first block of a word, and the most
+   in any block. */
+#define BOW_POSTINGS_FIRST_BLOCK_SIZE 2
+#define BOW_POSTINGS_MAX_BLOCK_SIZE 256
+
+/* The number of bytes taken by a block of SIZE entries, rounded up so
+   that the next block is aligned for a pointer. */
+#define BOW_POSTINGS_BLOCK_BYTES(SIZE)					\
+  ((sizeof (bow_postings_block) + sizeof (bow_de) * (SIZE)		\
+    + sizeof (void*) - 1) & ~(sizeof (void*) - 1))
+
+/* The most runs merged at once, and the stdio buffer size of each. */
+#define BOW_POSTINGS_MAX_MERGE 64
+#define BOW_POSTINGS_RUN_BUFFER_SIZE (64 * 1024)
+
+/* Each slab begins with this. */
+typedef struct _bow_postings_slab {
+  char *prev;			/* the slab allocated before this one */
+  int used;			/* the number of bytes used, once full */
+} bow_postings_slab;
+#define BOW_POSTINGS_SLAB_HEADER sizeof (bow_postings_slab)
+
+/* Create a new, empty builder, with room for CAPACITY words. */
+bow_postings *
+bow_postings_new (int capacity)
+{
+  bow_postings *ret;
+
+  if (capacity == 0)
+    capacity = bow_wi2dvf_default_capacity;
+  ret = bow_malloc (sizeof (bow_postings));
+  ret->size = capacity;
+  ret->list = bow_malloc (sizeof (bow_postings_list) * capacity);
+  memset (ret->list, 0, sizeof (bow_postings_list) * capacity);
+  ret->slab = NULL;
+  ret->slab_used = BOW_POSTINGS_SLAB_SIZE;
+  ret->num_slabs = 0;
+  ret->num_blocks = 0;
+  ret->num_entries = 0;
+  ret->memory_budget = bow_index_memory_budget;
+  ret->last_di = -1;
+  ret->runs = NULL;
+  ret->num_runs = 0;
+  ret->runs_size = 0;
+  return ret;
+}
+
+/* Return a new block for word index WI with room for SIZE entries,
+   carved from the current slab of POSTINGS, or from a new slab if it
+   is full. */
+static bow_postings_block *
+_bow_postings_block_new (bow_postings *postings, int wi, int size)
+{
+  bow_postings_block *block;
+  int bytes = BOW_POSTINGS_BLOCK_BYTES (size);
+  char *slab;
+
+  assert (BOW_POSTINGS_SLAB_HEADER + bytes <= BOW_POSTINGS_SLAB_SIZE);
+  if (postings->slab_used + bytes > BOW_POSTINGS_SLAB_SIZE)
+    {
+      if (postings->slab)
+	((bow_postings_slab*)postings->slab)->used = postings->slab_used;
+      slab = bow_malloc (BOW_POSTINGS_SLAB_SIZE);
+      ((bow_postings_slab*)slab)->prev = postings->slab;
+      postings->slab = slab;
+      postings->slab_used = BOW_POSTINGS_SLAB_HEADER;
+      postings->num_slabs++;
+    }
+  block = (bow_postings_block*) (postings->slab + postings->slab_used);
+  postings->slab_used += bytes;
+  postings->num_blocks++;
+  block->next = NULL;
+  block->wi = wi;
+  block->size = size;
+  return block;
+}
+
+static void _bow_postings_spill (bow_postings *postings);
+
+/* Increase by COUNT and WEIGHT the entry for word index WI and
+   document index DI.  The document indices added for each word must
+   not decrease. */
+void
+bow_postings_add_wi_di_count_weight (bow_postings *postings, int wi,
+				     int di, int count, float weight)
+{
+  bow_postings_list *list;
+  bow_de *de;
+
+  if (di > postings->last_di)
+    {
+      /* This is the first entry of a new document; if we are over
+	 budget, this is a good time to write a run. */
+      if (postings->memory_budget
+	  && ((size_t) postings->num_slabs * BOW_POSTINGS_SLAB_SIZE
+	      >= postings->memory_budget))
+	_bow_postings_spill (postings);
+      postings->last_di = di;
+    }
+
+  if (wi >= postings->size)
+    {
+      /* There are so many unique words, we need to grow the array
+	 of lists. */
+      int old_size = postings->size;
+      postings->size = MAX (wi+1, postings->size * 2);
+      postings->list = bow_realloc (postings->list,
+				    (sizeof (bow_postings_list)
+				     * postings->size));
+      memset (postings->list + old_size, 0,
+	      sizeof (bow_postings_list) * (postings->size - old_size));
+    }
+
+  list = &(postings->list[wi]);
+  if (list->tail
+      && list->tail->entry[list->tail_length-1].di == di)
+    {
+      /* The entry for DI is already there; it's at the end. */
+      de = &(list->tail->entry[list->tail_length-1]);
+    }
+  else
+    {
+      if (list->tail && list->tail->entry[list->tail_length-1].di > di)
+	bow_error ("Document index %d added after %d for word index %d",
+		   di, list->tail->entry[list->tail_length-1].di, wi);
+      if (!list->tail)
+	{
+	  list->head = list->tail = _bow_postings_block_new
+	    (postings, wi, BOW_POSTINGS_FIRST_BLOCK_SIZE);
+	  list->tail_length = 0;
+	}
+      else if (list->tail_length == list->tail->size)
+	{
+	  list->tail->next = _bow_postings_block_new
+	    (postings, wi, MIN (list->tail->size * 2,
+				BOW_POSTINGS_MAX_BLOCK_SIZE));
+	  list->tail = list->tail->next;
+	  list->tail_length = 0;
+	}
+      de = &(list->tail->entry[list->tail_length++]);
+      de->di = di;
+      de->count = 0;
+      de->weight = 0.0f;
+      list->length++;
+      postings->num_entries++;
+    }
+
+  de->count += count;
+  /* If we are recording only binary word absence/presence, force the
+     word count to 0 or 1. */
+  if (bow_binary_word_counts && de->count > 1)
+    de->count = 1;
+  de->weight += weight;
+}
+
+/* Read all the words from file pointer FP, and add them to POSTINGS,
+   associated with document index DI.  Return the number of words. */
+int
+bow_postings_add_di_text_fp (bow_postings *postings, int di, FILE *fp,
+			     const char *filename)
+{
+  char word[BOW_MAX_WORD_LENGTH]; /* buffer for reading and stemming words */
+  int wi;			/* a word index */
+  bow_lex *lex;
+  int num_words = 0;
+
+  /* Loop once for each document in this file. */
+  while ((lex = bow_default_lexer->open_text_fp (bow_default_lexer, fp,
+						 filename)))
+    {
+      /* Loop once for each lexical token in this document. */
+      while (bow_default_lexer->get_word (bow_default_lexer,
+					  lex, word, BOW_MAX_WORD_LENGTH))
+	{
+	  /* Find out the word's "index". */
+	  wi = bow_word2int_add_occurrence (word);
+	  if (wi < 0)
+	    continue;
+	  /* Increment our stats about this word/document pair. */
+	  bow_postings_add_wi_di_count_weight (postings, wi, di, 1, 1);
+	  /* Increment our count of the number of words in this document. */
+	  num_words++;
+	}
+      bow_default_lexer->close (bow_default_lexer, lex);
+    }
+  return num_words;
+}
+
+/* Return the largest document index added for word index WI, or -1 if
+   there are none. */
+int
+bow_postings_last_di (bow_postings *postings, int wi)
+{
+  bow_postings_list *list;
+
+  if (wi >= postings->size)
+    return -1;
+  list = &(postings->list[wi]);
+  if (!list->tail)
+    return -1;
+  return list->tail->entry[list->tail_length-1].di;
+}
+
+/* Free all the slabs of POSTINGS, and forget all its entries. */
+static void
+_bow_postings_empty (bow_postings *postings)
+{
+  char *slab;
+
+  while ((slab = postings->slab))
+    {
+      postings->slab = ((bow_postings_slab*)slab)->prev;
+      bow_free (slab);
+    }
+#ifdef __GLIBC__
+  /* The slabs are likely in the middle of the heap, where free()
+     won't give their pages back to the system by itself. */
+  malloc_trim (0);
+#endif
+  postings->slab_used = BOW_POSTINGS_SLAB_SIZE;
+  memset (postings->list, 0, sizeof (bow_postings_list) * postings->size);
+  postings->num_slabs = 0;
+  postings->num_blocks = 0;
+  postings->num_entries = 0;
+}
+
+/* Return a new, empty temporary file in bow_index_tmpdir, open for
+   writing and reading.  It is unlinked right away, so it goes away
+   when it is closed. */
+static FILE *
+_bow_postings_tmpfile ()
+{
+  const char *dir = bow_index_tmpdir;
+  char filename[BOW_MAX_WORD_LENGTH];
+  FILE *fp;
+  int fd;
+
+  if (!dir && !(dir = getenv ("TMPDIR")))
+    dir = "/tmp";
+  sprintf (filename, "%s/bowrunXXXXXX", dir);
+  if ((fd = mkstemp (filename)) < 0 || !(fp = fdopen (fd, "w+b")))
+    bow_error ("Couldn't create a temporary file in `%s'", dir);
+  unlink (filename);
+  setvbuf (fp, NULL, _IOFBF, BOW_POSTINGS_RUN_BUFFER_SIZE);
+  return fp;
+}
+
+/* Write all the entries of POSTINGS to a new run file, and empty it. */
+static void
+_bow_postings_spill (bow_postings *postings)
+{
+  bow_postings_list *list;
+  bow_postings_block *block;
+  FILE *fp;
+  int wi, header[2];
+
+  if (postings->num_entries == 0)
+    return;
+  bow_verbosify (bow_verbose, "\nWriting run %d of %lu entries\n",
+		 postings->num_runs, (unsigned long) postings->num_entries);
+  fp = _bow_postings_tmpfile ();
+  for (wi = 0; wi < postings->size; wi++)
+    {
+      list = &(postings->list[wi]);
+      if (list->length == 0)
+	continue;
+      header[0] = wi;
+      header[1] = list->length;
+      if (fwrite (header, sizeof (int), 2, fp) != 2)
+	bow_error ("Couldn't write run file");
+      for (block = list->head; block; block = block->next)
+	{
+	  int length = block->next ? block->size : list->tail_length;
+	  if (fwrite (block->entry, sizeof (bow_de), length, fp) != length)
+	    bow_error ("Couldn't write run file");
+	}
+    }
+  header[0] = -1;
+  if (fwrite (header, sizeof (int), 1, fp) != 1 || fflush (fp) != 0)
+    bow_error ("Couldn't write run file");
+  rewind (fp);
+
+  if (postings->num_runs == postings->runs_size)
+    {
+      postings->runs_size = MAX (16, postings->runs_size * 2);
+      postings->runs = bow_realloc (postings->runs,
+				    postings->runs_size * sizeof (FILE*));
+    }
+  postings->runs[postings->num_runs++] = fp;
+  _bow_postings_empty (postings);
+}
+
+/* Where a merge is in one run. */
+typedef struct _bow_postings_cursor {
+  FILE *fp;
+  int ri;			/* the run's place in the merge */
+  int wi;			/* the word of the next record, or -1 */
+  int length;			/* the number of entries in that record */
+} bow_postings_cursor;
+
+/* Read the header of the next record of the run of CURSOR. */
+static void
+_bow_postings_cursor_next (bow_postings_cursor *cursor)
+{
+  if (fread (&(cursor->wi), sizeof (int), 1, cursor->fp) != 1
+      || (cursor->wi >= 0
+	  && fread (&(cursor->length), sizeof (int), 1, cursor->fp) != 1))
+    bow_error ("Couldn't read run file");
+}
+
+/* Non-zero if cursor A's next record comes before cursor B's. */
+#define BOW_POSTINGS_CURSOR_LESS(A, B)				\
+  ((A)->wi < (B)->wi || ((A)->wi == (B)->wi && (A)->ri < (B)->ri))
+
+/* Restore the heap order of the LENGTH cursors of HEAP, after
+   HEAP[I] has been replaced. */
+static void
+_bow_postings_heap_down (bow_postings_cursor **heap, int length, int i)
+{
+  bow_postings_cursor *tmp;
+  int child;
+
+  for (;;)
+    {
+      child = 2 * i + 1;
+      if (child >= length)
+	return;
+      if (child + 1 < length
+	  && BOW_POSTINGS_CURSOR_LESS (heap[child+1], heap[child]))
+	child++;
+      if (!BOW_POSTINGS_CURSOR_LESS (heap[child], heap[i]))
+	return;
+      tmp = heap[i];
+      heap[i] = heap[child];
+      heap[child] = tmp;
+      i = child;
+    }
+}
+
+/* Merge the NUM_RUNS runs RUNS, which must hold entries of ever
+   larger document indices, and the DV's of OLD, if it is non-NULL,
+   which come before all of them.  If SEEK_START is NULL, write a run
+   to OUT; otherwise write the DV's of a wi2dvf data file for SIZE
+   words, and put the offset of each in SEEK_START. */
+static void
+_bow_postings_merge (FILE **runs, int num_runs, bow_wi2dvf *old,
+		     int size, FILE *out, off_t *seek_start)
+{
+  bow_postings_cursor *cursors, **heap, **pieces;
+  int heap_length, num_pieces, pi;
+  bow_de *buf;
+  int buf_size = 4096;
+  bow_dv *old_dv, header;
+  int wi, length, n, i, last_di;
+
+  cursors = bow_malloc (num_runs * sizeof (bow_postings_cursor));
+  heap = bow_malloc (num_runs * sizeof (bow_postings_cursor*));
+  pieces = bow_malloc (num_runs * sizeof (bow_postings_cursor*));
+  buf = bow_malloc (buf_size * sizeof (bow_de));
+  heap_length = 0;
+  for (i = 0; i < num_runs; i++)
+    {
+      cursors[i].fp = runs[i];
+      cursors[i].ri = i;
+      _bow_postings_cursor_next (&cursors[i]);
+      if (cursors[i].wi >= 0)
+	heap[heap_length++] = &cursors[i];
+    }
+  for (i = heap_length / 2 - 1; i >= 0; i--)
+    _bow_postings_heap_down (heap, heap_length, i);
+
+  for (wi = 0; wi < size; wi++)
+    {
+      /* Find the runs that have entries for WI; they come off the
+	 heap in run order, which is document index order. */
+      num_pieces = 0;
+      while (heap_length > 0 && heap[0]->wi == wi)
+	{
+	  pieces[num_pieces++] = heap[0];
+	  heap[0] = heap[--heap_length];
+	  _bow_postings_heap_down (heap, heap_length, 0);
+	}
+      assert (heap_length == 0 || heap[0]->wi > wi);
+      old_dv = old ? bow_wi2dvf_dv_hidden (old, wi, 1) : NULL;
+      if (old_dv && old_dv->length == 0)
+	old_dv = NULL;
+      length = old_dv ? old_dv->length : 0;
+      for (pi = 0; pi < num_pieces; pi++)
+	length += pieces[pi]->length;
+      if (seek_start)
+	seek_start[wi] = -1;
+      if (length == 0)
+	continue;
+
+      if (seek_start)
+	{
+	  seek_start[wi] = ftello (out);
+	  header.length = header.size = length;
+	  header.idf = old_dv ? old_dv->idf : 0.0f;
+	  if (fwrite (&header, sizeof (bow_dv), 1, out) != 1)
+	    bow_error ("Couldn't write merged data file");
+	}
+      else
+	{
+	  int record[2];
+	  record[0] = wi;
+	  record[1] = length;
+	  if (fwrite (record, sizeof (int), 2, out) != 2)
+	    bow_error ("Couldn't write run file");
+	}
+      last_di = -1;
+      if (old_dv)
+	{
+	  if (fwrite (old_dv->entry, sizeof (bow_de), old_dv->length, out)
+	      != old_dv->length)
+	    bow_error ("Couldn't write merged data file");
+	  last_di = old_dv->entry[old_dv->length-1].di;
+	}
+      for (pi = 0; pi < num_pieces; pi++)
+	{
+	  for (length = pieces[pi]->length; length > 0; length -= n)
+	    {
+	      n = MIN (length, buf_size);
+	      if (fread (buf, sizeof (bow_de), n, pieces[pi]->fp) != n)
+		bow_error ("Couldn't read run file");
+	      if (buf[0].di <= last_di)
+		bow_error ("Document indices out of order merging word %d",
+			   wi);
+	      last_di = buf[n-1].di;
+	      if (fwrite (buf, sizeof (bow_de), n, out) != n)
+		bow_error ("Couldn't write merged data file");
+	    }
+	  _bow_postings_cursor_next (pieces[pi]);
+	  if (pieces[pi]->wi >= 0)
+	    {
+	      /* Put it back in the heap. */
+	      for (i = heap_length++;
+		   i > 0 && BOW_POSTINGS_CURSOR_LESS (pieces[pi],
+						      heap[(i-1)/2]);
+		   i = (i-1)/2)
+		heap[i] = heap[(i-1)/2];
+	      heap[i] = pieces[pi];
+	    }
+	}
+    }
+  assert (heap_length == 0);
+  if (!seek_start)
+    {
+      wi = -1;
+      if (fwrite (&wi, sizeof (int), 1, out) != 1)
+	bow_error ("Couldn't write run file");
+    }
+  if (fflush (out) != 0)
+    bow_error ("Couldn't write merged file");
+
+  bow_free (cursors);
+  bow_free (heap);
+  bow_free (pieces);
+  bow_free (buf);
+}
+
+/* Merge all the runs of POSTINGS and the DV's of *WI2DVF into a new
+   wi2dvf data file, and replace *WI2DVF with a wi2dvf read from it. */
+static void
+_bow_postings_freeze_runs (bow_postings *postings, bow_wi2dvf **wi2dvf)
+{
+  bow_wi2dvf *old = *wi2dvf;
+  FILE *out;
+  off_t *seek_start;
+  char *hidden;
+  int size, wi, ri;
+
+  _bow_postings_spill (postings);
+
+  /* Merge the oldest runs until there are few enough to merge at
+     once, keeping the runs in document index order. */
+  while (postings->num_runs > BOW_POSTINGS_MAX_MERGE)
+    {
+      bow_verbosify (bow_verbose, "Merging %d of %d runs\n",
+		     BOW_POSTINGS_MAX_MERGE, postings->num_runs);
+      out = _bow_postings_tmpfile ();
+      _bow_postings_merge (postings->runs, BOW_POSTINGS_MAX_MERGE, NULL,
+			   postings->size, out, NULL);
+      rewind (out);
+      for (ri = 0; ri < BOW_POSTINGS_MAX_MERGE; ri++)
+	fclose (postings->runs[ri]);
+      postings->runs[0] = out;
+      memmove (postings->runs + 1,
+	       postings->runs + BOW_POSTINGS_MAX_MERGE,
+	       ((postings->num_runs - BOW_POSTINGS_MAX_MERGE)
+		* sizeof (FILE*)));
+      postings->num_runs -= BOW_POSTINGS_MAX_MERGE - 1;
+    }
+
+  bow_verbosify (bow_verbose, "Merging %d runs\n", postings->num_runs);
+  size = MAX (postings->size, old->size);
+  seek_start = bow_malloc (size * sizeof (off_t));
+  hidden = bow_malloc (size);
+  for (wi = 0; wi < size; wi++)
+    hidden[wi] = (wi < old->size && old->entry[wi].hidden);
+  out = _bow_postings_tmpfile ();
+  bow_wi2dvf_write_native_header (size, NULL, NULL, out);
+  _bow_postings_merge (postings->runs, postings->num_runs,
+		       old, size, out, seek_start);
+  for (ri = 0; ri < postings->num_runs; ri++)
+    fclose (postings->runs[ri]);
+  postings->num_runs = 0;
+
+  /* Now that we know where each DV is, fill in the seek table, and
+     read the file back in. */
+  rewind (out);
+  bow_wi2dvf_write_native_header (size, seek_start, hidden, out);
+  if (fflush (out) != 0)
+    bow_error ("Couldn't write merged data file");
+  rewind (out);
+  *wi2dvf = bow_wi2dvf_new_from_data_fp (out);
+  bow_wi2dvf_free (old);
+  bow_free (seek_start);
+  bow_free (hidden);
+}
+
+/* Add all the entries in POSTINGS to WI2DVF, and empty POSTINGS.  Each
+   word's entries are copied into a DV of exactly the right size. */
+void
+bow_postings_freeze (bow_postings *postings, bow_wi2dvf **wi2dvf)
+{
+  bow_postings_list *list;
+  bow_postings_block *block;
+  char **slabs;
+  char *slab;
+  int si, offset, length;
+
+  if (bow_verbosity_level >= bow_verbose)
+    bow_postings_print_stats (postings, stderr);
+  if (postings->num_runs > 0)
+    {
+      _bow_postings_freeze_runs (postings, wi2dvf);
+      return;
+    }
+  if (!postings->slab)
+    return;
+
+  /* Put the slabs in the order they were allocated, which is the
+     order of the blocks of each word. */
+  ((bow_postings_slab*)postings->slab)->used = postings->slab_used;
+  slabs = bow_malloc (postings->num_slabs * sizeof (char*));
+  for (si = postings->num_slabs - 1, slab = postings->slab; slab;
+       si--, slab = ((bow_postings_slab*)slab)->prev)
+    slabs[si] = slab;
+  assert (si == -1);
+
+  for (si = 0; si < postings->num_slabs; si++)
+    {
+      slab = slabs[si];
+      for (offset = BOW_POSTINGS_SLAB_HEADER;
+	   offset < ((bow_postings_slab*)slab)->used;
+	   offset += BOW_POSTINGS_BLOCK_BYTES (block->size))
+	{
+	  block = (bow_postings_block*) (slab + offset);
+	  list = &(postings->list[block->wi]);
+	  /* The DV is made at its full size, but its memory is only
+	     touched as the blocks are copied into it. */
+	  if (!list->dv)
+	    list->dv = bow_dv_new (list->length);
+	  length = MIN (block->size, list->length - list->dv->length);
+	  memcpy (list->dv->entry + list->dv->length, block->entry,
+		  sizeof (bow_de) * length);
+	  list->dv->length += length;
+	  if (list->dv->length == list->length)
+	    {
+	      bow_wi2dvf_add_wi_dv (wi2dvf, block->wi, list->dv);
+	      list->dv = NULL;
+	    }
+	}
+      /* The DV's still to be made can reuse this slab's memory. */
+      bow_free (slab);
+    }
+  bow_free (slabs);
+  postings->slab = NULL;
+  /* This gives the memory back to the system, once for all the slabs. */
+  _bow_postings_empty (postings);
+}
+
+/* Print statistics about the memory used by POSTINGS to FP. */
+void
+bow_postings_print_stats (bow_postings *postings, FILE *fp)
+{
+  size_t slab_bytes = (size_t) postings->num_slabs * BOW_POSTINGS_SLAB_SIZE;
+  size_t entry_bytes = postings->num_entries * sizeof (bow_de);
+
+  fprintf (fp, "%8d posting slabs of %d bytes\n",
+	   postings->num_slabs, BOW_POSTINGS_SLAB_SIZE);
+  fprintf (fp, "%8d posting blocks\n", postings->num_blocks);
+  fprintf (fp, "%8lu posting entries, using %lu bytes\n",
+	   (unsigned long) postings->num_entries,
+	   (unsigned long) entry_bytes);
+  fprintf (fp, "%8lu bytes allocated but unused\n",
+	   (unsigned long) (slab_bytes > entry_bytes
+			    ? slab_bytes - entry_bytes : 0));
+  if (postings->num_runs)
+    fprintf (fp, "%8d runs written to disk\n", postings->num_runs);
+}
+
+/* Free the memory held by POSTINGS. */
+void
+bow_postings_free (bow_postings *postings)
+{
+  int ri;
+
+  _bow_postings_empty (postings);
+  for (ri = 0; ri < postings->num_runs; ri++)
+    fclose (postings->runs[ri]);
+  if (postings->runs)
+    bow_free (postings->runs);
+  bow_free (postings->list);
+  bow_free (postings);
+}
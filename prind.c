@@ -200,6 +200,8 @@ bow_prind_score (bow_barrel *barrel, bow_wv *query_wv,
   float pr_w_c;			/* P(w|C), prob a word is in a class */
   float pr_c;			/* P(C), prior prob of a class */
   int num_scores;		/* number of entries placed in SCORES */
+  float *normalizers;		/* the CDOC->NORMALIZER of each class */
+  float *priors;		/* P(C) of each class, zero if not in model */
 
 #if 0
   if (loo_class >= 0)
@@ -208,10 +210,23 @@ bow_prind_score (bow_barrel *barrel, bow_wv *query_wv,
 
   /* Allocate space to store scores for *all* classes (documents) */
   scores = alloca (barrel->cdocs->length * sizeof (double));
+  normalizers = alloca (barrel->cdocs->length * sizeof (float));
+  priors = alloca (barrel->cdocs->length * sizeof (float));
 
-  /* Initialize the SCORES to zero. */
+  /* Initialize the SCORES to zero, and gather what the scoring
+     kernel needs to know about each class. */
   for (ci = 0; ci < barrel->cdocs->length; ci++)
-    scores[ci] = 0;
+    {
+      bow_cdoc *cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
+      scores[ci] = 0;
+      normalizers[ci] = cdoc->normalizer;
+      if (cdoc->type != bow_doc_train)
+	priors[ci] = 0;
+      else if (((bow_params_prind*)(barrel->method->params))->uniform_priors)
+	priors[ci] = 1.0f;
+      else
+	priors[ci] = cdoc->prior;
+    }
 
   /* Loop over each word in the word vector QUERY_WV, putting its
      contribution into SCORES. */
@@ -228,10 +243,20 @@ bow_prind_score (bow_barrel *barrel, bow_wv *query_wv,
       if (!dv)
 	continue;
 
-      if (bow_print_word_scores)
-	printf ("%-30s (queryweight=%.8f)\n",
-		bow_int2word (wi), 
-		query_wv->entry[wvi].weight * query_wv->normalizer);
+      if (!bow_print_word_scores)
+	{
+	  /* Put this word's (WI's) contribution into the SCORES of
+	     all the classes in which it appears. */
+	  (*bow_kernel_scatter_add_d) (scores, normalizers, priors,
+				       dv->entry, dv->length,
+				       (query_wv->entry[wvi].weight
+					* query_wv->normalizer));
+	  continue;
+	}
+
+      printf ("%-30s (queryweight=%.8f)\n",
+	      bow_int2word (wi), 
+	      query_wv->entry[wvi].weight * query_wv->normalizer);
 
       /* Loop over all classes, putting this word's (WI's)
 	 contribution into SCORES. */
@@ -313,32 +338,11 @@ bow_prind_score (bow_barrel *barrel, bow_wv *query_wv,
 
   /* Return the SCORES by putting them (and the `class indices') into
      SCORES in sorted order. */
-  {
-    num_scores = 0;
-    for (ci = 0; ci < barrel->cdocs->length; ci++)
-      {
-	if (num_scores < bscores_len
-	    || bscores[num_scores-1].weight < scores[ci])
-	  {
-	    /* We are going to put this score and CI into SCORES
-	       because either: (1) there is empty space in SCORES,
-	       or (2) SCORES[CI] is larger than the smallest score
-	       there currently. */
-	    int dsi;		/* an index into SCORES */
-	    if (num_scores < bscores_len)
-	      num_scores++;
-	    dsi = num_scores - 1;
-	    /* Shift down all the entries that are smaller than SCORES[CI] */
-	    for (; dsi > 0 && bscores[dsi-1].weight < scores[ci]; dsi--)
-	      bscores[dsi] = bscores[dsi-1];
-	    /* Insert the new score */
-	    bscores[dsi].weight = scores[ci];
-	    /* Check for NaN. */
-	    assert (bscores[dsi].weight == bscores[dsi].weight);
-	    bscores[dsi].di = ci;
-	  }
-      }
-  }
+  num_scores = (*bow_kernel_top_k) (scores, barrel->cdocs->length,
+				    bscores, bscores_len);
+  /* Check for NaN. */
+  for (ci = 0; ci < num_scores; ci++)
+    assert (bscores[ci].weight == bscores[ci].weight);
 
   return num_scores;
 }
@@ -361,7 +365,8 @@ rainbow_method bow_method_prind =
   bow_wv_set_weights_to_count,
   bow_wv_normalize_weights_by_summing,
   bow_barrel_free,
-  &bow_prind_params
+  &bow_prind_params,
+  1				/* scoring is thread-safe */
 };
 
 void _register_method_prind () __attribute__ ((constructor));
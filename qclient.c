@@ -0,0 +1,344 @@
+/* A client library for the binary protocol of rainbow's event-driven
+   query server.  See bow/qclient.h for the protocol.
+   Copyright (C) 2026 agent
+
+   Written by:  agent <agent@local>
+
+   This file is part of the Bag-Of-Words Library, `libbow'.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License
+   as published by the Free Software Foundation, version 2.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA */
+
+#include <bow/libbow.h>
+#include <bow/qclient.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+
+bow_qclient *
+bow_qclient_open (const char *host, int port)
+{
+  struct hostent *hp;
+  struct sockaddr_in addr;
+  bow_qclient *client;
+  int fd, one = 1;
+
+  if (!(hp = gethostbyname (host)))
+    {
+      errno = EHOSTUNREACH;
+      return NULL;
+    }
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  memcpy (&addr.sin_addr, hp->h_addr, hp->h_length);
+  if ((fd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+    return NULL;
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    {
+      close (fd);
+      return NULL;
+    }
+  /* Requests are written whole; don't let Nagle hold them back. */
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+  client = bow_malloc (sizeof (bow_qclient));
+  client->fd = fd;
+  client->next_id = 0;
+  client->req_size = 4096;
+  client->req = bow_malloc (client->req_size);
+  client->req_length = 0;
+  client->req_num_docs = 0;
+  client->in_size = 4096;
+  client->in = bow_malloc (client->in_size);
+  client->in_length = 0;
+  return client;
+}
+
+void
+bow_qclient_close (bow_qclient *client)
+{
+  close (client->fd);
+  bow_free (client->req);
+  bow_free (client->in);
+  bow_free (client);
+}
+
+/* Return a pointer to LENGTH more bytes at the end of the request
+   being built. */
+static unsigned char *
+_bow_qclient_extend (bow_qclient *client, int length)
+{
+  unsigned char *p;
+
+  while (client->req_length + length > client->req_size)
+    {
+      client->req_size *= 2;
+      client->req = bow_realloc (client->req, client->req_size);
+    }
+  p = client->req + client->req_length;
+  client->req_length += length;
+  return p;
+}
+
+/* Start a request for operation OP that asks for the best K classes. */
+static void
+_bow_qclient_begin_op (bow_qclient *client, int op, int k)
+{
+  unsigned char *p;
+
+  client->req_length = 0;
+  client->req_num_docs = 0;
+  p = _bow_qclient_extend (client, BOW_QPROTO_REQUEST_HEADER_SIZE);
+  bow_qproto_put32 (p, BOW_QPROTO_REQUEST_MAGIC);
+  /* The length, id and number of documents are filled in by
+     bow_qclient_send(). */
+  bow_qproto_put16 (p + 12, op);
+  bow_qproto_put16 (p + 14, k);
+}
+
+void
+bow_qclient_begin (bow_qclient *client, int k)
+{
+  assert (k >= 0 && k < 0x10000);
+  _bow_qclient_begin_op (client, BOW_QPROTO_OP_CLASSIFY, k);
+}
+
+void
+bow_qclient_add_text (bow_qclient *client, const char *text, int length)
+{
+  unsigned char *p = _bow_qclient_extend (client, 8 + length);
+
+  bow_qproto_put32 (p, BOW_QPROTO_DOC_TEXT);
+  bow_qproto_put32 (p + 4, length);
+  memcpy (p + 8, text, length);
+  client->req_num_docs++;
+}
+
+void
+bow_qclient_add_wv (bow_qclient *client, bow_wv *wv)
+{
+  unsigned char *p = _bow_qclient_extend (client, 8 + 8 * wv->num_entries);
+  int wvi;
+
+  bow_qproto_put32 (p, BOW_QPROTO_DOC_WV);
+  bow_qproto_put32 (p + 4, wv->num_entries);
+  for (wvi = 0, p += 8; wvi < wv->num_entries; wvi++, p += 8)
+    {
+      bow_qproto_put32 (p, wv->entry[wvi].wi);
+      bow_qproto_put32 (p + 4, wv->entry[wvi].count);
+    }
+  client->req_num_docs++;
+}
+
+int
+bow_qclient_send (bow_qclient *client)
+{
+  unsigned char *p = client->req;
+  int id = client->next_id++ & 0x7fffffff;
+  int written = 0, n;
+
+  assert (client->req_length >= BOW_QPROTO_REQUEST_HEADER_SIZE);
+  bow_qproto_put32 (p + 4, client->req_length - 8);
+  bow_qproto_put32 (p + 8, id);
+  bow_qproto_put32 (p + 16, client->req_num_docs);
+  while (written < client->req_length)
+    {
+      n = send (client->fd, client->req + written,
+		client->req_length - written, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return -1;
+      written += n;
+    }
+  return id;
+}
+
+/* Read until a whole reply is at the front of CLIENT->IN, and return
+   its length, or -1 on error. */
+static int
+_bow_qclient_read_reply (bow_qclient *client)
+{
+  unsigned int length = 0;
+  int n;
+
+  for (;;)
+    {
+      if (client->in_length >= 8)
+	{
+	  if (bow_qproto_get32 (client->in) != BOW_QPROTO_REPLY_MAGIC)
+	    return -1;
+	  length = bow_qproto_get32 (client->in + 4);
+	  if (length > BOW_QPROTO_MAX_LENGTH
+	      || length + 8 < BOW_QPROTO_REPLY_HEADER_SIZE)
+	    return -1;
+	  if (client->in_length >= length + 8)
+	    return length + 8;
+	  while (client->in_size < length + 8)
+	    {
+	      client->in_size *= 2;
+	      client->in = bow_realloc (client->in, client->in_size);
+	    }
+	}
+      n = read (client->fd, client->in + client->in_length,
+		client->in_size - client->in_length);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return -1;
+      client->in_length += n;
+    }
+}
+
+/* Drop the reply of LENGTH bytes from the front of CLIENT->IN. */
+static void
+_bow_qclient_consume (bow_qclient *client, int length)
+{
+  memmove (client->in, client->in + length, client->in_length - length);
+  client->in_length -= length;
+}
+
+int
+bow_qclient_receive (bow_qclient *client, bow_qclient_reply *reply)
+{
+  int length, d, h, num_hits, total_hits;
+  unsigned char *p, *end;
+
+  if ((length = _bow_qclient_read_reply (client)) < 0)
+    return -1;
+  p = client->in;
+  end = p + length;
+  reply->id = bow_qproto_get32 (p + 8);
+  reply->status = bow_qproto_get16 (p + 12);
+  reply->num_docs = 0;
+  p += BOW_QPROTO_REPLY_HEADER_SIZE;
+  if (reply->status != BOW_QPROTO_STATUS_OK)
+    {
+      _bow_qclient_consume (client, length);
+      return 0;
+    }
+  if (end - p < 4)
+    goto malformed;
+  reply->num_docs = bow_qproto_get32 (p);
+  p += 4;
+  /* There are at least 4 bytes per document and 8 per hit, which
+     bounds the sizes of the arrays.  The counts are unsigned on the
+     wire; one of 2^31 or more reads as negative here, and is as bad
+     as a huge one. */
+  if (reply->num_docs < 0 || reply->num_docs > (end - p) / 4)
+    goto malformed;
+  if (reply->docs_size < reply->num_docs)
+    {
+      reply->docs_size = reply->num_docs;
+      reply->num_hits = bow_realloc (reply->num_hits,
+				     reply->docs_size * sizeof (int));
+      reply->hits = bow_realloc (reply->hits,
+				 reply->docs_size * sizeof (bow_score*));
+    }
+  total_hits = (end - p) / 8;
+  if (reply->hits_storage_size < total_hits)
+    {
+      reply->hits_storage_size = total_hits;
+      reply->hits_storage = bow_realloc (reply->hits_storage,
+					 total_hits * sizeof (bow_score));
+    }
+  total_hits = 0;
+  for (d = 0; d < reply->num_docs; d++)
+    {
+      if (end - p < 4)
+	goto malformed;
+      num_hits = bow_qproto_get32 (p);
+      p += 4;
+      if (num_hits < 0 || num_hits > (end - p) / 8)
+	goto malformed;
+      reply->num_hits[d] = num_hits;
+      reply->hits[d] = reply->hits_storage + total_hits;
+      for (h = 0; h < num_hits; h++, p += 8)
+	{
+	  reply->hits[d][h].di = bow_qproto_get32 (p);
+	  reply->hits[d][h].weight = bow_qproto_get_float (p + 4);
+	  reply->hits[d][h].name = NULL;
+	}
+      total_hits += num_hits;
+    }
+  _bow_qclient_consume (client, length);
+  return 0;
+
+ malformed:
+  _bow_qclient_consume (client, length);
+  return -1;
+}
+
+void
+bow_qclient_reply_free_contents (bow_qclient_reply *reply)
+{
+  if (reply->num_hits)
+    bow_free (reply->num_hits);
+  if (reply->hits)
+    bow_free (reply->hits);
+  if (reply->hits_storage)
+    bow_free (reply->hits_storage);
+  memset (reply, 0, sizeof (bow_qclient_reply));
+}
+
+int
+bow_qclient_classnames (bow_qclient *client, char ***names)
+{
+  int length, num_classes, ci, name_length;
+  unsigned char *p, *end;
+
+  _bow_qclient_begin_op (client, BOW_QPROTO_OP_CLASSNAMES, 0);
+  if (bow_qclient_send (client) < 0
+      || (length = _bow_qclient_read_reply (client)) < 0)
+    return -1;
+  p = client->in;
+  end = p + length;
+  if (bow_qproto_get16 (p + 12) != BOW_QPROTO_STATUS_OK
+      || length < BOW_QPROTO_REPLY_HEADER_SIZE + 4)
+    {
+      _bow_qclient_consume (client, length);
+      return -1;
+    }
+  p += BOW_QPROTO_REPLY_HEADER_SIZE;
+  num_classes = bow_qproto_get32 (p);
+  p += 4;
+  if (num_classes < 0 || num_classes > (end - p) / 4)
+    {
+      _bow_qclient_consume (client, length);
+      return -1;
+    }
+  *names = bow_malloc (num_classes * sizeof (char*));
+  for (ci = 0; ci < num_classes; ci++)
+    {
+      name_length = (end - p >= 4) ? bow_qproto_get32 (p) : -1;
+      if (name_length < 0 || name_length > end - p - 4)
+	{
+	  while (ci--)
+	    bow_free ((*names)[ci]);
+	  bow_free (*names);
+	  _bow_qclient_consume (client, length);
+	  return -1;
+	}
+      (*names)[ci] = bow_malloc (name_length + 1);
+      memcpy ((*names)[ci], p + 4, name_length);
+      (*names)[ci][name_length] = '\0';
+      p += 4 + name_length;
+    }
+  _bow_qclient_consume (client, length);
+  return num_classes;
+}
@@ -0,0 +1,435 @@
+/* qload - a load generator for `rainbow --event-query-server'
+   Copyright (C) 2026 agent
+
+   Written by:  agent <agent@local>
+
+   This file is part of the Bag-Of-Words Library, `libbow'.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License
+   as published by the Free Software Foundation, version 2.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA */
+
+#include <bow/libbow.h>
+#include <bow/qclient.h>
+#include <argp.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+const char *argp_program_version = "qload 0.1";
+
+const char *argp_program_bug_address = "<mccallum@cs.cmu.edu>";
+
+static char qload_argp_doc[] =
+"qload -- send the documents in FILE..., or the files under it if it is "
+"a directory, to `rainbow --event-query-server' "
+"as fast as it will answer, and report throughput and latency";
+
+static char qload_argp_args_doc[] = "FILE...";
+
+enum {
+  HOST_KEY = 3000,
+  PORT_KEY,
+  CONNECTIONS_KEY,
+  BATCH_SIZE_KEY,
+  PIPELINE_KEY,
+  REQUESTS_KEY,
+  TOP_K_KEY,
+  WORD_VECTORS_KEY,
+  TEXT_PROTOCOL_KEY
+};
+
+static struct argp_option qload_options[] =
+{
+  {0, 0, 0, 0,
+   "Load generator options:", 1},
+  {"host", HOST_KEY, "HOST", 0,
+   "Connect to the server on HOST.  The default is localhost."},
+  {"port", PORT_KEY, "PORTNUM", 0,
+   "Connect to the server on port PORTNUM.  Required."},
+  {"connections", CONNECTIONS_KEY, "N", 0,
+   "Open N connections at once, each on its own thread.  The default "
+   "is 1."},
+  {"batch-size", BATCH_SIZE_KEY, "N", 0,
+   "Send N documents in each request.  The default is 1."},
+  {"pipeline", PIPELINE_KEY, "N", 0,
+   "Keep N requests awaiting replies on each connection.  The default "
+   "is 1."},
+  {"requests", REQUESTS_KEY, "N", 0,
+   "Send N requests on each connection.  The default is 1000."},
+  {"top-k", TOP_K_KEY, "K", 0,
+   "Ask for the scores of the best K classes only.  The default, 0, "
+   "asks for all of them."},
+  {"word-vectors", WORD_VECTORS_KEY, 0, 0,
+   "Lex the documents here, with the vocabulary in the model directory "
+   "given by -d, and send them as word vectors."},
+  {"text-protocol", TEXT_PROTOCOL_KEY, 0, 0,
+   "Send each document as a text request, for comparison with the "
+   "binary protocol."},
+  { 0 }
+};
+
+struct qload_arg_state
+{
+  const char *host;
+  int port;
+  int num_connections;
+  int batch_size;
+  int pipeline;
+  int num_requests;
+  int top_k;
+  int word_vectors;
+  int text_protocol;
+  char **filenames;
+  int num_filenames;
+} qload_arg_state;
+
+static error_t
+qload_parse_opt (int key, char *arg, struct argp_state *state)
+{
+  switch (key)
+    {
+    case HOST_KEY:
+      qload_arg_state.host = arg;
+      break;
+    case PORT_KEY:
+      qload_arg_state.port = atoi (arg);
+      break;
+    case CONNECTIONS_KEY:
+      qload_arg_state.num_connections = atoi (arg);
+      break;
+    case BATCH_SIZE_KEY:
+      qload_arg_state.batch_size = atoi (arg);
+      break;
+    case PIPELINE_KEY:
+      qload_arg_state.pipeline = atoi (arg);
+      break;
+    case REQUESTS_KEY:
+      qload_arg_state.num_requests = atoi (arg);
+      break;
+    case TOP_K_KEY:
+      qload_arg_state.top_k = atoi (arg);
+      break;
+    case WORD_VECTORS_KEY:
+      qload_arg_state.word_vectors = 1;
+      break;
+    case TEXT_PROTOCOL_KEY:
+      qload_arg_state.text_protocol = 1;
+      break;
+    case ARGP_KEY_ARG:
+      qload_arg_state.filenames = &state->argv[state->next - 1];
+      qload_arg_state.num_filenames = state->argc - state->next + 1;
+      state->next = state->argc;
+      break;
+    case ARGP_KEY_END:
+      if (qload_arg_state.num_filenames == 0 || qload_arg_state.port <= 0)
+	argp_usage (state);
+      if (qload_arg_state.num_connections < 1
+	  || qload_arg_state.batch_size < 1
+	  || qload_arg_state.pipeline < 1
+	  || qload_arg_state.num_requests < 1)
+	argp_error (state, "Counts must be positive.");
+      if (qload_arg_state.top_k < 0 || qload_arg_state.top_k > 0xffff)
+	argp_error (state, "--top-k must be between 0 and 65535.");
+      if (qload_arg_state.word_vectors && qload_arg_state.text_protocol)
+	argp_error (state, "The text protocol can't send word vectors.");
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+    }
+  return 0;
+}
+
+static struct argp qload_argp =
+{ qload_options, qload_parse_opt, qload_argp_args_doc,
+  qload_argp_doc, bow_argp_children};
+
+
+/* The documents to send, and their word vectors with --word-vectors. */
+static char **qload_docs;
+static int *qload_doc_lengths;
+static bow_wv **qload_doc_wvs;
+static int qload_num_docs;
+
+/* Read the file FILENAME into QLOAD_DOCS. */
+static int
+qload_read_doc (const char *filename, void *context)
+{
+  static int docs_size = 0;
+  FILE *fp;
+  int size = 4096, length = 0, n;
+  char *text;
+
+  if (!(fp = fopen (filename, "r")))
+    {
+      bow_verbosify (bow_quiet, "Couldn't open `%s'\n", filename);
+      return 0;
+    }
+  text = bow_malloc (size);
+  while ((n = fread (text + length, 1, size - length - 1, fp)) > 0)
+    {
+      length += n;
+      if (length == size - 1)
+	{
+	  size *= 2;
+	  text = bow_realloc (text, size);
+	}
+    }
+  fclose (fp);
+  text[length] = '\0';
+  if (qload_num_docs == docs_size)
+    {
+      docs_size = docs_size ? 2 * docs_size : 64;
+      qload_docs = bow_realloc (qload_docs, docs_size * sizeof (char*));
+      qload_doc_lengths = bow_realloc (qload_doc_lengths,
+				       docs_size * sizeof (int));
+    }
+  qload_docs[qload_num_docs] = text;
+  qload_doc_lengths[qload_num_docs] = length;
+  qload_num_docs++;
+  return 0;
+}
+
+/* What each connection's thread measured. */
+struct qload_results {
+  double *latencies;		/* in seconds, one per request */
+  int num_latencies;
+  int num_docs;
+  int failed;
+};
+
+static double
+qload_now ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Send the documents of request R on CLIENT, as one binary request or
+   as BATCH_SIZE text requests.  Return non-zero on error. */
+static int
+qload_send (bow_qclient *client, int r)
+{
+  int b, di, n;
+  char header[32];
+
+  if (!qload_arg_state.text_protocol)
+    bow_qclient_begin (client, qload_arg_state.top_k);
+  for (b = 0; b < qload_arg_state.batch_size; b++)
+    {
+      di = (r * qload_arg_state.batch_size + b) % qload_num_docs;
+      if (qload_arg_state.text_protocol)
+	{
+	  n = sprintf (header, "%d\n", qload_doc_lengths[di]);
+	  if (send (client->fd, header, n, MSG_NOSIGNAL) != n
+	      || (send (client->fd, qload_docs[di], qload_doc_lengths[di],
+			MSG_NOSIGNAL) != qload_doc_lengths[di]))
+	    return -1;
+	}
+      else if (qload_arg_state.word_vectors)
+	bow_qclient_add_wv (client, qload_doc_wvs[di]);
+      else
+	bow_qclient_add_text (client, qload_docs[di], qload_doc_lengths[di]);
+    }
+  if (!qload_arg_state.text_protocol)
+    return bow_qclient_send (client) < 0;
+  return 0;
+}
+
+/* Read the BATCH_SIZE text replies to a request sent with the text
+   protocol.  Return non-zero on error. */
+static int
+qload_receive_text (bow_qclient *client)
+{
+  int replies = 0, n, i;
+
+  for (;;)
+    {
+      for (i = 0; i + 1 < client->in_length; i++)
+	if (client->in[i] == '.' && client->in[i+1] == '\n'
+	    && (i == 0 || client->in[i-1] == '\n'))
+	  {
+	    memmove (client->in, client->in + i + 2, client->in_length - i - 2);
+	    client->in_length -= i + 2;
+	    if (++replies == qload_arg_state.batch_size)
+	      return 0;
+	    i = -1;
+	  }
+      if (client->in_length == client->in_size)
+	{
+	  client->in_size *= 2;
+	  client->in = bow_realloc (client->in, client->in_size);
+	}
+      n = read (client->fd, client->in + client->in_length,
+		client->in_size - client->in_length);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return -1;
+      client->in_length += n;
+    }
+}
+
+static void
+qload_connection (int thread_index, void *context)
+{
+  struct qload_results *res = (struct qload_results *)context + thread_index;
+  int num_requests = qload_arg_state.num_requests;
+  double *sent = bow_malloc (qload_arg_state.pipeline * sizeof (double));
+  bow_qclient_reply reply;
+  bow_qclient *client;
+  int r_sent = 0, r_done = 0;
+
+  memset (&reply, 0, sizeof (reply));
+  res->latencies = bow_malloc (num_requests * sizeof (double));
+  res->num_latencies = res->num_docs = res->failed = 0;
+  if (!(client = bow_qclient_open (qload_arg_state.host,
+				   qload_arg_state.port)))
+    {
+      bow_verbosify (bow_quiet, "Couldn't connect to %s:%d: %s\n",
+		     qload_arg_state.host, qload_arg_state.port,
+		     strerror (errno));
+      res->failed = 1;
+      return;
+    }
+  while (r_done < num_requests)
+    {
+      /* Keep the pipeline full. */
+      while (r_sent < num_requests
+	     && r_sent - r_done < qload_arg_state.pipeline)
+	{
+	  sent[r_sent % qload_arg_state.pipeline] = qload_now ();
+	  if (qload_send (client, thread_index * num_requests + r_sent))
+	    goto failed;
+	  r_sent++;
+	}
+      if (qload_arg_state.text_protocol)
+	{
+	  if (qload_receive_text (client))
+	    goto failed;
+	}
+      else if (bow_qclient_receive (client, &reply)
+	       || reply.status != BOW_QPROTO_STATUS_OK)
+	goto failed;
+      res->latencies[res->num_latencies++] =
+	qload_now () - sent[r_done % qload_arg_state.pipeline];
+      res->num_docs += qload_arg_state.batch_size;
+      r_done++;
+    }
+  bow_qclient_reply_free_contents (&reply);
+  bow_qclient_close (client);
+  bow_free (sent);
+  return;
+
+ failed:
+  bow_verbosify (bow_quiet, "Connection %d failed after %d requests\n",
+		 thread_index, r_done);
+  res->failed = 1;
+  bow_qclient_reply_free_contents (&reply);
+  bow_qclient_close (client);
+  bow_free (sent);
+}
+
+static int
+qload_compare_doubles (const void *x, const void *y)
+{
+  double a = *(const double *)x, b = *(const double *)y;
+  return (a > b) - (a < b);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct qload_results *results;
+  double *latencies, start, elapsed;
+  int num_latencies = 0, num_docs = 0, num_failed = 0;
+  int i, j;
+
+  qload_arg_state.host = "localhost";
+  qload_arg_state.num_connections = 1;
+  qload_arg_state.batch_size = 1;
+  qload_arg_state.pipeline = 1;
+  qload_arg_state.num_requests = 1000;
+  argp_parse (&qload_argp, argc, argv, 0, 0, &qload_arg_state);
+
+  for (i = 0; i < qload_arg_state.num_filenames; i++)
+    {
+      struct stat st;
+      if (stat (qload_arg_state.filenames[i], &st) == 0
+	  && S_ISDIR (st.st_mode))
+	bow_map_filenames_from_dir (qload_read_doc, NULL,
+				    qload_arg_state.filenames[i], "");
+      else
+	qload_read_doc (qload_arg_state.filenames[i], NULL);
+    }
+  if (qload_num_docs == 0)
+    bow_error ("No documents found.");
+
+  if (qload_arg_state.word_vectors)
+    {
+      char filename[BOW_MAX_WORD_LENGTH];
+      sprintf (filename, "%s/vocabulary", bow_data_dirname);
+      bow_words_read_from_file (filename);
+      bow_word2int_do_not_add = 1;
+      qload_doc_wvs = bow_malloc (qload_num_docs * sizeof (bow_wv*));
+      for (i = 0; i < qload_num_docs; i++)
+	{
+	  qload_doc_wvs[i] = bow_wv_new_from_text_string (qload_docs[i]);
+	  if (!qload_doc_wvs[i])
+	    qload_doc_wvs[i] = bow_wv_new (0);
+	}
+    }
+  bow_verbosify (bow_progress, "Sending %d documents\n", qload_num_docs);
+
+  results = bow_malloc (qload_arg_state.num_connections
+			* sizeof (struct qload_results));
+  start = qload_now ();
+  bow_threads_run (qload_arg_state.num_connections, qload_connection,
+		   results);
+  elapsed = qload_now () - start;
+
+  latencies = bow_malloc (qload_arg_state.num_connections
+			  * qload_arg_state.num_requests * sizeof (double));
+  for (i = 0; i < qload_arg_state.num_connections; i++)
+    {
+      for (j = 0; j < results[i].num_latencies; j++)
+	latencies[num_latencies++] = results[i].latencies[j];
+      num_docs += results[i].num_docs;
+      num_failed += results[i].failed;
+      bow_free (results[i].latencies);
+    }
+  if (num_latencies == 0)
+    bow_error ("No requests were answered.");
+  qsort (latencies, num_latencies, sizeof (double), qload_compare_doubles);
+
+  printf ("connections %d  batch %d  pipeline %d  protocol %s\n",
+	  qload_arg_state.num_connections, qload_arg_state.batch_size,
+	  qload_arg_state.pipeline,
+	  (qload_arg_state.text_protocol ? "text"
+	   : qload_arg_state.word_vectors ? "binary word vectors"
+	   : "binary text"));
+  printf ("%d requests, %d documents in %.3f seconds\n",
+	  num_latencies, num_docs, elapsed);
+  printf ("%.1f requests/second, %.1f documents/second\n",
+	  num_latencies / elapsed, num_docs / elapsed);
+  printf ("latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+	  1000 * latencies[num_latencies / 2],
+	  1000 * latencies[num_latencies * 9 / 10],
+	  1000 * latencies[num_latencies * 99 / 100],
+	  1000 * latencies[num_latencies - 1]);
+  if (num_failed)
+    printf ("%d connections failed\n", num_failed);
+  return num_failed ? 1 : 0;
+}
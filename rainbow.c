@@ -45,6 +45,11 @@
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/file.h>		/* for flock() */
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <bow/qclient.h>
 
 static int rainbow_sockfd;
 
@@ -74,6 +79,7 @@ enum {
   NO_LISP_SCORE_TRUNCATION_KEY,
   SERVER_KEY,
   FORKING_SERVER_KEY,
+  EVENT_SERVER_KEY,
   PRINT_DOC_NAMES_KEY,
   PRINT_LOG_ODDS_RATIO_KEY,
   WORD_PROBABILITIES_KEY,
@@ -83,11 +89,16 @@ enum {
   HIDE_VOCAB_INDICES_IN_FILE_KEY,
   TEST_ON_TRAINING_KEY,
   VPC_ONLY_KEY,
+  VPC_CHECKPOINT_INTERVAL_KEY,
   BUILD_AND_SAVE,
   TEST_FROM_SAVED,
   USE_SAVED_CLASSIFIER_KEY,
   PRINT_DOC_LENGTH_KEY,
   INDEX_LINES_KEY,
+  INDEX_ADD_KEY,
+  INDEX_DELETE_KEY,
+  INDEX_COMPACT_KEY,
+  INDEX_COMPACT_FRACTION_KEY,
 };
 
 static struct argp_option rainbow_options[] =
@@ -106,13 +117,32 @@ static struct argp_option rainbow_options[] =
    "The first two "
    "space-delimited words on each line are the document name and class name "
    "respectively"},
-#if VPC_ONLY
+  {"index-add", INDEX_ADD_KEY, 0, 0,
+   "Add the documents found under directories ARG... to the existing "
+   "index, each directory holding a class as with --index, without "
+   "rebuilding it.  A document whose filename is already in the index "
+   "replaces it."},
+  {"index-delete", INDEX_DELETE_KEY, "FILE", 0,
+   "Remove from the existing index the documents whose filenames are "
+   "listed in FILE, one per line.  May be combined with --index-add."},
+  {"index-compact", INDEX_COMPACT_KEY, 0, 0,
+   "Fold the documents added and removed by --index-add and --index-delete "
+   "into the document barrel."},
+  {"index-compact-fraction", INDEX_COMPACT_FRACTION_KEY, "F", 0,
+   "After --index-add or --index-delete, compact the index in the "
+   "background once more than fraction F of its documents have changed.  "
+   "Zero means never.  Default is 0.25."},
   {"vpc-only", VPC_ONLY_KEY, 0, 0,
-   "Only create a vector-per-class barrel.  Do not create a document barrel.  "
-   "Useful for creating barrels to be used with --query-server.  "
-   "NOTE: This is a hack which assumes multinomial and a naive Bayes-like "
-   "method.  Not meant for general purpose usage!"},
-#endif
+   "Only create a vector-per-class barrel, adding each document to the "
+   "class statistics as it is read, without creating a document barrel, "
+   "so that memory use doesn't grow with the number of documents.  "
+   "Useful for creating barrels to be used with --query-server.  Only "
+   "for naivebayes and other methods that need nothing but class "
+   "statistics."},
+  {"vpc-checkpoint-interval", VPC_CHECKPOINT_INTERVAL_KEY, "N", 0,
+   "With --vpc-only, save the statistics gathered so far every N "
+   "documents, so that if indexing is interrupted, running it again "
+   "picks up where it left off.  Zero means never.  Default is 10000."},
 
   {0, 0, 0, 0,
    "For doing document classification using the token-document matrix "
@@ -131,6 +161,16 @@ static struct argp_option rainbow_options[] =
   {"forking-query-server", FORKING_SERVER_KEY, "PORTNUM", 0,
    "Same as `--query-server', except allow multiple clients at once by "
    "forking for each client."},
+  {"event-query-server", EVENT_SERVER_KEY, "PORTNUM", 0,
+   "Serve queries on socket number PORTNUM to many clients at once from "
+   "one process, with an event loop and --threads worker threads sharing "
+   "the class barrel.  Each request is a line holding the number of bytes "
+   "of query text that follow it; requests may be pipelined, and the "
+   "replies, in the format of `--query-server', come back in order.  "
+   "A bad header line is answered with a line starting `ERROR', and "
+   "the connection is closed.  "
+   "Batches of documents may also be sent with the binary protocol of "
+   "bow/qclient.h."},
   {"print-doc-length", PRINT_DOC_LENGTH_KEY, 0, 0,
    "When printing the classification scores for each test document, at the "
    "end also print the number of words in the document.  This only works "
@@ -248,7 +288,9 @@ struct rainbow_arg_state
     rainbow_printing_word_probabilities,
     rainbow_building_and_saving,
     rainbow_testing_from_saved_model,
-    rainbow_indexing_lines
+    rainbow_indexing_lines,
+    rainbow_index_updating,
+    rainbow_index_compacting
   } what_doing;
   /* Where to find query text, or if NULL get query text from stdin */
   const char *query_filename;
@@ -278,12 +320,18 @@ struct rainbow_arg_state
   int test_on_training;
   int use_saved_classifier;
   int forking_server;
-#if VPC_ONLY
+  int event_server;
   /* Set if we only want to build a class barrel */
   int vpc_only;
-#endif
+  /* With VPC_ONLY, checkpoint every this many documents */
+  int vpc_checkpoint_interval;
   int print_doc_length;
   const char *indexing_lines_filename;
+  /* For --index-delete, the file listing the documents to remove */
+  const char *index_delete_filename;
+  /* Compact the index after an update once this fraction of it has
+     changed, or never if zero */
+  double index_compact_fraction;
 } rainbow_arg_state;
 
 static error_t
@@ -295,6 +343,11 @@ rainbow_parse_opt (int key, char *arg, struct argp_state *state)
       rainbow_arg_state.what_doing = rainbow_querying;
       rainbow_arg_state.query_filename = arg;
       break;
+    case EVENT_SERVER_KEY:
+      rainbow_arg_state.what_doing = rainbow_query_serving;
+      rainbow_arg_state.server_port_num = arg;
+      rainbow_arg_state.event_server = 1;
+      break;
     case FORKING_SERVER_KEY:
       rainbow_arg_state.forking_server = 1;
     case SERVER_KEY:
@@ -309,15 +362,29 @@ rainbow_parse_opt (int key, char *arg, struct argp_state *state)
       rainbow_arg_state.what_doing = rainbow_indexing;
       rainbow_arg_state.barrel_printing_format = arg;
       break;
-#if VPC_ONLY
     case VPC_ONLY_KEY:
       rainbow_arg_state.vpc_only = 1;
       break;
-#endif
+    case VPC_CHECKPOINT_INTERVAL_KEY:
+      rainbow_arg_state.vpc_checkpoint_interval = atoi (arg);
+      break;
     case INDEX_LINES_KEY:
       rainbow_arg_state.what_doing = rainbow_indexing_lines;
       rainbow_arg_state.indexing_lines_filename = arg;
       break;
+    case INDEX_ADD_KEY:
+      rainbow_arg_state.what_doing = rainbow_index_updating;
+      break;
+    case INDEX_DELETE_KEY:
+      rainbow_arg_state.what_doing = rainbow_index_updating;
+      rainbow_arg_state.index_delete_filename = arg;
+      break;
+    case INDEX_COMPACT_KEY:
+      rainbow_arg_state.what_doing = rainbow_index_compacting;
+      break;
+    case INDEX_COMPACT_FRACTION_KEY:
+      rainbow_arg_state.index_compact_fraction = atof (arg);
+      break;
     case 'r':
       rainbow_arg_state.repeat_query = 1;
       break;
@@ -444,6 +511,15 @@ rainbow_parse_opt (int key, char *arg, struct argp_state *state)
 	      argp_usage (state);
 	    }
 	}
+      else if (rainbow_arg_state.what_doing == rainbow_index_updating)
+	{
+	  if (state->arg_num == 0
+	      && rainbow_arg_state.index_delete_filename == NULL)
+	    {
+	      fprintf (stderr, "Need directories to add, or --index-delete.\n");
+	      argp_usage (state);
+	    }
+	}
       else if (state->arg_num != 0)
 	{
 	  /* Too many arguments.  */
@@ -513,9 +589,114 @@ filename_to_classname (const char *filename)
 
 #define VOCABULARY_FILENAME "vocabulary"
 #define DOC_BARREL_FILENAME "doc-barrel"
+#define DOC_DI2WV_FILENAME "doc-di2wv"
+#define DOC_DELTA_FILENAME "doc-delta"
 #define CLASS_BARREL_FILENAME "class-barrel"
 #define OUTPUTNAME_FILENAME "outfile"
 #define FORMAT_VERSION_FILENAME "format-version"
+#define LOCK_FILENAME "lock"
+#define VPC_CHECKPOINT_FILENAME "vpc-checkpoint"
+
+/* The number of documents in the doc-barrel file, not counting those
+   added by the doc-delta file. */
+static int rainbow_doc_barrel_file_length;
+
+/* The stamp of the doc-barrel file, which the doc-di2wv and doc-delta
+   files written for it carry too. */
+static bow_barrel_stamp rainbow_doc_barrel_stamp;
+
+/* Fill in STAMP for the document barrel, whose data file is open on
+   FP, so that the files that go with it can be matched to it. */
+static void
+rainbow_doc_barrel_stamp_fp (bow_barrel_stamp *stamp, FILE *fp)
+{
+  struct stat st;
+
+  if (fstat (fileno (fp), &st) != 0)
+    bow_error ("Couldn't stat the document barrel");
+  stamp->num_docs = rainbow_doc_barrel->cdocs->length;
+  stamp->num_words = rainbow_doc_barrel->wi2dvf->num_words;
+  stamp->data_size = st.st_size;
+  stamp->data_mtime = st.st_mtime;
+}
+
+/* Return, in memory from bow_malloc(), the name of the temporary file
+   that FILENAME is written to before it is renamed into place. */
+static char *
+rainbow_tmp_filename (const char *filename)
+{
+  size_t size = strlen (filename) + sizeof (".tmp");
+  char *ret = bow_malloc (size);
+
+  snprintf (ret, size, "%s.tmp", filename);
+  return ret;
+}
+
+/* Rename TMP_FILENAME, which came from rainbow_tmp_filename(), to
+   FILENAME, and free it. */
+static void
+rainbow_rename_tmp_filename (char *tmp_filename, const char *filename)
+{
+  if (rename (tmp_filename, filename) != 0)
+    bow_error ("Couldn't rename `%s' to `%s'", tmp_filename, filename);
+  bow_free (tmp_filename);
+}
+
+/* Write the document barrel, and a forward index of it, in the
+   directory DATA_DIRNAME.  Each is written to a temporary file that
+   is then renamed into place.  Any doc-delta file is removed last,
+   once the changes it holds are in the new doc-barrel; until then, a
+   rainbow reading the directory sees that it doesn't match the new
+   doc-barrel's stamp, and ignores it. */
+static void
+rainbow_archive_doc_barrel ()
+{
+  char filename[BOW_MAX_WORD_LENGTH];
+  char *tmp_filename;
+  char *fnp;
+  FILE *fp;
+
+  strcpy (filename, bow_data_dirname);
+  strcat (filename, "/");
+  fnp = filename + strlen (filename);
+
+  strcpy (fnp, DOC_BARREL_FILENAME);
+  tmp_filename = rainbow_tmp_filename (filename);
+  fp = bow_fopen (tmp_filename, "wb");
+  bow_barrel_write (rainbow_doc_barrel, fp);
+  if (rainbow_doc_barrel)
+    {
+      /* Renaming the file below leaves its size and time alone. */
+      fflush (fp);
+      rainbow_doc_barrel_stamp_fp (&rainbow_doc_barrel_stamp, fp);
+    }
+  fclose (fp);
+  /* Our own barrels may be memory-mapped from the old file; renaming
+     over it leaves their pages alone. */
+  rainbow_rename_tmp_filename (tmp_filename, filename);
+  if (rainbow_doc_barrel)
+    rainbow_doc_barrel_file_length = rainbow_doc_barrel->cdocs->length;
+
+  /* Write a forward index of the document barrel, so that passes over
+     the documents one at a time needn't merge all the DV's. */
+  strcpy (fnp, DOC_DI2WV_FILENAME);
+  if (rainbow_doc_barrel)
+    {
+      bow_di2wv *di2wv;
+      tmp_filename = rainbow_tmp_filename (filename);
+      di2wv = bow_di2wv_new_from_wi2dvf (rainbow_doc_barrel->wi2dvf);
+      fp = bow_fopen (tmp_filename, "wb");
+      bow_di2wv_write (di2wv, &rainbow_doc_barrel_stamp, fp);
+      fclose (fp);
+      bow_di2wv_free (di2wv);
+      rainbow_rename_tmp_filename (tmp_filename, filename);
+    }
+  else
+    unlink (filename);
+
+  strcpy (fnp, DOC_DELTA_FILENAME);
+  unlink (filename);
+}
 
 /* Write the stats in the directory DATA_DIRNAME. */
 void
@@ -543,15 +724,16 @@ rainbow_archive ()
   bow_words_write (fp);
   fclose (fp);
 
+  /* Unlink the barrel files before re-writing them, because our own
+     barrels may be memory-mapped from them, and truncating a mapped
+     file would pull the pages out from under us. */
   strcpy (fnp, CLASS_BARREL_FILENAME);
+  unlink (filename);
   fp = bow_fopen (filename, "wb");
   bow_barrel_write (rainbow_class_barrel, fp);
   fclose (fp);
 
-  strcpy (fnp, DOC_BARREL_FILENAME);
-  fp = bow_fopen (filename, "wb");
-  bow_barrel_write (rainbow_doc_barrel, fp);
-  fclose (fp);
+  rainbow_archive_doc_barrel ();
 }
 
 /* Read the stats from the directory DATA_DIRNAME. */
@@ -564,6 +746,8 @@ rainbow_unarchive ()
   char buf[1024];
   struct stat st;
   int e;
+  bow_barrel_stamp delta_stamp;
+  int have_delta = 0;
   
   if (rainbow_arg_state.what_doing != rainbow_query_serving)
     bow_verbosify (bow_progress, "Loading data files...\n");
@@ -615,6 +799,51 @@ rainbow_unarchive ()
   fp = bow_fopen (filename, "rb");
   rainbow_doc_barrel = bow_barrel_new_from_data_fp (fp);
   /* Don't close it because bow_wi2dvf_dv will still need to read it. */
+  if (rainbow_doc_barrel)
+    rainbow_doc_barrel_stamp_fp (&rainbow_doc_barrel_stamp, fp);
+
+  /* Apply the documents added and deleted since the document barrel
+     was written, if any.  A delta that was already folded into the
+     doc-barrel, but not yet removed, doesn't match its stamp. */
+  if (rainbow_doc_barrel)
+    rainbow_doc_barrel_file_length = rainbow_doc_barrel->cdocs->length;
+  strcpy (fnp, DOC_DELTA_FILENAME);
+  if (rainbow_doc_barrel && (fp = fopen (filename, "rb")))
+    {
+      if (fread (&delta_stamp, sizeof (delta_stamp), 1, fp) == 1
+	  && delta_stamp.num_docs == rainbow_doc_barrel_stamp.num_docs
+	  && delta_stamp.num_words == rainbow_doc_barrel_stamp.num_words
+	  && delta_stamp.data_size == rainbow_doc_barrel_stamp.data_size
+	  && delta_stamp.data_mtime == rainbow_doc_barrel_stamp.data_mtime)
+	{
+	  /* This closes FP. */
+	  bow_barrel_read_delta (rainbow_doc_barrel, fp);
+	  have_delta = 1;
+	}
+      else
+	{
+	  bow_verbosify (bow_progress, "Ignoring stale `%s'\n", filename);
+	  fclose (fp);
+	}
+    }
+
+  /* Use the forward index of the document barrel, if there is one
+     that matches it.  Archives written before it existed don't have
+     one, and do fine without.  It doesn't cover a delta, and one
+     left behind by an earlier index of this directory won't match
+     the stamp of the document barrel. */
+  strcpy (fnp, DOC_DI2WV_FILENAME);
+  if (rainbow_doc_barrel && !have_delta
+      && (fp = fopen (filename, "rb")))
+    {
+      bow_di2wv *di2wv = bow_di2wv_new_from_data_fp
+	(fp, &rainbow_doc_barrel_stamp);
+      fclose (fp);
+      if (di2wv)
+	rainbow_doc_barrel->wi2dvf->di2wv = di2wv;
+      else
+	bow_verbosify (bow_progress, "Ignoring stale `%s'\n", filename);
+    }
 
   /* Only do this if the document barrel exists */
   if (rainbow_doc_barrel && rainbow_doc_barrel->classnames == NULL)
@@ -637,6 +866,14 @@ rainbow_unarchive ()
   if (bow_uniform_class_priors)
     bow_barrel_set_cdoc_priors_to_class_uniform (rainbow_class_barrel);
   /*bow_barrel_set_cdoc_priors_to_class_uniform (rainbow_doc_barrel);*/
+
+  /* The score bounds that methods like kNN and TFIDF prune with
+     aren't archived; find them for the class barrel as read, before
+     any threads score with it.  Updating the index doesn't score. */
+  if (rainbow_class_barrel
+      && rainbow_arg_state.what_doing != rainbow_index_updating
+      && rainbow_arg_state.what_doing != rainbow_index_compacting)
+    bow_barrel_set_score_bounds (rainbow_class_barrel);
 }
 
 
@@ -657,14 +894,12 @@ rainbow_index (int num_classes, const char *classdir_names[],
 	bow_free_barrel (rainbow_doc_barrel);
       /* Index all the documents. */
       rainbow_doc_barrel = bow_barrel_new (0, 0, sizeof (bow_cdoc), NULL);
-#if VPC_ONLY
-      if (rainbow_arg_state.vpc_only)
-	rainbow_doc_barrel->is_vpc = 1;
-#endif VPC_ONLY
       if (bow_argp_method)
 	rainbow_doc_barrel->method = (rainbow_method*)bow_argp_method;
       else
 	rainbow_doc_barrel->method = rainbow_default_method;
+      /* Gather the entries of all the classes before making DV's. */
+      bow_barrel_start_indexing (rainbow_doc_barrel);
       for (class_index = 0; class_index < num_classes; class_index++)
 	{
 	  bow_verbosify (bow_progress, "Class `%s'\n  ", 
@@ -700,6 +935,7 @@ rainbow_index (int num_classes, const char *classdir_names[],
 			     "No text files found in directory `%s'\n", 
 			     classdir_names[class_index]);
 	}
+      bow_barrel_finish_indexing (rainbow_doc_barrel);
       if (bow_uniform_class_priors)
 	bow_barrel_set_cdoc_priors_to_class_uniform (rainbow_doc_barrel);
     }
@@ -760,62 +996,232 @@ rainbow_index (int num_classes, const char *classdir_names[],
 	}
     }
 
-#if VPC_ONLY
-  /* Weights have been calculated - all that is left to do is to calculate
-   * priors */
-  if (rainbow_arg_state.vpc_only)
+  /* Combine the documents into class statistics. */
+  rainbow_class_barrel = 
+    bow_barrel_new_vpc_with_weights (rainbow_doc_barrel);
+}
+
+/* Like rainbow_index(), but add the documents straight into a class
+   barrel, and make no document barrel.  Every
+   VPC_CHECKPOINT_INTERVAL documents, save what has been gathered so
+   far; if a checkpoint is there when we start, pick up from it. */
+void
+rainbow_index_vpc (int num_classes, const char *classdir_names[],
+		   const char *exception_name)
+{
+  char checkpoint_filename[BOW_MAX_WORD_LENGTH];
+  int class_index;
+
+  if (bow_prune_vocab_by_occur_count_n || bow_prune_vocab_by_infogain_n
+      || bow_prune_words_by_doc_count_n)
+    bow_error ("The vocabulary can't be pruned with --vpc-only");
+
+  sprintf (checkpoint_filename, "%s/%s", bow_data_dirname,
+	   VPC_CHECKPOINT_FILENAME);
+  if (access (checkpoint_filename, R_OK) == 0)
+    {
+      bow_verbosify (bow_progress, "Resuming from checkpoint `%s'\n",
+		     checkpoint_filename);
+      rainbow_class_barrel =
+	bow_barrel_new_vpc_from_checkpoint (checkpoint_filename);
+    }
+  else
+    rainbow_class_barrel = bow_barrel_new_vpc_streaming ();
+
+  for (class_index = 0; class_index < num_classes; class_index++)
+    {
+      bow_verbosify (bow_progress, "Class `%s'\n  ", 
+		     filename_to_classname (classdir_names[class_index]));
+      if (bow_barrel_add_vpc_from_text_dir
+	  (rainbow_class_barrel,
+	   classdir_names[class_index],
+	   exception_name,
+	   filename_to_classname (classdir_names[class_index]),
+	   (rainbow_arg_state.vpc_checkpoint_interval
+	    ? checkpoint_filename : NULL),
+	   rainbow_arg_state.vpc_checkpoint_interval)
+	  == 0)
+	bow_verbosify (bow_quiet,
+		       "No new text files found in directory `%s'\n", 
+		       classdir_names[class_index]);
+    }
+  bow_barrel_finish_vpc_streaming (rainbow_class_barrel);
+  /* There is no document barrel; an empty one is written to disk. */
+  rainbow_doc_barrel = NULL;
+}
+
+/* Take the lock on the directory DATA_DIRNAME that keeps two
+   rainbows from writing to it at once, waiting for it if need be.  It
+   is held until the process, and any child that inherits it, exits. */
+static void
+rainbow_lock_data_dir ()
+{
+  char filename[BOW_MAX_WORD_LENGTH];
+  int fd;
+
+  sprintf (filename, "%s/%s", bow_data_dirname, LOCK_FILENAME);
+  if ((fd = open (filename, O_RDWR | O_CREAT, 0666)) < 0)
+    bow_error ("Couldn't open `%s'", filename);
+  if (flock (fd, LOCK_EX) != 0)
+    bow_error ("Couldn't lock `%s'", filename);
+}
+
+/* Fold the documents added and deleted since the document barrel was
+   written into it, and write it back out. */
+static void
+rainbow_index_compact ()
+{
+  bow_verbosify (bow_progress, "Compacting %d documents, of which %d "
+		 "are new\n", rainbow_doc_barrel->cdocs->length,
+		 (rainbow_doc_barrel->cdocs->length
+		  - rainbow_doc_barrel_file_length));
+  bow_barrel_compact (rainbow_doc_barrel);
+  rainbow_archive_doc_barrel ();
+}
+
+/* Delete from the index in DATA_DIRNAME the documents whose filenames
+   are listed in DELETE_FILENAME, if it is non-NULL, and add those
+   under the directories CLASSDIR_NAMES, without touching the rest.
+   The changes are written to a doc-delta file next to the
+   doc-barrel, and the class barrel is rebuilt.  If more than
+   COMPACT_FRACTION of the documents have changed since the doc-barrel
+   was written, fold them into it, in a child process. */
+static void
+rainbow_index_update (int num_classes, const char *classdir_names[],
+		      const char *delete_filename, double compact_fraction)
+{
+  char filename[BOW_MAX_WORD_LENGTH];
+  char *tmp_filename;
+  char line[BOW_MAX_WORD_LENGTH];
+  bow_int4str *filenames;
+  bow_cdoc *cdoc;
+  FILE *fp;
+  int first_new_di, class_index, di, num_deleted, num_changed, len;
+
+  rainbow_unarchive ();
+  if (!rainbow_doc_barrel)
+    bow_error ("There is no document barrel to update in `%s'",
+	       bow_data_dirname);
+  first_new_di = rainbow_doc_barrel->cdocs->length;
+
+  if (delete_filename)
     {
-      bow_cdoc *cdocp;
-      double prior_sum = 0.0;
-      int num_classes = bow_barrel_num_classes (rainbow_doc_barrel);
-      int ci;
-      /* Normalize the class priors */
-      for (ci=0; ci < num_classes; ci++)
+      filenames = bow_int4str_new (0);
+      fp = bow_fopen (delete_filename, "r");
+      while (fgets (line, BOW_MAX_WORD_LENGTH, fp))
 	{
-	  cdocp = bow_array_entry_at_index (rainbow_doc_barrel->cdocs, ci);
-	  prior_sum += cdocp->prior;
+	  len = strlen (line);
+	  if (len > 0 && line[len-1] == '\n')
+	    line[--len] = '\0';
+	  if (len > 0)
+	    bow_str2int (filenames, line);
 	}
-      if (prior_sum)
-	for (ci=0; ci < num_classes; ci++)
-	  {
-	    cdocp = bow_array_entry_at_index (rainbow_doc_barrel->cdocs, ci);
-	    cdocp->prior = cdocp->prior / prior_sum;
-	  }
-      else
-	bow_verbosify (bow_progress, "WARNING: All classes have zero prior\n");
-      /* Recalculate word counts for each class */
-      {
-	bow_wv *wv = NULL;
-	int wvi;
-	bow_cdoc *cdoc;
-	int di;
-	bow_dv_heap *heap = bow_test_new_heap (rainbow_doc_barrel);
-	while ((di = bow_heap_next_wv (heap, rainbow_doc_barrel, &wv,
-				       bow_cdoc_yes)) != -1)
-	  {
-	    cdoc = bow_array_entry_at_index (rainbow_doc_barrel->cdocs, di);
-	    cdoc->word_count = 0;
-	    for (wvi = 0; wvi < wv->num_entries; wvi++)
-	      {
-		if (bow_wi2dvf_dv (rainbow_doc_barrel->wi2dvf,
-				   wv->entry[wvi].wi))
-		  cdoc->word_count += wv->entry[wvi].count;
-	      }
-	  }
-      }
-      /* We have been (secretly) using the doc_barrel as a class barrel
-       * all along.  Set doc_barrel to NULL so that an empty file is
-       * written to disk.  This will keep future executions from
-       * attempting to recalculate the class_barrel */
-      rainbow_class_barrel = rainbow_doc_barrel;
-      rainbow_doc_barrel = NULL;
-      return;
+      fclose (fp);
+      num_deleted = bow_barrel_delete_filenames (rainbow_doc_barrel,
+						 filenames, first_new_di);
+      bow_verbosify (bow_progress, "Deleted %d documents\n", num_deleted);
+      bow_int4str_free (filenames);
     }
-#endif
 
-  /* Combine the documents into class statistics. */
+  if (num_classes > 0)
+    {
+      /* The new entries go in the delta, in core; writing runs of
+	 them would only fold the whole barrel into one file. */
+      bow_index_memory_budget = 0;
+      bow_barrel_start_indexing (rainbow_doc_barrel);
+      for (class_index = 0; class_index < num_classes; class_index++)
+	{
+	  bow_verbosify (bow_progress, "Class `%s'\n  ", 
+			 filename_to_classname (classdir_names[class_index]));
+	  if (bow_barrel_add_from_text_dir
+	      (rainbow_doc_barrel, 
+	       classdir_names[class_index],
+	       rainbow_arg_state.output_filename,
+	       filename_to_classname (classdir_names[class_index]))
+	      == 0)
+	    bow_verbosify (bow_quiet,
+			   "No text files found in directory `%s'\n", 
+			   classdir_names[class_index]);
+	}
+      bow_barrel_finish_indexing (rainbow_doc_barrel);
+
+      /* A file that is added again, after it has been re-labeled for
+	 example, replaces the one that was there. */
+      filenames = bow_int4str_new (0);
+      for (di = first_new_di; di < rainbow_doc_barrel->cdocs->length; di++)
+	{
+	  cdoc = bow_array_entry_at_index (rainbow_doc_barrel->cdocs, di);
+	  bow_str2int (filenames, cdoc->filename);
+	}
+      num_deleted = bow_barrel_delete_filenames (rainbow_doc_barrel,
+						 filenames, first_new_di);
+      bow_verbosify (bow_progress, "Added %d documents, replacing %d\n",
+		     rainbow_doc_barrel->cdocs->length - first_new_di,
+		     num_deleted);
+      bow_int4str_free (filenames);
+    }
+
+  /* Combine the documents into class statistics again. */
+  bow_free_barrel (rainbow_class_barrel);
   rainbow_class_barrel = 
     bow_barrel_new_vpc_with_weights (rainbow_doc_barrel);
+
+  /* Write everything but the doc-barrel, each to a temporary file
+     that is then renamed into place, so that a rainbow reading them
+     meanwhile never sees one half written, and ours, which may be
+     memory-mapped from the old class barrel, keeps its pages.  The
+     vocabulary only grows, so it still fits the old barrels. */
+  sprintf (filename, "%s/%s", bow_data_dirname, VOCABULARY_FILENAME);
+  tmp_filename = rainbow_tmp_filename (filename);
+  fp = bow_fopen (tmp_filename, "wb");
+  bow_words_write (fp);
+  fclose (fp);
+  rainbow_rename_tmp_filename (tmp_filename, filename);
+
+  sprintf (filename, "%s/%s", bow_data_dirname, CLASS_BARREL_FILENAME);
+  tmp_filename = rainbow_tmp_filename (filename);
+  fp = bow_fopen (tmp_filename, "wb");
+  bow_barrel_write (rainbow_class_barrel, fp);
+  fclose (fp);
+  rainbow_rename_tmp_filename (tmp_filename, filename);
+
+  /* The delta starts with the stamp of the doc-barrel it follows. */
+  sprintf (filename, "%s/%s", bow_data_dirname, DOC_DELTA_FILENAME);
+  tmp_filename = rainbow_tmp_filename (filename);
+  fp = bow_fopen (tmp_filename, "wb");
+  if (fwrite (&rainbow_doc_barrel_stamp, sizeof (bow_barrel_stamp), 1, fp)
+      != 1)
+    bow_error ("Couldn't write `%s'", tmp_filename);
+  bow_barrel_write_delta (rainbow_doc_barrel, rainbow_doc_barrel_file_length,
+			  fp);
+  fclose (fp);
+  rainbow_rename_tmp_filename (tmp_filename, filename);
+
+  /* If much has changed, fold the changes in.  This reads all of the
+     DV's, so do it in the background; the child keeps the lock until
+     it is done. */
+  num_changed = (rainbow_doc_barrel->cdocs->length
+		 - rainbow_doc_barrel_file_length);
+  for (di = 0; di < rainbow_doc_barrel_file_length; di++)
+    {
+      cdoc = bow_array_entry_at_index (rainbow_doc_barrel->cdocs, di);
+      if (cdoc->type == bow_doc_deleted)
+	num_changed++;
+    }
+  if (compact_fraction > 0
+      && num_changed > compact_fraction * rainbow_doc_barrel_file_length)
+    {
+      pid_t pid = fork ();
+      if (pid < 0)
+	bow_error ("Couldn't fork to compact the index");
+      if (pid == 0)
+	{
+	  rainbow_index_compact ();
+	  exit (0);
+	}
+      bow_verbosify (bow_progress, "Compacting the index in process %d\n",
+		     (int) pid);
+    }
 }
 
 void
@@ -1156,7 +1562,7 @@ rainbow_socket_init (const char *socket_name, int use_unix_socket)
   bind_ret = bind(rainbow_sockfd, sap, servlen);
   assert(bind_ret >= 0);
 
-  listen(rainbow_sockfd, 5);
+  listen(rainbow_sockfd, rainbow_arg_state.event_server ? SOMAXCONN : 5);
 }
 
 
@@ -1207,6 +1613,787 @@ rainbow_serve ()
     exit (0);
 }
 
+
+/* Read in all the DV's of the class barrel now, so that threads
+   scoring against it only ever read the barrel. */
+static void
+rainbow_class_barrel_read_all_dvs ()
+{
+  int wi;
+
+  for (wi = 0; wi < rainbow_class_barrel->wi2dvf->size; wi++)
+    bow_wi2dvf_dv (rainbow_class_barrel->wi2dvf, wi);
+}
+
+/* The event-driven query server, for --event-query-server.  One
+   thread runs an epoll loop that accepts connections, reads requests
+   and writes replies, all without blocking; the other --threads
+   threads lex and score the queries.  A request is a line holding the
+   number of bytes of query text, then the text; or a binary request,
+   described in bow/qclient.h, holding a batch of documents as text or
+   word vectors.  A client may send many requests without waiting for
+   the replies; the replies to each connection are written in the
+   order its requests arrived.  A bad header line is answered with
+   "ERROR <message>" and "." lines, and ends the connection. */
+
+/* The largest query text we will accept, in bytes. */
+#define RAINBOW_SERVER_MAX_QUERY_LENGTH (16 * 1024 * 1024)
+
+/* The number of bytes read from a socket at a time. */
+#define RAINBOW_SERVER_READ_SIZE 65536
+
+typedef struct _rainbow_server_request {
+  struct _rainbow_server_conn *conn;
+  int seq;			/* the request's position on CONN */
+  char *text;			/* the query text, or binary request */
+  int text_length;
+  int binary;			/* is TEXT a binary request? */
+  char *reply;
+  int reply_length;
+  struct _rainbow_server_request *next;
+} rainbow_server_request;
+
+/* A client connection.  Its buffers are only allocated while there is
+   something in them, so that idle connections cost little. */
+typedef struct _rainbow_server_conn {
+  int fd;
+  char *in;			/* bytes read but not yet parsed */
+  int in_length;
+  char *out;			/* replies not yet written */
+  int out_length;
+  int out_written;
+  int next_seq;			/* SEQ of the next request read */
+  int next_seq_to_send;		/* SEQ of the next reply to write */
+  rainbow_server_request *replies; /* early replies, sorted by SEQ */
+  int num_outstanding;		/* requests being scored */
+  int closing;			/* no more requests will be read */
+  int broken;			/* replies can no longer be written */
+  unsigned events;		/* the epoll events we wait for */
+} rainbow_server_conn;
+
+/* Requests waiting to be scored, and replies waiting to be written. */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  rainbow_server_request *todo, *todo_last;
+  rainbow_server_request *done;
+  int wake_fd;			/* an eventfd that wakes the event loop */
+  int epoll_fd;
+} rainbow_server;
+
+/* Markers for the epoll data of the listening socket and WAKE_FD. */
+static int rainbow_server_listen_marker, rainbow_server_wake_marker;
+
+/* Score QUERY_WV, which may be NULL, and free it, using the thread's
+   context CTX.  Put the best NUM_HITS scores in HITS and return how
+   many there are. */
+static int
+rainbow_server_score_wv (bow_ctx *ctx, bow_wv *query_wv, bow_score *hits,
+			 int num_hits)
+{
+  int actual_num_hits = 0;
+
+  if (query_wv && query_wv->num_entries == 0)
+    {
+      /* As in rainbow_query(), an empty query gets an empty reply. */
+      bow_wv_free (query_wv);
+      query_wv = NULL;
+    }
+  if (query_wv)
+    {
+      bow_wv_prune_words_not_in_wi2dvf (query_wv,
+					rainbow_class_barrel->wi2dvf);
+      actual_num_hits = bow_barrel_score_r (ctx, rainbow_class_barrel,
+					    query_wv, hits, num_hits, -1);
+      bow_wv_free (query_wv);
+    }
+  return actual_num_hits;
+}
+
+static int
+rainbow_server_compare_we (const void *we1, const void *we2)
+{
+  return ((const bow_we *)we1)->wi - ((const bow_we *)we2)->wi;
+}
+
+/* Return the word vector of the NUM_ENTRIES pairs of word index and
+   count at P, as sent in the binary protocol.  The counts must
+   already be known to be positive ints.  Unknown words are dropped,
+   and repeated ones merged. */
+static bow_wv *
+rainbow_server_wv_from_pairs (const unsigned char *p, int num_entries)
+{
+  bow_wv *wv = bow_wv_new (num_entries);
+  int num_words = bow_num_words ();
+  int i, n;
+  unsigned int wi;
+
+  for (i = n = 0; i < num_entries; i++, p += 8)
+    {
+      wi = bow_qproto_get32 (p);
+      if (wi >= num_words)
+	continue;
+      wv->entry[n].wi = wi;
+      wv->entry[n].count = bow_qproto_get32 (p + 4);
+      wv->entry[n].weight = wv->entry[n].count;
+      n++;
+    }
+  qsort (wv->entry, n, sizeof (bow_we), rainbow_server_compare_we);
+  for (i = 0, wv->num_entries = 0; i < n; i++)
+    {
+      if (wv->num_entries
+	  && wv->entry[wv->num_entries-1].wi == wv->entry[i].wi)
+	{
+	  /* Don't let repeats add up to more than an int holds. */
+	  if (wv->entry[i].count > INT_MAX - wv->entry[wv->num_entries-1].count)
+	    wv->entry[wv->num_entries-1].count = INT_MAX;
+	  else
+	    wv->entry[wv->num_entries-1].count += wv->entry[i].count;
+	  wv->entry[wv->num_entries-1].weight += wv->entry[i].weight;
+	}
+      else
+	wv->entry[wv->num_entries++] = wv->entry[i];
+    }
+  wv->normalizer = 0;
+  return wv;
+}
+
+/* Return, in malloc()'ed memory, the header of a binary reply with
+   room for LENGTH bytes in all, and set its STATUS. */
+static unsigned char *
+rainbow_server_binary_reply_new (unsigned int id, int status, int length)
+{
+  unsigned char *reply = bow_malloc (length);
+
+  bow_qproto_put32 (reply, BOW_QPROTO_REPLY_MAGIC);
+  bow_qproto_put32 (reply + 4, length - 8);
+  bow_qproto_put32 (reply + 8, id);
+  bow_qproto_put16 (reply + 12, status);
+  bow_qproto_put16 (reply + 14, 0);
+  return reply;
+}
+
+/* Answer the binary request of LENGTH bytes at REQ, and return the
+   reply in malloc()'ed memory, setting *REPLY_LENGTH to its length.
+   HITS has room for as many scores as there are classes. */
+static char *
+rainbow_server_answer_binary (bow_ctx *ctx, const unsigned char *req,
+			      int length, bow_score *hits, int *reply_length)
+{
+  const unsigned char *p, *end = req + length;
+  unsigned char *reply, *rp;
+  unsigned int id, op, num_docs, type, n, count;
+  size_t max_length;
+  int num_classes = bow_barrel_num_classes (rainbow_class_barrel);
+  int k, d, i, actual_num_hits;
+  char *text;
+
+  id = bow_qproto_get32 (req + 8);
+  op = bow_qproto_get16 (req + 12);
+  k = bow_qproto_get16 (req + 14);
+  num_docs = bow_qproto_get32 (req + 16);
+  if (k == 0 || k > num_classes)
+    k = num_classes;
+
+  if (op == BOW_QPROTO_OP_CLASSNAMES)
+    {
+      *reply_length = BOW_QPROTO_REPLY_HEADER_SIZE + 4;
+      for (i = 0; i < num_classes; i++)
+	*reply_length += 4 + strlen (bow_int2str
+				     (rainbow_class_barrel->classnames, i));
+      reply = rainbow_server_binary_reply_new (id, BOW_QPROTO_STATUS_OK,
+					       *reply_length);
+      rp = reply + BOW_QPROTO_REPLY_HEADER_SIZE;
+      bow_qproto_put32 (rp, num_classes);
+      for (i = 0, rp += 4; i < num_classes; i++)
+	{
+	  const char *name = bow_int2str (rainbow_class_barrel->classnames, i);
+	  n = strlen (name);
+	  bow_qproto_put32 (rp, n);
+	  memcpy (rp + 4, name, n);
+	  rp += 4 + n;
+	}
+      return (char *) reply;
+    }
+  if (op != BOW_QPROTO_OP_CLASSIFY)
+    {
+      *reply_length = BOW_QPROTO_REPLY_HEADER_SIZE;
+      return (char *) rainbow_server_binary_reply_new
+	(id, BOW_QPROTO_STATUS_UNKNOWN_OP, *reply_length);
+    }
+
+  /* Check the framing of every document, and the counts of the word
+     vectors, before scoring any. */
+  p = req + BOW_QPROTO_REQUEST_HEADER_SIZE;
+  for (d = 0; d < num_docs && end - p >= 8; d++)
+    {
+      type = bow_qproto_get32 (p);
+      n = bow_qproto_get32 (p + 4);
+      p += 8;
+      if (type == BOW_QPROTO_DOC_WV && n <= (end - p) / 8)
+	{
+	  for (i = 0; i < n; i++, p += 8)
+	    {
+	      count = bow_qproto_get32 (p + 4);
+	      if (count == 0 || count > INT_MAX)
+		break;
+	    }
+	  if (i < n)
+	    break;
+	}
+      else if (type == BOW_QPROTO_DOC_TEXT && n <= end - p)
+	p += n;
+      else
+	break;
+    }
+  if (d < num_docs || p != end)
+    {
+      *reply_length = BOW_QPROTO_REPLY_HEADER_SIZE;
+      return (char *) rainbow_server_binary_reply_new
+	(id, BOW_QPROTO_STATUS_MALFORMED, *reply_length);
+    }
+
+  /* The request is at most BOW_QPROTO_MAX_LENGTH bytes, but K scores
+     for each of its documents can be much more than that. */
+  max_length = (BOW_QPROTO_REPLY_HEADER_SIZE + 4
+		+ (size_t) num_docs * (4 + 8 * (size_t) k));
+  if (max_length - 8 > BOW_QPROTO_MAX_LENGTH)
+    {
+      *reply_length = BOW_QPROTO_REPLY_HEADER_SIZE;
+      return (char *) rainbow_server_binary_reply_new
+	(id, BOW_QPROTO_STATUS_TOO_LARGE, *reply_length);
+    }
+  *reply_length = max_length;
+  reply = rainbow_server_binary_reply_new (id, BOW_QPROTO_STATUS_OK,
+					   *reply_length);
+  rp = reply + BOW_QPROTO_REPLY_HEADER_SIZE;
+  bow_qproto_put32 (rp, num_docs);
+  rp += 4;
+  p = req + BOW_QPROTO_REQUEST_HEADER_SIZE;
+  for (d = 0; d < num_docs; d++)
+    {
+      type = bow_qproto_get32 (p);
+      n = bow_qproto_get32 (p + 4);
+      p += 8;
+      if (type == BOW_QPROTO_DOC_WV)
+	{
+	  actual_num_hits = rainbow_server_score_wv
+	    (ctx, rainbow_server_wv_from_pairs (p, n), hits, k);
+	  p += 8 * n;
+	}
+      else
+	{
+	  text = bow_malloc (n + 1);
+	  memcpy (text, p, n);
+	  text[n] = '\0';
+	  actual_num_hits = rainbow_server_score_wv
+	    (ctx, bow_wv_new_from_str_r (ctx, text), hits, k);
+	  bow_free (text);
+	  p += n;
+	}
+      bow_qproto_put32 (rp, actual_num_hits);
+      for (i = 0, rp += 4; i < actual_num_hits; i++, rp += 8)
+	{
+	  bow_qproto_put32 (rp, hits[i].di);
+	  bow_qproto_put_float (rp + 4, hits[i].weight);
+	}
+    }
+  /* Documents with fewer than K scores leave the reply short. */
+  *reply_length = rp - reply;
+  bow_qproto_put32 (reply + 4, *reply_length - 8);
+  return (char *) reply;
+}
+
+/* Lex and score the query text TEXT, and return the reply in
+   malloc()'ed memory, setting *LENGTH to its length.  HITS has room
+   for as many scores as there are classes. */
+static char *
+rainbow_server_answer (bow_ctx *ctx, char *text, bow_score *hits,
+		       int *length)
+{
+  int num_hits = bow_barrel_num_classes (rainbow_class_barrel);
+  int actual_num_hits;
+  char *reply;
+  const char *name;
+  int reply_size, i, n;
+
+  actual_num_hits = rainbow_server_score_wv
+    (ctx, bow_wv_new_from_str_r (ctx, text), hits, num_hits);
+
+  /* Room for the class names, and usually for the scores. */
+  reply_size = 3;
+  for (i = 0; i < actual_num_hits; i++)
+    reply_size += (strlen (bow_int2str (rainbow_class_barrel->classnames,
+					hits[i].di))
+		   + 32);
+  reply = bow_malloc (reply_size);
+  *length = 0;
+  for (i = 0; i < actual_num_hits; i++)
+    {
+      /* For the sake CommonLisp, don't print numbers smaller than
+	 1e-35, because it can't `(read)' them. */
+      if (rainbow_arg_state.use_lisp_score_truncation
+	  && hits[i].weight < 1e-35
+	  && hits[i].weight > 0)
+	hits[i].weight = 0;
+      name = bow_int2str (rainbow_class_barrel->classnames, hits[i].di);
+      while ((n = snprintf (reply + *length, reply_size - *length,
+			    "%s %.*g\n", name, bow_score_print_precision,
+			    hits[i].weight))
+	     >= reply_size - *length - 2)
+	{
+	  /* A long score; leave room for the rest too. */
+	  reply_size = 2 * reply_size + n;
+	  reply = bow_realloc (reply, reply_size);
+	}
+      *length += n;
+    }
+  strcpy (reply + *length, ".\n");
+  *length += 2;
+  return reply;
+}
+
+static void rainbow_server_event_loop ();
+
+/* The worker threads: score requests until the end of time, each
+   with a context of its own.  Thread 0 runs the event loop instead. */
+static void
+rainbow_server_worker (int thread_index, void *context)
+{
+  bow_ctx *ctx;
+  bow_score *hits;
+  rainbow_server_request *req;
+  uint64_t one = 1;
+
+  if (thread_index == 0)
+    {
+      /* The calling thread runs the event loop. */
+      rainbow_server_event_loop ();
+      return;
+    }
+  ctx = bow_ctx_new ();
+  hits = bow_malloc (bow_barrel_num_classes (rainbow_class_barrel)
+		     * sizeof (bow_score));
+  for (;;)
+    {
+      pthread_mutex_lock (&rainbow_server.lock);
+      while (!rainbow_server.todo)
+	pthread_cond_wait (&rainbow_server.not_empty, &rainbow_server.lock);
+      req = rainbow_server.todo;
+      if (!(rainbow_server.todo = req->next))
+	rainbow_server.todo_last = NULL;
+      pthread_mutex_unlock (&rainbow_server.lock);
+
+      if (req->binary)
+	req->reply = rainbow_server_answer_binary
+	  (ctx, (unsigned char *) req->text, req->text_length, hits,
+	   &req->reply_length);
+      else
+	req->reply = rainbow_server_answer (ctx, req->text, hits,
+					    &req->reply_length);
+      bow_free (req->text);
+      req->text = NULL;
+
+      pthread_mutex_lock (&rainbow_server.lock);
+      req->next = rainbow_server.done;
+      rainbow_server.done = req;
+      pthread_mutex_unlock (&rainbow_server.lock);
+      write (rainbow_server.wake_fd, &one, sizeof (one));
+    }
+}
+
+/* Set the events we wait for on CONN: input until it is closing, and
+   output while there are replies that couldn't be written yet. */
+static void
+rainbow_server_conn_watch (rainbow_server_conn *conn, int want_write)
+{
+  struct epoll_event ev;
+
+  if (conn->broken)
+    {
+      /* Otherwise we would hear of the hang-up over and over. */
+      if (conn->events)
+	epoll_ctl (rainbow_server.epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+      conn->events = 0;
+      return;
+    }
+  ev.events = ((conn->closing ? 0 : EPOLLIN | EPOLLRDHUP)
+	       | (want_write ? EPOLLOUT : 0));
+  if (conn->events == ev.events)
+    return;
+  conn->events = ev.events;
+  ev.data.ptr = conn;
+  epoll_ctl (rainbow_server.epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/* Write as much of CONN's pending replies as the socket will take. */
+static void
+rainbow_server_conn_flush (rainbow_server_conn *conn)
+{
+  int n;
+
+  while (conn->out_written < conn->out_length)
+    {
+      n = send (conn->fd, conn->out + conn->out_written,
+		conn->out_length - conn->out_written, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+	  rainbow_server_conn_watch (conn, 1);
+	  return;
+	}
+      if (n < 0)
+	{
+	  /* The client went away; drop what it won't read. */
+	  conn->closing = conn->broken = 1;
+	  break;
+	}
+      conn->out_written += n;
+    }
+  bow_free (conn->out);
+  conn->out = NULL;
+  conn->out_length = conn->out_written = 0;
+  rainbow_server_conn_watch (conn, 0);
+}
+
+/* Close and free CONN if we are done with it.  Return non-zero if it
+   was freed. */
+static int
+rainbow_server_conn_maybe_close (rainbow_server_conn *conn)
+{
+  if (!conn->closing || conn->num_outstanding
+      || (conn->out && !conn->broken))
+    return 0;
+  close (conn->fd);
+  if (conn->in)
+    bow_free (conn->in);
+  if (conn->out)
+    bow_free (conn->out);
+  assert (!conn->replies);
+  bow_free (conn);
+  return 1;
+}
+
+/* Queue the reply of the scored request REQ for writing, along with
+   any replies that were waiting for it. */
+static void
+rainbow_server_deliver (rainbow_server_request *req)
+{
+  rainbow_server_conn *conn = req->conn;
+  rainbow_server_request **rp;
+
+  /* Insert REQ among the replies that arrived early. */
+  for (rp = &conn->replies; *rp && (*rp)->seq < req->seq; rp = &(*rp)->next)
+    ;
+  req->next = *rp;
+  *rp = req;
+
+  while ((req = conn->replies) && req->seq == conn->next_seq_to_send)
+    {
+      conn->replies = req->next;
+      conn->next_seq_to_send++;
+      conn->num_outstanding--;
+      if (!conn->broken)
+	{
+	  conn->out = bow_realloc (conn->out,
+				   conn->out_length + req->reply_length);
+	  memcpy (conn->out + conn->out_length, req->reply,
+		  req->reply_length);
+	  conn->out_length += req->reply_length;
+	}
+      bow_free (req->reply);
+      bow_free (req);
+    }
+  if (conn->out)
+    rainbow_server_conn_flush (conn);
+  rainbow_server_conn_maybe_close (conn);
+}
+
+/* Queue a request of LENGTH bytes of CONN's input starting at TEXT
+   for the workers. */
+static void
+rainbow_server_conn_queue (rainbow_server_conn *conn, const char *text,
+			   int length, int binary)
+{
+  rainbow_server_request *req;
+
+  req = bow_malloc (sizeof (rainbow_server_request));
+  req->conn = conn;
+  req->seq = conn->next_seq++;
+  req->text = bow_malloc (length + 1);
+  memcpy (req->text, text, length);
+  req->text[length] = '\0';
+  req->text_length = length;
+  req->binary = binary;
+  req->next = NULL;
+  conn->num_outstanding++;
+
+  pthread_mutex_lock (&rainbow_server.lock);
+  if (rainbow_server.todo_last)
+    rainbow_server.todo_last->next = req;
+  else
+    rainbow_server.todo = req;
+  rainbow_server.todo_last = req;
+  pthread_cond_signal (&rainbow_server.not_empty);
+  pthread_mutex_unlock (&rainbow_server.lock);
+}
+
+/* Answer CONN's next request with the error MESSAGE, after the
+   replies to its earlier requests. */
+static void
+rainbow_server_conn_refuse (rainbow_server_conn *conn, const char *message)
+{
+  rainbow_server_request *req;
+  uint64_t one = 1;
+
+  req = bow_malloc (sizeof (rainbow_server_request));
+  req->conn = conn;
+  req->seq = conn->next_seq++;
+  req->text = NULL;
+  req->text_length = 0;
+  req->binary = 0;
+  req->reply_length = strlen ("ERROR \n.\n") + strlen (message);
+  req->reply = bow_malloc (req->reply_length + 1);
+  sprintf (req->reply, "ERROR %s\n.\n", message);
+  conn->num_outstanding++;
+
+  /* Go through the workers' replies, which are delivered in order. */
+  pthread_mutex_lock (&rainbow_server.lock);
+  req->next = rainbow_server.done;
+  rainbow_server.done = req;
+  pthread_mutex_unlock (&rainbow_server.lock);
+  write (rainbow_server.wake_fd, &one, sizeof (one));
+}
+
+/* Hand the complete requests at the front of CONN's input to the
+   workers.  Return -1 if the input is malformed; a bad header line
+   gets an error reply first. */
+static int
+rainbow_server_conn_parse (rainbow_server_conn *conn)
+{
+  const unsigned char *u;
+  char *nl, *s;
+  long length;
+  int used = 0, avail;
+
+  while ((avail = conn->in_length - used) > 0)
+    {
+      u = (unsigned char *) conn->in + used;
+      if (u[0] == (BOW_QPROTO_REQUEST_MAGIC >> 24))
+	{
+	  /* A binary request; see bow/qclient.h. */
+	  if (avail < 8)
+	    break;
+	  length = bow_qproto_get32 (u + 4);
+	  if (bow_qproto_get32 (u) != BOW_QPROTO_REQUEST_MAGIC
+	      || length + 8 < BOW_QPROTO_REQUEST_HEADER_SIZE
+	      || length > BOW_QPROTO_MAX_LENGTH)
+	    return -1;
+	  if (avail < length + 8)
+	    break;
+	  rainbow_server_conn_queue (conn, conn->in + used, length + 8, 1);
+	  used += length + 8;
+	  continue;
+	}
+      if (!(nl = memchr (conn->in + used, '\n', avail)))
+	{
+	  if (avail > 32)
+	    {
+	      /* No header line is that long. */
+	      rainbow_server_conn_refuse (conn, "header line too long");
+	      return -1;
+	    }
+	  break;
+	}
+      /* The header is the length in decimal digits, and nothing else
+	 but an optional carriage return.  The input isn't
+	 NUL-terminated, so don't read past NL. */
+      length = 0;
+      for (s = conn->in + used; s < nl && *s >= '0' && *s <= '9'; s++)
+	if ((length = 10 * length + (*s - '0'))
+	    > RAINBOW_SERVER_MAX_QUERY_LENGTH)
+	  break;
+      if (length > RAINBOW_SERVER_MAX_QUERY_LENGTH)
+	{
+	  rainbow_server_conn_refuse (conn, "query too long");
+	  return -1;
+	}
+      if (s == conn->in + used
+	  || (s < nl && !(*s == '\r' && s + 1 == nl)))
+	{
+	  rainbow_server_conn_refuse (conn, "bad header line");
+	  return -1;
+	}
+      if (conn->in_length - (nl + 1 - conn->in) < length)
+	break;
+      rainbow_server_conn_queue (conn, nl + 1, length, 0);
+      used = nl + 1 + length - conn->in;
+    }
+  if (used == conn->in_length)
+    {
+      bow_free (conn->in);
+      conn->in = NULL;
+      conn->in_length = 0;
+    }
+  else if (used)
+    {
+      memmove (conn->in, conn->in + used, conn->in_length - used);
+      conn->in_length -= used;
+    }
+  return 0;
+}
+
+/* Read everything available on CONN, and queue its requests. */
+static void
+rainbow_server_conn_read (rainbow_server_conn *conn)
+{
+  char buf[RAINBOW_SERVER_READ_SIZE];
+  int n;
+
+  while (!conn->closing)
+    {
+      n = read (conn->fd, buf, sizeof (buf));
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	break;
+      if (n <= 0)
+	{
+	  /* End of input; still answer what was asked. */
+	  conn->closing = 1;
+	  break;
+	}
+      conn->in = bow_realloc (conn->in, conn->in_length + n);
+      memcpy (conn->in + conn->in_length, buf, n);
+      conn->in_length += n;
+      if (rainbow_server_conn_parse (conn) < 0)
+	{
+	  bow_verbosify (bow_progress, "Bad request; closing connection.\n");
+	  conn->closing = 1;
+	  break;
+	}
+    }
+}
+
+/* Accept all pending connections on the listening socket. */
+static void
+rainbow_server_accept ()
+{
+  struct epoll_event ev;
+  rainbow_server_conn *conn;
+  int fd;
+
+  while ((fd = accept (rainbow_sockfd, NULL, NULL)) >= 0)
+    {
+      fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+      conn = bow_malloc (sizeof (rainbow_server_conn));
+      memset (conn, 0, sizeof (rainbow_server_conn));
+      conn->fd = fd;
+      conn->events = ev.events = EPOLLIN | EPOLLRDHUP;
+      ev.data.ptr = conn;
+      if (epoll_ctl (rainbow_server.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	bow_error ("epoll_ctl: %s", strerror (errno));
+    }
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    bow_verbosify (bow_progress, "accept: %s\n", strerror (errno));
+}
+
+/* The event loop, run by thread 0 of rainbow_event_serve(). */
+static void
+rainbow_server_event_loop ()
+{
+#define RAINBOW_SERVER_MAX_EVENTS 256
+  struct epoll_event events[RAINBOW_SERVER_MAX_EVENTS];
+  rainbow_server_conn *conn;
+  rainbow_server_request *done, *next;
+  uint64_t count;
+  int i, n, woken;
+
+  for (;;)
+    {
+      woken = 0;
+      n = epoll_wait (rainbow_server.epoll_fd, events,
+		      RAINBOW_SERVER_MAX_EVENTS, -1);
+      if (n < 0 && errno != EINTR)
+	bow_error ("epoll_wait: %s", strerror (errno));
+      for (i = 0; i < n; i++)
+	{
+	  if (events[i].data.ptr == &rainbow_server_listen_marker)
+	    {
+	      rainbow_server_accept ();
+	      continue;
+	    }
+	  if (events[i].data.ptr == &rainbow_server_wake_marker)
+	    {
+	      woken = 1;
+	      continue;
+	    }
+	  conn = events[i].data.ptr;
+	  if (events[i].events & EPOLLOUT)
+	    rainbow_server_conn_flush (conn);
+	  if (events[i].events & (EPOLLHUP | EPOLLERR))
+	    /* The client is gone both ways. */
+	    conn->closing = conn->broken = 1;
+	  else if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+	    rainbow_server_conn_read (conn);
+	  if (!rainbow_server_conn_maybe_close (conn))
+	    rainbow_server_conn_watch (conn, conn->out != NULL);
+	}
+      /* Deliver replies last, since that may free connections that
+	 appear in EVENTS. */
+      if (woken)
+	{
+	  read (rainbow_server.wake_fd, &count, sizeof (count));
+	  pthread_mutex_lock (&rainbow_server.lock);
+	  done = rainbow_server.done;
+	  rainbow_server.done = NULL;
+	  pthread_mutex_unlock (&rainbow_server.lock);
+	  for ( ; done; done = next)
+	    {
+	      next = done->next;
+	      rainbow_server_deliver (done);
+	    }
+	}
+    }
+}
+
+/* Serve queries on RAINBOW_SOCKFD forever, with an event loop and
+   BOW_NUM_THREADS scoring threads.  If the method's scoring isn't
+   thread-safe, use only one scoring thread. */
+void
+rainbow_event_serve ()
+{
+  struct epoll_event ev;
+  int num_workers;
+
+  num_workers = (rainbow_class_barrel->method->score_is_thread_safe
+		 ? bow_num_threads : 1);
+  rainbow_class_barrel_read_all_dvs ();
+
+  pthread_mutex_init (&rainbow_server.lock, NULL);
+  pthread_cond_init (&rainbow_server.not_empty, NULL);
+  rainbow_server.todo = rainbow_server.todo_last = NULL;
+  rainbow_server.done = NULL;
+  rainbow_server.wake_fd = eventfd (0, EFD_NONBLOCK);
+  rainbow_server.epoll_fd = epoll_create1 (0);
+  if (rainbow_server.wake_fd < 0 || rainbow_server.epoll_fd < 0)
+    bow_error ("Couldn't set up the event loop: %s", strerror (errno));
+  fcntl (rainbow_sockfd, F_SETFL, fcntl (rainbow_sockfd, F_GETFL) | O_NONBLOCK);
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = &rainbow_server_listen_marker;
+  epoll_ctl (rainbow_server.epoll_fd, EPOLL_CTL_ADD, rainbow_sockfd, &ev);
+  ev.events = EPOLLIN;
+  ev.data.ptr = &rainbow_server_wake_marker;
+  epoll_ctl (rainbow_server.epoll_fd, EPOLL_CTL_ADD, rainbow_server.wake_fd,
+	     &ev);
+
+  bow_verbosify (bow_progress, "Serving queries with %d scoring threads.\n",
+		 num_workers);
+  bow_threads_run (num_workers + 1, rainbow_server_worker, NULL);
+}
+
 #if RAINBOW_LISP
 
 /* Setup rainbow so that we can do our lisp interface. */
@@ -1337,6 +2524,170 @@ rainbow_lisp_query (const char *query_file,
 
 
 extern FILE *svml_test_file;
+
+/* Prepare QUERY_WV, the word vector of the document described by
+   DOC_CDOC, and score it against the class barrel, putting at most
+   NUM_HITS_TO_RETRIEVE scores in HITS.  Return the number of scores. */
+static int
+rainbow_test_score_wv (bow_cdoc *doc_cdoc, bow_wv *query_wv,
+		       bow_score *hits, int num_hits_to_retrieve)
+{
+  /* Remove words not in the class_barrel */
+  bow_wv_prune_words_not_in_wi2dvf (query_wv, 
+				    rainbow_class_barrel->wi2dvf);
+  bow_wv_set_weights (query_wv, rainbow_class_barrel);
+  bow_wv_normalize_weights (query_wv, rainbow_class_barrel);
+  if (!strcmp(rainbow_class_barrel->method->name, "em"))
+    return bow_barrel_score (rainbow_class_barrel, 
+			     query_wv, hits,
+			     num_hits_to_retrieve, 
+			     (rainbow_arg_state.test_on_training
+			      ? (int) doc_cdoc->class_probs
+			      : (int) NULL));
+  if (svml_test_file)
+    fprintf (svml_test_file,"%d ",-1*((doc_cdoc->class*2)-1));
+  return bow_barrel_score (rainbow_class_barrel, 
+			   query_wv, hits,
+			   num_hits_to_retrieve, 
+			   (rainbow_arg_state.test_on_training
+			    ? doc_cdoc->class
+			    : -1));
+}
+
+/* Print the line of --test output for the document described by
+   DOC_CDOC, whose scores are the NUM_HITS entries of HITS, and which
+   has DOC_LENGTH words. */
+static void
+rainbow_test_print_hits (FILE *test_fp, bow_cdoc *doc_cdoc,
+			 bow_score *hits, int num_hits, int doc_length)
+{
+  int hi;			/* hit index */
+
+  fprintf (test_fp, "%s %s ", 
+	   doc_cdoc->filename, 
+	   bow_barrel_classname_at_index (rainbow_doc_barrel,
+					  doc_cdoc->class));
+  for (hi = 0; hi < num_hits; hi++)
+    {
+      /* For the sake CommonLisp, don't print numbers smaller than
+	 1e-35, because it can't `(read)' them. */
+      if (rainbow_arg_state.use_lisp_score_truncation
+	  && hits[hi].weight < 1e-35
+	  && hits[hi].weight > 0)
+	hits[hi].weight = 0;
+      fprintf (test_fp, "%s:%.*g ", 
+	       bow_barrel_classname_at_index
+	       (rainbow_class_barrel, hits[hi].di),
+	       bow_score_print_precision,
+	       hits[hi].weight);
+    }
+  if (rainbow_arg_state.print_doc_length)
+    fprintf (test_fp, "%d", doc_length);
+  fprintf (test_fp, "\n");
+}
+
+/* The number of test documents read in at a time by
+   rainbow_test_batch(). */
+#define RAINBOW_TEST_BATCH_SIZE 4096
+
+/* A batch of test documents, shared by the threads scoring it. */
+typedef struct _rainbow_test_batch_context {
+  int num_docs;
+  int next_doc;			/* the next document to hand out */
+  int num_hits_to_retrieve;
+  bow_cdoc **doc_cdocs;
+  bow_wv **query_wvs;
+  bow_score *hits;		/* NUM_HITS_TO_RETRIEVE per document */
+  int *num_hits;
+  int *doc_lengths;
+} rainbow_test_batch_context;
+
+static void
+rainbow_test_batch_thread (int thread_index, void *context)
+{
+  rainbow_test_batch_context *bc = context;
+  int i;
+
+  while ((i = __sync_fetch_and_add (&bc->next_doc, 1)) < bc->num_docs)
+    {
+      bc->num_hits[i] =
+	rainbow_test_score_wv (bc->doc_cdocs[i], bc->query_wvs[i],
+			       bc->hits + i * bc->num_hits_to_retrieve,
+			       bc->num_hits_to_retrieve);
+      bc->doc_lengths[i] = bow_wv_word_count (bc->query_wvs[i]);
+    }
+}
+
+/* Return non-zero if rainbow_test() may score its test documents on
+   several threads. */
+static int
+rainbow_test_can_batch ()
+{
+  return (bow_num_threads > 1
+	  && rainbow_class_barrel->method->score_is_thread_safe
+	  && !svml_test_file
+	  && !bow_print_word_scores);
+}
+
+/* Do the work of one trial of rainbow_test() with BOW_NUM_THREADS
+   threads: read the word vectors of the documents in TEST_HEAP
+   satisfying CLASSIFY_CDOC_P a batch at a time, score the batch on
+   all the threads, and print the results in the same order as the
+   serial loop does. */
+static void
+rainbow_test_batch (FILE *test_fp, bow_dv_heap *test_heap,
+		    int (*classify_cdoc_p)(bow_cdoc*),
+		    int num_hits_to_retrieve)
+{
+  rainbow_test_batch_context bc;
+  bow_wv *query_wv = NULL;
+  int di, i;
+  int done = 0;
+
+  rainbow_class_barrel_read_all_dvs ();
+
+  bc.num_hits_to_retrieve = num_hits_to_retrieve;
+  bc.doc_cdocs = bow_malloc (RAINBOW_TEST_BATCH_SIZE * sizeof (bow_cdoc*));
+  bc.query_wvs = bow_malloc (RAINBOW_TEST_BATCH_SIZE * sizeof (bow_wv*));
+  bc.hits = bow_malloc (RAINBOW_TEST_BATCH_SIZE * num_hits_to_retrieve
+			* sizeof (bow_score));
+  bc.num_hits = bow_malloc (RAINBOW_TEST_BATCH_SIZE * sizeof (int));
+  bc.doc_lengths = bow_malloc (RAINBOW_TEST_BATCH_SIZE * sizeof (int));
+  while (!done)
+    {
+      for (bc.num_docs = 0; bc.num_docs < RAINBOW_TEST_BATCH_SIZE; 
+	   bc.num_docs++)
+	{
+	  di = bow_heap_next_wv (test_heap, rainbow_doc_barrel, &query_wv,
+				 classify_cdoc_p);
+	  if (di == -1)
+	    {
+	      done = 1;
+	      break;
+	    }
+	  bc.doc_cdocs[bc.num_docs] = 
+	    bow_array_entry_at_index (rainbow_doc_barrel->cdocs, di);
+	  /* The heap owns QUERY_WV, so keep a copy of our own. */
+	  bc.query_wvs[bc.num_docs] = bow_wv_copy (query_wv);
+	  bc.query_wvs[bc.num_docs]->normalizer = query_wv->normalizer;
+	}
+      bc.next_doc = 0;
+      bow_threads_run (bow_num_threads, rainbow_test_batch_thread, &bc);
+      for (i = 0; i < bc.num_docs; i++)
+	{
+	  rainbow_test_print_hits (test_fp, bc.doc_cdocs[i],
+				   bc.hits + i * num_hits_to_retrieve,
+				   bc.num_hits[i], bc.doc_lengths[i]);
+	  bow_wv_free (bc.query_wvs[i]);
+	}
+    }
+  bow_free (bc.doc_cdocs);
+  bow_free (bc.query_wvs);
+  bow_free (bc.hits);
+  bow_free (bc.num_hits);
+  bow_free (bc.doc_lengths);
+}
+
 /* Run test trials, outputing results to TEST_FP.  The results are
    indended to be read and processed by the Perl script
    ./rainbow-stats. */
@@ -1350,9 +2701,7 @@ rainbow_test (FILE *test_fp)
   bow_score *hits = NULL;
   int num_hits_to_retrieve=0;
   int actual_num_hits;
-  int hi;			/* hit index */
   bow_cdoc *doc_cdoc;
-  bow_cdoc *class_cdoc;
   int (*classify_cdoc_p)(bow_cdoc*);
 
   /* (Re)set the weight-setting method, if requested with `-m' argument. */
@@ -1454,79 +2803,21 @@ rainbow_test (FILE *test_fp)
       /* Loop once for each test document.  NOTE: This will skip documents
 	 that don't have any words that are in the vocabulary. */
 
+      if (rainbow_test_can_batch ())
+	{
+	  rainbow_test_batch (test_fp, test_heap, classify_cdoc_p,
+			      num_hits_to_retrieve);
+	  continue;
+	}
       while ((di = bow_heap_next_wv (test_heap, rainbow_doc_barrel, &query_wv,
 				     classify_cdoc_p)) != -1)
 	{
 	  doc_cdoc = bow_array_entry_at_index (rainbow_doc_barrel->cdocs, 
 					       di);
-
-	  class_cdoc = bow_array_entry_at_index (rainbow_class_barrel->cdocs, 
-						 doc_cdoc->class);
-	  /* Remove words not in the class_barrel */
-	  bow_wv_prune_words_not_in_wi2dvf (query_wv, 
-					    rainbow_class_barrel->wi2dvf);
-	  bow_wv_set_weights (query_wv, rainbow_class_barrel);
-	  bow_wv_normalize_weights (query_wv, rainbow_class_barrel);
-	  if (!strcmp(rainbow_class_barrel->method->name, "em"))
-	    {
-	      actual_num_hits = 
-		bow_barrel_score (rainbow_class_barrel, 
-			      query_wv, hits,
-			      num_hits_to_retrieve, 
-			      (rainbow_arg_state.test_on_training
-			       ? (int) doc_cdoc->class_probs
-			       : (int) NULL));
-	    }
-	  else {
-	    if (svml_test_file) {
-	      fprintf (svml_test_file,"%d ",-1*((doc_cdoc->class*2)-1));
-	    } 
-	    actual_num_hits = 
-	      bow_barrel_score (rainbow_class_barrel, 
-				query_wv, hits,
-				num_hits_to_retrieve, 
-				(rainbow_arg_state.test_on_training
-				 ? doc_cdoc->class
-				 : -1));
-	  }
-
-	  //assert (actual_num_hits == num_hits_to_retrieve);
-#if 0
-	  printf ("%8.6f %d %8.6f %8.6f %d ",
-		  class_cdoc->normalizer, 
-		  class_cdoc->word_count, 
-		  class_cdoc->normalizer / class_cdoc->word_count, 
-		  class_cdoc->prior,
-		  doc_cdoc->class);
-	  if (hits[0].di == doc_cdoc->class)
-	    printf ("1\n");
-	  else
-	    printf ("0\n");
-#endif
-	  fprintf (test_fp, "%s %s ", 
-		   doc_cdoc->filename, 
-		   bow_barrel_classname_at_index (rainbow_doc_barrel,
-						  doc_cdoc->class));
-	  for (hi = 0; hi < actual_num_hits; hi++)
-	    {
-	      class_cdoc = 
-		bow_array_entry_at_index (rainbow_class_barrel->cdocs,
-					  hits[hi].di);
-	      /* For the sake CommonLisp, don't print numbers smaller than
-		 1e-35, because it can't `(read)' them. */
-	      if (rainbow_arg_state.use_lisp_score_truncation
-		  && hits[hi].weight < 1e-35
-		  && hits[hi].weight > 0)
-		hits[hi].weight = 0;
-	      fprintf (test_fp, "%s:%.*g ", 
-		       bow_barrel_classname_at_index
-		       (rainbow_class_barrel, hits[hi].di),
-		       bow_score_print_precision,
-		       hits[hi].weight);
-	    }
-	  if (rainbow_arg_state.print_doc_length)
-	    fprintf (test_fp, "%d", bow_wv_word_count (query_wv));
-	  fprintf (test_fp, "\n");
+	  actual_num_hits = rainbow_test_score_wv (doc_cdoc, query_wv, hits,
+						   num_hits_to_retrieve);
+	  rainbow_test_print_hits (test_fp, doc_cdoc, hits, actual_num_hits,
+				   bow_wv_word_count (query_wv));
 	}
       /* Don't free the heap here because bow_test_next_wv() does it
 	 for us. */
@@ -1637,6 +2928,8 @@ rainbow_test_files (FILE *out_fp, const char *test_dirname)
       lex.document = data;
       lex.document_length = strlen (data);
       lex.document_position = 0;
+      lex.parameters = bow_default_lexer_parameters;
+      lex.num_words = 0;
 
       if (bow_str_is_text (data))
 	query_wv = bow_wv_new_from_lex (&lex);
@@ -1930,15 +3223,24 @@ main (int argc, char *argv[])
   rainbow_arg_state.test_on_training = 0;
   rainbow_arg_state.use_saved_classifier = 0;
   rainbow_arg_state.forking_server = 0;
+  rainbow_arg_state.event_server = 0;
   rainbow_arg_state.print_doc_length = 0;
   rainbow_arg_state.indexing_lines_filename = NULL;
-#ifdef VPC_ONLY
+  rainbow_arg_state.index_delete_filename = NULL;
+  rainbow_arg_state.index_compact_fraction = 0.25;
   rainbow_arg_state.vpc_only = 0;
-#endif
+  rainbow_arg_state.vpc_checkpoint_interval = 10000;
   
   /* Parse the command-line arguments. */
   argp_parse (&rainbow_argp, argc, argv, 0, 0, &rainbow_arg_state);
 
+  /* Keep other rainbows from writing the index while we do. */
+  if (rainbow_arg_state.what_doing == rainbow_indexing
+      || rainbow_arg_state.what_doing == rainbow_indexing_lines
+      || rainbow_arg_state.what_doing == rainbow_index_updating
+      || rainbow_arg_state.what_doing == rainbow_index_compacting)
+    rainbow_lock_data_dir ();
+
   if (rainbow_arg_state.what_doing == rainbow_indexing)
     {
       /* Strip any trailing `/'s from the classnames, so we can find the 
@@ -1968,14 +3270,29 @@ main (int argc, char *argv[])
 	  rainbow_classnames = 
 	    (const char **)(argv + rainbow_arg_state.non_option_argi);
 	  /* Index text in the directories. */
-	  rainbow_index (argc - rainbow_arg_state.non_option_argi,
-			 rainbow_classnames, 
-			 rainbow_arg_state.output_filename);
+	  if (rainbow_arg_state.vpc_only)
+	    rainbow_index_vpc (argc - rainbow_arg_state.non_option_argi,
+			       rainbow_classnames, 
+			       rainbow_arg_state.output_filename);
+	  else
+	    rainbow_index (argc - rainbow_arg_state.non_option_argi,
+			   rainbow_classnames, 
+			   rainbow_arg_state.output_filename);
 	}
       if (bow_num_words ())
 	rainbow_archive ();
       else
 	bow_error ("No text documents found.");
+      if (rainbow_arg_state.vpc_only)
+	{
+	  /* The checkpoint isn't needed now that all is written. */
+	  char filename[BOW_MAX_WORD_LENGTH];
+	  sprintf (filename, "%s/%s", bow_data_dirname,
+		   VPC_CHECKPOINT_FILENAME);
+	  unlink (filename);
+	  strcat (filename, ".tmp");
+	  unlink (filename);
+	}
       exit (0);
     }
 
@@ -1989,6 +3306,35 @@ main (int argc, char *argv[])
       exit (0);
     }
 
+  if (rainbow_arg_state.what_doing == rainbow_index_updating)
+    {
+      int argi, len;
+
+      for (argi = rainbow_arg_state.non_option_argi; 
+	   argi > 0 && argi < argc; argi++)
+	{
+	  len = strlen (argv[argi]);
+	  if (argv[argi][len-1] == '/')
+	    argv[argi][len-1] = '\0';
+	}
+      rainbow_index_update ((rainbow_arg_state.non_option_argi
+			     ? argc - rainbow_arg_state.non_option_argi : 0),
+			    (const char **)(argv 
+					    + rainbow_arg_state.non_option_argi),
+			    rainbow_arg_state.index_delete_filename,
+			    rainbow_arg_state.index_compact_fraction);
+      exit (0);
+    }
+
+  if (rainbow_arg_state.what_doing == rainbow_index_compacting)
+    {
+      rainbow_unarchive ();
+      if (!rainbow_doc_barrel)
+	bow_error ("There is no document barrel to compact in `%s'",
+		   bow_data_dirname);
+      rainbow_index_compact ();
+      exit (0);
+    }
 
   /* We are using an already built model.  Get it from disk. */
   rainbow_unarchive ();
@@ -2131,7 +3477,8 @@ main (int argc, char *argv[])
       for (di = 0; di < rainbow_doc_barrel->cdocs->length; di++)
 	{
 	  cdoc = bow_array_entry_at_index (rainbow_doc_barrel->cdocs, di);
-	  if (rainbow_arg_state.printing_class == NULL
+	  if ((rainbow_arg_state.printing_class == NULL
+	       && cdoc->type != bow_doc_deleted)
 	      || (tag >= 0 && cdoc->type == tag))
 	    printf ("%s\n", cdoc->filename);
 	}
@@ -2419,6 +3766,8 @@ main (int argc, char *argv[])
     {
       bow_word2int_do_not_add = 1;
       rainbow_socket_init (rainbow_arg_state.server_port_num, 0);
+      if (rainbow_arg_state.event_server)
+	rainbow_event_serve ();
       while (1)
 	{
 	  signal( SIGPIPE, SigPipeHandler );            /* drapp-2/10 */
@@ -400,7 +400,8 @@ bow_tag_change_tags (bow_array *docs, int tag1, int tag2)
 }
 
 
-/* Mark all documents in the array DOCS to be of type BOW_DOC_UNTAGGED. */
+/* Mark all documents in the array DOCS to be of type BOW_DOC_UNTAGGED,
+   except those that have been deleted from the index. */
 void
 bow_set_all_docs_untagged (bow_array *docs)
 {
@@ -410,7 +411,8 @@ bow_set_all_docs_untagged (bow_array *docs)
   for (i = 0; i < docs->length ; i++)
     {
       doc = bow_array_entry_at_index (docs, i);
-      doc->type = bow_doc_untagged;
+      if (doc->type != bow_doc_deleted)
+	doc->type = bow_doc_untagged;
     }
 }
 
@@ -561,7 +563,7 @@ bow_set_doc_types_randomly_by_count (bow_array *docs, int num_classes,
   for (di = 0; di < docs->length ; di++)
     {
       cdoc = bow_array_entry_at_index (docs, di);
-      if (cdoc->type == bow_doc_ignore
+      if (cdoc->type == bow_doc_ignore || cdoc->type == bow_doc_deleted
 	  || (take_proportion_from_remaining
 	      && cdoc->type != bow_doc_untagged))
 	continue;
@@ -643,7 +645,7 @@ bow_set_doc_types_randomly_by_fraction (bow_array *docs,
   for (di = 0; di < docs->length ; di++)
     {
       cdoc = bow_array_entry_at_index (docs, di);
-      if (cdoc->type != bow_doc_ignore)
+      if (cdoc->type != bow_doc_ignore && cdoc->type != bow_doc_deleted)
 	non_ignore_doc_count++;
     }
 
@@ -48,8 +48,9 @@ typedef struct
 /* Used when declaring rule_list's. */
 static char LAMBDA[] = "";
 
-/* Used to point to the end of the word that is currently being stem()'ed. */
-static char *end;
+/* Used to point to the end of the word that is currently being stem()'ed.
+   Per-thread, so that documents can be lexed on several threads. */
+static __thread char *end;
 
 
 /* word_size (word)
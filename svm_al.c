@@ -580,7 +580,8 @@ int al_svm_guts(bow_wv **train_docs, int *train_yvect, double *weights,
 
     last_subndocs = sub_ndocs;
 
-    /* calculate tvals that are necessary */
+    /* calculate tvals that are necessary (neither smo nor dcd needs
+     * any for docs that aren't sv's) */
     if (svm_use_smo) {
       for (j=sub_ndocs; j<dec; j++) {
 	weights[j] = 0.0;
@@ -3,6 +3,7 @@
 /* "main" file for all of the svm related code - any svm stuff should
  * pass through some function here */
 #include <bow/svm.h>
+#include <pthread.h>
 
 #if !HAVE_SQRTF
 #define sqrtf sqrt
@@ -43,6 +44,7 @@
 #define TRANS_IGNORE_BIAS_ARG          14028
 #define TRANS_HYP_REFRESH_ARG          14029
 #define TRANS_SMART_VALS_ARG           14030
+#define SMO_SHRINKING_ARG              14031
 
 #define AGAINST_ALL 0
 #define PAIRWISE    1
@@ -53,7 +55,7 @@
 static int weight_type=RAW;   /* 0=raw_freq, 1=tfidf, 2=infogain */
 static int tf_transform_type=RAW;  /* 0=raw, 1=log, 2?... */
 static int vote_type=0;
-static int cache_size=4000037;
+static int cache_size=100;    /* megabytes of kernel rows */
 static int quick_scoring=1;
 static int do_active_learning=0;
 static int test_in_train=0;
@@ -73,6 +75,7 @@ int svm_use_smo=0;
 #else
 int svm_use_smo=1;
 #endif
+int svm_smo_shrinking=1;
 
 
 double svm_epsilon_a=1E-12;       /* for alpha's & there bounds */
@@ -83,7 +86,7 @@ int svm_bsize=4;               /* sizeof working set */
 int svm_kernel_type=0;          /* 0=linear */
 int svm_remove_misclassified=0;
 int svm_weight_style;
-int svm_nkc_calls;
+__thread int svm_nkc_calls;
 
 int svm_trans_npos;
 int svm_trans_nobias=0;
@@ -152,8 +155,8 @@ static struct argp_option svm_options[] = {
    "do transduction over the unlabeled data during active learning."},
   {"svm-bsize", BSIZE_TYPE, "", 0,
    "maximum size to construct the subproblems."},
-  {"svm-cache-size", CACHE_SIZE_ARG, "", 0,
-   "Number of kernel evaluations to cache."},
+  {"svm-cache-size", CACHE_SIZE_ARG, "MB", 0,
+   "Megabytes of kernel matrix rows to cache (default 100)."},
   {"svm-cost", COST_TYPE, "", 0,
    "cost to bound the lagrange multipliers by (default 1000)."},
   {"svm-df-counts", DF_COUNTS_ARG, "", 0,
@@ -172,6 +175,9 @@ static struct argp_option svm_options[] = {
    "what random seed should be used in the test-in-train splits"},
   {"svm-remove-misclassified", REMOVE_MISCLASS_TYPE, "", 0,
    "Remove all of the misclassified examples and retrain (default none (0), 1=bound, 2=wrong."},
+  {"svm-shrinking", SMO_SHRINKING_ARG, "", 0,
+   "Whether SMO should set aside examples stuck at a bound while it "
+   "optimizes the rest (default 1)."},
   {"svm-start-at", START_AT_ARG, "", 0,
    "which model should be the first generated."},
   {"svm-suppress-score-matrix", SUPPRESS_SCORE_MAT_ARG, 0, 0,
@@ -202,6 +208,7 @@ static struct argp_option svm_options[] = {
 #else 
    "default 1 (use SMO) - PR_LOQO not compiled"
 #endif
+   "; 2 uses dual coordinate descent for the linear kernel."
   },
   {"svm-vote", VOTE_TYPE, "", 0,
    "Type of voting to use (0=singular, 1=pairwise; default 0)."},
@@ -280,8 +287,8 @@ error_t svm_parse_opt (int key, char *arg, struct argp_state *state) {
     break;
   case CACHE_SIZE_ARG:
     cache_size = atoi(arg);
-    if (cache_size < 2) {
-      fprintf(stderr, "Invalid value for --cache_size, value must be greater than 1\n");
+    if (cache_size < 1) {
+      fprintf(stderr, "Invalid value for --svm-cache-size, value must be at least 1\n");
       return ARGP_ERR_UNKNOWN;
     }
     break;
@@ -324,6 +331,9 @@ error_t svm_parse_opt (int key, char *arg, struct argp_state *state) {
   case QUICK_SCORE:
     quick_scoring = 1;
     break;
+  case SMO_SHRINKING_ARG:
+    svm_smo_shrinking = atoi(arg);
+    break;
   case SUPPRESS_SCORE_MAT_ARG:
     suppress_score_mat = 1;
     break;
@@ -385,7 +395,7 @@ error_t svm_parse_opt (int key, char *arg, struct argp_state *state) {
       svm_epsilon_crit /= 2;
     }
 #ifndef HAVE_LOQO
-    if (svm_use_smo != 1) {
+    if (svm_use_smo == 0) {
       fprintf(stderr,"Cannot switch from SMO, no other solvers were built,\n"
 	      "rebuild libbow with pr_loqo to use another algorithm.\n");
     }
@@ -503,19 +513,7 @@ double dprod(bow_wv *wv1, bow_wv *wv2) {
 
 /* dot product between a sparce & non-sparse vector */
 double dprod_sd(bow_wv *wv, double *W) {
-  double sum;
-  bow_we *v;
-  int i;
-
-  i = 0;
-  sum = 0.0;
-  v = wv->entry;
-
-  while (i < wv->num_entries) {
-    sum += v[i].weight * W[v[i].wi];
-    i++;
-  }
-  return(sum);
+  return((*bow_kernel_dot_sd)(wv->entry, wv->num_entries, W));
 }
 
 /* this is a whole different function just because the kernel is the biggest bottleneck */
@@ -562,110 +560,560 @@ double kernel_sig(bow_wv *wv1, bow_wv *wv2) {
 }
 
 
-static int rlength;
-typedef struct _kc_el {
-  bow_wv *i, *j;
-  double val;
-  unsigned int age;
-} kc_el;
+/* The kernel cache.  kcache_init() registers the documents being
+ * trained upon; after that a document is known by its ordinal in that
+ * array, and the cache holds whole rows of the kernel matrix (the
+ * kernel of one document against every registered one).  Rows are
+ * kept in LRU order in at most cache_size megabytes.  While a solver
+ * has restricted the cache to some of the documents, new rows are only
+ * computed at their columns & are marked partial.  Each thread has its
+ * own cache; the ones training models for svm_vpc_merge() share the
+ * documents registered on the calling thread & keep their whole rows
+ * in a kcache_store (see kcache_attach). */
+struct kcache {
+  bow_wv **docs;      /* the registered documents, by ordinal */
+  int      ndocs;
+  int      shared;    /* whether DOCS & the map belong to another cache */
+  double **rows;      /* the row of each ordinal, or NULL */
+  char    *partial;   /* whether the row only covers COLS */
+  int     *cols;      /* the ordinals rows are restricted to, */
+  int      ncols;     /* or -1 for all of them */
+  int     *prev;      /* LRU list of cached rows, by ordinal */
+  int     *next;
+  int      head;      /* most recently used row */
+  int      tail;      /* least recently used row */
+  int      nrows;
+  int      max_rows;
+  bow_wv **hkeys;     /* open-addressed map from doc pointer to ordinal */
+  int     *hvals;
+  int      hsize;     /* a power of 2 */
+  float   *dense;     /* the document of the row being computed, */
+  int     *stamp;     /* valid where stamp[wi] == nstamp */
+  int      nstamp;
+  int      dense_size;
+  int      miss1;     /* the ordinals of the last miss of svm_kernel_cache */
+  int      miss2;
+  struct kcache_store *store; /* where whole rows go, if not ROWS */
+  int      pins[2];   /* the last 2 rows this thread got from STORE */
+};
+
+/* whole rows shared by several threads' caches.  A row doesn't change
+ * once it's in, so it's read without the lock - but each thread pins
+ * the last two rows it got, so that no other thread evicts them while
+ * they're in use. */
+struct kcache_store {
+  pthread_mutex_t lock;
+  double **rows;
+  int     *refs;      /* how many threads have each row pinned */
+  int     *prev;      /* LRU list, like the one in struct kcache */
+  int     *next;
+  int      head;
+  int      tail;
+  int      nrows;
+  int      max_rows;
+};
+
+static __thread struct kcache kc = {NULL, 0};
 
-static kc_el *harray;
-static unsigned int max_age;
+/* how many caches the cache_size megabytes are split between */
+static __thread int kcache_nslices = 1;
 
-void kcache_init(int nwide) {
+static __thread int sub_nkcc=0; /* this makes nkc_calls = actual calls / 100 */
+
+static void kcache_count(int n) {
+  sub_nkcc += n;
+  svm_nkc_calls += sub_nkcc / 100;
+  sub_nkcc %= 100;
+}
+
+static int kcache_hash(bow_wv *wv) {
+  unsigned long h = (unsigned long) wv;
+  h ^= h >> 17;
+  h *= 0xed5ad4bbUL;
+  h ^= h >> 11;
+  h *= 0xac4c1b51UL;
+  h ^= h >> 15;
+  return ((int) (h & (kc.hsize-1)));
+}
+
+/* how many rows fit in this thread's share of cache_size (half of it
+ * goes to the store, if there is one) */
+static int kcache_max_rows() {
+  long max_rows;
+
+  max_rows = ((long) cache_size * 1024 * 1024) 
+    / (sizeof(double)*kc.ndocs*kcache_nslices*(kc.store ? 2 : 1));
+  /* always leave room for the 2 rows opt_pair needs at once */
+  return ((max_rows < 2) ? 2 : ((max_rows > kc.ndocs) ? kc.ndocs : max_rows));
+}
+
+/* sets up the rows (& the rest of what isn't the registration) */
+static void kcache_alloc_rows() {
   int i;
-  max_age = 1;
+
+  kc.rows = (double **) malloc(sizeof(double *)*kc.ndocs);
+  kc.partial = (char *) malloc(sizeof(char)*kc.ndocs);
+  kc.cols = (int *) malloc(sizeof(int)*kc.ndocs);
+  kc.prev = (int *) malloc(sizeof(int)*kc.ndocs);
+  kc.next = (int *) malloc(sizeof(int)*kc.ndocs);
+  if (!(kc.rows && kc.partial && kc.cols && kc.prev && kc.next)) {
+    bow_error("Could not allocate space for the kernel cache.\n");
+  }
+  for (i=0; i<kc.ndocs; i++) {
+    kc.rows[i] = NULL;
+    kc.partial[i] = 0;
+  }
+
+  kc.max_rows = kcache_max_rows();
+  kc.nrows = 0;
+  kc.head = kc.tail = -1;
+  kc.miss1 = kc.miss2 = -1;
+  kc.ncols = -1;
+  kc.pins[0] = kc.pins[1] = -1;
+
+  kc.dense_size = bow_num_words();
+  kc.dense = (float *) malloc(sizeof(float)*kc.dense_size);
+  kc.stamp = (int *) malloc(sizeof(int)*kc.dense_size);
+  for (i=0; i<kc.dense_size; i++) {
+    kc.stamp[i] = 0;
+  }
+  kc.nstamp = 0;
+}
+
+void kcache_init(bow_wv **docs, int ndocs) {
+  int i, h;
+
   svm_nkc_calls = 0;
-  rlength = nwide;
-  if ((harray = (kc_el *) malloc(sizeof(kc_el)*cache_size)) == NULL) {
-    cache_size = cache_size/2;
-    fprintf(stderr, "Could not allocate space for the kernel cache.\n"
-	    "Shrinking size to %d and trying again.\n", cache_size);
-    return (kcache_init(nwide));
+  kc.ndocs = ndocs;
+  kc.shared = 0;
+  kc.store = NULL;
+  kc.docs = (bow_wv **) malloc(sizeof(bow_wv *)*ndocs);
+  for (kc.hsize=2; kc.hsize < 2*ndocs; kc.hsize *= 2)
+    ;
+  kc.hkeys = (bow_wv **) malloc(sizeof(bow_wv *)*kc.hsize);
+  kc.hvals = (int *) malloc(sizeof(int)*kc.hsize);
+  if (!(kc.docs && kc.hkeys && kc.hvals)) {
+    bow_error("Could not allocate space for the kernel cache.\n");
   }
 
-  for (i=0; i<cache_size; i++) {
-    harray[i].i = (bow_wv *) ~0;
-    harray[i].age = 0;
+  for (i=0; i<kc.hsize; i++) {
+    kc.hkeys[i] = NULL;
   }
+  for (i=0; i<ndocs; i++) {
+    kc.docs[i] = docs[i];
+    for (h=kcache_hash(docs[i]); kc.hkeys[h]; h=(h+1) & (kc.hsize-1))
+      ;
+    kc.hkeys[h] = docs[i];
+    kc.hvals[h] = i;
+  }
+
+  kcache_alloc_rows();
 }
 
 void kcache_clear() {
-  free(harray);
+  int i;
+
+  for (i=0; i<kc.ndocs; i++) {
+    if (kc.rows[i]) {
+      free(kc.rows[i]);
+    }
+  }
+  if (!kc.shared) {
+    free(kc.docs);
+    free(kc.hkeys);
+    free(kc.hvals);
+  }
+  free(kc.rows);
+  free(kc.partial);
+  free(kc.cols);
+  free(kc.prev);
+  free(kc.next);
+  free(kc.dense);
+  free(kc.stamp);
+  kc.docs = NULL;
+  kc.ndocs = 0;
+  kc.shared = 0;
 }
 
-void kcache_age() {
-  max_age++;
+/* take row O out of an LRU list */
+static void kcache_lru_unlink(int o, int *prev, int *next, int *head, int *tail) {
+  if (prev[o] >= 0) next[prev[o]] = next[o];
+  else              *head = next[o];
+  if (next[o] >= 0) prev[next[o]] = prev[o];
+  else              *tail = prev[o];
 }
 
-#define NHASHES   3
-static int sub_nkcc=0; /* this makes nkc_calls = actual calls / 100 */
-double svm_kernel_cache(bow_wv *wv1, bow_wv *wv2) {
-  int h_index;
-  int k;
-  unsigned int min_age, min_from;
-  double d;
+/* put row O at the front of an LRU list */
+static void kcache_lru_push(int o, int *prev, int *next, int *head, int *tail) {
+  prev[o] = -1;
+  next[o] = *head;
+  if (*head >= 0) prev[*head] = o;
+  else            *tail = o;
+  *head = o;
+}
 
-  if (!((sub_nkcc++) % 100)) {
-    svm_nkc_calls ++;
+/* sets up a store for the rows of the documents registered with this
+ * thread's cache, for NTHREADS threads to share */
+static struct kcache_store *kcache_store_new(int nthreads) {
+  struct kcache_store *st;
+  long max_rows;
+  int i;
+
+  st = (struct kcache_store *) malloc(sizeof(struct kcache_store));
+  st->rows = (double **) malloc(sizeof(double *)*kc.ndocs);
+  st->refs = (int *) malloc(sizeof(int)*kc.ndocs);
+  st->prev = (int *) malloc(sizeof(int)*kc.ndocs);
+  st->next = (int *) malloc(sizeof(int)*kc.ndocs);
+  if (!(st->rows && st->refs && st->prev && st->next)) {
+    bow_error("Could not allocate space for the kernel cache.\n");
+  }
+  for (i=0; i<kc.ndocs; i++) {
+    st->rows[i] = NULL;
+    st->refs[i] = 0;
+  }
+  pthread_mutex_init(&st->lock, NULL);
+  st->head = st->tail = -1;
+  st->nrows = 0;
+
+  /* there has to be an unpinned row to evict when it's full */
+  max_rows = ((long) cache_size * 1024 * 1024) / (sizeof(double)*kc.ndocs*2);
+  max_rows = MAX(max_rows, 2*nthreads+1);
+  st->max_rows = MIN(max_rows, kc.ndocs);
+  return st;
+}
+
+static void kcache_store_free(struct kcache_store *st) {
+  int i;
+
+  for (i=0; i<kc.ndocs; i++) {
+    if (st->rows[i]) {
+      free(st->rows[i]);
+    }
   }
+  pthread_mutex_destroy(&st->lock);
+  free(st->rows);
+  free(st->refs);
+  free(st->prev);
+  free(st->next);
+  free(st);
+}
 
-  min_age = ~((unsigned long) 0);
+/* pins row O of the store for this thread, unpinning the one before
+ * the last.  the lock must be held. */
+static void kcache_store_pin(int o) {
+  struct kcache_store *st = kc.store;
 
-  /* all of the kernels are symetric */
-  if (wv1>wv2) {
-    bow_wv *tmp;
-    tmp = wv2;
-    wv2 = wv1;
-    wv1 = tmp;
+  if (kc.pins[1] == o) {
+    return;
+  }
+  if (kc.pins[0] >= 0) {
+    st->refs[kc.pins[0]]--;
   }
+  kc.pins[0] = kc.pins[1];
+  kc.pins[1] = o;
+  st->refs[o]++;
+}
 
-  for (k=h_index=0; k<NHASHES; k++) {
-    h_index = ((((unsigned int)wv1)*rlength+((unsigned int)wv2))+h_index+19) % cache_size;
-    
-    if ((harray[h_index].i == wv1) && (harray[h_index].j == wv2)) {
-      harray[h_index].age = max_age;
-      return (harray[h_index].val);
+/* the store's row O, pinned, or NULL */
+static double *kcache_store_get(int o) {
+  struct kcache_store *st = kc.store;
+  double *row;
+
+  pthread_mutex_lock(&st->lock);
+  if ((row = st->rows[o])) {
+    kcache_store_pin(o);
+    if (st->head != o) {
+      kcache_lru_unlink(o, st->prev, st->next, &st->head, &st->tail);
+      kcache_lru_push(o, st->prev, st->next, &st->head, &st->tail);
+    }
+  }
+  pthread_mutex_unlock(&st->lock);
+  return row;
+}
+
+/* puts ROW in the store as row O (unless another thread beat us to it,
+ * in which case ROW is freed) & returns the store's row, pinned */
+static double *kcache_store_put(int o, double *row) {
+  struct kcache_store *st = kc.store;
+  int victim;
+
+  pthread_mutex_lock(&st->lock);
+  if (st->rows[o]) {
+    free(row);
+    row = st->rows[o];
+    kcache_lru_unlink(o, st->prev, st->next, &st->head, &st->tail);
+  } else {
+    if (st->nrows < st->max_rows) {
+      st->nrows++;
+    } else {
+      for (victim=st->tail; st->refs[victim]; victim=st->prev[victim])
+	;
+      kcache_lru_unlink(victim, st->prev, st->next, &st->head, &st->tail);
+      free(st->rows[victim]);
+      st->rows[victim] = NULL;
+    }
+    st->rows[o] = row;
+  }
+  kcache_lru_push(o, st->prev, st->next, &st->head, &st->tail);
+  kcache_store_pin(o);
+  pthread_mutex_unlock(&st->lock);
+  return row;
+}
+
+/* gives this thread a cache of its own share of cache_size, over the
+ * documents registered in FROM (the calling thread's cache, which
+ * mustn't be changed until kcache_detach), that puts its whole rows in
+ * STORE.  kcache_nslices says how many threads are sharing. */
+static void kcache_attach(struct kcache *from, struct kcache_store *store) {
+  if (from == &kc) {
+    kc.store = store;
+    kc.max_rows = kcache_max_rows();
+    return;
+  }
+  kc.docs = from->docs;
+  kc.ndocs = from->ndocs;
+  kc.hkeys = from->hkeys;
+  kc.hvals = from->hvals;
+  kc.hsize = from->hsize;
+  kc.shared = 1;
+  kc.store = store;
+  kcache_alloc_rows();
+}
+
+static void kcache_detach(struct kcache *from) {
+  int i;
+
+  pthread_mutex_lock(&kc.store->lock);
+  for (i=0; i<2; i++) {
+    if (kc.pins[i] >= 0) {
+      kc.store->refs[kc.pins[i]]--;
+    }
+    kc.pins[i] = -1;
+  }
+  pthread_mutex_unlock(&kc.store->lock);
+
+  if (from != &kc) {
+    kcache_clear();
+  }
+  kc.store = NULL;
+}
+
+/* returns the ordinal WV was registered with, or -1 */
+int kcache_ordinal(bow_wv *wv) {
+  int h;
+
+  if (!kc.docs) {
+    return -1;
+  }
+  for (h=kcache_hash(wv); kc.hkeys[h]; h=(h+1) & (kc.hsize-1)) {
+    if (kc.hkeys[h] == wv) {
+      return (kc.hvals[h]);
+    }
+  }
+  return -1;
+}
+
+static void kcache_unlink(int o) {
+  kcache_lru_unlink(o, kc.prev, kc.next, &kc.head, &kc.tail);
+}
+
+static void kcache_push(int o) {
+  kcache_lru_push(o, kc.prev, kc.next, &kc.head, &kc.tail);
+}
+
+/* fill ROW with the kernel of document O against all of the registered
+ * documents.  Document O is scattered into a dense vector once, so each
+ * kernel is a single pass over the other document's entries; the sums
+ * are taken in the same order as dprod() & ddprod(), so the values are
+ * the same as kernel() would give. */
+static void kcache_compute_row(int o, double *row) {
+  bow_wv *wv, *v;
+  double  sum, tmp;
+  float  *dense;
+  int    *stamp;
+  int     nstamp;
+  int     n;
+  int i, j, c;
+
+  n = (kc.ncols < 0) ? kc.ndocs : kc.ncols;
+  kcache_count(n);
+  wv = kc.docs[o];
+
+  if (svm_kernel_type == FISHER) {
+    for (c=0; c<n; c++) {
+      j = (kc.ncols < 0) ? c : kc.cols[c];
+      row[j] = kernel(wv, kc.docs[j]);
+    }
+    return;
+  }
+
+  if (++kc.nstamp < 0) {
+    for (i=0; i<kc.dense_size; i++) {
+      kc.stamp[i] = 0;
+    }
+    kc.nstamp = 1;
+  }
+  dense = kc.dense;
+  stamp = kc.stamp;
+  nstamp = kc.nstamp;
+  for (i=0; i<wv->num_entries; i++) {
+    dense[wv->entry[i].wi] = wv->entry[i].weight;
+    stamp[wv->entry[i].wi] = nstamp;
+  }
+
+  for (c=0; c<n; c++) {
+    j = (kc.ncols < 0) ? c : kc.cols[c];
+    v = kc.docs[j];
+    sum = 0.0;
+    if (svm_kernel_type == 2) {
+      for (i=0; i<v->num_entries; i++) {
+	if (stamp[v->entry[i].wi] == nstamp) {
+	  tmp = dense[v->entry[i].wi] - v->entry[i].weight;
+	  sum += tmp*tmp;
+	}
+      }
+      row[j] = exp(-1*kparm.rbf.gamma * sum);
     } else {
-      if (harray[h_index].age > 0) {
-	if (min_age > harray[h_index].age) {
-	  min_age = harray[h_index].age;
-	  min_from = h_index;
+      for (i=0; i<v->num_entries; i++) {
+	if (stamp[v->entry[i].wi] == nstamp) {
+	  sum += dense[v->entry[i].wi] * v->entry[i].weight;
 	}
-	continue;
+      }
+      if (svm_kernel_type == 0) {
+	row[j] = sum;
+      } else if (svm_kernel_type == 1) {
+	row[j] = pow(kparm.poly.lin_co * sum + kparm.poly.const_co, 
+		     kparm.poly.degree);
       } else {
-	min_from = h_index;
-	break;
+	row[j] = tanh(kparm.sig.lin_co * sum + kparm.sig.const_co);
+      }
+    }
+  }
+}
+
+/* returns the kernel row of the document with ordinal O, computing it
+ * (& evicting the least recently used row) if it isn't cached.  The
+ * row stays valid until another row is asked for, but asking for a row
+ * never evicts the one asked for just before it. */
+double *svm_kernel_row(int o) {
+  double *row;
+
+  if ((row = kc.rows[o])) {
+    if (kc.head != o) {
+      kcache_unlink(o);
+      kcache_push(o);
+    }
+    return row;
+  }
+
+  /* whole rows live in the store, if there is one (so only partial
+   * ones are in ROWS) */
+  if (kc.store) {
+    if ((row = kcache_store_get(o))) {
+      return row;
+    }
+    if (kc.ncols < 0) {
+      if (!(row = (double *) malloc(sizeof(double)*kc.ndocs))) {
+	bow_error("Could not allocate space for the kernel cache.\n");
       }
+      kcache_compute_row(o, row);
+      return (kcache_store_put(o, row));
+    }
+  }
+
+  if (kc.nrows < kc.max_rows) {
+    if (!(row = (double *) malloc(sizeof(double)*kc.ndocs))) {
+      bow_error("Could not allocate space for the kernel cache.\n");
     }
+    kc.nrows++;
+  } else {
+    int victim = kc.tail;
+    row = kc.rows[victim];
+    kc.rows[victim] = NULL;
+    kcache_unlink(victim);
   }
 
-  d = kernel(wv1,wv2);
-  harray[min_from].i = wv1;
-  harray[min_from].j = wv2;
-  harray[min_from].val = d;
-  harray[min_from].age = max_age;
-  return (d);
+  kcache_compute_row(o, row);
+  kc.rows[o] = row;
+  kc.partial[o] = (kc.ncols >= 0);
+  kcache_push(o);
+  return row;
 }
 
-/* don't add the evaluation (useful if the items are getting deleted from a set) */
-double svm_kernel_cache_lookup(bow_wv *wv1, bow_wv *wv2) {
-  int h_index;
-  int k;
+/* compute new rows only at the columns of the N ordinals ORDS, until
+ * kcache_unrestrict().  Rows already cached stay, so each call must
+ * name a subset of the ordinals of the one before it. */
+void kcache_restrict(int *ords, int n) {
+  int i;
 
-  /* all of the kernels are symetric */
-  if (wv1>wv2) {
-    bow_wv *tmp;
-    tmp = wv2;
-    wv2 = wv1;
-    wv1 = tmp;
+  if (n >= kc.ndocs) {
+    kc.ncols = -1;
+    return;
+  }
+  for (i=0; i<n; i++) {
+    kc.cols[i] = ords[i];
   }
+  kc.ncols = n;
+}
 
-  for (k=h_index=0; k<NHASHES; k++) {
-    h_index = ((((unsigned int)wv1)*rlength+((unsigned int)wv2))+h_index+19) % cache_size;
-    
-    if ((harray[h_index].i == wv1) && (harray[h_index].j == wv2)) {
-      return (harray[h_index].val);
+/* go back to computing whole rows, & forget the partial ones */
+void kcache_unrestrict() {
+  int i;
+
+  kc.ncols = -1;
+  for (i=0; i<kc.ndocs; i++) {
+    if (kc.rows[i] && kc.partial[i]) {
+      kcache_unlink(i);
+      free(kc.rows[i]);
+      kc.rows[i] = NULL;
+      kc.partial[i] = 0;
+      kc.nrows--;
+    }
+  }
+}
+
+double svm_kernel_cache(bow_wv *wv1, bow_wv *wv2) {
+  int o1, o2;
+
+  o1 = kcache_ordinal(wv1);
+  o2 = kcache_ordinal(wv2);
+  /* (partial rows only exist while a solver has restricted the cache) */
+  if (o1 < 0 || o2 < 0 || kc.ncols >= 0) {
+    kcache_count(1);
+    return (kernel(wv1,wv2));
+  }
+
+  if (kc.rows[o1]) {
+    return (svm_kernel_row(o1)[o2]);
+  } else if (kc.rows[o2]) {
+    return (svm_kernel_row(o2)[o1]);
+  }
+
+  /* neither row is cached.  Callers tend to walk along a row, so a
+   * document that was also in the last miss gets its row computed;
+   * otherwise just this one kernel is. */
+  if (o1 == kc.miss1 || o1 == kc.miss2) {
+    return (svm_kernel_row(o1)[o2]);
+  } else if (o2 == kc.miss1 || o2 == kc.miss2) {
+    return (svm_kernel_row(o2)[o1]);
+  }
+  kc.miss1 = o1;
+  kc.miss2 = o2;
+  kcache_count(1);
+  return (kernel(wv1,wv2));
+}
+
+/* don't add the evaluation (useful if the items are getting deleted from a set) */
+double svm_kernel_cache_lookup(bow_wv *wv1, bow_wv *wv2) {
+  int o1, o2;
+
+  o1 = kcache_ordinal(wv1);
+  o2 = kcache_ordinal(wv2);
+  if (o1 >= 0 && o2 >= 0 && kc.ncols < 0) {
+    if (kc.rows[o1]) {
+      return (kc.rows[o1][o2]);
+    } else if (kc.rows[o2]) {
+      return (kc.rows[o2][o1]);
     }
   }
 
@@ -1121,7 +1569,16 @@ int svm_remove_bound_examples(bow_wv **docs, int *yvect, double *weights,
   *nsv = 0;
 
   if (svm_use_smo) {
-    x = smo(sub_docs, sub_yvect, weights, b, W, sub_ndocs, tvals, sub_cvect, nsv);
+    /* the weights start over, so the hyperplane has to too */
+    if (*W) {
+      free(*W);
+      *W = NULL;
+    }
+    if (SVM_USING_DCD) {
+      x = dcd(sub_docs, sub_yvect, weights, b, W, sub_ndocs, tvals, sub_cvect, nsv);
+    } else {
+      x = smo(sub_docs, sub_yvect, weights, b, W, sub_ndocs, tvals, sub_cvect, nsv);
+    }
   } else {
 #ifdef HAVE_LOQO
     x = build_svm_guts(sub_docs, sub_yvect, weights, b, W, sub_ndocs, tvals, 
@@ -1152,7 +1609,9 @@ inline int solve_svm(bow_wv **docs, int *yvect, double *weights, double *ab,
 		     int *nsv) {
   int x;
 
-  if (svm_use_smo) {
+  if (SVM_USING_DCD) {
+    x = dcd(docs, yvect, weights, ab, W, ndocs, tvals, cvect, nsv);
+  } else if (svm_use_smo) {
     x = smo(docs, yvect, weights, ab, W, ndocs, tvals, cvect, nsv);
   } else {
 #ifdef HAVE_LOQO
@@ -1187,22 +1646,13 @@ int svm_trans_or_chunk(bow_wv **docs, int *yvect, int *trans_yvect,
   }
 }
 
-/* cover for all the functions */
-/* this function does a small amount of pre & post-processing for the
- * algorithm independent stuff (like randomly permuting everything &
- * outputting a hyperplane if possible) */
-int tlf_svm(bow_wv **docs, int *yvect, double *weights, double *ab, 
-	    bow_wv **W_wv, int ntrans, int ndocs) {
+/* seeds the generator & permutes DOCS & YVECT for tlf_svm - each part 
+ * separately, because the solvers are going to expect all unlabeled 
+ * data (data with a different C*) to be in the latter half.  returns
+ * the table that tlf_svm_finish needs to undo it. */
+static int *tlf_svm_permute(bow_wv **docs, int *yvect, int ntrans, int ndocs) {
   int          nlabeled;
-  int          misclass;
-  int          nsv;
   int         *permute_table;
-  double      *tvals;
-  double      *W=NULL;
-
-  int i,j;
-
-  struct tms t1, t2;
 
   if (svm_random_seed) {
     srandom(svm_random_seed);
@@ -1217,24 +1667,31 @@ int tlf_svm(bow_wv **docs, int *yvect, double *weights, double *ab,
 
   nlabeled = ndocs - ntrans;
 
-  /* permute each part, but don't mudge them together, because the 
-   * solvers are going to expect all unlabeled data (data with a 
-   * different C* to be in the latter half) */
   svm_permute_data(permute_table, docs, yvect, nlabeled);
   svm_permute_data(&(permute_table[nlabeled]), &(docs[nlabeled]), &(yvect[nlabeled]), ntrans);
 
   /* lets try to reduce determinism... */
   srandom((int) time(NULL));
 
-  times(&t1);
-      
+  return permute_table;
+}
+
+/* finds the weights (& hyperplane) for the permuted data, returns the
+ * number of support vectors */
+static int tlf_svm_solve(bow_wv **docs, int *yvect, double *weights, double *ab, 
+			 double **W, int *permute_table, int ntrans, int ndocs) {
+  int          nsv;
+  double      *tvals;
+
+  int i;
+
   if (do_active_learning) {
     if (test_in_train) {
-      nsv = al_svm_test_wrapper(docs, yvect, weights, ab, &W, ntrans, ndocs,
+      nsv = al_svm_test_wrapper(docs, yvect, weights, ab, W, ntrans, ndocs,
 				(suppress_score_mat ? 0 : 1),
 				al_pick_random, permute_table);
     } else {
-      nsv = al_svm(docs, yvect, weights, ab, &W, ntrans, ndocs, al_pick_random);
+      nsv = al_svm(docs, yvect, weights, ab, W, ntrans, ndocs, al_pick_random);
     }
   } else {
     /* initialize... */
@@ -1245,17 +1702,43 @@ int tlf_svm(bow_wv **docs, int *yvect, double *weights, double *ab,
       tvals[i] = 0.0;
     }
 
-    svm_trans_or_chunk(docs, yvect, NULL, weights, tvals, ab, &W, ntrans, ndocs, &nsv);
+    svm_trans_or_chunk(docs, yvect, NULL, weights, tvals, ab, W, ntrans, ndocs, &nsv);
   }
 
-  times(&t2);
-  fprintf(stderr,"user: %d, system:%d, kernel_calls:%d\n", (int)(t2.tms_utime-t1.tms_utime),
-	  (int) (t2.tms_stime - t1.tms_stime), svm_nkc_calls);
-  printf("user: %d, system:%d, kernel_calls:%d\n", (int)(t2.tms_utime-t1.tms_utime),
-	  (int) (t2.tms_stime - t1.tms_stime), svm_nkc_calls);
+  return nsv;
+}
+
+static void tlf_svm_print_times(int user, int system, int nkc_calls) {
+  fprintf(stderr,"user: %d, system:%d, kernel_calls:%d\n", user, system, nkc_calls);
+  printf("user: %d, system:%d, kernel_calls:%d\n", user, system, nkc_calls);
+}
+
+/* undoes tlf_svm_permute (on the weights too), turns the hyperplane W
+ * into a wv & prints the support vectors */
+static void tlf_svm_finish(bow_wv **docs, int *yvect, double *weights, 
+			   double *W, bow_wv **W_wv, int *permute_table, 
+			   int ntrans, int ndocs, int nsv) {
+  int          nlabeled;
+  int          misclass;
+  double      *tmp;
+
+  int i,j;
+
+  nlabeled = ndocs - ntrans;
+
+  /* the weights go back to where their documents do */
+  tmp = (double *) malloc(sizeof(double)*ndocs);
+  for (i=0; i<nlabeled; i++) {
+    tmp[permute_table[i]] = weights[i];
+  }
+  for (i=nlabeled; i<ndocs; i++) {
+    tmp[nlabeled+permute_table[i]] = weights[i];
+  }
+  for (i=0; i<ndocs; i++) {
+    weights[i] = tmp[i];
+  }
+  free(tmp);
 
-  
-  /* unpermute data */
   svm_unpermute_data(permute_table, docs, yvect, nlabeled);
   svm_unpermute_data(&(permute_table[nlabeled]), &(docs[nlabeled]), &(yvect[nlabeled]), ntrans);
 
@@ -1267,7 +1750,7 @@ int tlf_svm(bow_wv **docs, int *yvect, double *weights, double *ab,
   }
 
   printf("support vectors: ");
-  for (i=j=0; j<nsv; i++) {
+  for (i=j=0; i<ndocs && j<nsv; i++) {
     if (weights[i] > svm_epsilon_a) {
       printf("%d(%f) ",i,weights[i]);
       j++;
@@ -1287,10 +1770,142 @@ int tlf_svm(bow_wv **docs, int *yvect, double *weights, double *ab,
     }
   }
   printf("\n%d support vectors (%d bounded)\n", nsv, misclass);
+}
+
+/* cover for all the functions */
+/* this function does a small amount of pre & post-processing for the
+ * algorithm independent stuff (like randomly permuting everything &
+ * outputting a hyperplane if possible) */
+int tlf_svm(bow_wv **docs, int *yvect, double *weights, double *ab, 
+	    bow_wv **W_wv, int ntrans, int ndocs) {
+  int          nsv;
+  int         *permute_table;
+  double      *W=NULL;
+
+  struct tms t1, t2;
+
+  permute_table = tlf_svm_permute(docs, yvect, ntrans, ndocs);
+
+  times(&t1);
+  nsv = tlf_svm_solve(docs, yvect, weights, ab, &W, permute_table, ntrans, ndocs);
+  times(&t2);
+  tlf_svm_print_times((int) (t2.tms_utime - t1.tms_utime), 
+		      (int) (t2.tms_stime - t1.tms_stime), svm_nkc_calls);
+
+  tlf_svm_finish(docs, yvect, weights, W, W_wv, permute_table, ntrans, ndocs, nsv);
 
   return nsv;
 }
 
+/* a binary model for svm_train_models to train, along with what 
+ * tlf_svm_finish & add_sv_barrel need afterwards */
+struct svm_model_job {
+  bow_wv **docs;          /* the model's documents (permuted), */
+  int     *yvect;         /* their labels, */
+  int     *utdocs;        /* & their indices in the training set */
+  int     *permute_table;
+  int      ntrans;
+  int      ndocs;
+  double  *weights;
+  double   b;
+  double  *W;
+  int      nsv;
+  int      user;          /* cpu time of the thread that trained it */
+  int      nkc_calls;
+};
+
+struct svm_train_context {
+  struct svm_model_job *jobs;
+  int            njobs;
+  int            next;      /* the next job to be taken */
+  int            nthreads;
+  struct kcache *kc;        /* the calling thread's cache, */
+  struct kcache_store *store; /* & the rows shared out of it */
+};
+
+/* copies the arrays describing a model & permutes them, so that the 
+ * caller can go on to set up the next one */
+static void svm_model_job_init(struct svm_model_job *job, bow_wv **docs, 
+			       int *yvect, int *utdocs, int ntrans, int ndocs) {
+  int i;
+
+  job->docs = (bow_wv **) malloc(sizeof(bow_wv *)*ndocs);
+  job->yvect = (int *) malloc(sizeof(int)*ndocs);
+  job->utdocs = (int *) malloc(sizeof(int)*ndocs);
+  job->weights = (double *) malloc(sizeof(double)*ndocs);
+  for (i=0; i<ndocs; i++) {
+    job->docs[i] = docs[i];
+    job->yvect[i] = yvect[i];
+    job->utdocs[i] = utdocs[i];
+  }
+  job->ntrans = ntrans;
+  job->ndocs = ndocs;
+  job->W = NULL;
+  job->permute_table = tlf_svm_permute(job->docs, job->yvect, ntrans, ndocs);
+}
+
+static void svm_model_job_free(struct svm_model_job *job) {
+  free(job->docs);
+  free(job->yvect);
+  free(job->utdocs);
+  free(job->weights);
+}
+
+/* the work of one thread of svm_train_models: take models until there
+ * are none left */
+static void svm_train_models_thread(int thread_index, void *context) {
+  struct svm_train_context *tc = context;
+  struct svm_model_job *job;
+  struct timespec t1, t2;
+  int i;
+
+  kcache_nslices = tc->nthreads;
+  if (tc->store) {
+    kcache_attach(tc->kc, tc->store);
+  }
+
+  while ((i = __sync_fetch_and_add(&tc->next, 1)) < tc->njobs) {
+    job = &(tc->jobs[i]);
+    svm_nkc_calls = 0;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    job->nsv = tlf_svm_solve(job->docs, job->yvect, job->weights, &(job->b), 
+			     &(job->W), job->permute_table, job->ntrans, 
+			     job->ndocs);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t2);
+    job->user = (int) (((t2.tv_sec - t1.tv_sec) 
+			+ (t2.tv_nsec - t1.tv_nsec) / 1e9) * sysconf(_SC_CLK_TCK));
+    job->nkc_calls = svm_nkc_calls;
+  }
+
+  if (tc->store) {
+    kcache_detach(tc->kc);
+  }
+  kcache_nslices = 1;
+}
+
+/* trains the NJOBS models on up to bow_num_threads threads.  each
+ * thread has its own solver state & slice of the kernel cache, & the
+ * whole rows of the documents registered with the calling thread's
+ * cache (if there are any) are shared.  the models are independent, so
+ * they come out the same as they would one after another. */
+static void svm_train_models(struct svm_model_job *jobs, int njobs) {
+  struct svm_train_context tc;
+
+  tc.jobs = jobs;
+  tc.njobs = njobs;
+  tc.next = 0;
+  tc.nthreads = MIN(bow_num_threads, njobs);
+  tc.kc = &kc;
+  tc.store = NULL;
+  if (svm_weight_style != WEIGHTS_PER_MODEL) {
+    tc.store = kcache_store_new(tc.nthreads);
+  }
+  bow_threads_run(tc.nthreads, svm_train_models_thread, &tc);
+  if (tc.store) {
+    kcache_store_free(tc.store);
+  }
+}
+
 bow_wv *svm_darray_to_wv(double *W) {
   bow_wv *W_wv;
   int     num_words, i, j;
@@ -1442,7 +2057,7 @@ int add_sv_barrel(bow_barrel *new_barrel,double *weights, int *yvect, int *tdocs
   for (i=j=0; j<nsv; i++) {
     if (weights[i] > svm_epsilon_a) {
       if (yvect[i] > 0) {
-	if (pi > num_words) {
+	if (pi == num_words) {
 	  dummy_wv_pos->num_entries = pi;
 	  cdoc_pos.word_count = pi;
 	  bow_barrel_add_document(new_barrel, &cdoc_pos, dummy_wv_pos);
@@ -1454,10 +2069,10 @@ int add_sv_barrel(bow_barrel *new_barrel,double *weights, int *yvect, int *tdocs
 	dummy_wv_pos->entry[pi].wi = pi;
 	pi++;
       } else {
-	if (ni > num_words) {
-	  dummy_wv_neg->num_entries = pi;
+	if (ni == num_words) {
+	  dummy_wv_neg->num_entries = ni;
 	  cdoc_neg.word_count = ni;
-	  bow_barrel_add_document(new_barrel, &cdoc_neg, dummy_wv_pos);
+	  bow_barrel_add_document(new_barrel, &cdoc_neg, dummy_wv_neg);
 	  ni = 0;
 	  n_meta_docs++;
 	}
@@ -1490,6 +2105,7 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
   bow_wv      **docs;        /* a doc major matrix */
   int           max_nsv;     /* highest # of nsv's in a submodel */
   int           mdocs;       /* the number of docs in the current submodel */
+  struct svm_model_job *jobs; /* the models, when they're trained at once */
   bow_wv      **model_weights;
   int           n_meta_docs; /* # of documents that will go into the class barrel
 			      * before the weight vectors will */
@@ -1516,7 +2132,7 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
   int i,j;
 
 #ifndef HAVE_LOQO
-  if (svm_use_smo != 1) {
+  if (svm_use_smo == 0) {
     fprintf(stderr,"Can only use SMO, no other solvers were built,\n"
 	    "rebuild libbow with pr_loqo to use another algorithm.\n");
   }
@@ -1588,7 +2204,7 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
 
     svm_set_barrel_weights(docs, NULL, ndocs, &weight_vect);
 
-    kcache_init(ndocs);
+    kcache_init(docs, ndocs);
   } else {
     /* the ndocs value is the number of training documents that will
      * actually be used - this is done now JUST to fill up the tdocs array. */
@@ -1660,6 +2276,24 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
     }
   }
 
+  /* the models are set up in order, but trained after the loop, several
+   * at once - unless there's only one thread, or something that needs
+   * to train them one after another (or shares their documents) is on */
+  jobs = NULL;
+  if (bow_num_threads > 1 && svm_use_smo && !ntrans && !do_active_learning 
+      && !test_in_train && !svml_basename && !svm_remove_misclassified
+      && svm_kernel_type != FISHER 
+      && (svm_weight_style != WEIGHTS_PER_MODEL || vote_type == PAIRWISE)) {
+    if (vote_type == PAIRWISE) {
+      i = (nclasses-1)*nclasses/2;
+    } else {
+      i = nclasses;
+    }
+    if (i > 1) {
+      jobs = (struct svm_model_job *) malloc(sizeof(struct svm_model_job)*i);
+    }
+  }
+
   for (npass=0, cto=1; 1; ) {
     /* initialize & pull together the classes for the npass'th model... */
     if (vote_type == PAIRWISE) {
@@ -1798,6 +2432,8 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
 
       nsv = 0;
       W[nloops] = bow_wv_new(0);
+    } else if (jobs) {
+      svm_model_job_init(&(jobs[nloops]), sub_docs, yvect, utdocs, ntrans, mdocs);
     } else {
       /* only useful with test-in-train - ONLY build models after a certain point
        * (like when the previously acquired data runs out) */
@@ -1806,19 +2442,22 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
       }
     }
 
-    if (vote_type == PAIRWISE && weight_type) {
-      for (i=0; i<mdocs; i++) {
-	bow_wv_free(sub_docs[i]);
+    /* (the rest waits until the model's been trained) */
+    if (!jobs) {
+      if (vote_type == PAIRWISE && weight_type) {
+	for (i=0; i<mdocs; i++) {
+	  bow_wv_free(sub_docs[i]);
+	}
       }
-    }
 
-    if (max_nsv < nsv) {
-      max_nsv = nsv;
-    }
+      if (max_nsv < nsv) {
+	max_nsv = nsv;
+      }
 
-    /* now we need to drop the significant classes into the barrel */
-    if (!test_in_train) {
-      n_meta_docs += add_sv_barrel(class_barrel, weights, yvect, utdocs, b, nloops, nsv);
+      /* now we need to drop the significant classes into the barrel */
+      if (!test_in_train) {
+	n_meta_docs += add_sv_barrel(class_barrel, weights, yvect, utdocs, b, nloops, nsv);
+      }
     }
     
     if (vote_type == PAIRWISE) {
@@ -1829,6 +2468,42 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
     nloops++;
   }
 
+  if (jobs) {
+    int kcalls = 0;
+
+    svm_train_models(jobs, nloops);
+
+    for (j=0; j<nloops; j++) {
+      struct svm_model_job *job = &(jobs[j]);
+
+      /* the calls are counted per model, the single threaded ones 
+       * since the cache was set up */
+      if (svm_weight_style == WEIGHTS_PER_MODEL) {
+	kcalls = job->nkc_calls;
+      } else {
+	kcalls += job->nkc_calls;
+      }
+      tlf_svm_print_times(job->user, 0, kcalls);
+      tlf_svm_finish(job->docs, job->yvect, job->weights, job->W, &(W[j]),
+		     job->permute_table, job->ntrans, job->ndocs, job->nsv);
+
+      if (vote_type == PAIRWISE && weight_type) {
+	for (i=0; i<job->ndocs; i++) {
+	  bow_wv_free(job->docs[i]);
+	}
+      }
+
+      if (max_nsv < job->nsv) {
+	max_nsv = job->nsv;
+      }
+
+      n_meta_docs += add_sv_barrel(class_barrel, job->weights, job->yvect, 
+				   job->utdocs, job->b, j, job->nsv);
+      svm_model_job_free(job);
+    }
+    free(jobs);
+  }
+
   if (test_in_train) {
     exit(0);
   }
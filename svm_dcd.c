@@ -0,0 +1,193 @@
+/* ********************* svm_dcd.c **********************
+ * Dual coordinate descent for the linear kernel, as in Hsieh, Chang,
+ * Lin, Keerthi & Sundararajan's "A Dual Coordinate Descent Method for
+ * Large-scale Linear SVM" (ICML 2008).  The hyperplane is kept as a
+ * dense vector & updated in place, so no kernel values are computed at
+ * all - each step is a dot product & an update over one document's
+ * entries.
+ *
+ * There's no equality constraint on the weights here, so the bias is
+ * learned as the weight of an extra feature (DCD_BIAS) which all of
+ * the documents share; that means it's regularized along with the rest
+ * of the hyperplane. */
+
+#include <bow/svm.h>
+
+#define DCD_BIAS      1.0   /* the value of the bias feature */
+#define DCD_MAX_ITER  1000  /* passes over the data before giving up */
+/* the stopping tolerance on the gap between the largest & smallest
+ * projected gradients.  svm_epsilon_crit is a tolerance on smo's KKT
+ * conditions, which is much too tight for this - liblinear uses 0.1. */
+#define DCD_EPSILON   0.1
+
+/* returns whether any of the weights changed */
+int dcd(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W,
+	int ndocs, double *error, float *cvect, int *nsv) {
+  int          active;     /* the # of examples not shrunk away */
+  int          changed;
+  double       G, PG;      /* gradient & projected gradient */
+  double       PGmax_old, PGmin_old;
+  double       PGmax, PGmin;
+  double      *QD;         /* the diagonal of the hessian */
+  double       wb;         /* the weight of the bias feature */
+  double      *hyp;
+  int         *index;
+  int          iter;
+  int          num_words;
+  unsigned short xsubi[3];
+  struct tms   t1, t2;
+
+  int i,j,k,s;
+
+  times(&t1);
+  num_words = bow_num_words();
+
+  if (!(*W)) {
+    *W = (double *) malloc(sizeof(double)*num_words);
+    for (j=0; j<num_words; j++) {
+      (*W)[j] = 0.0;
+    }
+    for (i=0; i<ndocs; i++) {
+      if (weights[i] != 0.0) {
+	for (j=0; j<docs[i]->num_entries; j++) {
+	  (*W)[docs[i]->entry[j].wi] +=
+	    yvect[i] * weights[i] * docs[i]->entry[j].weight;
+	}
+      }
+    }
+  }
+  hyp = *W;
+
+  QD = (double *) malloc(sizeof(double)*ndocs);
+  index = (int *) malloc(sizeof(int)*ndocs);
+  for (i=wb=0; i<ndocs; i++) {
+    QD[i] = DCD_BIAS*DCD_BIAS;
+    for (j=0; j<docs[i]->num_entries; j++) {
+      QD[i] += docs[i]->entry[j].weight * docs[i]->entry[j].weight;
+    }
+    wb += yvect[i] * weights[i] * DCD_BIAS;
+    index[i] = i;
+  }
+
+  /* a generator of our own, so that models trained on several threads
+   * come out the same as they would on one */
+  xsubi[0] = 0x330e;
+  xsubi[1] = svm_random_seed & 0xffff;
+  xsubi[2] = (svm_random_seed >> 16) & 0xffff;
+
+  changed = 0;
+  active = ndocs;
+  PGmax_old = MAXDOUBLE;
+  PGmin_old = -1*MAXDOUBLE;
+  for (iter=0; iter<DCD_MAX_ITER; iter++) {
+    PGmax = -1*MAXDOUBLE;
+    PGmin = MAXDOUBLE;
+
+    for (s=0; s<active; s++) {
+      j = s + nrand48(xsubi) % (active - s);
+      k = index[s];
+      index[s] = index[j];
+      index[j] = k;
+    }
+
+    for (s=0; s<active; s++) {
+      i = index[s];
+      G = yvect[i] * ((*bow_kernel_dot_sd)(docs[i]->entry, docs[i]->num_entries, hyp)
+		      + wb*DCD_BIAS) - 1;
+
+      /* examples at a bound whose gradient points further out of the
+       * box than the worst violator of the last pass get shrunk */
+      PG = 0.0;
+      if (weights[i] == 0.0) {
+	if (G > PGmax_old) {
+	  active--;
+	  index[s] = index[active];
+	  index[active] = i;
+	  s--;
+	  continue;
+	} else if (G < 0) {
+	  PG = G;
+	}
+      } else if (weights[i] == cvect[i]) {
+	if (G < PGmin_old) {
+	  active--;
+	  index[s] = index[active];
+	  index[active] = i;
+	  s--;
+	  continue;
+	} else if (G > 0) {
+	  PG = G;
+	}
+      } else {
+	PG = G;
+      }
+
+      PGmax = MAX(PGmax, PG);
+      PGmin = MIN(PGmin, PG);
+
+      if (fabs(PG) > svm_epsilon_a) {
+	double aold = weights[i];
+	double d;
+
+	weights[i] = MIN(MAX(aold - G/QD[i], 0.0), cvect[i]);
+	d = (weights[i] - aold) * yvect[i];
+	for (j=0; j<docs[i]->num_entries; j++) {
+	  hyp[docs[i]->entry[j].wi] += d * docs[i]->entry[j].weight;
+	}
+	wb += d*DCD_BIAS;
+	changed = 1;
+      }
+    }
+
+    /* (several models' lines would be interleaved) */
+    if (bow_num_threads == 1) {
+      times(&t2);
+      fprintf(stderr, "\r\t\t\t\t\t\titer: %d   active: %d   gap: %f   "
+	      "time: %.2fs     ", iter+1, active, PGmax-PGmin,
+	      (double) (t2.tms_utime - t1.tms_utime) / sysconf(_SC_CLK_TCK));
+      fflush(stderr);
+    }
+
+    if (PGmax - PGmin <= DCD_EPSILON) {
+      if (active == ndocs) {
+	iter++;
+	break;
+      }
+      /* everything comes back for one more look */
+      active = ndocs;
+      PGmax_old = MAXDOUBLE;
+      PGmin_old = -1*MAXDOUBLE;
+      continue;
+    }
+    PGmax_old = (PGmax <= 0) ? MAXDOUBLE : PGmax;
+    PGmin_old = (PGmin >= 0) ? -1*MAXDOUBLE : PGmin;
+  }
+
+  times(&t2);
+  if (bow_num_threads == 1) {
+    fprintf(stderr, "\ndcd: %d iterations in %.2fs (%.4fs each)\n", iter,
+	    (double) (t2.tms_utime - t1.tms_utime) / sysconf(_SC_CLK_TCK),
+	    (double) (t2.tms_utime - t1.tms_utime) / sysconf(_SC_CLK_TCK)
+	    / MAX(iter, 1));
+  }
+  if (iter == DCD_MAX_ITER) {
+    fprintf(stderr, "dcd: stopped after %d iterations without converging\n",
+	    DCD_MAX_ITER);
+  }
+
+  /* the errors are kept (like smo's) without the bias */
+  for (i=*nsv=0; i<ndocs; i++) {
+    error[i] = (*bow_kernel_dot_sd)(docs[i]->entry, docs[i]->num_entries, hyp)
+      - yvect[i];
+    if (weights[i] > svm_epsilon_a) {
+      (*nsv) ++;
+    }
+  }
+
+  *a_b = -1 * wb * DCD_BIAS;
+
+  free(QD);
+  free(index);
+
+  return (changed);
+}
@@ -304,8 +304,6 @@ void setup_solve_sub_qp(int *ws, int *y, double *a, bow_wv **docs, struct svm_qp
     }
   }
 
-  kcache_age();
-
   /* init_a is kept in qd so that the B alphas that correspond to 
    * the alphas in the primal are readily & easily available */
   for(i=0; i<n; i++) {
@@ -398,8 +396,6 @@ void update_gradient(double *s, bow_wv **docs, int *yvect, double *weights,
       s[i] += wdy[j]*svm_kernel_cache(docs[i],docs[wds[j]]);
     }
   }
-
-  kcache_age();
 }
 
 double calculate_b(double *s, int *yvect, double *a, float *cvect, int ndocs) {
@@ -538,7 +534,7 @@ int build_svm_guts(bow_wv **docs, int *yvect, double *weights, double *b,
   }
 
   if (svm_weight_style == WEIGHTS_PER_MODEL) {
-    kcache_init(ndocs);
+    kcache_init(docs, ndocs);
   }
 
   n2inc_prec = LOOSE2LIVE;
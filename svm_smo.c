@@ -100,15 +100,19 @@ void check_inv(struct svm_smo_model *m,int ndocs) {
 }
 #endif
 
-static int m1=0,m2=0,m3=0,m4=0;
-
 #define PRINT_SMO_PROGRESS(f,ms) (fprintf((f),                          \
-       "\r\t\t\t\t\t\tmajor: %d   opt_single: %d/%d   opt_pair: %d/%d     ",\
-       (ms)->n_outer, (ms)->n_single_suc, (ms)->n_single_tot,           \
+       "\r\t\t\t\t\t\tmajor: %d   active: %d   opt_pair: %d/%d     ",  \
+       (ms)->n_outer, (ms)->active.ilength,                            \
        (ms)->n_pair_suc, (ms)->n_pair_tot))
 
+/* the smallest curvature used when picking a pair (for non-PSD kernels) */
+#define SMO_TAU 1e-12
+/* how many pairs get optimized between shrinkings of the active set */
+#define SMO_SHRINK_INTERVAL 1000
+
 
-/* does NOT call kcache_age */
+/* computes the error of EX from scratch (smo() itself keeps the
+ * errors of all of the examples up to date as it goes) */
 double smo_evaluate_error(struct svm_smo_model *model, int ex) {
   /* do the hyperplane calculation... */
   if (svm_kernel_type == 0) {
@@ -138,45 +142,33 @@ double smo_evaluate_error(struct svm_smo_model *model, int ex) {
 /* in this case we need to compute the obj. function when a2 is at the endpoints */
 double calc_eta_hi(int ex1, int ex2, double L, double H, double k11, double k12, 
 		   double k22, struct svm_smo_model *ms) {
-  bow_wv **docs;
-  int ndocs;
+  double *error;
   double *weights;
   int *yvect;
 
   double Lf, Hf,s, gamma;
   double tmp;
-  int i;
 
-  docs = ms->docs;
-  ndocs = ms->ndocs;
+  error = ms->error;
   weights = ms->weights;
   yvect = ms->yvect;
 
-  /* this need not be horribly efficient, since it is only called,
-   * for every time eta is non-negative (which is alledgedly rare) */
+  /* v1 & v2 are the parts of the outputs of ex1 & ex2 that come from
+   * the rest of the examples - their errors already hold those sums */
   {
     double v1,v2;
     double a1, a2;
     int y1, y2;
 
-    for(i=0,v1=v2=0.0; i<ndocs; i++) {
-      if (i==ex1 || i==ex2) {
-	continue;
-      }
-      if (weights[i] == 0.0) {
-	continue;
-      }
-      tmp = yvect[i]*weights[i];
-      v1 += tmp*svm_kernel_cache(docs[ex1],docs[i]);
-      v2 += tmp*svm_kernel_cache(docs[ex2],docs[i]);
-    }
-
     a1 = weights[ex1];
     a2 = weights[ex2];
 
     y1 = yvect[ex1];
     y2 = yvect[ex2];
 
+    v1 = error[ex1] + y1 - y1*a1*k11 - y2*a2*k12;
+    v2 = error[ex2] + y2 - y1*a1*k12 - y2*a2*k22;
+
 #define CALC_W(gamma,s,a2) ((tmp=gamma-s*a2) + a2 - .5*(k11*(tmp*tmp) - k22*a2*a2) \
 			    - s*k12*tmp*a2 - y1*tmp*v1 - y2*a2*v2)
 
@@ -198,8 +190,8 @@ double calc_eta_hi(int ex1, int ex2, double L, double H, double k11, double k12,
 /* "tries" to jointly optimize a pair of lagrange weights ...
  * can't always succeed - in those cases, 0 is returned, 1 on success */
 
-/* INVARIANTS: both error[ex1] & error[ex2] must be valid, though 
- * it doesn't matter what set they belong to 
+/* INVARIANTS: the errors of all of the active examples must be valid, 
+ * whatever set they belong to 
 
  * all of the weights are feasible & obey the lin. equality
  * constraint when they come in & only this fn plays with the weights */
@@ -212,8 +204,9 @@ int opt_pair(int ex1, int ex2, struct svm_smo_model *ms) {
   double   e1, e2;
   double   eta;    /* the value of the second deriv. of the obj */
   double   k11, k12, k22;
-  int      ndocs;
   double   L, H;
+  int     *ord;
+  double  *row1, *row2;
   double  *weights;
   int     *yvect;
   int      y1, y2;
@@ -224,7 +217,6 @@ int opt_pair(int ex1, int ex2, struct svm_smo_model *ms) {
   //printV("",ms->error,ms->ndocs,"\n");
 
   if (ex1 == ex2) {
-    m1 ++;
     return 0;
   }
 
@@ -255,16 +247,17 @@ int opt_pair(int ex1, int ex2, struct svm_smo_model *ms) {
   }
 
   if (L >= H) {
-    m2++;
     return 0;
   }
 
   docs = ms->docs;
-  ndocs = ms->ndocs;
+  ord = ms->ord;
 
-  k12 = svm_kernel_cache(docs[ex1],docs[ex2]);
-  k11 = svm_kernel_cache(docs[ex1],docs[ex1]);
-  k22 = svm_kernel_cache(docs[ex2],docs[ex2]);
+  row1 = svm_kernel_row(ord[ex1]);
+  row2 = svm_kernel_row(ord[ex2]);
+  k12 = row1[ord[ex2]];
+  k11 = row1[ord[ex1]];
+  k22 = row2[ord[ex2]];
 
   eta = 2*k12 - k11 - k22;
 
@@ -293,7 +286,6 @@ int opt_pair(int ex1, int ex2, struct svm_smo_model *ms) {
   }
 
   if (fabs(a2 - ao2) < svm_epsilon_a) { //*(a2 + ao2 + svm_epsilon_crit)) {
-    m4 ++;
     return 0;
   }
 
@@ -330,41 +322,45 @@ int opt_pair(int ex1, int ex2, struct svm_smo_model *ms) {
     }
   }
 
-  /* update the sets (& start to re-evaluate bup & blow) */
+  /* much like the build_svm algorithm's s(t) vector, error needs 
+   * to be updated every time we set some new alphas - with both rows
+   * at hand, it's cheap to keep every active example's error up to 
+   * date (the shrunk ones get rebuilt by smo_unshrink) */
+  {
+    double *error = ms->error;
+    int    *items = ms->active.items;
+    int     nitems = ms->active.ilength;
+    int     t;
+
+    for (i=0; i<nitems; i++) {
+      t = items[i];
+      error[t] += diff1*row1[ord[t]] + diff2*row2[ord[t]];
+    }
+  }
+
+  /* update the sets */
   { 
     int j, i, y;
-    double a, aold, C, e;
+    double a, aold, C;
     struct set *s;
 
-    ms->bup = MAXDOUBLE;
-    ms->blow = -1*MAXDOUBLE;
-
-    for (j=0, i=ex1, a=a1, aold=ao1, y=y1, C=C1, e=e1; 
+    for (j=0, i=ex1, a=a1, aold=ao1, y=y1, C=C1; 
 	 j<2; 
-	 j++, i=ex2, a=a2, aold=ao2, y=y2, C=C2, e=e2) {
-      /* the following block also sets bup & blow to preliminary values.
-       * this is so that we don't need to repeat these checks when we're 
-       * trying to figure out whether or not some */
+	 j++, i=ex2, a=a2, aold=ao2, y=y2, C=C2) {
       if (a < svm_epsilon_a) {
 	if (y == 1)  {
 	  s = &(ms->I1);
-	  if (ms->bup > e) { ms->bup = e; ms->iup = i; }
 	} else {
 	  s = &(ms->I4);
-	  if (ms->blow < e) { ms->blow = e; ms->ilow = i; }
 	}
       } else if (a > C - svm_epsilon_a) {
 	if (y == 1)  {
 	  s = &(ms->I3);
-	  if (ms->blow < e) { ms->blow = e; ms->ilow = i; }
 	} else {
 	  s = &(ms->I2);
-	  if (ms->bup > e) { ms->bup = e; ms->iup = i; }
 	}
       } else {
 	s = &(ms->I0);
-	if (ms->blow < e) { ms->blow = e; ms->ilow = i; }
-	if (ms->bup > e) { ms->bup = e; ms->iup = i; }	
       }
 
       if (set_insert(i, s)) { /* if this was actually inserted, 
@@ -398,171 +394,209 @@ int opt_pair(int ex1, int ex2, struct svm_smo_model *ms) {
 
   ms->n_pair_suc ++;
 
-  /* much like the build_svm algorithm's s(t) vector, error needs 
-   * to be updated every time we set some new alphas */
-  /* also finish update bup & blow */
-  {
-    double *error = ms->error;
-    int    *items;
-    int     nitems;
-
-    items = ms->I0.items;
-    nitems = ms->I0.ilength;
+  //printf("blow = %f(%d), bup = %f(%d)\n",ms->blow, ms->ilow, ms->bup, ms->iup);
 
-    for (i=0; i<nitems; i++) {
-      double a, b;
-      a = svm_kernel_cache(docs[ex1],docs[items[i]]);
-      b = svm_kernel_cache(docs[ex2],docs[items[i]]);
-      error[items[i]]  +=  diff1*a + diff2*b;
-    }
+  return 1;
+}
 
-    {
-      int efrom;
-      double e;
+/* whether EX's alpha can move so that its error counts against bup
+ * (I_up in keerthi, et al.) or against blow (I_low) */
+static inline int smo_in_up(int ex, struct svm_smo_model *ms) {
+  return (set_lookup(ex, &(ms->I0)) || set_lookup(ex, &(ms->I1))
+	  || set_lookup(ex, &(ms->I2)));
+}
 
-      /* compute the new bup & blow */
-      for (i=0, e=ms->bup; i<nitems; i++) {
-	if (e > error[items[i]]) {
-	  e = error[items[i]];
-	  efrom = items[i];
-	}
-      }
-      if (e != ms->bup) {
-	ms->bup = e;
-	ms->iup = efrom;
-      }
+static inline int smo_in_low(int ex, struct svm_smo_model *ms) {
+  return (set_lookup(ex, &(ms->I0)) || set_lookup(ex, &(ms->I3))
+	  || set_lookup(ex, &(ms->I4)));
+}
 
-      for (i=0, e=ms->blow; i<nitems; i++) {
-	if (e < error[items[i]]) {
-	  e = error[items[i]];
-	  efrom = items[i];
-	}
-      }
-      if (ms->blow != e) {
-	ms->blow = e;
-	ms->ilow = efrom;
-      }
+/* computes bup & blow over the active examples & picks the next pair
+ * to optimize: ilow is the example which violates the optimality 
+ * conditions the most, it's partner is the one (in I_up) that gives
+ * the largest 2nd order gain of the obj. function with it (fan, chen &
+ * lin's "working set selection 2").  returns 0 when there's no pair 
+ * which violates the conditions by more than 2*svm_epsilon_crit. */
+static int smo_select_pair(struct svm_smo_model *ms, int *ex1, int *ex2) {
+  double *diag;
+  double *error;
+  int    *items;
+  int     nitems;
+  int    *ord;
+  double *row;
+
+  double a, b, g, gmin;
+  int    i, j, k, t;
+
+  diag = ms->diag;
+  error = ms->error;
+  items = ms->active.items;
+  nitems = ms->active.ilength;
+  ord = ms->ord;
+
+  ms->bup = MAXDOUBLE;
+  ms->blow = -1*MAXDOUBLE;
+  for (k=0; k<nitems; k++) {
+    t = items[k];
+    if (smo_in_up(t, ms) && error[t] < ms->bup) {
+      ms->bup = error[t];
+      ms->iup = t;
+    }
+    if (smo_in_low(t, ms) && error[t] > ms->blow) {
+      ms->blow = error[t];
+      ms->ilow = t;
     }
   }
 
-  kcache_age();
-  //printf("blow = %f(%d), bup = %f(%d)\n",ms->blow, ms->ilow, ms->bup, ms->iup);
+  if (ms->blow - ms->bup <= 2*svm_epsilon_crit) {
+    return 0;
+  }
 
+  i = ms->ilow;
+  row = svm_kernel_row(ord[i]);
+  j = ms->iup;
+  gmin = MAXDOUBLE;
+  for (k=0; k<nitems; k++) {
+    t = items[k];
+    if (!smo_in_up(t, ms) || error[t] >= error[i]) {
+      continue;
+    }
+    b = error[i] - error[t];
+    a = diag[i] + diag[t] - 2*row[ord[t]];
+    if (a <= 0) {
+      a = SMO_TAU;
+    }
+    g = -(b*b)/a;
+    if (g < gmin) {
+      gmin = g;
+      j = t;
+    }
+  }
+
+  *ex1 = j;
+  *ex2 = i;
   return 1;
 }
 
-/* this function is only called when all examples are being queried (ie.
- * the examine_all phase). */
-int opt_single(int ex2, struct svm_smo_model *ms) {
+/* takes the examples which are stuck at a bound & can't be part of a
+ * violating pair given the current bup & blow out of the active set
+ * (joachims' "shrinking" heuristic).  they can still be wrong, which is
+ * why smo_unshrink brings them back before smo() finishes. */
+static void smo_shrink(struct svm_smo_model *ms) {
+  double *error;
+  int    *items;
+  int     up, low;
+  int i, t;
+
+  error = ms->error;
+  items = ms->active.items;
+
+  /* backwards, since set_delete swaps the last item into the hole */
+  for (i=ms->active.ilength-1; i>=0; i--) {
+    t = items[i];
+    if (set_lookup(t, &(ms->I0))) {
+      continue;
+    }
+    up = smo_in_up(t, ms);
+    low = smo_in_low(t, ms);
+    if ((up && !low && error[t] > ms->blow) 
+	|| (low && !up && error[t] < ms->bup)) {
+      set_delete(t, &(ms->active));
+    }
+  }
+
+  for (i=0; i<ms->active.ilength; i++) {
+    ms->cols[i] = ms->ord[items[i]];
+  }
+  kcache_restrict(ms->cols, ms->active.ilength);
+}
+
+/* recomputes the error of every example which isn't in VALID from the
+ * current weights */
+static void smo_reconstruct_errors(struct svm_smo_model *ms, struct set *valid) {
+  bow_wv **docs;
   double  *error;
   int      ndocs;
+  int     *ord;
   double  *weights;
   int     *yvect;
+  int i, j;
 
-  double a2;
-  double e2;
-  int    y2;
-
-  ms->n_single_tot ++;
-
+  docs = ms->docs;
   error = ms->error;
   ndocs = ms->ndocs;
+  ord = ms->ord;
   weights = ms->weights;
-  yvect   = ms->yvect;
-
-  y2 = ms->yvect[ex2];
-  a2 = weights[ex2];
-
-  if (set_lookup(ex2, &(ms->I0))) {
-    e2 = error[ex2];
-  } else {
-    e2 = error[ex2] = smo_evaluate_error(ms, ex2);
+  yvect = ms->yvect;
 
-    if (set_lookup(ex2, &(ms->I1)) || set_lookup(ex2, &(ms->I2))) {
-      if (e2 < ms->bup) {
-	ms->iup = ex2;
-	ms->bup = e2;
+  if (svm_kernel_type == 0) {
+    for (i=0; i<ndocs; i++) {
+      if (!set_lookup(i, valid)) {
+	error[i] = evaluate_model_hyperplane(ms->W, 0.0, docs[i]) - yvect[i];
       }
-    } else if (!set_lookup(ex2, &(ms->I0))) {  /* must be in I3 orI4 */
-      if (e2 > ms->blow) {
-	ms->ilow = ex2;
-	ms->blow = e2;
-      }     
     }
+    return;
   }
 
-  {
-    int opt=1;
-    int ex1;
-
-    if (set_lookup(ex2, &(ms->I0)) || set_lookup(ex2, &(ms->I1)) 
-	|| set_lookup(ex2, &(ms->I2))) {
-      if (ms->blow-e2 > 2*svm_epsilon_crit) {
-	opt = 0;
-	ex1 = ms->ilow;
-      }
+  for (i=0; i<ndocs; i++) {
+    if (!set_lookup(i, valid)) {
+      error[i] = 0.0;
     }
-
-    if (set_lookup(ex2, &(ms->I0)) || set_lookup(ex2, &(ms->I3))
-	|| set_lookup(ex2, &(ms->I4))) {
-      if (e2-ms->bup > 2*svm_epsilon_crit) {
-	opt = 0;
-	ex1 = ms->iup;
+  }
+  /* a support vector's kernel row at a time */
+  for (j=0; j<ndocs; j++) {
+    if (weights[j] != 0.0) {
+      double *row = svm_kernel_row(ord[j]);
+      double  t = yvect[j]*weights[j];
+
+      for (i=0; i<ndocs; i++) {
+	if (!set_lookup(i, valid)) {
+	  error[i] += t*row[ord[i]];
+	}
       }
     }
-
-    if (opt == 1) {
-      kcache_age();
-      return 0;
-    }
-
-    /* if we get here, then opt was == 1 & ex1 was valid */
-
-    if (set_lookup(ex2, &(ms->I0))) {
-      if (ms->blow > 2*e2 - ms->bup) {
-	ex1 = ms->ilow;
-      } else {
-	ex1 = ms->iup;
-      }
+  }
+  for (i=0; i<ndocs; i++) {
+    if (!set_lookup(i, valid)) {
+      error[i] -= yvect[i];
     }
+  }
+}
 
-    if (!set_lookup(ex1, &(ms->I0))) { /* not in the cache & it needs to be */
-      error[ex1] = smo_evaluate_error(ms, ex1);
-    }
+/* brings every shrunk example back into the active set */
+static void smo_unshrink(struct svm_smo_model *ms) {
+  int i;
 
-    kcache_age();
-    if (opt_pair(ex1, ex2, ms)) {
-      ms->n_single_suc ++;
-      return 1;
-    } else {
-      return 0;
-    }
+  kcache_unrestrict();
+  kcache_restrict(ms->ord, ms->ndocs);
+  smo_reconstruct_errors(ms, &(ms->active));
+  for (i=0; i<ms->ndocs; i++) {
+    set_insert(i, &(ms->active));
   }
 }
 
 int smo(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W, 
 	int ndocs, double *error, float *cvect, int *nsv) {
   int          changed;
-  int          inspect_all;
+  int          counter;
   struct svm_smo_model model;
-  int          nchanged;
   int          num_words;
-  double      *original_weights;
+  struct set  *sv_sets[3];
+  int         *items;
+  int          nitems;
+  int          unshrunk;
+  int          ex1, ex2;
 
-  int i,j,k,n;
+  int i,j,m;
 
   num_words = bow_num_words();
 
-  m1 = m2 = m3 = m4 = 0;
-
-  model.n_pair_suc = model.n_pair_tot = model.n_single_suc = 
-    model.n_single_tot = model.n_outer = 0;
+  model.n_pair_suc = model.n_pair_tot = model.n_outer = 0;
   model.nsv = *nsv;
   model.docs = docs;
   model.error = error;
   model.ndocs = ndocs;
   model.cvect = cvect;
-  original_weights = NULL;
   if (svm_kernel_type == 0 && !(*W)) {
     *W = model.W = (double *) malloc(sizeof(double)*num_words);
   } else {
@@ -572,21 +606,35 @@ int smo(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W,
   model.yvect = yvect;
 
   /* figure out the # of positives */
-  for (i=j=k=n=0; i<ndocs; i++) {
+  for (i=j=0; i<ndocs; i++) {
     if (yvect[i] == 1) {
-      k = i;
       j++;
-    } else {
-      n = i;
     }
   }
-  /* k is set to the last positive example found, n is the last negative */
+
+  if (svm_weight_style == WEIGHTS_PER_MODEL) {
+    kcache_init(docs, ndocs);
+  }
+
+  model.ord = (int *) malloc(sizeof(int)*ndocs);
+  model.cols = (int *) malloc(sizeof(int)*ndocs);
+  model.diag = (double *) malloc(sizeof(double)*ndocs);
+  for (i=0; i<ndocs; i++) {
+    model.ord[i] = kcache_ordinal(docs[i]);
+    assert(model.ord[i] >= 0);
+  }
+  /* only this model's documents are needed from the cache */
+  kcache_restrict(model.ord, ndocs);
+  for (i=0; i<ndocs; i++) {
+    model.diag[i] = svm_kernel_cache(docs[i], docs[i]);
+  }
 
   make_set(ndocs,ndocs,&(model.I0));
   make_set(ndocs,j,&(model.I1));
   make_set(ndocs,ndocs-j,&(model.I2));
   make_set(ndocs,j,&(model.I3));
   make_set(ndocs,ndocs-j,&(model.I4));
+  make_set(ndocs,ndocs,&(model.active));
 
   /* this is the code which initializes the sets according to the weights values */
   for (i=0; i<ndocs; i++) {
@@ -607,61 +655,20 @@ int smo(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W,
     for (i=0; i<num_words; i++) {
       model.W[i] = 0.0;
     }
-  }
 
-  if (model.I0.ilength == 0) {
-    model.blow = 1;
-    model.bup  = -1;
-    model.iup  = k;
-    model.ilow = n;
-    error[k] = -1;
-    error[n] = 1;
-  } else { /* compute bup & blow */
-    int    efrom, nitems;
-    int   *items;
-    double e;
-
-    nitems = model.I0.ilength;
-    items = model.I0.items;
-
-    for (i=0, e=-1*MAXDOUBLE; i<nitems; i++) {
-      if (e < error[items[i]]) {
-	e = error[items[i]];
-	efrom = items[i];
-      }
-    }
-    model.blow = e;
-    model.ilow = efrom;
-    
-    for (i=0, e=MAXDOUBLE; i<nitems; i++) {
-      if (e > error[items[i]]) {
-	e = error[items[i]];
-	efrom = items[i];
-      }
-    }
-    model.bup = e;
-    model.iup = efrom;
-
-    if (model.W) {
+    /* the hyperplane is made from the unbound & the bound sv's */
+    sv_sets[0] = &(model.I0);
+    sv_sets[1] = &(model.I2);
+    sv_sets[2] = &(model.I3);
+    for (m=0; m<3; m++) {
+      nitems = sv_sets[m]->ilength;
+      items = sv_sets[m]->items;
       for (i=0; i<nitems; i++) {
 	for (j=0; j<docs[items[i]]->num_entries; j++) {
 	  model.W[docs[items[i]]->entry[j].wi] += 
 	    yvect[items[i]] * weights[items[i]] * docs[items[i]]->entry[j].weight;
 	}
       }
-      
-      /* also need to include bound sv's (I2 & I3) */
-      for (k=0, nitems=model.I2.ilength, items=model.I2.items; 
-	   k<2; 
-	   k++, nitems=model.I3.ilength, items=model.I3.items) {
-	
-	for (i=0; i<nitems; i++) {
-	  for (j=0; j<docs[items[i]]->num_entries; j++) {
-	    model.W[docs[items[i]]->entry[j].wi] += 
-	      yvect[items[i]] * weights[items[i]] * docs[items[i]]->entry[j].weight;
-	  }
-	}
-      }
     }
   }
 
@@ -669,98 +676,72 @@ int smo(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W,
     model.W = *W;
   }
 
-  if (svm_weight_style == WEIGHTS_PER_MODEL) {
-    kcache_init(ndocs);
+  /* the errors of the examples in I0 come in valid, the rest need to
+   * be computed once - after that opt_pair keeps them all up to date */
+  smo_reconstruct_errors(&model, &(model.I0));
+
+  for (i=0; i<ndocs; i++) {
+    set_insert(i, &(model.active));
   }
 
-  inspect_all = 1;
-  nchanged = 0;
+  /* keerthi, et al's modification 2, with the pair chosen by 2nd order
+   * information; every SMO_SHRINK_INTERVAL iterations the active set
+   * gets shrunk.  when it's optimal, the shrunk examples come back & 
+   * the loop only stops once all of them are optimal too. */
   changed = 0;
-  while (nchanged || inspect_all) {
-    nchanged = 0;
-    
+  unshrunk = 0;
+  counter = MIN(ndocs, SMO_SHRINK_INTERVAL);
+  while (1) {
 #ifdef DEBUG
     check_inv(&model,ndocs);
 #endif
 
-    model.n_outer ++;
-    PRINT_SMO_PROGRESS(stderr, &model);
-    fflush(stderr);
-
-    if (1 && inspect_all) {
-      int ub = ndocs;
-      i=j=random() % ndocs;
-      for (k=0; k<2; k++,ub=j,i=0) {
-	for (; i<ub; i++) {
-	  nchanged += opt_single(i, &model);
+    if (!smo_select_pair(&model, &ex1, &ex2)) {
+      if (model.active.ilength == ndocs) {
+	break;
+      }
+      smo_unshrink(&model);
+      if (!smo_select_pair(&model, &ex1, &ex2)) {
+	break;
+      }
+      counter = 1;
+    }
 
-#ifdef DEBUG
-	  check_inv(&model,ndocs);
-#endif
+    if (--counter == 0) {
+      counter = MIN(ndocs, SMO_SHRINK_INTERVAL);
+      if (svm_smo_shrinking) {
+	/* bring them all back once, when we're near the end, so that
+	 * the errors which went stale don't drive the last few steps */
+	if (!unshrunk && model.blow - model.bup <= 20*svm_epsilon_crit) {
+	  unshrunk = 1;
+	  smo_unshrink(&model);
 	}
+	smo_shrink(&model);
       }
-      inspect_all = 0;
-    } else {
-      /* greg's modification to keerthi, et al's modification 2 */
-      /* loop of optimizing all pairwise in a row with all elements
-       * in I0 (just like above, but only those in I0) */
-      do {
-	nchanged = 0;
-
-	/* here's the continuous iup/ilow loop */
-	while (1) {
-	  if (!set_lookup(model.iup, &(model.I0))) {
-	    error[model.iup] = smo_evaluate_error(&model,model.iup);
-	  }
-	  if (!set_lookup(model.ilow, &(model.I0))) {
-	    error[model.ilow] = smo_evaluate_error(&model,model.ilow);
-	  }
-	  if (opt_pair(model.iup, model.ilow, &model)) {
-#ifdef DEBUG
-	    check_inv(&model,ndocs);
-#endif
-	    
-	    nchanged ++;
-	  } else {
-	    break;
-	  }
-	  if (model.bup > model.blow - 2*svm_epsilon_crit)
-	    break;
-	}
-	
-	if (nchanged) {
-	  changed = 1;
-	}
-	nchanged = 0;
-	  
-	/* now inspect all of the elements in I0 */
-	{
-	  int ub = ndocs;
-	  i=j=random() % ndocs;
-	  for (k=0; k<2; k++,ub=j,i=0) {
-	    for (; i<ub; i++) {
-	      if (set_lookup(i, &(model.I0))) {
-		nchanged += opt_single(i, &model);
-#ifdef DEBUG
-		check_inv(&model,ndocs);
-#endif
-	      }
-	    }
-	  }
-	}
-      } while (nchanged);
-      /* of of the loop */
+      model.n_outer ++;
+      /* (several models' lines would be interleaved) */
+      if (bow_num_threads == 1) {
+	PRINT_SMO_PROGRESS(stderr, &model);
+	fflush(stderr);
+      }
+    }
 
-      if (nchanged) {
-	changed = 1;
-      } 
-      inspect_all = 1;
+    if (!opt_pair(ex1, ex2, &model) 
+	&& (ex1 == model.iup || !opt_pair(model.iup, ex2, &model))) {
+      /* no progress can be made on the most violating pair - so 
+       * we're done, unless some of the examples are set aside */
+      if (model.active.ilength == ndocs) {
+	break;
+      }
+      smo_unshrink(&model);
+      counter = MIN(ndocs, SMO_SHRINK_INTERVAL);
+      continue;
     }
+    changed = 1;
 
-    /* note: both of the above blocks no when they are done so they flip inspect_all */
-    if (nchanged) {
-      changed = 1;
-    } 
+#ifdef DEBUG
+    check_inv(&model,ndocs);
+#endif
   }
 
   free_set(&model.I0);
@@ -768,7 +749,12 @@ int smo(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W,
   free_set(&model.I2);
   free_set(&model.I3);
   free_set(&model.I4);
+  free_set(&model.active);
+  free(model.ord);
+  free(model.cols);
+  free(model.diag);
 
+  kcache_unrestrict();
   if (svm_weight_style == WEIGHTS_PER_MODEL) {
     kcache_clear();
   }
@@ -779,14 +765,6 @@ int smo(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W,
 
   *a_b = (model.bup + model.blow) / 2;
 
-  if (svm_kernel_type == 0) {
-    for (i=j=0; i<num_words; i++) {
-      if (model.W[i] != 0.0) 
-	j++;
-    }
-  }
-
-  //printf("m1: %d, m2: %d, m3: %d, m4: %d", m1,m2,m3,m4);
   *nsv = model.nsv;
 
   return (changed);
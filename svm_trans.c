@@ -151,7 +151,8 @@ int transduce_svm(bow_wv **docs, int *yvect, int *trans_yvect_store,
 
   /* initialize what the tvect should look like for the unlabeled docs */
   if (svm_use_smo) {
-    /* nothing needs to be done to the tvals since they are only valid for sv's */
+    /* nothing needs to be done to the tvals since they are only valid for
+     * sv's (& dcd doesn't read them at all) */
     for (i=nlabeled; i<ndocs; i++) {
       weights[i] = 0.0;
     }
@@ -259,7 +260,8 @@ int transduce_svm(bow_wv **docs, int *yvect, int *trans_yvect_store,
 	  }
 	}
 
-	if (svm_trans_smart_vals) {
+	/* dcd recomputes the tvals itself */
+	if (svm_trans_smart_vals && !SVM_USING_DCD) {
 	  if (svm_use_smo) {
 	    double wi, wj;
 	    int yi, yj;
@@ -322,8 +324,8 @@ int transduce_svm(bow_wv **docs, int *yvect, int *trans_yvect_store,
 #endif
     
     /* set the proper tvals for the unlabeled docs 
-     * (since they will no longer be bound) */
-    if (svm_use_smo) {
+     * (since they will no longer be bound) - dcd recomputes them itself */
+    if (svm_use_smo && !SVM_USING_DCD) {
       smo_model.W = *W;
       for (i=nlabeled; i<ndocs; i++) {
 	if ((weights[i] > cvect[i] - svm_epsilon_a) && 
@@ -30,8 +30,9 @@
 #endif
 
 /* The number of documents with non-zero dot-product with the query. 
-   Set in bow_tfidf_score(). */
-int bow_tfidf_num_hit_documents;
+   Set in bow_tfidf_score().  When it prunes, only the documents it
+   scored are counted. */
+__thread int bow_tfidf_num_hit_documents;
 
 #define DOING_LOG_COUNTS 1
 
@@ -170,6 +171,23 @@ bow_tfidf_set_weights (bow_barrel *barrel)
   bow_verbosify (bow_progress, "\n");
 }
 
+/* Bound what each word of BARREL can add to a score, for the pruning
+   in bow_tfidf_score(). */
+static void
+bow_tfidf_set_score_bounds (bow_barrel *barrel)
+{
+  bow_wi2dvf_set_max_weights (barrel->wi2dvf, barrel->cdocs, 1);
+}
+
+/* Normalize the weights of BARREL to unit length, then bound its
+   scores. */
+static void
+bow_tfidf_normalize_weights (bow_barrel *barrel)
+{
+  bow_barrel_normalize_weights_by_vector_length (barrel);
+  bow_tfidf_set_score_bounds (barrel);
+}
+
 
 /* Function to fill an array of the best matches to the document
    described by wv from the corpus in wi2dvf. There are 'best' elements
@@ -313,6 +331,52 @@ bow_tfidf_score_old (bow_barrel *barrel, bow_wv *query_wv,
 
 
 
+/* bow_tfidf_score() leaves out documents that can't make the top
+   SCORES_SIZE only for queries of at most this many words.  Walking
+   the DV's of a longer query a document at a time costs more than
+   adding them all up, as below, saves. */
+#define BOW_TFIDF_PRUNE_MAX_WORDS 8
+
+/* What bow_tfidf_score_document() needs to know about the query. */
+struct bow_tfidf_query {
+  bow_barrel *barrel;
+  bow_wv *query_wv;
+  int num_hit_documents;
+};
+
+/* Score document DI against the query CONTEXT, given the weights DW
+   of the NUM_PRESENT query words WVI in it.  This does the same
+   single-precision operations, in the same order, as the
+   bow_kernel_scatter_add()'s in bow_tfidf_score() do, so that pruning
+   doesn't change any scores. */
+static int __attribute__ ((optimize ("fp-contract=off")))
+bow_tfidf_score_document (void *context, int di, int num_present,
+			  const int *wvi, const float *dw, double *score)
+{
+  struct bow_tfidf_query *q = context;
+  bow_wv *query_wv = q->query_wv;
+  bow_cdoc *cdoc = bow_array_entry_at_index (q->barrel->cdocs, di);
+  float normalizer = cdoc->normalizer;
+  float lscore = 0;
+  float w;
+  int i;
+
+  for (i = 0; i < num_present; i++)
+    {
+      if (dw[i] == 0)
+	continue;
+      w = query_wv->entry[wvi[i]].weight * query_wv->normalizer;
+      lscore += w * (dw[i] * normalizer);
+    }
+
+  /* Documents that no query word scored don't make the list at all. */
+  if (lscore == 0)
+    return 0;
+  q->num_hit_documents++;
+  *score = lscore;
+  return 1;
+}
+
 int
 bow_tfidf_score (bow_barrel *barrel, bow_wv *query_wv, 
 		 bow_score *scores, int scores_size, int loo_class)
@@ -320,9 +384,10 @@ bow_tfidf_score (bow_barrel *barrel, bow_wv *query_wv,
   int num_scores = 0;		/* How many elements are in this array */
   int ci, i;
   float *lscores;
-  int **wis;
-  int wvi, dvi;
+  float *normalizers;		/* the CDOC->NORMALIZER of each document */
+  int wvi;
   bow_cdoc *cdoc;
+  bow_dv *dv;
   int num_hit_documents = 0;
 
 #if 0
@@ -330,15 +395,6 @@ bow_tfidf_score (bow_barrel *barrel, bow_wv *query_wv,
     bow_error ("PrInd cannot implement Leave-One-Out scoring.");
 #endif
 
-  /* Yuck.  This is inefficient. */
-  lscores = bow_malloc (barrel->cdocs->length * sizeof (float));
-  wis = bow_malloc (barrel->cdocs->length * sizeof (int*));
-  for (i = 0; i < barrel->cdocs->length; i++)
-    {
-      lscores[i] = 0;
-      wis[i] = NULL;
-    }
-
   /* Set the weights in the QUERY_WV.  Note: this is duplication of
      effort, since it was already done, but it was done incorrectly
      before, without the IDF. */
@@ -349,101 +405,101 @@ bow_tfidf_score (bow_barrel *barrel, bow_wv *query_wv,
 #endif
   bow_wv_normalize_weights_by_vector_length (query_wv);
 
+  /* When only a few of many documents are wanted for a short query,
+     leave out the ones that can't make it, if the words' bounds have
+     been set.  All the documents are ranked otherwise, as they are in
+     a barrel of classes.  Either way, only model documents are
+     ranked. */
+  if (bow_score_pruning && scores_size < barrel->cdocs->length
+      && query_wv->num_entries <= BOW_TFIDF_PRUNE_MAX_WORDS
+      && barrel->wi2dvf->has_max_weights)
+    {
+      struct bow_tfidf_query q;
+
+      q.barrel = barrel;
+      q.query_wv = query_wv;
+      q.num_hit_documents = 0;
+      num_scores = bow_wi2dvf_top_k (barrel->wi2dvf, barrel->cdocs, 1,
+				     query_wv, query_wv->normalizer,
+				     bow_tfidf_score_document, &q,
+				     scores, scores_size);
+      num_hit_documents = q.num_hit_documents;
+      goto name_scores;
+    }
+
+  lscores = bow_malloc (barrel->cdocs->length * sizeof (float));
+  normalizers = bow_malloc (barrel->cdocs->length * sizeof (float));
+  for (i = 0; i < barrel->cdocs->length; i++)
+    {
+      lscores[i] = 0;
+      cdoc = bow_array_entry_at_index (barrel->cdocs, i);
+      normalizers[i] = cdoc->normalizer;
+    }
+
   for (wvi = 0; wvi < query_wv->num_entries; wvi++)
     {
-      bow_dv *dv = bow_wi2dvf_dv (barrel->wi2dvf, query_wv->entry[wvi].wi);
+      dv = bow_wi2dvf_dv (barrel->wi2dvf, query_wv->entry[wvi].wi);
 
       /* If the model doesn't know about this word, skip it. */
       if (!dv)
 	continue;
 
-      /* Loop over all documents/classes that contain word WI,
-	 and increment their score. */
-      for (dvi = 0; dvi < dv->length; dvi++)
-	{
-	  cdoc = bow_array_entry_at_index (barrel->cdocs, dv->entry[dvi].di);
-	  lscores[dv->entry[dvi].di] += ((query_wv->entry[wvi].weight
-					  * query_wv->normalizer)
-					 * (dv->entry[dvi].weight
-					    * cdoc->normalizer));
-	  if (wis[dv->entry[dvi].di] == NULL)
-	    {
-	      int j;
-	      wis[dv->entry[dvi].di] = bow_malloc ((query_wv->num_entries+1)
-						   * sizeof (int));
-	      for (j = 0; j < (query_wv->num_entries+1); j++)
-		wis[dv->entry[dvi].di][j] = -1;
-	    }
-	  i = 0;
-	  while (wis[dv->entry[dvi].di][i] >= 0)
-	    i++;
-	  assert (i <= query_wv->num_entries);
-	  wis[dv->entry[dvi].di][i] = query_wv->entry[wvi].wi;
-	  /* Why was this here? 
-	     assert (wis[dv->entry[dvi].di][i] != 1); */
-	}
+      /* Increment the score of all documents/classes that contain
+	 word WI. */
+      (*bow_kernel_scatter_add) (lscores, normalizers, dv->entry, dv->length,
+				 (query_wv->entry[wvi].weight
+				  * query_wv->normalizer));
     } 
 
+  /* Documents that no query word scored don't make the list at all,
+     and nor do those that aren't model documents, as in
+     bow_wi2dvf_top_k(). */
   for (ci = 0; ci < barrel->cdocs->length; ci++)
     {
-      if (lscores[ci] == 0)
-	continue;
-      
-      num_hit_documents++;
-      
-      /* Store the result in the SCORES array */
-      /* If we haven't filled the list, or we beat the last item in the list */
-      if ((num_scores < scores_size)
-	  || (scores[num_scores - 1].weight < lscores[ci]))
+      cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
+      if (lscores[ci] == 0 || cdoc->type != bow_doc_train)
+	lscores[ci] = -FLT_MAX;
+      else
+	num_hit_documents++;
+    }
+  num_scores = (*bow_kernel_top_k_f) (lscores, barrel->cdocs->length,
+				      scores, scores_size);
+  while (num_scores > 0 && scores[num_scores-1].weight == -FLT_MAX)
+    num_scores--;
+  bow_free (lscores);
+  bow_free (normalizers);
+
+ name_scores:
+  /* Store the query words that appear in each document in its NAME,
+     in the order of QUERY_WV.  There are only a few documents, so
+     look each up in the DV of each word rather than walking the DVs. */
+  for (i = 0; i < num_scores; i++)
+    {
+      const char *word;
+      char *name;
+      int length = 0, size = 64, word_length;
+
+      name = bow_malloc (size);
+      for (wvi = 0; wvi < query_wv->num_entries; wvi++)
 	{
-	  /* We're going to search up the list comparing element i-1 with
-	     our current score and moving it down the list if it's worse */
-	  if (num_scores < scores_size)
+	  dv = bow_wi2dvf_dv (barrel->wi2dvf, query_wv->entry[wvi].wi);
+	  if (!dv || !bow_dv_entry_at_di (dv, scores[i].di))
+	    continue;
+	  word = bow_int2word (query_wv->entry[wvi].wi);
+	  word_length = strlen (word);
+	  while (length + word_length + 2 > size)
 	    {
-	      i = num_scores;
-	      num_scores++;
+	      size *= 2;
+	      name = bow_realloc (name, size);
 	    }
-	  else
-	    i = num_scores - 1;
-
-	  /* Shift down all the bits of the array that need shifting */
-	  for (; (i > 0) && (scores[i - 1].weight < lscores[ci]); i--)
-	    scores[i] = scores[i-1];
-
-	  /* Insert our new score */
-	  scores[i].weight = lscores[ci];
-	  scores[i].di = ci;
-
-#if 1
-	  {
-	    /* Store the appearing words in NAME. */
-	    char buf[BOW_MAX_WORD_LENGTH * query_wv->num_entries];
-	    int j;
-
-	    assert (wis[ci]);
-	    buf[0] = '\0';
-	    for (j = 0; wis[ci][j] >= 0; j++)
-	      {
-		strcat (buf, bow_int2word (wis[ci][j]));
-		strcat (buf, " ");
-	      }
-	    scores[i].name = strdup (buf);
-	    assert (scores[i].name);
-	  }
-#else
-	  scores[i].name = NULL;
-#endif
+	  memcpy (name + length, word, word_length);
+	  length += word_length;
+	  name[length++] = ' ';
 	}
+      name[length] = '\0';
+      scores[i].name = name;
     }
 
-  bow_free (lscores);
-  for (i = 0; i < barrel->cdocs->length; i++)
-    {
-      if (wis[i])
-	bow_free (wis[i]);
-    }
-  bow_free (wis);
-
   bow_tfidf_num_hit_documents = num_hit_documents;
 
   /* All done - return the number of elements we have */
@@ -480,14 +536,16 @@ rainbow_method bow_method_ ## PARAM_NAME =				\
   #PARAM_NAME,								\
   bow_tfidf_set_weights,						\
   0,				/* no weight scaling function */	\
-  bow_barrel_normalize_weights_by_vector_length,			\
+  bow_tfidf_normalize_weights,						\
   bow_barrel_new_vpc_weight_then_merge,					\
   0,				/* no prior-setting function */		\
   bow_tfidf_score,							\
   bow_wv_set_weights_to_count_times_idf,				\
   bow_wv_normalize_weights_by_vector_length,				\
   bow_barrel_free,							\
-  &bow_tfidf_params_ ## PARAM_NAME					\
+  &bow_tfidf_params_ ## PARAM_NAME,					\
+  1,				/* scoring is thread-safe */		\
+  bow_tfidf_set_score_bounds						\
 };									\
 void _register_method_ ## PARAM_NAME ()					\
  __attribute__ ((constructor));						\
@@ -0,0 +1,89 @@
+/* Running pieces of work on several threads at once.
+   Copyright (C) 2026 agent
+
+   Written by:  agent <agent@local>
+
+   This file is part of the Bag-Of-Words Library, `libbow'.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License
+   as published by the Free Software Foundation, version 2.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA */
+
+#include <bow/libbow.h>
+#include <pthread.h>
+
+/* The number of threads used by the parallel parts of the library.
+   One means do everything on the calling thread. */
+int bow_num_threads = 1;
+
+/* Return the number of processors currently online, or 1 if that
+   can't be determined. */
+int
+bow_threads_num_processors ()
+{
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (int) n : 1;
+}
+
+/* What each thread started by bow_threads_run() needs to know. */
+struct _bow_threads_arg {
+  void (*func)(int thread_index, void *context);
+  void *context;
+  int thread_index;
+};
+
+static void *
+_bow_threads_start (void *arg)
+{
+  struct _bow_threads_arg *ta = arg;
+  (*ta->func) (ta->thread_index, ta->context);
+  return NULL;
+}
+
+/* Call FUNC(I, CONTEXT) for each I from 0 to NUM_THREADS-1, each on
+   its own thread, and return once they have all returned.  Thread 0
+   is the calling thread itself. */
+void
+bow_threads_run (int num_threads,
+		 void (*func)(int thread_index, void *context),
+		 void *context)
+{
+  pthread_t *tids;
+  struct _bow_threads_arg *args;
+  int i, err;
+
+  assert (num_threads > 0);
+  if (num_threads == 1)
+    {
+      (*func) (0, context);
+      return;
+    }
+  tids = bow_malloc (num_threads * sizeof (pthread_t));
+  args = bow_malloc (num_threads * sizeof (struct _bow_threads_arg));
+  for (i = 0; i < num_threads; i++)
+    {
+      args[i].func = func;
+      args[i].context = context;
+      args[i].thread_index = i;
+    }
+  for (i = 1; i < num_threads; i++)
+    {
+      err = pthread_create (&(tids[i]), NULL, _bow_threads_start, &(args[i]));
+      if (err)
+	bow_error ("Couldn't create thread %d: %s", i, strerror (err));
+    }
+  _bow_threads_start (&(args[0]));
+  for (i = 1; i < num_threads; i++)
+    pthread_join (tids[i], NULL);
+  bow_free (tids);
+  bow_free (args);
+}
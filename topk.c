@@ -0,0 +1,409 @@
+/* Finding the best few documents for a query, with pruning.
+   Copyright (C) 2026 agent
+
+   Written by:  agent <agent@local>
+
+   This file is part of the Bag-Of-Words Library, `libbow'.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License
+   as published by the Free Software Foundation, version 2.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA */
+
+/* Most of the time spent scoring a long query goes to its common
+   words, whose DV's are long but add little to any one document's
+   score.  bow_wi2dvf_top_k() uses the "max-score" method of Turtle
+   and Flood: the query's words are sorted by the most they can add to
+   a score, and once the K'th best score so far is more than the first
+   few words can add between them, a document that has only those
+   words can't make the top K.  So only the DV's of the other words
+   are walked to find candidates.  The bound of each candidate is then
+   tightened with its actual weights, and the first few words are
+   looked up in it (by a galloping search of their DV's) only for as
+   long as it might still make the top K.  The candidates that survive
+   are scored by the caller, exactly as it would score them without
+   pruning, so the results are the same either way. */
+
+#include <bow/libbow.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+
+int bow_score_pruning = 1;
+
+/* Scores are summed in single precision, and in a different order
+   than their bounds; for a query of N words, leave this much room for
+   rounding, relative to the bound. */
+#define BOW_TOP_K_SLACK(N) (((N) + 8) * 4 * FLT_EPSILON)
+
+/* A word of the query, and how far its DV has been walked. */
+typedef struct _bow_top_k_word {
+  bow_dv *dv;
+  int index;			/* the first entry not yet passed */
+  int di;			/* its DI, or INT_MAX past the end */
+  int wvi;			/* the word's index in the query */
+  double scale;			/* |query weight * QUERY_SCALE| */
+  double bound;			/* the most it can add to a score */
+} bow_top_k_word;
+
+/* Set the DI of W from its INDEX. */
+#define BOW_TOP_K_SET_DI(W)					\
+  ((W)->di = ((W)->index < (W)->dv->length			\
+	      ? (W)->dv->entry[(W)->index].di : INT_MAX))
+
+/* Return the largest magnitude of the WEIGHT of DV's entries for
+   model documents in CDOCS, times the NORMALIZER if USE_NORMALIZER. */
+static float
+_bow_dv_max_weight (bow_dv *dv, bow_array *cdocs, int use_normalizer)
+{
+  int dvi;
+  bow_cdoc *cdoc;
+  double w, max = 0;
+  float ret;
+
+  for (dvi = 0; dvi < dv->length; dvi++)
+    {
+      cdoc = bow_array_entry_at_index (cdocs, dv->entry[dvi].di);
+      if (cdoc->type != bow_doc_train)
+	continue;
+      w = fabs (dv->entry[dvi].weight);
+      if (use_normalizer)
+	w *= fabs (cdoc->normalizer);
+      if (w > max)
+	max = w;
+    }
+  /* Round up, so that the float is a bound on the double. */
+  ret = max;
+  if (ret < max)
+    ret = nextafterf (max, FLT_MAX);
+  return ret;
+}
+
+void
+bow_wi2dvf_set_max_weights (bow_wi2dvf *wi2dvf, bow_array *cdocs,
+			    int use_normalizer)
+{
+  int wi;
+  bow_dv *dv;
+
+  for (wi = 0; wi < wi2dvf->size; wi++)
+    {
+      dv = bow_wi2dvf_dv (wi2dvf, wi);
+      if (dv == NULL)
+	wi2dvf->entry[wi].max_weight = -1;
+      else
+	wi2dvf->entry[wi].max_weight =
+	  _bow_dv_max_weight (dv, cdocs, use_normalizer);
+    }
+  wi2dvf->has_max_weights = 1;
+}
+
+void
+bow_wi2dvf_forget_max_weights (bow_wi2dvf *wi2dvf)
+{
+  int wi;
+
+  for (wi = 0; wi < wi2dvf->size; wi++)
+    wi2dvf->entry[wi].max_weight = -1;
+  wi2dvf->has_max_weights = 0;
+}
+
+/* Advance the place of W in its DV to the first entry whose DI is at
+   least DI. */
+static void
+_bow_top_k_seek (bow_top_k_word *w, int di)
+{
+  bow_de *entry = w->dv->entry;
+  int length = w->dv->length;
+  int lo = w->index, hi, mid, step;
+
+  if (lo >= length || entry[lo].di >= di)
+    return;
+  /* Gallop ahead until passing DI, then search back; ENTRY[LO].DI is
+     always less than DI. */
+  for (step = 1, hi = lo + 1; hi < length && entry[hi].di < di; step *= 2)
+    {
+      lo = hi;
+      hi = lo + step;
+    }
+  if (hi > length)
+    hi = length;
+  while (hi - lo > 1)
+    {
+      mid = (lo + hi) / 2;
+      if (entry[mid].di < di)
+	lo = mid;
+      else
+	hi = mid;
+    }
+  w->index = hi;
+  BOW_TOP_K_SET_DI (w);
+}
+
+/* Restore the heap property of the LENGTH words of HEAP, ordered by
+   the DI each is at, below index I. */
+static void
+_bow_top_k_sift_down (bow_top_k_word **heap, int length, int i)
+{
+  bow_top_k_word *w = heap[i];
+  int child;
+
+  while ((child = 2 * i + 1) < length)
+    {
+      if (child + 1 < length
+	  && heap[child + 1]->di < heap[child]->di)
+	child++;
+      if (w->di <= heap[child]->di)
+	break;
+      heap[i] = heap[child];
+      i = child;
+    }
+  heap[i] = w;
+}
+
+static void
+_bow_top_k_sift_up (bow_top_k_word **heap, int i)
+{
+  bow_top_k_word *w = heap[i];
+
+  while (i > 0 && w->di < heap[(i - 1) / 2]->di)
+    {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+  heap[i] = w;
+}
+
+/* Make a heap in HEAP of those of the NUM_WORDS WORDS that aren't at
+   the end of their DV's, and return how many there are. */
+static int
+_bow_top_k_heapify (bow_top_k_word **heap, bow_top_k_word *words,
+		    int num_words)
+{
+  int i, length = 0;
+
+  for (i = 0; i < num_words; i++)
+    if (words[i].index < words[i].dv->length)
+      heap[length++] = &(words[i]);
+  for (i = length / 2 - 1; i >= 0; i--)
+    _bow_top_k_sift_down (heap, length, i);
+  return length;
+}
+
+/* Sort the N indices WVI into increasing order, along with their
+   weights DW.  N is usually small. */
+static void
+_bow_top_k_sort_present (int *wvi, float *dw, int n)
+{
+  int i, j, tw;
+  float td;
+
+  for (i = 1; i < n; i++)
+    {
+      tw = wvi[i];
+      td = dw[i];
+      for (j = i; j > 0 && wvi[j-1] > tw; j--)
+	{
+	  wvi[j] = wvi[j-1];
+	  dw[j] = dw[j-1];
+	}
+      wvi[j] = tw;
+      dw[j] = td;
+    }
+}
+
+static int
+_bow_top_k_word_compare (const void *p1, const void *p2)
+{
+  const bow_top_k_word *w1 = p1, *w2 = p2;
+
+  if (w1->bound != w2->bound)
+    return (w1->bound < w2->bound) ? -1 : 1;
+  return w1->wvi - w2->wvi;
+}
+
+int
+bow_wi2dvf_top_k (bow_wi2dvf *wi2dvf, bow_array *cdocs,
+		  int use_normalizer, bow_wv *query_wv,
+		  double query_scale, bow_top_k_score_fn score_fn,
+		  void *context, bow_score *scores, int k)
+{
+  bow_top_k_word *words, *w;
+  bow_top_k_word **heap;	/* the essential words, by DI */
+  bow_top_k_word **here;	/* the essential words at the candidate */
+  int num_words = 0, heap_length, num_here;
+  int first_essential;		/* WORDS before it aren't walked */
+  double *cum;			/* CUM[j] is the sum of WORDS[<j].BOUND */
+  int *present;			/* the query words DI has, by WVI */
+  float *dw;			/* and their weights there */
+  int num_present;
+  double threshold;		/* the K'th best score, once there are K */
+  double slack, bound, doc_scale, score, max;
+  int num_scores = 0;
+  bow_dv *dv;
+  bow_cdoc *cdoc;
+  int wvi, di, i, j;
+
+  if (k <= 0)
+    return 0;
+
+  words = bow_malloc ((query_wv->num_entries + 1) * sizeof (bow_top_k_word));
+  for (wvi = 0; wvi < query_wv->num_entries; wvi++)
+    {
+      dv = bow_wi2dvf_dv (wi2dvf, query_wv->entry[wvi].wi);
+      if (dv == NULL || dv->length == 0)
+	continue;
+      w = &(words[num_words++]);
+      w->dv = dv;
+      w->index = 0;
+      w->di = dv->entry[0].di;
+      w->wvi = wvi;
+      w->scale = fabs (query_wv->entry[wvi].weight * query_scale);
+      if (!bow_score_pruning)
+	{
+	  w->bound = HUGE_VAL;
+	  continue;
+	}
+      /* A word whose bound hasn't been set, in a barrel read from
+	 disk for example, could add anything.  The bound isn't found
+	 and kept here, because other threads may be scoring with
+	 WI2DVF too. */
+      max = wi2dvf->entry[query_wv->entry[wvi].wi].max_weight;
+      if (max < 0)
+	w->bound = HUGE_VAL;
+      else
+	w->bound = w->scale * max;
+    }
+  qsort (words, num_words, sizeof (bow_top_k_word), _bow_top_k_word_compare);
+  cum = bow_malloc ((num_words + 1) * sizeof (double));
+  for (cum[0] = 0, j = 0; j < num_words; j++)
+    cum[j+1] = cum[j] + words[j].bound;
+  slack = 1 + BOW_TOP_K_SLACK (num_words);
+
+  heap = bow_malloc ((num_words + 1) * sizeof (bow_top_k_word*));
+  here = bow_malloc ((num_words + 1) * sizeof (bow_top_k_word*));
+  present = bow_malloc ((num_words + 1) * sizeof (int));
+  dw = bow_malloc ((num_words + 1) * sizeof (float));
+  first_essential = 0;
+  heap_length = _bow_top_k_heapify (heap, words, num_words);
+  threshold = -HUGE_VAL;
+
+  while (heap_length > 0)
+    {
+      /* The next candidate is the lowest DI any essential word is
+	 at.  Take those words off the heap, bounding DI's score with
+	 their actual weights and the bounds of the other words. */
+      di = heap[0]->di;
+      cdoc = bow_array_entry_at_index (cdocs, di);
+      doc_scale = use_normalizer ? fabs (cdoc->normalizer) : 1;
+      bound = cum[first_essential];
+      for (num_here = 0; heap_length > 0 && heap[0]->di == di; )
+	{
+	  w = here[num_here++] = heap[0];
+	  bound += (w->scale * fabs (w->dv->entry[w->index].weight)
+		    * doc_scale);
+	  heap[0] = heap[--heap_length];
+	  if (heap_length > 0)
+	    _bow_top_k_sift_down (heap, heap_length, 0);
+	}
+
+      /* Look the other words up, those that can add the most first,
+	 while DI might still make the top K. */
+      for (j = first_essential - 1;
+	   (j >= 0 && cdoc->type == bow_doc_train
+	    && (num_scores < k || bound * slack > threshold));
+	   j--)
+	{
+	  w = &(words[j]);
+	  bound -= w->bound;
+	  _bow_top_k_seek (w, di);
+	  if (w->di == di)
+	    bound += (w->scale * fabs (w->dv->entry[w->index].weight)
+		      * doc_scale);
+	}
+
+      if (cdoc->type == bow_doc_train
+	  && (num_scores < k || bound * slack > threshold))
+	{
+	  for (num_present = 0; num_present < num_here; num_present++)
+	    {
+	      w = here[num_present];
+	      present[num_present] = w->wvi;
+	      dw[num_present] = w->dv->entry[w->index].weight;
+	    }
+	  for (j = 0; j < first_essential; j++)
+	    {
+	      w = &(words[j]);
+	      if (w->di == di)
+		{
+		  present[num_present] = w->wvi;
+		  dw[num_present++] = w->dv->entry[w->index].weight;
+		}
+	    }
+	  _bow_top_k_sort_present (present, dw, num_present);
+
+	  /* Later documents have higher DI's, so they only get in by
+	     beating the K'th score outright. */
+	  if ((*score_fn) (context, di, num_present, present, dw, &score)
+	      && (num_scores < k || score > threshold))
+	    {
+	      if (num_scores < k)
+		i = num_scores++;
+	      else
+		i = num_scores - 1;
+	      for (; i > 0 && scores[i-1].weight < score; i--)
+		scores[i] = scores[i-1];
+	      scores[i].di = di;
+	      scores[i].weight = score;
+	      scores[i].name = NULL;
+	      if (num_scores == k)
+		threshold = scores[k-1].weight;
+	    }
+	}
+
+      /* Move the words at DI past it, and put them back. */
+      for (i = 0; i < num_here; i++)
+	{
+	  w = here[i];
+	  w->index++;
+	  BOW_TOP_K_SET_DI (w);
+	  if (w->index < w->dv->length)
+	    {
+	      heap[heap_length] = w;
+	      _bow_top_k_sift_up (heap, heap_length++);
+	    }
+	}
+
+      /* If the threshold has gone up past what some more of the words
+	 can add between them, stop walking their DV's. */
+      if (num_scores == k)
+	{
+	  for (j = first_essential;
+	       j < num_words && cum[j+1] * slack <= threshold;
+	       j++)
+	    ;
+	  if (j != first_essential)
+	    {
+	      first_essential = j;
+	      heap_length = _bow_top_k_heapify
+		(heap, words + first_essential, num_words - first_essential);
+	    }
+	}
+    }
+
+  bow_free (words);
+  bow_free (cum);
+  bow_free (heap);
+  bow_free (here);
+  bow_free (present);
+  bow_free (dw);
+  return num_scores;
+}
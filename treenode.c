@@ -563,6 +563,27 @@ bow_treenode_add_new_loo_for_di_wvi (treenode *tn,
 {
   int i;
 
+  bow_treenode_alloc_new_loo (tn, di_count);
+  if (tn->new_di_wvi_loo[di] == NULL)
+    {
+      tn->new_di_wvi_loo[di] = 
+	bow_malloc (di_wv_num_entries * sizeof (double));
+      for (i = 0; i < di_wv_num_entries; i++)
+	tn->new_di_wvi_loo[di][i] = 0;
+    }
+  tn->new_di_loo[di] += weight;
+  tn->new_di_wvi_loo[di][wvi] += weight;
+}
+
+/* Make sure that treenode TN has the arrays, indexed by DI, in which
+   bow_treenode_add_new_loo_for_di_wvi() records NEW LOO info for
+   DI_COUNT documents.  Once they exist, several threads may add LOO
+   info for different documents at the same time. */
+void
+bow_treenode_alloc_new_loo (treenode *tn, int di_count)
+{
+  int i;
+
   if (tn->new_di_loo == NULL)
     {
       tn->new_di_loo =
@@ -577,15 +598,6 @@ bow_treenode_add_new_loo_for_di_wvi (treenode *tn,
       for (i = 0; i < di_count; i++)
 	tn->new_di_wvi_loo[i] = NULL;
     }
-  if (tn->new_di_wvi_loo[di] == NULL)
-    {
-      tn->new_di_wvi_loo[di] = 
-	bow_malloc (di_wv_num_entries * sizeof (double));
-      for (i = 0; i < di_wv_num_entries; i++)
-	tn->new_di_wvi_loo[di][i] = 0;
-    }
-  tn->new_di_loo[di] += weight;
-  tn->new_di_wvi_loo[di][wvi] += weight;
 }
 
 /* Clear all LOO info for treenode TN */
@@ -1257,6 +1269,202 @@ bow_treenode_log_local_prob_of_wv_loo (treenode *tn, bow_wv *wv, int loo_di)
   return log_prob;
 }
 
+/* Compiled trees */
+
+/* Return the index of node TN in the NODES array of TC. */
+int
+bow_treenode_compiled_node_index (bow_treenode_compiled *tc, treenode *tn)
+{
+  int ni;
+
+  for (ni = 0; ni < tc->nodes_count; ni++)
+    if (tc->nodes[ni] == tn)
+      return ni;
+  bow_error ("Node %s not found in compiled tree", tn->name);
+  return -1;
+}
+
+/* Return a compiled snapshot of the WORDS, NEW_WORDS and LAMBDAS of
+   the tree under ROOT.  The snapshot must be recompiled whenever
+   WORDS, LAMBDAS or the shape of the tree change, and NEW_WORDS added
+   to it must be put back with bow_treenode_compiled_store_new_words(). */
+bow_treenode_compiled *
+bow_treenode_compiled_new (treenode *root)
+{
+  bow_treenode_compiled *tc;
+  treenode *iterator, *tn, *ancestor;
+  int ni, li, ai, wi;
+  double *lambdas;
+  int *ancestors;
+
+  tc = bow_malloc (sizeof (bow_treenode_compiled));
+  tc->words_capacity = root->words_capacity;
+  tc->nodes_count = bow_treenode_node_count (root);
+  tc->leaves_count = bow_treenode_leaf_count (root);
+  tc->nodes = bow_malloc (tc->nodes_count * sizeof (treenode*));
+  tc->leaves = bow_malloc (tc->leaves_count * sizeof (treenode*));
+  tc->path_capacity = 0;
+  for (iterator = root, ni = 0, li = 0;
+       (tn = bow_treenode_iterate_all (&iterator)); 
+       ni++)
+    {
+      assert (tn->words_capacity == tc->words_capacity);
+      tc->nodes[ni] = tn;
+      if (tn->children_count == 0)
+	{
+	  tc->leaves[li++] = tn;
+	  if (tn->depth + 2 > tc->path_capacity)
+	    tc->path_capacity = tn->depth + 2;
+	}
+    }
+  assert (ni == tc->nodes_count && li == tc->leaves_count);
+
+  /* Lay out each leaf's path of ancestors, and the mixture weights
+     along it, in one row per leaf. */
+  tc->leaf_ancestors = 
+    bow_malloc (tc->leaves_count * tc->path_capacity * sizeof (int));
+  tc->leaf_lambdas = 
+    bow_malloc (tc->leaves_count * tc->path_capacity * sizeof (double));
+  for (li = 0; li < tc->leaves_count; li++)
+    {
+      tn = tc->leaves[li];
+      ancestors = tc->leaf_ancestors + li * tc->path_capacity;
+      lambdas = tc->leaf_lambdas + li * tc->path_capacity;
+      for (ancestor = tn, ai = 0; ancestor; 
+	   ancestor = ancestor->parent, ai++)
+	{
+	  ancestors[ai] = bow_treenode_compiled_node_index (tc, ancestor);
+	  lambdas[ai] = tn->lambdas[ai];
+	}
+      /* The last entry is for the uniform distribution. */
+      ancestors[ai] = -1;
+      lambdas[ai] = tn->lambdas[ai];
+    }
+
+  /* Gather the WORDS and NEW_WORDS of all nodes so that the entries
+     for one word are adjacent. */
+  tc->words = 
+    bow_malloc (tc->words_capacity * tc->nodes_count * sizeof (double));
+  tc->new_words = 
+    bow_malloc (tc->words_capacity * tc->nodes_count * sizeof (double));
+  for (wi = 0; wi < tc->words_capacity; wi++)
+    {
+      for (ni = 0; ni < tc->nodes_count; ni++)
+	{
+	  tc->words[wi * tc->nodes_count + ni] = tc->nodes[ni]->words[wi];
+	  tc->new_words[wi * tc->nodes_count + ni] = 
+	    tc->nodes[ni]->new_words[wi];
+	}
+    }
+  tc->leaf_log_probs = NULL;
+  return tc;
+}
+
+/* Fill in the LEAF_LOG_PROBS of TC, for use by
+   bow_treenode_compiled_log_prob_of_wvs().  They use the vertical
+   mixture over ancestors if SHRINKAGE is non-zero, and the leaf's own
+   WORDS otherwise. */
+void
+bow_treenode_compiled_set_leaf_log_probs (bow_treenode_compiled *tc,
+					  int shrinkage)
+{
+  treenode *tn;
+  int li, ai, wi;
+  const double *lambdas;
+  const int *ancestors;
+  double pr;
+
+  tc->shrinkage = shrinkage;
+  if (tc->leaf_log_probs == NULL)
+    tc->leaf_log_probs = 
+      bow_malloc (tc->words_capacity * tc->leaves_count * sizeof (double));
+  for (wi = 0; wi < tc->words_capacity; wi++)
+    {
+      for (li = 0; li < tc->leaves_count; li++)
+	{
+	  tn = tc->leaves[li];
+	  if (shrinkage)
+	    {
+	      /* Same sum, in the same order, as bow_treenode_pr_wi() */
+	      ancestors = tc->leaf_ancestors + li * tc->path_capacity;
+	      lambdas = tc->leaf_lambdas + li * tc->path_capacity;
+	      pr = 0;
+	      for (ai = 0; ancestors[ai] >= 0; ai++)
+		pr += (lambdas[ai] 
+		       * tc->words[wi * tc->nodes_count + ancestors[ai]]);
+	      pr += lambdas[ai] / tn->words_capacity;
+	    }
+	  else
+	    pr = tn->words[wi];
+	  tc->leaf_log_probs[wi * tc->leaves_count + li] = log (pr);
+	}
+    }
+}
+
+/* Copy the NEW_WORDS accumulated in TC back into the nodes of the
+   tree it was compiled from. */
+void
+bow_treenode_compiled_store_new_words (bow_treenode_compiled *tc)
+{
+  int ni, wi;
+
+  for (ni = 0; ni < tc->nodes_count; ni++)
+    for (wi = 0; wi < tc->words_capacity; wi++)
+      tc->nodes[ni]->new_words[wi] = 
+	tc->new_words[wi * tc->nodes_count + ni];
+}
+
+/* Free the memory allocated by bow_treenode_compiled_new(). */
+void
+bow_treenode_compiled_free (bow_treenode_compiled *tc)
+{
+  bow_free (tc->nodes);
+  bow_free (tc->leaves);
+  bow_free (tc->leaf_ancestors);
+  bow_free (tc->leaf_lambdas);
+  bow_free (tc->words);
+  bow_free (tc->new_words);
+  if (tc->leaf_log_probs)
+    bow_free (tc->leaf_log_probs);
+  bow_free (tc);
+}
+
+/* Fill LOG_PROBS with the log-probability of each leaf of TC having
+   produced each of the WVS_COUNT word vectors in WVS; the entry for
+   the WVI'th word vector and the LI'th leaf (in the order of
+   bow_treenode_iterate_leaves()) is LOG_PROBS[WVI*TC->LEAVES_COUNT+LI].
+   The results are identical to those of bow_treenode_log_prob_of_wv()
+   or bow_treenode_log_local_prob_of_wv(), depending on how TC was
+   compiled. */
+void
+bow_treenode_compiled_log_prob_of_wvs (bow_treenode_compiled *tc,
+				       bow_wv **wvs, int wvs_count,
+				       double *log_probs)
+{
+  int i, wvi, li;
+  int leaves_count = tc->leaves_count;
+  double *doc_log_probs;
+  const double *word_log_probs;
+  double count;
+
+  assert (tc->leaf_log_probs);
+  for (i = 0; i < wvs_count; i++)
+    {
+      doc_log_probs = log_probs + i * leaves_count;
+      for (li = 0; li < leaves_count; li++)
+	doc_log_probs[li] = 0;
+      for (wvi = 0; wvi < wvs[i]->num_entries; wvi++)
+	{
+	  assert (wvs[i]->entry[wvi].wi < tc->words_capacity);
+	  word_log_probs = (tc->leaf_log_probs 
+			    + wvs[i]->entry[wvi].wi * leaves_count);
+	  count = wvs[i]->entry[wvi].count;
+	  for (li = 0; li < leaves_count; li++)
+	    doc_log_probs[li] += count * word_log_probs[li];
+	}
+    }
+}
+
 /* Return the number of leaves under (and including) TN */
 int
 bow_treenode_leaf_count (treenode *tn)
@@ -39,6 +39,249 @@ double bow_wi2dvf_sum (bow_wi2dvf *wi2dvf)
   return sum;
 }
 
+/* The number of words a thread of _bow_barrel_vpc_sum() takes at a
+   time. */
+#define BOW_VPC_CHUNK 64
+
+/* What the threads of _bow_barrel_vpc_sum() share. */
+typedef struct _bow_vpc_context {
+  bow_barrel *doc_barrel;
+  bow_barrel *vpc_barrel;
+  int num_classes;
+  int max_wi;			/* make class DV's for words below this */
+  int use_class_probs;		/* spread documents over classes */
+  int next_wi;			/* the next chunk of words to hand out */
+  int **word_counts;		/* per thread, the count of each document */
+  int *num_words;		/* per thread, the class DV's made */
+  int *max_ci;			/* per thread, the highest class seen */
+} bow_vpc_context;
+
+/* Add the entries of DV, the document vector of word WI, to the class
+   vector *VPC_DV, as bow_barrel_new_vpc() does. */
+static void
+_bow_vpc_add_dv (bow_vpc_context *vc, bow_dv *dv, bow_dv **vpc_dv,
+		 int *max_ci)
+{
+  bow_cdoc *cdoc;
+  float weight;
+  int dvi, ci;
+
+  for (dvi = 0; dvi < dv->length; dvi++)
+    {
+      cdoc = bow_array_entry_at_index (vc->doc_barrel->cdocs,
+				       dv->entry[dvi].di);
+      ci = cdoc->class;
+      assert (ci >= 0);
+      assert (ci < vc->num_classes);
+      if (ci > *max_ci)
+	*max_ci = ci;
+      if (cdoc->type != bow_doc_train)
+	continue;
+
+      /* The old version of bow_wi2dvf_add_di_text_fp() initialized
+	 the dv WEIGHT to 0 instead of the word count.  If the weight 
+	 is zero, then use the count instead.  Note, however, that
+	 the TFIDF method might have set the weight, so we don't
+	 want to use the count all the time. */
+      if (dv->entry[dvi].weight)
+	weight = dv->entry[dvi].weight;
+      else
+	weight = dv->entry[dvi].count;
+
+      if (!*vpc_dv)
+	*vpc_dv = bow_dv_new (0);
+      if (bow_event_model == bow_event_document)
+	{
+	  assert (dv->entry[dvi].count);
+	  bow_dv_add_di_count_weight (vpc_dv, ci, 1, 1);
+	}
+      else if (bow_event_model == bow_event_document_then_word)
+	bow_dv_add_di_count_weight
+	  (vpc_dv, ci, dv->entry[dvi].count,
+	   (bow_event_document_then_word_document_length
+	    * weight / cdoc->word_count));
+      else
+	bow_dv_add_di_count_weight (vpc_dv, ci, dv->entry[dvi].count, weight);
+    }
+}
+
+/* Like _bow_vpc_add_dv(), but as bow_barrel_new_vpc_using_class_probs()
+   does, adding each training or unlabeled document to every class
+   in proportion to its CLASS_PROBS. */
+static void
+_bow_vpc_add_dv_using_class_probs (bow_vpc_context *vc, bow_dv *dv,
+				   bow_dv **vpc_dv)
+{
+  bow_cdoc *cdoc;
+  float weight;
+  int dvi, ci;
+
+  for (dvi = 0; dvi < dv->length; dvi++)
+    {
+      cdoc = bow_array_entry_at_index (vc->doc_barrel->cdocs,
+				       dv->entry[dvi].di);
+      if (cdoc->type != bow_doc_train && cdoc->type != bow_doc_unlabeled)
+	continue;
+
+      /* See _bow_vpc_add_dv() about a zero WEIGHT. */
+      if (dv->entry[dvi].weight)
+	weight = dv->entry[dvi].weight;
+      else
+	weight = dv->entry[dvi].count;
+
+      if (!*vpc_dv)
+	*vpc_dv = bow_dv_new (0);
+      for (ci = 0; ci < vc->num_classes; ci++) 
+	{
+	  /* do the right thing based on the event model */
+	  if (bow_event_model == bow_event_document)
+	    {
+	      assert (dv->entry[dvi].count);
+	      bow_dv_add_di_count_weight (vpc_dv, ci, 1,
+					  cdoc->class_probs[ci]);
+	    }
+	  else if (bow_event_model == bow_event_document_then_word)
+	    bow_dv_add_di_count_weight
+	      (vpc_dv, ci, 1,
+	       (bow_event_document_then_word_document_length
+		* weight * cdoc->class_probs[ci] / cdoc->word_count));
+	  else
+	    bow_dv_add_di_count_weight (vpc_dv, ci, 1,
+					weight * cdoc->class_probs[ci]);
+	}
+    }
+}
+
+/* The work of one thread of _bow_barrel_vpc_sum(): take chunks of
+   words until there are none left, and for each, add its counts to
+   the document lengths in VC->WORD_COUNTS, if that is non-NULL,
+   and make its class DV, if VC->VPC_BARREL is non-NULL.  Each word is
+   taken by one thread only, so each class DV is too. */
+static void
+_bow_vpc_sum_thread (int thread_index, void *context)
+{
+  bow_vpc_context *vc = context;
+  bow_wi2dvf *wi2dvf = vc->doc_barrel->wi2dvf;
+  int *word_counts = vc->word_counts ? vc->word_counts[thread_index] : NULL;
+  bow_dv *dv, *vpc_dv;
+  int wi, end, dvi;
+
+  while ((wi = __sync_fetch_and_add (&vc->next_wi, BOW_VPC_CHUNK))
+	 < wi2dvf->size)
+    {
+      for (end = MIN (wi + BOW_VPC_CHUNK, wi2dvf->size); wi < end; wi++)
+	{
+	  dv = bow_wi2dvf_dv (wi2dvf, wi);
+	  if (!dv)
+	    continue;
+	  if (word_counts)
+	    for (dvi = 0; dvi < dv->length; dvi++)
+	      word_counts[dv->entry[dvi].di] += dv->entry[dvi].count;
+	  if (!vc->vpc_barrel || wi >= vc->max_wi)
+	    continue;
+	  vpc_dv = NULL;
+	  if (vc->use_class_probs)
+	    _bow_vpc_add_dv_using_class_probs (vc, dv, &vpc_dv);
+	  else
+	    _bow_vpc_add_dv (vc, dv, &vpc_dv, &(vc->max_ci[thread_index]));
+	  /* This could be NULL if all of this word's occurrences are
+	     in non training docs. */
+	  if (vpc_dv)
+	    {
+	      /* Set the IDF of the class's wi2dvf directly from the
+		 doc's wi2dvf */
+	      vpc_dv->idf = dv->idf;
+	      vc->vpc_barrel->wi2dvf->entry[wi].dv = vpc_dv;
+	      vc->vpc_barrel->wi2dvf->entry[wi].seek_start = 2;
+	      vc->num_words[thread_index]++;
+	    }
+	}
+    }
+}
+
+/* Set the CDOC->WORD_COUNT of each document of DOC_BARREL to the
+   number of its words still in the (potentially pruned) vocabulary,
+   and sum together the counts and weights of the words below MAX_WI
+   in the training documents into VPC_BARREL, as if by
+   bow_wi2dvf_add_wi_di_count_weight() one word at a time, using the
+   CLASS_PROBS of the documents if USE_CLASS_PROBS is non-zero.  The
+   words are split among BOW_NUM_THREADS threads.  Return the highest
+   class index seen. */
+static int
+_bow_barrel_vpc_sum (bow_barrel *doc_barrel, bow_barrel *vpc_barrel,
+		     int num_classes, int max_wi, int use_class_probs)
+{
+  bow_vpc_context vc;
+  int num_threads = bow_num_threads;
+  int num_docs = doc_barrel->cdocs->length;
+  bow_cdoc *cdoc;
+  int wi, di, t, max_ci = -1;
+
+  /* Read in the DV's first, since the threads can't share the data
+     file. */
+  if (num_threads > 1)
+    for (wi = 0; wi < doc_barrel->wi2dvf->size; wi++)
+      bow_wi2dvf_dv (doc_barrel->wi2dvf, wi);
+
+  vc.doc_barrel = doc_barrel;
+  vc.vpc_barrel = vpc_barrel;
+  vc.num_classes = num_classes;
+  vc.max_wi = max_wi;
+  vc.use_class_probs = use_class_probs;
+  vc.word_counts = bow_malloc (num_threads * sizeof (int*));
+  vc.num_words = bow_malloc (num_threads * sizeof (int));
+  vc.max_ci = bow_malloc (num_threads * sizeof (int));
+  for (t = 0; t < num_threads; t++)
+    {
+      vc.word_counts[t] = bow_malloc (num_docs * sizeof (int));
+      memset (vc.word_counts[t], 0, num_docs * sizeof (int));
+      vc.num_words[t] = 0;
+      vc.max_ci[t] = -1;
+    }
+
+  /* The document-then-word event model needs the document lengths
+     before it can weigh the words, so count them first; otherwise do
+     both in the same pass. */
+  if (bow_event_model == bow_event_document_then_word)
+    vc.vpc_barrel = NULL;
+  vc.next_wi = 0;
+  bow_threads_run (num_threads, _bow_vpc_sum_thread, &vc);
+
+  /* Documents with no words left get a WORD_COUNT of zero. */
+  for (di = 0; di < num_docs; di++)
+    {
+      cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
+      cdoc->word_count = 0;
+      for (t = 0; t < num_threads; t++)
+	cdoc->word_count += vc.word_counts[t][di];
+    }
+
+  if (!vc.vpc_barrel)
+    {
+      vc.vpc_barrel = vpc_barrel;
+      for (t = 0; t < num_threads; t++)
+	bow_free (vc.word_counts[t]);
+      bow_free (vc.word_counts);
+      vc.word_counts = NULL;
+      vc.next_wi = 0;
+      bow_threads_run (num_threads, _bow_vpc_sum_thread, &vc);
+    }
+
+  for (t = 0; t < num_threads; t++)
+    {
+      vpc_barrel->wi2dvf->num_words += vc.num_words[t];
+      if (vc.max_ci[t] > max_ci)
+	max_ci = vc.max_ci[t];
+      if (vc.word_counts)
+	bow_free (vc.word_counts[t]);
+    }
+  if (vc.word_counts)
+    bow_free (vc.word_counts);
+  bow_free (vc.num_words);
+  bow_free (vc.max_ci);
+  return max_ci;
+}
+
 /* Given a barrel of documents, create and return another barrel with
    only one vector per class. The classes will be represented as
    "documents" in this new barrel. */
@@ -48,16 +291,11 @@ bow_barrel_new_vpc (bow_barrel *doc_barrel)
   bow_barrel* vpc_barrel;	/* The vector per class barrel */
   int max_ci = -1;		/* The highest index of encountered classes */
   int num_classes = bow_barrel_num_classes (doc_barrel);
-  int wi;
   int max_wi;
-  int dvi;
   int ci;
-  bow_dv *dv;
-  bow_dv *vpc_dv;
   int di;
   int num_docs_per_ci[num_classes];
   bow_cdoc *cdoc;
-  double sum = 0;
 
   assert (doc_barrel->classnames);
 
@@ -90,92 +328,11 @@ bow_barrel_new_vpc (bow_barrel *doc_barrel)
     }
 
   /* Update the CDOC->WORD_COUNT in the DOC_BARREL in order to match
-     the (potentially) pruned vocabulary. */
-  {
-    bow_wv *wv = NULL;
-    int wvi;
-    bow_dv_heap *heap = bow_test_new_heap (doc_barrel);
-    while ((di = bow_heap_next_wv (heap, doc_barrel, &wv,
-				   bow_cdoc_yes)) != -1)
-      {
-	cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
-	cdoc->word_count = 0;
-	for (wvi = 0; wvi < wv->num_entries; wvi++)
-	  {
-	    if (bow_wi2dvf_dv (doc_barrel->wi2dvf, wv->entry[wvi].wi))
-	      cdoc->word_count += wv->entry[wvi].count;
-	  }
-      }
-  }
-
-  /* Initialize the WI2DVF part of the VPC_BARREL.  Sum together the
-     counts and weights for individual documents, grabbing only the
-     training documents. */
-  for (wi = 0; wi < max_wi; wi++)
-    {
-      dv = bow_wi2dvf_dv (doc_barrel->wi2dvf, wi);
-      if (!dv)
-	continue;
-      for (dvi = 0; dvi < dv->length; dvi++)
-	{
-	  di = dv->entry[dvi].di;
-	  cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
-	  ci = cdoc->class;
-	  assert (ci >= 0);
-	  assert (ci < num_classes);
-	  if (ci > max_ci)
-	    max_ci = ci;
-	  if (cdoc->type == bow_doc_train)
-	    {
-	      float weight;
-
-	      /* The old version of bow_wi2dvf_add_di_text_fp() initialized
-		 the dv WEIGHT to 0 instead of the word count.  If the weight 
-		 is zero, then use the count instead.  Note, however, that
-		 the TFIDF method might have set the weight, so we don't
-		 want to use the count all the time. */
-	      if (dv->entry[dvi].weight)
-		weight = dv->entry[dvi].weight;
-	      else
-		weight = dv->entry[dvi].count;
-
-	      if (bow_event_model == bow_event_document)
-		{
-		  assert (dv->entry[dvi].count);
-		  bow_wi2dvf_add_wi_di_count_weight (&(vpc_barrel->wi2dvf), 
-						     wi, ci, 1, 1);
-		}
-	      else if (bow_event_model == bow_event_document_then_word)
-		{
-		  bow_wi2dvf_add_wi_di_count_weight
-		    (&(vpc_barrel->wi2dvf), wi, ci, dv->entry[dvi].count,
-		     (bow_event_document_then_word_document_length
-		      * weight / cdoc->word_count));
-		  sum += (bow_event_document_then_word_document_length
-			  * weight / cdoc->word_count);
-		}
-	      else
-		{
-		  bow_wi2dvf_add_wi_di_count_weight (&(vpc_barrel->wi2dvf), 
-						     wi, ci, 
-						     dv->entry[dvi].count,
-						     weight);
-		}
-	    }
-	}
-      /* Set the IDF of the class's wi2dvf directly from the doc's wi2dvf */
-      vpc_dv = bow_wi2dvf_dv (vpc_barrel->wi2dvf, wi);
-      if (vpc_dv)		/* this could be null if all of this word's
-				   occurrences are in non training docs */
-	vpc_dv->idf = dv->idf;
-      if (max_wi - wi % 100 == 0)
-	bow_verbosify (bow_verbose, "\b\b\b\b\b\b%6d", max_wi - wi);
-    }
-#if 0
-  bow_verbosify (bow_progress, "vpc_sum=%f\n", sum);
-  bow_verbosify (bow_progress, "wi2dvf_sum=%f\n", 
-		 bow_wi2dvf_sum (vpc_barrel->wi2dvf));
-#endif
+     the (potentially) pruned vocabulary, and initialize the WI2DVF
+     part of the VPC_BARREL.  Sum together the counts and weights for
+     individual documents, grabbing only the training documents. */
+  max_ci = _bow_barrel_vpc_sum (doc_barrel, vpc_barrel, num_classes, max_wi,
+				0);
   bow_verbosify (bow_verbose, "\b\b\b\b\b\b");
   /* xxx OK to have some classes with no words
      assert (num_classes-1 == max_ci); */
@@ -281,6 +438,326 @@ bow_barrel_new_vpc_weight_then_merge (bow_barrel *doc_barrel)
   return vpc_barrel;
 }
 
+/* Return a new, empty `vector-per-class' barrel, to which
+   bow_barrel_add_vpc_from_text_dir() adds documents straight into the
+   class statistics, one at a time, without making a barrel of the
+   documents.  Only methods whose class barrel is made by
+   bow_barrel_new_vpc_merge_then_weight() from counted priors can be
+   trained this way. */
+bow_barrel *
+bow_barrel_new_vpc_streaming ()
+{
+  bow_barrel *vpc_barrel;
+
+  vpc_barrel = bow_barrel_new (0, 0, sizeof (bow_cdoc), NULL);
+  if (vpc_barrel->method->vpc_with_weights
+      != bow_barrel_new_vpc_merge_then_weight
+      || vpc_barrel->method->vpc_set_priors
+      != bow_barrel_set_vpc_priors_by_counting
+      || vpc_barrel->method->scale_weights)
+    bow_error ("Method `%s' can't be trained without a document barrel",
+	       vpc_barrel->method->name);
+  vpc_barrel->classnames = bow_int4str_new (0);
+  vpc_barrel->is_vpc = 1;
+  return vpc_barrel;
+}
+
+/* Write the vocabulary and VPC_BARREL, whose weights and priors have
+   not been set yet, to the file FILENAME, so that a training run
+   that is interrupted can pick up from there.  The file is replaced
+   atomically. */
+void
+bow_barrel_write_vpc_checkpoint (bow_barrel *vpc_barrel,
+				 const char *filename)
+{
+  size_t size = strlen (filename) + sizeof (".tmp");
+  char *tmp_filename = bow_malloc (size);
+  FILE *fp;
+
+  snprintf (tmp_filename, size, "%s.tmp", filename);
+  fp = bow_fopen (tmp_filename, "wb");
+  bow_words_write (fp);
+  bow_barrel_write (vpc_barrel, fp);
+  fclose (fp);
+  if (rename (tmp_filename, filename) != 0)
+    bow_error ("Couldn't rename `%s' to `%s'", tmp_filename, filename);
+  bow_free (tmp_filename);
+}
+
+/* Return the barrel in the checkpoint file FILENAME written by
+   bow_barrel_write_vpc_checkpoint(), and make its vocabulary the
+   current one. */
+bow_barrel *
+bow_barrel_new_vpc_from_checkpoint (const char *filename)
+{
+  bow_barrel *vpc_barrel;
+  FILE *fp;
+  int wi;
+
+  fp = bow_fopen (filename, "rb");
+  bow_words_read_from_fp (fp);
+  vpc_barrel = bow_barrel_new_from_data_fp (fp);
+  vpc_barrel->is_vpc = 1;
+  /* Read in all the DV's now, since adding to a DV that is still on
+     disk would start a new one. */
+  for (wi = 0; wi < vpc_barrel->wi2dvf->size; wi++)
+    bow_wi2dvf_dv_hidden (vpc_barrel->wi2dvf, wi, 1);
+  /* Don't close FP, because the WI2DVF holds on to it. */
+  return vpc_barrel;
+}
+
+/* Add the documents found when recursively descending directory
+   DIRNAME, as members of class CLASSNAME, to the class statistics of
+   VPC_BARREL, which was made by bow_barrel_new_vpc_streaming().  The
+   first documents of the directory that are already counted in
+   VPC_BARREL, as they are when it was read from a checkpoint, are
+   skipped.  If CHECKPOINT_FILENAME is non-NULL, write a checkpoint
+   there every CHECKPOINT_INTERVAL documents, counting those of all
+   the classes in VPC_BARREL.  Return the number of documents
+   added. */
+int
+bow_barrel_add_vpc_from_text_dir (bow_barrel *vpc_barrel,
+				  const char *dirname,
+				  const char *except_name,
+				  const char *classname,
+				  const char *checkpoint_filename,
+				  int checkpoint_interval)
+{
+  int text_file_count = 0, binary_file_count = 0, skipped_count = 0;
+  int num_to_skip;
+  int num_counted;		/* documents in VPC_BARREL, of all classes */
+  int ci, i;
+  bow_cdoc *cdoc;
+  /* The counts of the words in the current document, and the words
+     that are in it. */
+  int *doc_counts = NULL;
+  int doc_counts_size = 0;
+  int *doc_wis = NULL;
+  int doc_wis_size = 0;
+  int num_doc_wis;
+
+  int vpc_index_file (const char *filename, void *context)
+    {
+      char word[BOW_MAX_WORD_LENGTH];
+      FILE *fp;
+      bow_lex *lex;
+      int wi, i, count, word_count;
+      float weight;
+
+      /* If the filename matches the exception name, return immediately. */
+      if (except_name && !strcmp (filename, except_name))
+	return 0;
+
+      if (!(fp = fopen (filename, "r")))
+	{
+	  bow_verbosify (bow_progress,
+			 "Couldn't open file `%s' for reading.", filename);
+	  return 0;
+	}
+      if (!bow_fp_is_text (fp))
+	{
+	  bow_verbosify (bow_progress,
+			 "\nFile `%s' skipped because not text\n",
+			 filename);
+	  binary_file_count++;
+	  fclose (fp);
+	  return 1;
+	}
+      if (skipped_count < num_to_skip)
+	{
+	  skipped_count++;
+	  fclose (fp);
+	  return 1;
+	}
+
+      /* Count the words of the document, just as
+	 bow_postings_add_di_text_fp() would. */
+      num_doc_wis = 0;
+      while ((lex = bow_default_lexer->open_text_fp (bow_default_lexer, fp,
+						     filename)))
+	{
+	  while (bow_default_lexer->get_word (bow_default_lexer,
+					      lex, word, BOW_MAX_WORD_LENGTH))
+	    {
+	      wi = bow_word2int_add_occurrence (word);
+	      if (wi < 0)
+		continue;
+	      if (wi >= doc_counts_size)
+		{
+		  int old_size = doc_counts_size;
+		  doc_counts_size = MAX (wi + 1, 2 * doc_counts_size);
+		  doc_counts = bow_realloc (doc_counts,
+					    doc_counts_size * sizeof (int));
+		  for ( ; old_size < doc_counts_size; old_size++)
+		    doc_counts[old_size] = 0;
+		}
+	      if (doc_counts[wi]++ == 0)
+		{
+		  if (num_doc_wis >= doc_wis_size)
+		    {
+		      doc_wis_size = MAX (64, 2 * doc_wis_size);
+		      doc_wis = bow_realloc (doc_wis,
+					     doc_wis_size * sizeof (int));
+		    }
+		  doc_wis[num_doc_wis++] = wi;
+		}
+	    }
+	  bow_default_lexer->close (bow_default_lexer, lex);
+	}
+      fclose (fp);
+
+      /* The document's length, as bow_barrel_new_vpc() recounts it. */
+      word_count = 0;
+      for (i = 0; i < num_doc_wis; i++)
+	word_count += ((bow_binary_word_counts && doc_counts[doc_wis[i]] > 1)
+		       ? 1 : doc_counts[doc_wis[i]]);
+
+      /* Add the document to its class as bow_barrel_new_vpc() does,
+	 with the same count and weight it would have had in a
+	 document barrel. */
+      for (i = 0; i < num_doc_wis; i++)
+	{
+	  wi = doc_wis[i];
+	  weight = doc_counts[wi];
+	  count = (bow_binary_word_counts && doc_counts[wi] > 1
+		   ? 1 : doc_counts[wi]);
+	  doc_counts[wi] = 0;
+	  if (bow_event_model == bow_event_document)
+	    bow_wi2dvf_add_wi_di_count_weight (&(vpc_barrel->wi2dvf),
+					       wi, ci, 1, 1);
+	  else if (bow_event_model == bow_event_document_then_word)
+	    bow_wi2dvf_add_wi_di_count_weight
+	      (&(vpc_barrel->wi2dvf), wi, ci, count,
+	       (bow_event_document_then_word_document_length
+		* weight / word_count));
+	  else
+	    bow_wi2dvf_add_wi_di_count_weight (&(vpc_barrel->wi2dvf),
+					       wi, ci, count, weight);
+	}
+
+      /* The class's WORD_COUNT is its number of documents. */
+      cdoc = bow_array_entry_at_index (vpc_barrel->cdocs, ci);
+      cdoc->word_count++;
+      text_file_count++;
+      num_counted++;
+      if (checkpoint_filename && checkpoint_interval > 0
+	  && num_counted % checkpoint_interval == 0)
+	bow_barrel_write_vpc_checkpoint (vpc_barrel, checkpoint_filename);
+      bow_verbosify (bow_progress,
+		     "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b"
+		     "%6d : %8d", 
+		     text_file_count, bow_num_words ());
+      return 1;
+    }
+
+  assert (vpc_barrel->is_vpc);
+  ci = bow_str2int (vpc_barrel->classnames, classname);
+  if (ci == vpc_barrel->cdocs->length)
+    {
+      bow_cdoc new_cdoc;
+
+      new_cdoc.type = bow_doc_train;
+      new_cdoc.class = ci;
+      new_cdoc.filename = strdup (classname);
+      if (!new_cdoc.filename)
+	bow_error ("Memory exhausted.");
+      new_cdoc.word_count = 0;
+      new_cdoc.normalizer = -1.0f;
+      new_cdoc.prior = 0;
+      new_cdoc.class_probs = NULL;
+      bow_array_append (vpc_barrel->cdocs, &new_cdoc);
+    }
+  assert (ci < vpc_barrel->cdocs->length);
+  /* Count the documents of the whole run, so that a checkpoint is
+     written every CHECKPOINT_INTERVAL of them however they are split
+     between the class directories. */
+  num_counted = 0;
+  for (i = 0; i < vpc_barrel->cdocs->length; i++)
+    {
+      cdoc = bow_array_entry_at_index (vpc_barrel->cdocs, i);
+      num_counted += cdoc->word_count;
+    }
+  cdoc = bow_array_entry_at_index (vpc_barrel->cdocs, ci);
+  num_to_skip = cdoc->word_count;
+  if (num_to_skip)
+    bow_verbosify (bow_progress, "Skipping %d documents already counted\n  ",
+		   num_to_skip);
+
+  bow_verbosify (bow_progress,
+		 "Gathering stats... files : unique-words :: "
+		 "                 ");
+  bow_map_filenames_from_dir (vpc_index_file, 0, dirname, "");
+  bow_verbosify (bow_progress, "\n");
+  if (binary_file_count > text_file_count + skipped_count)
+    bow_verbosify (bow_quiet,
+		   "Found mostly binary files, which were ignored.\n");
+  if (skipped_count < num_to_skip)
+    bow_error ("Directory `%s' has fewer documents than were counted "
+	       "before", dirname);
+  if (doc_counts)
+    bow_free (doc_counts);
+  if (doc_wis)
+    bow_free (doc_wis);
+  return text_file_count;
+}
+
+/* Set the priors and weights of VPC_BARREL, made by
+   bow_barrel_new_vpc_streaming(), once all the documents have been
+   added, making it the same as the class barrel that
+   bow_barrel_new_vpc_with_weights() would have made from a barrel of
+   the same documents. */
+void
+bow_barrel_finish_vpc_streaming (bow_barrel *vpc_barrel)
+{
+  int num_classes = vpc_barrel->cdocs->length;
+  int num_non_empty_classes = 0;
+  double prior_sum = 0;
+  float doc_prior;
+  bow_cdoc *cdoc;
+  int ci, i;
+
+  for (ci = 0; ci < num_classes; ci++)
+    {
+      cdoc = bow_array_entry_at_index (vpc_barrel->cdocs, ci);
+      if (cdoc->word_count)
+	num_non_empty_classes++;
+    }
+  /* Sum the priors of the documents one by one, as
+     bow_barrel_set_vpc_priors_by_counting() does, so that they round
+     the same way. */
+  for (ci = 0; ci < num_classes; ci++)
+    {
+      cdoc = bow_array_entry_at_index (vpc_barrel->cdocs, ci);
+      bow_verbosify (bow_verbose, "%20d model documents in class `%s'\n",
+		     cdoc->word_count, cdoc->filename);
+      if (bow_uniform_class_priors && cdoc->word_count)
+	doc_prior = (1.0 / (num_non_empty_classes * cdoc->word_count));
+      else
+	doc_prior = 1.0f;
+      cdoc->prior = 0;
+      for (i = 0; i < cdoc->word_count; i++)
+	cdoc->prior += doc_prior;
+      prior_sum += cdoc->prior;
+    }
+  if (prior_sum)
+    {
+      for (ci = 0; ci < num_classes; ci++)
+	{
+	  cdoc = bow_array_entry_at_index (vpc_barrel->cdocs, ci);
+	  cdoc->prior /= prior_sum;
+	  if (cdoc->prior == 0)
+	    bow_verbosify (bow_progress, 
+			   "WARNING: class `%s' has zero prior\n",
+			   cdoc->filename);
+	}
+    }
+  else
+    bow_verbosify (bow_progress, "WARNING: All classes have zero prior\n");
+
+  bow_barrel_set_weights (vpc_barrel);
+  bow_barrel_normalize_weights (vpc_barrel);
+}
+
 /* Set the class prior probabilities by counting the number of
    documents of each class. */
 void
@@ -367,12 +844,8 @@ bow_barrel_new_vpc_using_class_probs (bow_barrel *doc_barrel)
 {
   bow_barrel* vpc_barrel;	/* The vector per class barrel */
   int num_classes = bow_barrel_num_classes (doc_barrel);
-  int wi;
   int max_wi;
-  int dvi;
   int ci;
-  bow_dv *dv;
-  bow_dv *vpc_dv;
   int di;
   float num_docs_per_ci[num_classes];
   bow_cdoc *cdoc;
@@ -411,87 +884,11 @@ bow_barrel_new_vpc_using_class_probs (bow_barrel *doc_barrel)
     }
 
   /* Update the CDOC->WORD_COUNT in the DOC_BARREL in order to match
-     the (potentially) pruned vocabulary. */
-  {
-    bow_wv *wv = NULL;
-    int wvi;
-    bow_dv_heap *heap = bow_test_new_heap (doc_barrel);
-    while ((di = bow_heap_next_wv (heap, doc_barrel, &wv,
-				   bow_cdoc_yes)) != -1)
-      {
-	cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
-	cdoc->word_count = 0;
-	for (wvi = 0; wvi < wv->num_entries; wvi++)
-	  {
-	    if (bow_wi2dvf_dv (doc_barrel->wi2dvf, wv->entry[wvi].wi))
-	      cdoc->word_count += wv->entry[wvi].count;
-	  }
-      }
-  }
-
-  /* Initialize the WI2DVF part of the VPC_BARREL.  Sum together the
-     counts and weights for individual documents, grabbing only the
-     training documents. */
-  for (wi = 0; wi < max_wi; wi++)
-    {
-      dv = bow_wi2dvf_dv (doc_barrel->wi2dvf, wi);
-      if (!dv)
-	continue;
-      for (dvi = 0; dvi < dv->length; dvi++)
-	{
-	  di = dv->entry[dvi].di;
-	  cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
-	  if (cdoc->type == bow_doc_train ||
-	      cdoc->type == bow_doc_unlabeled)
-	    {
-	      float weight;
-	      
-	      /* The old version of bow_wi2dvf_add_di_text_fp() initialized
-		 the dv WEIGHT to 0 instead of the word count.  If the weight 
-		 is zero, then use the count instead.  Note, however, that
-		 the TFIDF method might have set the weight, so we don't
-		 want to use the count all the time. */
-	      if (dv->entry[dvi].weight)
-		weight = dv->entry[dvi].weight;
-	      else
-		weight = dv->entry[dvi].count;
-
-	      for (ci = 0; ci < num_classes; ci++) 
-		{
-
-		  /* do the right thing based on the event model */
-		  if (bow_event_model == bow_event_document)
-		    {
-		      assert (dv->entry[dvi].count);
-		      bow_wi2dvf_add_wi_di_count_weight (&(vpc_barrel->wi2dvf), 
-							 wi, ci, 1, 
-							 cdoc->class_probs[ci]);
-		    }
-		  else if (bow_event_model == bow_event_document_then_word)
-		    {
-		      bow_wi2dvf_add_wi_di_count_weight
-			(&(vpc_barrel->wi2dvf), wi, ci, 1,
-			 (bow_event_document_then_word_document_length
-			  * weight * cdoc->class_probs[ci] / cdoc->word_count));
-		    }
-		  else
-		    {
-		      bow_wi2dvf_add_wi_di_count_weight (&(vpc_barrel->wi2dvf), 
-							 wi, ci, 
-							 1,
-							 weight * cdoc->class_probs[ci]);
-		    }
-		}
-	    }
-	}
-      /* Set the IDF of the class's wi2dvf directly from the doc's wi2dvf */
-      vpc_dv = bow_wi2dvf_dv (vpc_barrel->wi2dvf, wi);
-      if (vpc_dv) 
-	vpc_dv->idf = dv->idf;
-      if (max_wi - wi % 100 == 0)
-	bow_verbosify (bow_verbose, "\b\b\b\b\b\b%6d", max_wi - wi);
-    }
-
+     the (potentially) pruned vocabulary, and initialize the WI2DVF
+     part of the VPC_BARREL.  Sum together the counts and weights for
+     individual documents, grabbing only the training and unlabeled
+     documents. */
+  _bow_barrel_vpc_sum (doc_barrel, vpc_barrel, num_classes, max_wi, 1);
   bow_verbosify (bow_verbose, "\b\b\b\b\b\b\n");
 
   /* Initialize the CDOCS and CLASSNAMES parts of the VPC_BARREL.
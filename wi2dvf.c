@@ -23,11 +23,26 @@
 #include <netinet/in.h>		/* for machine-independent byte-order */
 #include <assert.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>		/* for mmap() of native-encoded data files */
+#include <unistd.h>
 
-#define INIT_BOW_DVF(DVF) { DVF.seek_start = -1; DVF.dv = NULL; }
+#define INIT_BOW_DVF(DVF) \
+  { DVF.seek_start = -1; DVF.dv = NULL; DVF.hidden = 0; DVF.max_weight = -1; }
+
+/* Non-zero if the "document vector" DV is a view into the
+   memory-mapped data file of WI2DVF, rather than malloc'ed memory. */
+#define BOW_WI2DVF_DV_IS_MAPPED(WI2DVF, DV)				\
+  ((WI2DVF)->mmap_base							\
+   && (char*)(DV) >= (WI2DVF)->mmap_base				\
+   && (char*)(DV) < (WI2DVF)->mmap_base + (WI2DVF)->mmap_length)
 
 unsigned int bow_wi2dvf_default_capacity = 1024;
 
+/* The layout used by bow_wi2dvf_write() for the "document vectors". */
+bow_dv_encoding bow_wi2dvf_write_encoding = bow_dv_encoding_stream;
+
 bow_wi2dvf *
 bow_wi2dvf_new (int capacity)
 {
@@ -40,11 +55,70 @@ bow_wi2dvf_new (int capacity)
   ret->size = capacity;
   ret->num_words = 0;
   ret->fp = NULL;
+  ret->encoding = bow_dv_encoding_stream;
+  ret->mmap_base = NULL;
+  ret->mmap_length = 0;
+  ret->di2wv = NULL;
+  ret->has_max_weights = 0;
   for (i = 0; i < capacity; i++)
     INIT_BOW_DVF(ret->entry[i]);
   return ret;
 }
 
+/* Write the file offset N to the stream FP in a machine-independent
+   format, as two ints, high word first. */
+static void
+_bow_wi2dvf_fwrite_seek (off_t n, FILE *fp)
+{
+  bow_fwrite_int ((int) (n >> 32), fp);
+  bow_fwrite_int ((int) (n & 0xffffffff), fp);
+}
+
+/* Read a file offset written by _bow_wi2dvf_fwrite_seek() from the
+   stream FP into *NP. */
+static void
+_bow_wi2dvf_fread_seek (off_t *np, FILE *fp)
+{
+  int high, low;
+
+  bow_fread_int (&high, fp);
+  bow_fread_int (&low, fp);
+  *np = ((off_t) high) * 4294967296LL + (unsigned int) low;
+}
+
+/* If the WI'th "document vector" of WI2DVF is a view into the
+   memory-mapped data file, replace it with a malloc'ed copy, so that
+   it can be grown with bow_realloc() and freed with bow_dv_free(). */
+static void
+_bow_wi2dvf_unmap_dv (bow_wi2dvf *wi2dvf, int wi)
+{
+  bow_dv *view = wi2dvf->entry[wi].dv;
+  bow_dv *dv;
+
+  if (!BOW_WI2DVF_DV_IS_MAPPED (wi2dvf, view))
+    return;
+  dv = bow_dv_new (view->length);
+  dv->length = view->length;
+  dv->idf = view->idf;
+  memcpy (dv->entry, view->entry, sizeof (bow_de) * view->length);
+  wi2dvf->entry[wi].dv = dv;
+}
+
+/* Adding entries to WI2DVF moves the entries of its "document
+   vectors" around, so any forward index of it is no longer good, and
+   the new entries may be above the words' bounds. */
+static void
+_bow_wi2dvf_forget_di2wv (bow_wi2dvf *wi2dvf)
+{
+  if (wi2dvf->di2wv)
+    {
+      bow_di2wv_free (wi2dvf->di2wv);
+      wi2dvf->di2wv = NULL;
+    }
+  if (wi2dvf->has_max_weights)
+    bow_wi2dvf_forget_max_weights (wi2dvf);
+}
+
 /* xxx We should think about a scheme that doesn't require keeping all
    the "document vectors" in core at the time time.  We could write
    them to disk, read them back in when we needed to add to them, then
@@ -59,6 +133,7 @@ bow_wi2dvf_add_di_wv (bow_wi2dvf **wi2dvf, int di, bow_wv *wv)
   int i, wi;
   int max_wi = bow_num_words ();
 
+  _bow_wi2dvf_forget_di2wv (*wi2dvf);
   if (max_wi > (*wi2dvf)->size)
     {
       /* There are so many unique words, we need to grow the array
@@ -87,6 +162,8 @@ bow_wi2dvf_add_di_wv (bow_wi2dvf **wi2dvf, int di, bow_wv *wv)
 	  (*wi2dvf)->entry[wi].seek_start = 2;
 	  ((*wi2dvf)->num_words)++;
 	}
+      else
+	_bow_wi2dvf_unmap_dv (*wi2dvf, wi);
       /* Add the "document index" DI and the count associated with
          word index WI to the WI'th "document vector". */
       bow_dv_add_di_count_weight (&((*wi2dvf)->entry[wi].dv), di,
@@ -166,6 +243,7 @@ void
 bow_wi2dvf_add_wi_di_count_weight (bow_wi2dvf **wi2dvf, int wi,
 				   int di, int count, float weight)
 {
+  _bow_wi2dvf_forget_di2wv (*wi2dvf);
   if (wi >= (*wi2dvf)->size)
     {
       /* There are so many unique words, we need to grow the array
@@ -190,6 +268,8 @@ bow_wi2dvf_add_wi_di_count_weight (bow_wi2dvf **wi2dvf, int wi,
       (*wi2dvf)->entry[wi].seek_start = 2;
       ((*wi2dvf)->num_words)++;
     }
+  else
+    _bow_wi2dvf_unmap_dv (*wi2dvf, wi);
   /* Add the "document index" DI and the count associated with
      word index WI to the WI'th "document vector". */
   bow_dv_add_di_count_weight (&((*wi2dvf)->entry[wi].dv), di, count, weight);
@@ -202,6 +282,7 @@ void
 bow_wi2dvf_set_wi_di_count_weight (bow_wi2dvf **wi2dvf, int wi,
 				   int di, int count, float weight)
 {
+  _bow_wi2dvf_forget_di2wv (*wi2dvf);
   if (wi >= (*wi2dvf)->size)
     {
       /* There are so many unique words, we need to grow the array
@@ -226,11 +307,156 @@ bow_wi2dvf_set_wi_di_count_weight (bow_wi2dvf **wi2dvf, int wi,
       (*wi2dvf)->entry[wi].seek_start = 2;
       ((*wi2dvf)->num_words)++;
     }
+  else
+    _bow_wi2dvf_unmap_dv (*wi2dvf, wi);
   /* Add the "document index" DI and the count associated with
      word index WI to the WI'th "document vector". */
   bow_dv_set_di_count_weight (&((*wi2dvf)->entry[wi].dv), di, count, weight);
 }
 
+/* Add the entries of the "document vector" DV to the WI'th "document
+   vector" of WI2DVF, which must be in core if there is one.  If there
+   is no WI'th DV yet, DV becomes it; otherwise DV is freed. */
+static void
+_bow_wi2dvf_append_wi_dv (bow_wi2dvf **wi2dvf, int wi, bow_dv *dv)
+{
+  bow_dv *old_dv;
+  int dvi;
+
+  if (wi >= (*wi2dvf)->size)
+    {
+      /* There are so many unique words, we need to grow the array
+	 that maps WI's to DVF's. */
+      int old_size = (*wi2dvf)->size;
+      (*wi2dvf)->size = MAX (wi+1, (*wi2dvf)->size * 2);
+      (*wi2dvf) = bow_realloc (*wi2dvf, 
+			       (sizeof (bow_wi2dvf)
+				+ (sizeof (bow_dvf) * (*wi2dvf)->size)));
+      /* Initialize the new part of the realloc'ed space. */
+      for ( ; old_size < (*wi2dvf)->size; old_size++)
+	INIT_BOW_DVF((*wi2dvf)->entry[old_size]);
+    }
+
+  if ((*wi2dvf)->entry[wi].dv == NULL)
+    {
+      (*wi2dvf)->entry[wi].dv = dv;
+      /* This 2 is a flag to the hide/unhide code that this DV exists. */
+      (*wi2dvf)->entry[wi].seek_start = 2;
+      ((*wi2dvf)->num_words)++;
+      return;
+    }
+
+  _bow_wi2dvf_unmap_dv (*wi2dvf, wi);
+  old_dv = (*wi2dvf)->entry[wi].dv;
+  if (dv->length > 0 && old_dv->length > 0
+      && dv->entry[0].di > old_dv->entry[old_dv->length-1].di)
+    {
+      /* All of DV's entries go after the old ones; grow the old DV
+	 once, to exactly the size needed, and copy them on the end. */
+      if (old_dv->length + dv->length > old_dv->size)
+	{
+	  old_dv->size = old_dv->length + dv->length;
+	  old_dv = bow_realloc (old_dv, (sizeof (bow_dv) 
+					 + sizeof (bow_de) * old_dv->size));
+	  (*wi2dvf)->entry[wi].dv = old_dv;
+	}
+      memcpy (old_dv->entry + old_dv->length, dv->entry,
+	      sizeof (bow_de) * dv->length);
+      old_dv->length += dv->length;
+    }
+  else
+    {
+      for (dvi = 0; dvi < dv->length; dvi++)
+	bow_dv_add_di_count_weight (&((*wi2dvf)->entry[wi].dv),
+				    dv->entry[dvi].di, dv->entry[dvi].count,
+				    dv->entry[dvi].weight);
+    }
+  bow_dv_free (dv);
+}
+
+/* Add the entries of the "document vector" DV to the WI'th "document
+   vector" of WI2DVF.  If there is no WI'th DV yet, DV becomes it;
+   otherwise DV is freed.  If the WI'th DV is still only in the data
+   file, it is read first. */
+void
+bow_wi2dvf_add_wi_dv (bow_wi2dvf **wi2dvf, int wi, bow_dv *dv)
+{
+  _bow_wi2dvf_forget_di2wv (*wi2dvf);
+  if (wi < (*wi2dvf)->size)
+    bow_wi2dvf_dv_hidden (*wi2dvf, wi, 1);
+  _bow_wi2dvf_append_wi_dv (wi2dvf, wi, dv);
+}
+
+/* Append the entries of each DV of DELTA to the DV's of WI2DVF, and
+   free DELTA. */
+void
+bow_wi2dvf_merge_delta (bow_wi2dvf **wi2dvf, bow_wi2dvf *delta)
+{
+  bow_dv *delta_dv, *dv;
+  int wi;
+
+  _bow_wi2dvf_forget_di2wv (*wi2dvf);
+  for (wi = 0; wi < delta->size; wi++)
+    {
+      delta_dv = bow_wi2dvf_dv_hidden (delta, wi, 1);
+      if (!delta_dv)
+	continue;
+      /* Take over a DV in core; copy one that goes away with the
+	 mapping of DELTA's file. */
+      if (BOW_WI2DVF_DV_IS_MAPPED (delta, delta_dv))
+	{
+	  dv = bow_dv_new (delta_dv->length);
+	  dv->length = delta_dv->length;
+	  dv->idf = delta_dv->idf;
+	  memcpy (dv->entry, delta_dv->entry,
+		  sizeof (bow_de) * dv->length);
+	}
+      else
+	{
+	  dv = delta_dv;
+	  delta->entry[wi].dv = NULL;
+	}
+      bow_wi2dvf_add_wi_dv (wi2dvf, wi, dv);
+    }
+  bow_wi2dvf_free (delta);
+}
+
+/* Return a new `wi2dvf' holding copies of the entries of WI2DVF with
+   document indices FIRST_DI or more. */
+bow_wi2dvf *
+bow_wi2dvf_new_tail (bow_wi2dvf *wi2dvf, int first_di)
+{
+  bow_wi2dvf *ret = bow_wi2dvf_new (wi2dvf->size);
+  bow_dv *dv, *tail;
+  int wi, lo, hi, mid;
+
+  for (wi = 0; wi < wi2dvf->size; wi++)
+    {
+      if (wi2dvf->entry[wi].dv)
+	dv = wi2dvf->entry[wi].dv;
+      else
+	continue;
+      /* Find the first entry for FIRST_DI or more. */
+      lo = 0;
+      hi = dv->length;
+      while (lo < hi)
+	{
+	  mid = (lo + hi) / 2;
+	  if (dv->entry[mid].di < first_di)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+      if (lo == dv->length)
+	continue;
+      tail = bow_dv_new (dv->length - lo);
+      tail->length = dv->length - lo;
+      memcpy (tail->entry, dv->entry + lo, sizeof (bow_de) * tail->length);
+      _bow_wi2dvf_append_wi_dv (&ret, wi, tail);
+    }
+  return ret;
+}
+
 
 
 /* Return a pointer to the BOW_DE for a particular word/document pair, 
@@ -283,11 +509,11 @@ bow_wi2dvf_hide_wi (bow_wi2dvf *wi2dvf, int wi)
   /* The token -1 is reserved to mean that the DV is uninitialized. */
   assert (!(wi2dvf->entry[wi].dv && wi2dvf->entry[wi].seek_start == -1));
 
-  /* Make the SEEK_START negative so we won't use it in normal situations,
-     but will be able to remember it and get it back when we need it. */
-  if (wi2dvf->entry[wi].seek_start > 0)
+  /* Mark the DVF hidden, so we won't use it in normal situations,
+     but will be able to get it back when we need it. */
+  if (wi2dvf->entry[wi].seek_start > 0 && !wi2dvf->entry[wi].hidden)
     {
-      wi2dvf->entry[wi].seek_start = - (wi2dvf->entry[wi].seek_start);
+      wi2dvf->entry[wi].hidden = 1;
       (wi2dvf->num_words)--;
     }
 }
@@ -313,8 +539,8 @@ void
 bow_wi2dvf_unhide_wi (bow_wi2dvf *wi2dvf, int wi)
 {
   assert (wi < wi2dvf->size);
-  assert (wi2dvf->entry[wi].seek_start < -1);
-  wi2dvf->entry[wi].seek_start = - (wi2dvf->entry[wi].seek_start);
+  assert (wi2dvf->entry[wi].hidden);
+  wi2dvf->entry[wi].hidden = 0;
   (wi2dvf->num_words)++;
 }
 
@@ -420,9 +646,9 @@ bow_wi2dvf_unhide_all_wi (bow_wi2dvf *wi2dvf)
 
   for (wi = 0; wi < wi2dvf->size; wi++)
     {
-      if (wi2dvf->entry[wi].seek_start < -1)
+      if (wi2dvf->entry[wi].hidden)
 	{
-	  wi2dvf->entry[wi].seek_start = - (wi2dvf->entry[wi].seek_start);
+	  wi2dvf->entry[wi].hidden = 0;
 	  (wi2dvf->num_words)++;
 	}
     }
@@ -448,56 +674,120 @@ bow_wi2dvf_set_idf_to_count (bow_wi2dvf *wi2dvf)
     }
 }
 
-/* Write WI2DVF to file-pointer FP, in a machine-independent format.
+/* Write WI2DVF to file-pointer FP, in a machine-independent format,
+   unless BOW_WI2DVF_WRITE_ENCODING asks for bow_dv_encoding_native.
+   The DV's are laid out according to BOW_WI2DVF_WRITE_ENCODING.
    This is the format expected by bow_wi2dvf_new_from_fp(). */
 void
 bow_wi2dvf_write (bow_wi2dvf *wi2dvf, FILE *fp)
 {
-  long seek_base;
-  long seek_current;
+  off_t seek_base;
+  off_t seek_current;
   int wi;
+  bow_dv_encoding encoding;
+  int seek_size;
+  int padding = 0;
+
+  /* Files older than version 9 have no record of hidden words, and
+     can only hold 32-bit offsets. */
+  if (bow_file_format_version < 9)
+    {
+      bow_wi2dvf_unhide_all_wi (wi2dvf);
+      seek_size = sizeof (int);
+    }
+  else
+    seek_size = 2 * sizeof (int);
 
-  bow_wi2dvf_unhide_all_wi (wi2dvf);
+  /* Files older than version 8 have no record of the encoding. */
+  if (bow_file_format_version < 8)
+    encoding = bow_dv_encoding_stream;
+  else
+    encoding = bow_wi2dvf_write_encoding;
 
   /* Figure out how many bytes the WI2DVF (without the DV's) will
      take at the beginning the file. */
   seek_base = 
-    (ftell (fp)			/* Where we are starting */
+    (ftello (fp)		/* Where we are starting */
      + (sizeof (int)		/* for the number of "word indices" */
-	+ (sizeof (int)		/* for each SEEK_START value */
-	   * wi2dvf->size)));	/* multiplied by the number of WI's */
+	+ (seek_size		/* for each SEEK_START value */
+	   * (off_t) wi2dvf->size)));	/* multiplied by the number of WI's */
+  if (bow_file_format_version >= 8)
+    seek_base += sizeof (int);	/* for the ENCODING */
+  if (bow_file_format_version >= 9)
+    seek_base += (wi2dvf->size + 7) / 8; /* for the hidden bitmap */
+
+  /* Native DV's are used in place from the mapped file, so they must
+     start on a boundary suitably aligned for a `bow_dv'. */
+  if (encoding == bow_dv_encoding_native)
+    {
+      padding = (sizeof (double) - (seek_base % sizeof (double)))
+	% sizeof (double);
+      seek_base += padding;
+    }
 
   /* Write the maximum "word index". */
   bow_fwrite_int (wi2dvf->size, fp);
+  if (bow_file_format_version >= 8)
+    bow_fwrite_int (encoding, fp);
 
   /* Figure out the correct SEEK_START values for all the DVF's,
      set them in the DVF's data structure, and write out the DVF's
      SEEK_START information. */
   for (wi = 0, seek_current = seek_base; wi < wi2dvf->size; wi++)
     {
+      /* Make sure the DV is in core, even if it is hidden, because
+	 hidden DV's are written too. */
+      bow_wi2dvf_dv_hidden (wi2dvf, wi, 1);
       if (wi2dvf->entry[wi].dv == NULL)
 	{
-	  /* Write an indication of a NULL document vector. */
-	  bow_fwrite_int (-1, fp);
-	  /* Set the SEEK_START in the data structure. */
+	  /* Set the SEEK_START in the data structure, as an indication
+	     of a NULL document vector. */
 	  wi2dvf->entry[wi].seek_start = -1;
+	  wi2dvf->entry[wi].hidden = 0;
 	}
       else
 	{
-	  /* Write the DVF's SEEK_START info. */
-	  bow_fwrite_int (seek_current, fp);
+	  if (bow_file_format_version < 9 && seek_current > 0x7fffffff)
+	    bow_error ("Barrel too large for file format version %d",
+		       bow_file_format_version);
 	  /* Set the SEEK_START in the data structure. */
 	  wi2dvf->entry[wi].seek_start = seek_current;
 
 	  /* Add the number of bytes it will take to write the
 	     WI'th "document vector" */
-	  seek_current += bow_dv_write_size (wi2dvf->entry[wi].dv);
+	  if (encoding == bow_dv_encoding_native)
+	    seek_current += bow_dv_write_native_size (wi2dvf->entry[wi].dv);
+	  else if (encoding == bow_dv_encoding_compressed)
+	    seek_current += 
+	      bow_dv_write_compressed_size (wi2dvf->entry[wi].dv);
+	  else
+	    seek_current += bow_dv_write_size (wi2dvf->entry[wi].dv);
+	}
+      /* Write the DVF's SEEK_START info. */
+      if (bow_file_format_version < 9)
+	bow_fwrite_int (wi2dvf->entry[wi].seek_start, fp);
+      else
+	_bow_wi2dvf_fwrite_seek (wi2dvf->entry[wi].seek_start, fp);
+    }
+
+  /* Write the bitmap of hidden words. */
+  if (bow_file_format_version >= 9)
+    {
+      for (wi = 0; wi < wi2dvf->size; wi += 8)
+	{
+	  int bit, byte = 0;
+	  for (bit = 0; bit < 8 && wi + bit < wi2dvf->size; bit++)
+	    if (wi2dvf->entry[wi + bit].hidden)
+	      byte |= 1 << bit;
+	  fputc (byte, fp);
 	}
     }
+  for ( ; padding > 0; padding--)
+    fputc (0, fp);
 
   /* We have now finished writing the DVF seek information; we should 
      be at the position we calculated earlier for SEEK_BASE. */
-  assert (ftell (fp) == seek_base);
+  assert (ftello (fp) == seek_base);
 
   /* Now write the actual "document vector" information. */
   for (wi = 0; wi < wi2dvf->size; wi++)
@@ -506,12 +796,61 @@ bow_wi2dvf_write (bow_wi2dvf *wi2dvf, FILE *fp)
 	{
 	  /* Make sure we are at the same place in the file that
 	     we said we'd be. */
-	  assert (ftell (fp) == wi2dvf->entry[wi].seek_start);
-	  bow_dv_write (wi2dvf->entry[wi].dv, fp);
+	  assert (ftello (fp) == wi2dvf->entry[wi].seek_start);
+	  if (encoding == bow_dv_encoding_native)
+	    bow_dv_write_native (wi2dvf->entry[wi].dv, fp);
+	  else if (encoding == bow_dv_encoding_compressed)
+	    bow_dv_write_compressed (wi2dvf->entry[wi].dv, fp);
+	  else
+	    bow_dv_write (wi2dvf->entry[wi].dv, fp);
 	}
     }
 }
 
+/* Write to FP, which must be at the start of the file, the part of a
+   wi2dvf data file that comes before the "document vectors", for SIZE
+   words and the native DV encoding.  SEEK_START gives the file offset
+   of each word's DV, or -1; if it is NULL, all are written as -1.  If
+   HIDDEN is non-NULL, word WI is hidden if HIDDEN[WI] is non-zero.
+   Return the offset at which the first DV must be written. */
+off_t
+bow_wi2dvf_write_native_header (int size, const off_t *seek_start,
+				const char *hidden, FILE *fp)
+{
+  off_t seek_base;
+  int padding, wi;
+
+  if (bow_file_format_version < 9)
+    bow_error ("Can't write a wi2dvf a DV at a time in file format "
+	       "version %d", bow_file_format_version);
+  assert (ftello (fp) == 0);
+
+  /* The same layout as bow_wi2dvf_write() uses. */
+  seek_base = (2 * sizeof (int)			/* SIZE and ENCODING */
+	       + (2 * sizeof (int)) * (off_t) size /* the SEEK_START's */
+	       + (size + 7) / 8);		/* the hidden bitmap */
+  padding = (sizeof (double) - (seek_base % sizeof (double)))
+    % sizeof (double);
+  seek_base += padding;
+
+  bow_fwrite_int (size, fp);
+  bow_fwrite_int (bow_dv_encoding_native, fp);
+  for (wi = 0; wi < size; wi++)
+    _bow_wi2dvf_fwrite_seek (seek_start ? seek_start[wi] : -1, fp);
+  for (wi = 0; wi < size; wi += 8)
+    {
+      int bit, byte = 0;
+      for (bit = 0; hidden && bit < 8 && wi + bit < size; bit++)
+	if (hidden[wi + bit])
+	  byte |= 1 << bit;
+      fputc (byte, fp);
+    }
+  for ( ; padding > 0; padding--)
+    fputc (0, fp);
+  assert (ftello (fp) == seek_base);
+  return seek_base;
+}
+
 /* Write WI2DVF to a file, in a machine-independent format.  This
    is the format expected by bow_wi2dvf_new_from_file(). */
 void
@@ -544,17 +883,74 @@ bow_wi2dvf_new_from_data_fp (FILE *fp)
   /* Create a new WI2DVF of that size.*/
   ret = bow_wi2dvf_new (size);
   ret->fp = fp;
+  if (bow_file_format_version >= 8)
+    {
+      int encoding;
+      bow_fread_int (&encoding, fp);
+      if (encoding < 0 || encoding >= bow_dv_encoding_limit)
+	bow_error ("Unknown document vector encoding %d", encoding);
+      ret->encoding = encoding;
+    }
 
   /* Read all the DVF information, but not the actual "document vectors";
      We'll do that later in bow_wi2dvf_dv(). */
   for (wi = 0; wi < size; wi++)
     {
-      bow_fread_int (&(ret->entry[wi].seek_start), fp);
+      if (bow_file_format_version < 9)
+	{
+	  int seek_start;
+	  bow_fread_int (&seek_start, fp);
+	  ret->entry[wi].seek_start = seek_start;
+	}
+      else
+	_bow_wi2dvf_fread_seek (&(ret->entry[wi].seek_start), fp);
       if (ret->entry[wi].seek_start != -1)
 	(ret->num_words)++;
       ret->entry[wi].dv = NULL;
     }
 
+  /* Read the bitmap of hidden words. */
+  if (bow_file_format_version >= 9)
+    {
+      for (wi = 0; wi < size; wi += 8)
+	{
+	  int bit, byte = fgetc (fp);
+	  assert (byte != EOF);
+	  for (bit = 0; bit < 8 && wi + bit < size; bit++)
+	    if (byte & (1 << bit))
+	      {
+		assert (ret->entry[wi + bit].seek_start != -1);
+		ret->entry[wi + bit].hidden = 1;
+		(ret->num_words)--;
+	      }
+	}
+    }
+
+  /* DV's in host layout can be used straight from the page cache;
+     map the whole file, read-only.  Functions that change DV's in
+     place copy them out of the mapping first; see bow_wi2dvf_unmap().
+     Compressed DV's are decoded straight from the page cache, without
+     stdio.  If the file can't be mapped (it is a pipe, for example),
+     fall back to reading the DV's with FP. */
+  if (ret->encoding == bow_dv_encoding_native
+      || ret->encoding == bow_dv_encoding_compressed)
+    {
+      struct stat st;
+      void *base;
+
+      if (fstat (fileno (fp), &st) == 0 && S_ISREG (st.st_mode)
+	  && st.st_size > 0)
+	{
+	  base = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		       fileno (fp), 0);
+	  if (base != MAP_FAILED)
+	    {
+	      ret->mmap_base = base;
+	      ret->mmap_length = st.st_size;
+	    }
+	}
+    }
+
   return ret;
 }
 
@@ -585,46 +981,59 @@ bow_wi2dvf_free (bow_wi2dvf *wi2dvf)
     fclose (wi2dvf->fp);
   for (i = 0; i < wi2dvf->size; i++)
     {
-      if (wi2dvf->entry[i].dv)
+      if (wi2dvf->entry[i].dv
+	  && !BOW_WI2DVF_DV_IS_MAPPED (wi2dvf, wi2dvf->entry[i].dv))
 	bow_dv_free (wi2dvf->entry[i].dv);
     }
+  if (wi2dvf->mmap_base)
+    munmap (wi2dvf->mmap_base, wi2dvf->mmap_length);
+  if (wi2dvf->di2wv)
+    bow_di2wv_free (wi2dvf->di2wv);
   bow_free (wi2dvf);
 }
 
-/* Return the "document vector" corresponding to "word index" WI.  This
-   function will read the "document vector" out of the file passed to
-   bow_wi2dvf_new_from_file() if is hasn't been read already.  If the 
-   DV has been "hidden" (by feature selection, for example) it will not
-   be returned unless EVEN_IF_HIDDEN is non-zero. */
-bow_dv *
-bow_wi2dvf_dv_hidden (bow_wi2dvf *wi2dvf, int wi, int even_if_hidden)
+/* Copy the DV's of WI2DVF out of its mapped data file, so that they
+   can be changed in place. */
+void
+bow_wi2dvf_unmap (bow_wi2dvf *wi2dvf)
 {
-  /* If the word-index is higher than anything we know about,
-     return NULL.  This could legitimately happen if the query
-     document has vocabulary that wasn't in the training data. */
-  if (wi >= wi2dvf->size)
+  int wi;
+
+  if (!wi2dvf->mmap_base)
+    return;
+  for (wi = 0; wi < wi2dvf->size; wi++)
+    if (wi2dvf->entry[wi].dv)
+      _bow_wi2dvf_unmap_dv (wi2dvf, wi);
+  munmap (wi2dvf->mmap_base, wi2dvf->mmap_length);
+  wi2dvf->mmap_base = NULL;
+  wi2dvf->mmap_length = 0;
+}
+
+/* Read the WI'th "document vector" of WI2DVF from its data file, and
+   return it, or NULL if there isn't one. */
+static bow_dv *
+_bow_wi2dvf_read_dv (bow_wi2dvf *wi2dvf, int wi)
+{
+  /* If the SEEK_START position of WI'th DVF is -1, then this was an
+     empty "document vector", so return NULL. */
+  if (wi2dvf->entry[wi].seek_start == -1)
     return NULL;
 
-  /* If the "document vector" is available (it has already been read
-     in, it is non-NULL), and it is not hidden (it's SEEK_START is
-     greater than or equal to -1) then simply return it.  Note that
-     newly created WI2DVF's that haven't been saved (like those for
-     VPC_BARREL's) with have non-NULL dv's and SEEK_START's of -1. */
-  if (wi2dvf->entry[wi].dv 
-      && (wi2dvf->entry[wi].seek_start >= -1
-	  || even_if_hidden))
+  /* If the data file is memory-mapped, the "document vector" is
+     already in core; just point at it, or decode it. */
+  if (wi2dvf->mmap_base)
     {
-      assert (wi2dvf->entry[wi].dv->idf == wi2dvf->entry[wi].dv->idf);
+      assert (wi2dvf->entry[wi].seek_start > 2
+	      && wi2dvf->entry[wi].seek_start < wi2dvf->mmap_length);
+      if (wi2dvf->encoding == bow_dv_encoding_compressed)
+	wi2dvf->entry[wi].dv = bow_dv_new_from_compressed_data
+	  ((unsigned char*) wi2dvf->mmap_base + wi2dvf->entry[wi].seek_start);
+      else
+	wi2dvf->entry[wi].dv = (bow_dv*)
+	  (wi2dvf->mmap_base + wi2dvf->entry[wi].seek_start);
       return wi2dvf->entry[wi].dv;
     }
 
-  /* If the SEEK_START position of WI'th DVF is -1, then this was an
-     empty "document vector", so return NULL.  If the SEEK_START
-     position of the WI'th DVF is less than -1, then this document
-     vector was hidden by BOW_WI2DVF_HIDE_WI(), so return NULL. */
-  if (wi2dvf->entry[wi].seek_start <= -1)
-    return NULL;
-
   /* If we want to read it in, but if this WI2DVF isn't backed by a
      data file (for example, it's being built from a directory of
      text files), then just return NULL. */
@@ -633,19 +1042,100 @@ bow_wi2dvf_dv_hidden (bow_wi2dvf *wi2dvf, int wi, int even_if_hidden)
 
   /* Read in the document vector. */
   assert (wi2dvf->entry[wi].seek_start > 2);
-  fseek (wi2dvf->fp, wi2dvf->entry[wi].seek_start, SEEK_SET);
-  wi2dvf->entry[wi].dv = bow_dv_new_from_data_fp (wi2dvf->fp);
+  fseeko (wi2dvf->fp, wi2dvf->entry[wi].seek_start, SEEK_SET);
+  if (wi2dvf->encoding == bow_dv_encoding_native)
+    wi2dvf->entry[wi].dv = bow_dv_new_from_native_data_fp (wi2dvf->fp);
+  else if (wi2dvf->encoding == bow_dv_encoding_compressed)
+    wi2dvf->entry[wi].dv = bow_dv_new_from_compressed_data_fp (wi2dvf->fp);
+  else
+    wi2dvf->entry[wi].dv = bow_dv_new_from_data_fp (wi2dvf->fp);
   /* Check for NaN. */
   assert (wi2dvf->entry[wi].dv->idf == wi2dvf->entry[wi].dv->idf);
 
+  /* Words added since the file was written are in core only, with
+     SEEK_START 2. */
   assert (wi == wi2dvf->size - 1
-	  || wi2dvf->entry[wi+1].seek_start == -1
-	  || ftell (wi2dvf->fp) == ABS(wi2dvf->entry[wi+1].seek_start));
+	  || wi2dvf->entry[wi+1].seek_start <= 2
+	  || ftello (wi2dvf->fp) == wi2dvf->entry[wi+1].seek_start);
 
   /* Return what we just read. */
   return wi2dvf->entry[wi].dv;
 }
 
+/* Return the "document vector" corresponding to "word index" WI.  This
+   function will read the "document vector" out of the file passed to
+   bow_wi2dvf_new_from_file() if is hasn't been read already.  If the 
+   DV has been "hidden" (by feature selection, for example) it will not
+   be returned unless EVEN_IF_HIDDEN is non-zero. */
+bow_dv *
+bow_wi2dvf_dv_hidden (bow_wi2dvf *wi2dvf, int wi, int even_if_hidden)
+{
+  /* If the word-index is higher than anything we know about,
+     return NULL.  This could legitimately happen if the query
+     document has vocabulary that wasn't in the training data. */
+  if (wi >= wi2dvf->size)
+    return NULL;
+
+  /* If the DV has been hidden by BOW_WI2DVF_HIDE_WI(), pretend it
+     isn't there. */
+  if (wi2dvf->entry[wi].hidden && !even_if_hidden)
+    return NULL;
+
+  /* If the "document vector" is available (it has already been read
+     in, it is non-NULL), then simply return it.  Note that newly
+     created WI2DVF's that haven't been saved (like those for
+     VPC_BARREL's) with have non-NULL dv's and SEEK_START's of 2. */
+  if (wi2dvf->entry[wi].dv)
+    {
+      assert (wi2dvf->entry[wi].dv->idf == wi2dvf->entry[wi].dv->idf);
+      return wi2dvf->entry[wi].dv;
+    }
+
+  return _bow_wi2dvf_read_dv (wi2dvf, wi);
+}
+
+/* Return a new `wi2dvf' with the entries of WI2DVF, but with each
+   document index DI changed to NEW_DI[DI], leaving out those for
+   which that is -1. */
+bow_wi2dvf *
+bow_wi2dvf_new_renumbered (bow_wi2dvf *wi2dvf, const int *new_di)
+{
+  bow_wi2dvf *ret = bow_wi2dvf_new (wi2dvf->size);
+  bow_dv *dv, *new_dv;
+  int wi, dvi, di, length;
+
+  for (wi = 0; wi < wi2dvf->size; wi++)
+    {
+      dv = bow_wi2dvf_dv_hidden (wi2dvf, wi, 1);
+      if (!dv)
+	continue;
+      for (dvi = 0, length = 0; dvi < dv->length; dvi++)
+	if (new_di[dv->entry[dvi].di] >= 0)
+	  length++;
+      if (length)
+	{
+	  new_dv = bow_dv_new (length);
+	  new_dv->idf = dv->idf;
+	  for (dvi = 0; dvi < dv->length; dvi++)
+	    {
+	      di = new_di[dv->entry[dvi].di];
+	      if (di < 0)
+		continue;
+	      new_dv->entry[new_dv->length] = dv->entry[dvi];
+	      new_dv->entry[new_dv->length++].di = di;
+	    }
+	  _bow_wi2dvf_append_wi_dv (&ret, wi, new_dv);
+	  if (wi2dvf->entry[wi].hidden)
+	    bow_wi2dvf_hide_wi (ret, wi);
+	}
+      /* Don't keep both copies in core at once. */
+      if (!BOW_WI2DVF_DV_IS_MAPPED (wi2dvf, dv))
+	bow_dv_free (dv);
+      wi2dvf->entry[wi].dv = NULL;
+    }
+  return ret;
+}
+
 /* Return the "document vector" corresponding to "word index" WI.
    This function will read the "document vector" out of the file
    passed to bow_wi2dvf_new_from_file() if is hasn't been read
@@ -53,9 +53,12 @@ bow_wv_copy (bow_wv *wv)
   return ret;
 }
 
-/* Create and return a new "word vector" from a document buffer LEX. */
-bow_wv *
-bow_wv_new_from_lex (bow_lex *lex)
+/* Create and return a new "word vector" from a document buffer LEX,
+   reading its words with LEXER.  If ADD_WORDS is non-zero, get their
+   indices with bow_word2int_add_occurrence(), otherwise with
+   bow_word2int_no_add(). */
+static bow_wv *
+_bow_wv_new_from_lex (bow_lexer *lexer, bow_lex *lex, int add_words)
 {
   int i, j;
   char word[BOW_MAX_WORD_LENGTH]; /* buffer for reading and stemming words */
@@ -71,10 +74,12 @@ bow_wv_new_from_lex (bow_lex *lex)
 
   /* Read words from the file, stem them, get their word index, and
      append each of them to `wi_array'. */
-  while (bow_default_lexer->get_word (bow_default_lexer,
-				      lex, word, BOW_MAX_WORD_LENGTH))
+  while (lexer->get_word (lexer, lex, word, BOW_MAX_WORD_LENGTH))
     {
-      wi = bow_word2int_add_occurrence (word);
+      if (add_words)
+	wi = bow_word2int_add_occurrence (word);
+      else
+	wi = bow_word2int_no_add (word);
       if (wi < 0)
 	continue;
       if (wi_array_length == wi_array_size-1)
@@ -135,6 +140,13 @@ bow_wv_new_from_lex (bow_lex *lex)
   return wv;
 }
 
+/* Create and return a new "word vector" from a document buffer LEX. */
+bow_wv *
+bow_wv_new_from_lex (bow_lex *lex)
+{
+  return _bow_wv_new_from_lex (bow_default_lexer, lex, 1);
+}
+
 bow_wv *
 bow_wv_new_from_text_fp (FILE *fp, const char *filename)
 {
@@ -165,12 +177,53 @@ bow_wv_new_from_text_string (char *the_string)
   assert (lex->document);
   lex->document_length = strlen (the_string);
   lex->document_position = 0;
+  lex->parameters = bow_default_lexer_parameters;
+  lex->num_words = 0;
   ret = bow_wv_new_from_lex (lex);
   free (lex->document);
   free (lex);
   return ret;
 }
 
+/* Like bow_wv_new_from_lex(), but reading words with CTX's lexer and
+   parameters, and looking them up as CTX says. */
+bow_wv *
+bow_wv_new_from_lex_r (bow_ctx *ctx, bow_lex *lex)
+{
+  lex->parameters = &(ctx->lexer_parameters);
+  return _bow_wv_new_from_lex (ctx->lexer, lex, ctx->add_words);
+}
+
+/* Like bow_wv_new_from_text_fp(), but with CTX's lexer. */
+bow_wv *
+bow_wv_new_from_text_fp_r (bow_ctx *ctx, FILE *fp, const char *filename)
+{
+  bow_wv *ret;
+  bow_lex *lex;
+
+  /* NOTE: This will read just the first document from the file. */
+  lex = ctx->lexer->open_text_fp (ctx->lexer, fp, filename);
+  if (lex == NULL)
+    return NULL;
+  ret = bow_wv_new_from_lex_r (ctx, lex);
+  ctx->lexer->close (ctx->lexer, lex);
+  return ret;
+}
+
+bow_wv *
+bow_wv_new_from_str_r (bow_ctx *ctx, char *str)
+{
+  bow_wv *ret;
+  bow_lex *lex;
+
+  lex = ctx->lexer->open_str (ctx->lexer, str);
+  if (lex == NULL)
+    return NULL;
+  ret = bow_wv_new_from_lex_r (ctx, lex);
+  ctx->lexer->close (ctx->lexer, lex);
+  return ret;
+}
+
 /* Remove words that don't occur in WI2DVF */
 void
 bow_wv_prune_words_not_in_wi2dvf (bow_wv *wv, bow_wi2dvf *wi2dvf)